@@ -15,6 +15,7 @@
 #include <libdank/modules/tracing/oops.h>
 #include <libdank/modules/fileconf/sbox.h>
 #include <libdank/modules/fileconf/sbox.h>
+#include <libdank/modules/metrics/metrics.h>
 #include <libdank/modules/ctlserver/ctlserver.h>
 
 static const int fatal_signals[] = {
@@ -404,6 +405,7 @@ int app_init_vercheck(const char *ver,logctx *lc,const app_def *app,
 	if(ctlsock){
 		if(init_ctlserver(ctlsock) == 0){
 			ret |= init_log_server();
+			ret |= init_metrics_server();
 			ctx->ctlsrvsocket = ctlsock;
 		}else{
 			ret = -1;
@@ -5,6 +5,7 @@
 #include <libdank/objects/objustring.h>
 #include <libdank/modules/fileconf/sbox.h>
 #include <libdank/modules/logging/logging.h>
+#include <libdank/modules/metrics/metrics.h>
 #include <libdank/modules/ctlserver/ctlserver.h>
 
 void app_stop(const app_def *app,app_ctx *ctx,int ret){
@@ -15,6 +16,7 @@ void app_stop(const app_def *app,app_ctx *ctx,int ret){
 	}
 	if(ctx){
 		if(ctx->ctlsrvsocket){
+			ret |= stop_metrics_server();
 			ret |= stop_log_server();
 			ret |= stop_ctlserver();
 			ctx->ctlsrvsocket = NULL;
@@ -0,0 +1,43 @@
+#ifndef MODULES_CTLSERVER_CTLPROTO
+#define MODULES_CTLSERVER_CTLPROTO
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <libdank/version.h>
+
+// Pipelined connections. The client's header (sent with the error descriptor
+// as SCM_RIGHTS, as for any connection) carries CTLSERVER_PIPELINE_VERSION
+// rather than CTLSERVER_PROTOCOL_VERSION. The connection then persists, and
+// carries any number of requests, each a ctlframe followed by the
+// NUL-terminated command and the command's input (if any).
+//
+// Requests are run concurrently, and their replies interleave. Each reply is
+// some number of ctlframes carrying output, having status CTLFRAME_MORE,
+// followed by a final (possibly empty) ctlframe carrying the command's
+// status. Replies carry their request's id. Error output is written to the
+// error descriptor, as usual.
+//
+// Commands of class CTLPRIO_BULK, which take over the socket, are refused.
+// All fields are in network byte order.
+#define CTLSERVER_PIPELINE_VERSION (0x80000000u | CTLSERVER_PROTOCOL_VERSION)
+
+typedef struct ctlframe {
+	uint32_t len;		// bytes of payload following the header
+	uint32_t id;		// chosen by the client, echoed in replies
+	uint32_t status;	// replies only; 0 in requests
+} ctlframe;
+
+#define CTLFRAME_MAXLEN		(16u << 20)	// largest accepted request
+#define CTLFRAME_OK		0u
+#define CTLFRAME_FAILED		1u	// the handler returned failure
+#define CTLFRAME_REFUSED	2u	// no such command, or not pipelineable
+#define CTLFRAME_MORE		0xffffffffu	// output; more frames follow
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
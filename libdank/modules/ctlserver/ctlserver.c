@@ -1,6 +1,10 @@
+#define LOG_CATEGORY LOGCAT_CTLSERVER
+
+#include <time.h>
 #include <stdint.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <libdank/utils/fds.h>
 #include <libdank/utils/string.h>
 #include <libdank/utils/threads.h>
@@ -8,47 +12,129 @@
 #include <libdank/utils/threads.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/utils/localsock.h>
+#include <libdank/ersatz/compat.h>
 #include <libdank/modules/events/fds.h>
 #include <libdank/modules/tracing/oops.h>
 #include <libdank/modules/events/evcore.h>
 #include <libdank/modules/tracing/threads.h>
+#include <libdank/modules/metrics/metrics.h>
+#include <libdank/modules/ctlserver/ctlproto.h>
 #include <libdank/modules/ctlserver/ctlserver.h>
 
+#ifdef LIB_COMPAT_LINUX
+#include <sys/timerfd.h>
+#endif
+
+// Exported commands are hashed by name. An entry being deleted is marked
+// dying, so no new invocations are scheduled, and freed once its running
+// invocations have completed (delcommand() waits on cmdcond).
+#define CMDTABLE_BUCKETS 64 // power of 2
+
 typedef struct export_cmd {
 	unsigned refcount;
+	int dying;
 	const command *cmd;
 	struct export_cmd *next;
 } export_cmd;
 
+// Pipelined connections share a blocking socket among their commands, so
+// nothing is written to one from the ctl evthread: their server commands,
+// and refusals, are run by drones like any other command.
 typedef struct scheduled_cmd {
 	cmd_state cs;
-	export_cmd *cmd;
+	const command *cmd;	// NULL for refusals
+	export_cmd *ecmd;	// NULL unless exported
+	const char *refusal;	// sent to errsd in place of running a command
+	ctlserv_prio prio;
 	struct scheduled_cmd *next;
 } scheduled_cmd;
 
+// Commands are queued FIFO within each priority class, and drones take from
+// the highest class with work. The pool grows whenever a command is queued
+// without an idle drone to take it, so that a handful of long-running
+// commands (ie log_dump) can't hold up others. Drones idle for
+// DRONE_IDLE_SEC retire, down to DRONES_MIN; retired drones are joined by
+// the ctl evthread as it schedules, or at shutdown.
+#define DRONES_MIN 2
+#define DRONES_MAX 32
+#define DRONE_IDLE_SEC 30
+
 typedef struct drone {
 	pthread_t tid;
+	int retired;	// has exited, and awaits a join
+	struct drone *next;
 } drone;
 
+typedef struct cmdqueue {
+	scheduled_cmd *head,**tail;
+} cmdqueue;
+
+// Queues are served in this order
+static const ctlserv_prio prio_order[CTLPRIO_COUNT] = {
+	CTLPRIO_HIGH,
+	CTLPRIO_NORMAL,
+	CTLPRIO_BULK,
+};
+
 typedef struct ctlserv_marshal {
 	struct sockaddr_un suna;
-	char cmdbuf[128]; // FIXME 128?
 } ctlserv_marshal;
 
-#define DRONE_HORDE_SIZE 3
+// Connections are read without blocking by the ctl evthread, which owns all
+// of their state. Once the header (the protocol version, carrying the error
+// descriptor as SCM_RIGHTS) and NUL-terminated command string have arrived,
+// the command is handed to a drone. Connections which haven't delivered them
+// within CTLCONN_TIMEOUT_SEC are dropped (swept each second on Linux, and
+// upon each accept elsewhere).
+//
+// Pipelined connections (see ctlproto.h) instead remain with the evthread
+// until the client closes them, and are never swept. Each complete request
+// frame is scheduled as a command of its own, sharing the connection's
+// cmd_pipe, which outlives the ctlconn until its last command completes.
+// A connection with CTLPIPE_INFLIGHT_MAX commands in flight stalls: its
+// requests aren't read until one completes, and writes to wakefds[1]. Thus a
+// client which stops reading its replies can hold no more than that many
+// drones.
+#define CTLCONN_TIMEOUT_SEC 5
+#define CTLCONN_MAX 256
+#define CTLCONN_READ_CHUNK 65536
+#define CTLPIPE_INFLIGHT_MAX (DRONES_MAX / 4)
+
+typedef struct ctlconn {
+	int sd,errsd;
+	uint32_t version;
+	unsigned verlen;	// bytes of version read
+	size_t cmdlen;		// bytes of cmdbuf read
+	char cmdbuf[128];
+	time_t deadline;
+	cmd_pipe *pipe;		// pipelined connections only
+	char *fbuf;		// partial request frames
+	size_t flen,fsize;
+	int stalled;		// awaiting completion of an in-flight command
+	struct ctlconn *next;
+} ctlconn;
 
 static char *listensn;
 static evhandler *ctlev;
 static int listenfd = -1;
-static export_cmd *cmdtable;
+static export_cmd *cmdtable[CMDTABLE_BUCKETS];
 static ctlserv_marshal *cmarsh;
 static const command server_commands[];
-static scheduled_cmd *pending_cmd_states;
-static drone drone_horde[DRONE_HORDE_SIZE];
+static cmdqueue pending_cmds[CTLPRIO_COUNT];
+static drone *drones;
+static unsigned drone_count,idle_drones,queued_count;
+static metric *cmds_run,*cmds_failed,*cmds_queued,*cmd_usec,*conns_timedout;
+static metric *drones_live;
+static ctlconn *ctlconns; // owned by the ctl evthread
+static unsigned ctlconn_count;
+static int wakefds[2] = { -1, -1 };
+#ifdef LIB_COMPAT_LINUX
+static int sweepfd = -1;
+#endif
 
 // Don't use static initializers, as it fouls up multiple-run unit testing (or
 // anything else which would start and stop ctlserver instances).
-static pthread_cond_t srvrcond;
+static pthread_cond_t srvrcond,cmdcond;
 static pthread_mutex_t srvrlock;
 
 static int
@@ -67,29 +153,48 @@ mainserv_close(void){
 	return ret;
 }
 
+static inline unsigned
+cmdtable_bucket(const char *cmd){
+	uint32_t h = 2166136261u; // FNV-1a
+
+	while(*cmd){
+		h = (h ^ (unsigned char)*cmd++) * 16777619u;
+	}
+	return h & (CMDTABLE_BUCKETS - 1);
+}
+
+static export_cmd *
+find_command_locked(const char *cmd){
+	export_cmd *cur;
+
+	for(cur = cmdtable[cmdtable_bucket(cmd)] ; cur ; cur = cur->next){
+		if(!cur->dying && strcmp(cmd,cur->cmd->cmd) == 0){
+			break;
+		}
+	}
+	return cur;
+}
+
 static int
 delcommand(const char *cmd){
 	export_cmd *cur,**pre;
-	unsigned refcount = 0;
 
-	do{
-		pthread_mutex_lock(&srvrlock);
-		for(pre = &cmdtable ; (cur = *pre) ; pre = &cur->next){
-			if(strcmp(cmd,cur->cmd->cmd) == 0){
-				if((refcount = cur->refcount) == 0){
-					*pre = cur->next;
-				}
-				break;
-			}
-		}
+	pthread_mutex_lock(&srvrlock);
+	if((cur = find_command_locked(cmd)) == NULL){
 		pthread_mutex_unlock(&srvrlock);
-		if(!cur){
-			bitch("Couldn't find ctlserver entry for %s\n",cmd);
-			return -1;
-		}
-		// FIXME don't busy-wait; use a cond...
-	}while(refcount);
-	Free(cur); // cur has been extracted, we needn't have the lock
+		bitch("Couldn't find ctlserver entry for %s\n",cmd);
+		return -1;
+	}
+	cur->dying = 1;
+	while(cur->refcount){
+		pthread_cond_wait(&cmdcond,&srvrlock);
+	}
+	for(pre = &cmdtable[cmdtable_bucket(cmd)] ; *pre != cur ; pre = &(*pre)->next){
+		;
+	}
+	*pre = cur->next;
+	pthread_mutex_unlock(&srvrlock);
+	Free(cur);
 	nag("Eliminated ctlserver entry for %s\n",cmd);
 	return 0;
 }
@@ -115,9 +220,15 @@ regcommand(const command *cmd){
 	}
 	tmp->cmd = cmd;
 	tmp->refcount = 0;
+	tmp->dying = 0;
+	if((unsigned)cmd->prio >= CTLPRIO_COUNT){
+		bitch("Invalid priority for %s: %d\n",cmd->cmd,cmd->prio);
+		Free(tmp);
+		return -1;
+	}
 	pthread_mutex_lock(&srvrlock);
-		tmp->next = cmdtable;
-		cmdtable = tmp;
+		tmp->next = cmdtable[cmdtable_bucket(cmd->cmd)];
+		cmdtable[cmdtable_bucket(cmd->cmd)] = tmp;
 	pthread_mutex_unlock(&srvrlock);
 	return 0;
 }
@@ -160,16 +271,19 @@ server_shutdown(cmd_state *cs __attribute__ ((unused))){
 static int
 stringize_help_locked(ustring *u){
 	const typeof(*server_commands) *scur;
-	const typeof(*cmdtable) *cur;
+	const export_cmd *cur;
+	unsigned b;
 
 	for(scur = server_commands ; scur->cmd ; ++scur){
 		if(printUString(u,"internal] %s\n",scur->cmd) < 0){
 			return -1;
 		}
 	}
-	for(cur = cmdtable ; cur ; cur = cur->next){
-		if(printUString(u,"external] %s\n",cur->cmd->cmd) < 0){
-			return -1;
+	for(b = 0 ; b < CMDTABLE_BUCKETS ; ++b){
+		for(cur = cmdtable[b] ; cur ; cur = cur->next){
+			if(printUString(u,"external] %s\n",cur->cmd->cmd) < 0){
+				return -1;
+			}
 		}
 	}
 	return 0;
@@ -186,8 +300,67 @@ server_noop(cmd_state *cs __attribute__ ((unused))){
 	return 0;
 }
 
+static scheduled_cmd *
+dequeue_cmd_locked(void){
+	unsigned z;
+
+	for(z = 0 ; z < CTLPRIO_COUNT ; ++z){
+		cmdqueue *q = &pending_cmds[prio_order[z]];
+		scheduled_cmd *sc;
+
+		if( (sc = q->head) ){
+			if((q->head = sc->next) == NULL){
+				q->tail = &q->head;
+			}
+			--queued_count;
+			return sc;
+		}
+	}
+	return NULL;
+}
+
+static void
+enqueue_cmd_locked(scheduled_cmd *sc){
+	cmdqueue *q = &pending_cmds[sc->prio];
+
+	sc->next = NULL;
+	*q->tail = sc;
+	q->tail = &sc->next;
+	++queued_count;
+}
+
+// Wait for a command as an idle drone. Returns NULL should the drone retire.
+static scheduled_cmd *
+await_cmd(drone *d){
+	struct timespec deadline;
+	scheduled_cmd *me;
+
+	clock_gettime(CLOCK_REALTIME,&deadline);
+	deadline.tv_sec += DRONE_IDLE_SEC;
+	PTHREAD_PUSH(&srvrlock,cleanup_mutex);
+	++idle_drones;
+	while((me = dequeue_cmd_locked()) == NULL){
+		int err = pthread_cond_timedwait(&srvrcond,&srvrlock,&deadline);
+
+		if(err == ETIMEDOUT){
+			if(drone_count > DRONES_MIN){
+				--drone_count;
+				d->retired = 1;
+				break;
+			}
+			deadline.tv_sec += DRONE_IDLE_SEC;
+		}else if(err){
+			bitch("Couldn't wait on condvar %p/%p\n",&srvrcond,&srvrlock);
+		}
+	}
+	--idle_drones;
+	PTHREAD_POP();
+	return me;
+}
+
 static void
-ctldrone_main(void *v __attribute__ ((unused))){
+ctldrone_main(void *v){
+	drone *d = v;
 	logctx *lc;
 
 	if((lc = get_thread_logctx()) == NULL){
@@ -200,39 +373,55 @@ ctldrone_main(void *v __attribute__ ((unused))){
 	while(1){
 		ustring out = USTRING_INITIALIZER,err = USTRING_INITIALIZER;
 		ustring *oldout,*olderr;
+		struct timespec t0,t1;
 		scheduled_cmd *me;
 		cmd_state *cs;
 		int oldstate;
 
-		PTHREAD_PUSH(&srvrlock,cleanup_mutex);
-		while((me = pending_cmd_states) == NULL){
-			if(pthread_cond_wait(&srvrcond,&srvrlock)){
-				bitch("Couldn't wait on condvar %p/%p\n",&srvrcond,&srvrlock);
-			}
+		if((me = await_cmd(d)) == NULL){
+			nag("Retiring after %ds idle\n",DRONE_IDLE_SEC);
+			gauge_add(drones_live,-1);
+			return;
 		}
-		pending_cmd_states = me->next;
-		PTHREAD_POP();
+		gauge_add(cmds_queued,-1);
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&oldstate);
 		oldout = lc->out;
 		lc->out = &out;
 		olderr = lc->err;
 		lc->err = &err;
 		cs = &me->cs;
-		timenag("%s on %d/%d\n",me->cmd->cmd->cmd,cs->sd,cs->errsd);
-		me->cmd->cmd->func(cs);
+		if(me->refusal){
+			Writen(cs->errsd,me->refusal,strlen(me->refusal));
+			cs->status = CTLFRAME_REFUSED;
+		}else{
+			timenag("%s on %d/%d\n",me->cmd->cmd,cs->sd,cs->errsd);
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			if(me->cmd->func(cs)){
+				counter_inc(cmds_failed);
+				cs->status = CTLFRAME_FAILED;
+			}
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			counter_inc(cmds_run);
+			histogram_record(cmd_usec,(uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000 +
+						(t1.tv_nsec - t0.tv_nsec) / 1000));
+		}
 		if(!cs->sent_success){
 			nag("%zu outb on %d, %zu errb on %d\n",lc->out->current,cs->sd,
 					lc->err->current,cs->errsd);
-			if(lc->out->current){
-				Writen(cs->sd,lc->out->string,lc->out->current);
-			}
+			// Follows whatever the handler streamed
+			cmd_write_ustring(cs,lc->out);
+			cmd_flush(cs);
 			if(lc->err->current){
 				Writen(cs->errsd,lc->err->string,lc->err->current);
 			}
 		}
-		pthread_mutex_lock(&srvrlock);
-		--me->cmd->refcount;
-		pthread_mutex_unlock(&srvrlock);
+		if(me->ecmd){
+			pthread_mutex_lock(&srvrlock);
+			if(--me->ecmd->refcount == 0 && me->ecmd->dying){
+				pthread_cond_broadcast(&cmdcond);
+			}
+			pthread_mutex_unlock(&srvrlock);
+		}
 		close_cmd_state(cs);
 		Free(me);
 		reset_ustring(&out);
@@ -245,37 +434,135 @@ ctldrone_main(void *v __attribute__ ((unused))){
 }
 
 static int
-schedule(int sd,int errsd,const char *cmdstr){
+spawn_drone(void){
+	drone *d;
+
+	if((d = Malloc("drone",sizeof(*d))) == NULL){
+		return -1;
+	}
+	d->retired = 0;
+	pthread_mutex_lock(&srvrlock);
+	++drone_count;
+	pthread_mutex_unlock(&srvrlock);
+	if(new_traceable_thread("ctldrone",&d->tid,ctldrone_main,d)){
+		pthread_mutex_lock(&srvrlock);
+		--drone_count;
+		pthread_mutex_unlock(&srvrlock);
+		Free(d);
+		return -1;
+	}
+	pthread_mutex_lock(&srvrlock);
+	d->next = drones;
+	drones = d;
+	pthread_mutex_unlock(&srvrlock);
+	gauge_add(drones_live,1);
+	return 0;
+}
+
+// Join any drones which have retired
+static int
+bury_retired_drones(void){
+	drone *d,**pre,*dead = NULL;
+	int ret = 0;
+
+	pthread_mutex_lock(&srvrlock);
+	for(pre = &drones ; (d = *pre) ; ){
+		if(d->retired){
+			*pre = d->next;
+			d->next = dead;
+			dead = d;
+		}else{
+			pre = &d->next;
+		}
+	}
+	pthread_mutex_unlock(&srvrlock);
+	while( (d = dead) ){
+		dead = d->next;
+		ret |= join_traceable_thread("drone",d->tid);
+		Free(d);
+	}
+	return ret;
+}
+
+static const command *
+find_server_command(const char *cmd){
+	const command *c;
+
+	for(c = server_commands ; c->cmd ; ++c){
+		if(strcmp(cmd,c->cmd) == 0){
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static scheduled_cmd *
+queue_cmd_locked(const cmd_state *cs,const command *c,export_cmd *ecmd,
+			const char *refusal,ctlserv_prio prio){
+	scheduled_cmd *sc;
+
+	if( (sc = Malloc("ctldrone",sizeof(*sc))) ){
+		sc->cs = *cs;
+		sc->cmd = c;
+		sc->ecmd = ecmd;
+		sc->refusal = refusal;
+		sc->prio = prio;
+		enqueue_cmd_locked(sc);
+		gauge_add(cmds_queued,1);
+	}
+	return sc;
+}
+
+// The command state passes to a drone, or is closed on error. Called with
+// cancellation disabled by run_command(), which we mustn't reenable, so
+// PTHREAD_LOCK() is not used.
+static int
+schedule(cmd_state *cs,const char *cmdstr){
 	static const char ERR_NO_RESOURCES[] = "No resources for command.\n";
 	static const char ERR_NO_HANDLER[] = "No handler for command.\n";
+	static const char ERR_NO_PIPE[] = "Command unavailable when pipelined.\n";
+	const char *err = ERR_NO_HANDLER;
 	scheduled_cmd *cmd = NULL;
+	const command *sc;
+	int grow = 0;
 	export_cmd *cur;
 
-	PTHREAD_LOCK(&srvrlock);
-	for(cur = cmdtable ; cur ; cur = cur->next){
-		if(strcmp(cur->cmd->cmd,cmdstr) == 0){
-			if( (cmd = Malloc("ctldrone",sizeof(*cmd))) ){
-				init_cmd_state(&cmd->cs,sd,errsd);
-				++cur->refcount;
-				cmd->cmd = cur;
-				cmd->next = pending_cmd_states;
-				pending_cmd_states = cmd;
-			}
-			break;
+	bury_retired_drones();
+	pthread_mutex_lock(&srvrlock);
+	if(cs->pipe && (sc = find_server_command(cmdstr))){
+		if((cmd = queue_cmd_locked(cs,sc,NULL,NULL,sc->prio)) == NULL){
+			err = ERR_NO_RESOURCES;
+		}
+	}else if( (cur = find_command_locked(cmdstr)) ){
+		// Bulk commands write directly to the socket
+		if(cs->pipe && cur->cmd->prio == CTLPRIO_BULK){
+			err = ERR_NO_PIPE;
+		}else if( (cmd = queue_cmd_locked(cs,cur->cmd,cur,NULL,cur->cmd->prio)) ){
+			++cur->refcount;
+		}else{
+			err = ERR_NO_RESOURCES;
 		}
 	}
-	PTHREAD_UNLOCK(&srvrlock);
-	pthread_cond_signal(&srvrcond);
-	if(cur == NULL){
-		Writen(errsd,ERR_NO_HANDLER,strlen(ERR_NO_HANDLER));
-	}else if(cmd == NULL){
-		Writen(errsd,ERR_NO_RESOURCES,strlen(ERR_NO_RESOURCES));
-	}else{ // drone or shutdown process will clean up cmd state (and sd's)
-		return 0;
+	if(cmd == NULL && cs->pipe){
+		cmd = queue_cmd_locked(cs,NULL,NULL,err,CTLPRIO_HIGH);
 	}
+	if(cmd){
+		// Signalled drones remain idle until they wake, so compare
+		// against the whole backlog
+		grow = queued_count > idle_drones && drone_count < DRONES_MAX;
+	}
+	pthread_mutex_unlock(&srvrlock);
+	if(cmd){
+		pthread_cond_signal(&srvrcond);
+		if(grow && spawn_drone()){
+			bitch("Couldn't grow the drone pool\n");
+		}
+		return 0; // drone or shutdown process will clean up cmd state (and sd's)
+	}
+	Writen(cs->errsd,err,strlen(err));
 	bitch("Couldn't schedule command %s; sent error\n",cmdstr);
-	Close(sd);
-	Close(errsd);
+	cs->status = CTLFRAME_REFUSED;
+	close_cmd_state(cs);
 	return -1;
 }
 
@@ -288,133 +575,475 @@ schedule(int sd,int errsd,const char *cmdstr){
 #define MSG_CMSG_CLOEXEC 0
 #endif
 
-// reads up to *sz - 1
+// Reads of the header, and of the command string following it, return -1 on
+// error (or premature EOF), 0 should the socket be drained, or 1 on progress.
+// The socket itself is left blocking for the command's handler; we instead
+// read with MSG_DONTWAIT.
 static int
-recv_fd(int sd,char *data,size_t *sz){
+recv_ctlconn_header(ctlconn *cc){
 	char buf[CMSG_SPACE(sizeof(int))];
 	struct cmsghdr *cmsg;
 	struct iovec iov[1];
 	struct msghdr mh;
-	uint32_t version;
-	int recvd;
-	size_t z;
+	ssize_t r;
 
 	memset(&mh,0,sizeof(mh));
-	iov[0].iov_base = (void *)&version;
-	iov[0].iov_len = sizeof(version);
+	iov[0].iov_base = (char *)&cc->version + cc->verlen;
+	iov[0].iov_len = sizeof(cc->version) - cc->verlen;
 	mh.msg_iov = iov;
-	mh.msg_control = buf;
-	mh.msg_controllen = sizeof(buf);
 	mh.msg_iovlen = sizeof(iov) / sizeof(*iov);
+	if(cc->errsd < 0){
+		mh.msg_control = buf;
+		mh.msg_controllen = sizeof(buf);
+	}
+	while((r = recvmsg(cc->sd,&mh,MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK){
+			return 0;
+		}else if(errno != EINTR){
+			moan("Error reading SCM_RIGHTS message on %d\n",cc->sd);
+			return -1;
+		}
+	}
+	if(r == 0){
+		bitch("EOF after %u header bytes on %d\n",cc->verlen,cc->sd);
+		return -1;
+	}
+	if(cc->errsd < 0){
+		// The descriptor accompanies the header's first byte
+		if((cmsg = CMSG_FIRSTHDR(&mh)) == NULL || (mh.msg_flags & MSG_CTRUNC)){
+			bitch("Malformed SCM_RIGHTS message\n");
+			return -1;
+		}
+		if(cmsg->cmsg_len != CMSG_LEN(sizeof(int))){
+			bitch("Badly-sized SCM_RIGHTS message (%zu != %zu)\n",
+				CMSG_LEN(sizeof(int)),(size_t)cmsg->cmsg_len);
+			return -1;
+		}
+		if(cmsg->cmsg_level != SOL_SOCKET){
+			bitch("Bad level receiving fd (%d)\n",cmsg->cmsg_level);
+			return -1;
+		}
+		if(cmsg->cmsg_type != SCM_RIGHTS){
+			bitch("Bad type receiving fd (%d)\n",cmsg->cmsg_type);
+			return -1;
+		}
+		memcpy(&cc->errsd,CMSG_DATA(cmsg),sizeof(cc->errsd));
+		if(set_fd_close_on_exec(cc->errsd)){
+			return -1;
+		}
+	}
+	cc->verlen += (unsigned)r;
+	return 1;
+}
 
-	// FIXME might want to supply MSG_ERRQUEUE / MSG_WAITALL?
-	if((recvd = recvmsg(sd,&mh,MSG_CMSG_CLOEXEC)) < (int)sizeof(version)){
-		if(recvd < 0){
-			moan("Error reading SCM_RIGHTS message\n");
-		}else{
-			bitch("Short (%d) read on SCM_RIGHTS message\n",recvd);
+// Peek at what's available, and consume no more than the command string (and
+// its NUL terminator); anything following is input for the command's handler.
+static int
+recv_ctlconn_command(ctlconn *cc){
+	size_t avail = sizeof(cc->cmdbuf) - 1 - cc->cmdlen;
+	const char *nul;
+	ssize_t r,take;
+
+	if(avail == 0){
+		bitch("Command exceeded %zub on %d\n",sizeof(cc->cmdbuf) - 1,cc->sd);
+		return -1;
+	}
+	while((r = recv(cc->sd,cc->cmdbuf + cc->cmdlen,avail,MSG_PEEK | MSG_DONTWAIT)) < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK){
+			return 0;
+		}else if(errno != EINTR){
+			moan("Error reading command on %d\n",cc->sd);
+			return -1;
 		}
+	}
+	if(r == 0){
+		bitch("EOF after %zub of command on %d\n",cc->cmdlen,cc->sd);
 		return -1;
 	}
-	if((cmsg = CMSG_FIRSTHDR(&mh)) == NULL){
-		bitch("Malformed SCM_RIGHTS message\n");
+	if( (nul = memchr(cc->cmdbuf + cc->cmdlen,'\0',(size_t)r)) ){
+		take = nul - (cc->cmdbuf + cc->cmdlen) + 1;
+	}else{
+		take = r;
+	}
+	if(recv(cc->sd,cc->cmdbuf + cc->cmdlen,(size_t)take,MSG_DONTWAIT) != take){
+		moan("Error consuming %zdb of command on %d\n",take,cc->sd);
 		return -1;
 	}
-	if(cmsg->cmsg_len != CMSG_LEN(sizeof(int))){
-		bitch("Badly-sized SCM_RIGHTS message (%zu != %zu)\n",
-			CMSG_LEN(sizeof(int)),(size_t)cmsg->cmsg_len);
+	cc->cmdlen += (size_t)take;
+	return 1;
+}
+
+static int
+ctlconn_complete(const ctlconn *cc){
+	return cc->cmdlen && cc->cmdbuf[cc->cmdlen - 1] == '\0';
+}
+
+static void
+free_ctlconn(ctlconn *cc){
+	ctlconn **pre;
+
+	for(pre = &ctlconns ; *pre != cc ; pre = &(*pre)->next){
+		;
+	}
+	*pre = cc->next;
+	--ctlconn_count;
+	if(cc->pipe){
+		release_cmd_pipe(cc->pipe); // the pipe owns the descriptors
+	}else{
+		if(cc->sd >= 0){
+			Close(cc->sd);
+		}
+		if(cc->errsd >= 0){
+			Close(cc->errsd);
+		}
+	}
+	Free(cc->fbuf);
+	Free(cc);
+}
+
+// Free a connection still registered with the evhandler
+static void
+drop_ctlconn(ctlconn *cc){
+	remove_fd_from_evhandler(ctlev,cc->sd);
+	free_ctlconn(cc);
+}
+
+// returns 0 if it was a server command (having run and closed it), < 0
+// otherwise
+static int
+check_for_server_command(cmd_state *cs,const char *cmd){
+	const command *c;
+
+	if((c = find_server_command(cmd)) == NULL){
 		return -1;
 	}
-	if(cmsg->cmsg_level != SOL_SOCKET){
-		bitch("Bad level receiving fd (%d)\n",cmsg->cmsg_level);
+	if(c->func(cs)){
+		cs->status = CTLFRAME_FAILED;
+	}
+	close_cmd_state(cs);
+	return 0;
+}
+
+// Pipelined clients can see their reply before we've released the command
+// state, and stop the server, so we mustn't be cancelled in between.
+static void
+run_command(cmd_state *cs,const char *cmd){
+	int oldstate;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&oldstate);
+	timenag("[%s] sd %d, errsd %d\n",cmd,cs->sd,cs->errsd);
+	// If this is a server command, handle it in our context (unless
+	// pipelined; see scheduled_cmd).
+	if(cs->pipe || check_for_server_command(cs,cmd)){
+		schedule(cs,cmd);
+	}
+	pthread_setcancelstate(oldstate,NULL);
+}
+
+// The descriptors pass to the command, and the connection is freed.
+static void
+dispatch_ctlconn(ctlconn *cc){
+	cmd_state cs;
+
+	if(remove_fd_from_evhandler(ctlev,cc->sd)){
+		free_ctlconn(cc);
+		return;
+	}
+	init_cmd_state(&cs,cc->sd,cc->errsd);
+	cc->sd = cc->errsd = -1;
+	run_command(&cs,cc->cmdbuf);
+	free_ctlconn(cc);
+}
+
+// The request's payload is the NUL-terminated command, followed by its input
+static int
+dispatch_frame(ctlconn *cc,uint32_t id,const char *payload,size_t len){
+	const char *nul;
+	cmd_state cs;
+	size_t inlen;
+	char *input;
+
+	if((nul = memchr(payload,'\0',len)) == NULL || nul == payload){
+		bitch("Malformed request %u on %d\n",id,cc->sd);
 		return -1;
 	}
-	if(cmsg->cmsg_type != SCM_RIGHTS){
-		bitch("Bad type receiving fd (%d)\n",cmsg->cmsg_type);
+	inlen = len - (size_t)(nul - payload) - 1;
+	if((input = Malloc("ctl input",inlen + 1)) == NULL){
 		return -1;
 	}
-	iov[0].iov_len = 1;
-	mh.msg_control = NULL;
-	mh.msg_controllen = 0;
-	for(z = 0 ; z < *sz ; ++z){
-		iov[0].iov_base = data + z;
-		if((recvd = recvmsg(sd,&mh,0)) < 1){
-			if(recvd < 0){
-				moan("Error reading command\n");
-			}else{
-				bitch("Short (%d) read on command\n",recvd);
-			}
+	memcpy(input,nul + 1,inlen);
+	input[inlen] = '\0';
+	init_piped_cmd_state(&cs,cc->pipe,id,input,inlen);
+	run_command(&cs,payload);
+	return 0;
+}
+
+// Schedule each complete frame in the buffer, retaining any partial frame.
+// Stops early, marking the connection stalled, if too many are in flight.
+static int
+dispatch_frames(ctlconn *cc){
+	size_t off = 0;
+
+	while(cc->flen - off >= sizeof(ctlframe)){
+		ctlframe hdr;
+		size_t len;
+
+		if(stall_cmd_pipe(cc->pipe,CTLPIPE_INFLIGHT_MAX)){
+			cc->stalled = 1;
+			break;
+		}
+		memcpy(&hdr,cc->fbuf + off,sizeof(hdr));
+		if((len = ntohl(hdr.len)) > CTLFRAME_MAXLEN){
+			bitch("%zub request exceeds %ub on %d\n",len,CTLFRAME_MAXLEN,cc->sd);
 			return -1;
 		}
-		if(data[z] == '\0'){
+		if(cc->flen - off - sizeof(hdr) < len){
 			break;
 		}
+		if(dispatch_frame(cc,ntohl(hdr.id),cc->fbuf + off + sizeof(hdr),len)){
+			return -1;
+		}
+		off += sizeof(hdr) + len;
+	}
+	memmove(cc->fbuf,cc->fbuf + off,cc->flen - off);
+	cc->flen -= off;
+	return 0;
+}
+
+// Read and dispatch frames until the socket's drained or the connection
+// stalls (returning 0), or until error or EOF (returning -1; the connection
+// ought be dropped). A stalled connection is read once woken.
+static int
+recv_ctlconn_frames(ctlconn *cc){
+	for( ; ; ){
+		ssize_t r;
+
+		if(cc->stalled){
+			return 0;
+		}
+		if(cc->fsize - cc->flen < CTLCONN_READ_CHUNK){
+			size_t nsize = cc->fsize ? cc->fsize * 2 : CTLCONN_READ_CHUNK * 2;
+			char *tmp;
+
+			if(nsize > CTLFRAME_MAXLEN * 2){
+				bitch("Request buffer exceeded on %d\n",cc->sd);
+				return -1;
+			}
+			if((tmp = Realloc("ctl frames",cc->fbuf,nsize)) == NULL){
+				return -1;
+			}
+			cc->fbuf = tmp;
+			cc->fsize = nsize;
+		}
+		if((r = recv(cc->sd,cc->fbuf + cc->flen,cc->fsize - cc->flen,MSG_DONTWAIT)) < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				return 0;
+			}else if(errno != EINTR){
+				moan("Error reading requests on %d\n",cc->sd);
+				return -1;
+			}
+			continue;
+		}else if(r == 0){
+			if(cc->flen){
+				bitch("EOF with %zub of request on %d\n",cc->flen,cc->sd);
+			}
+			return -1;
+		}
+		cc->flen += (size_t)r;
+		if(dispatch_frames(cc)){
+			return -1;
+		}
 	}
-	*sz = z;
-	return *CMSG_DATA(cmsg);
 }
 
+// The connection persists with the evthread, its descriptors now belonging
+// to a cmd_pipe.
 static int
-ctlserv_accept(int sd,char *cmdbuf,size_t *sz){
-	int fd;
+pipeline_ctlconn(ctlconn *cc){
+	if((cc->pipe = create_cmd_pipe(cc->sd,cc->errsd,wakefds[1])) == NULL){
+		return -1;
+	}
+	nag("Pipelining on sd %d\n",cc->sd);
+	return 0;
+}
+
+static void
+ctlconn_readable(int sd __attribute__ ((unused)),void *vcc){
+	ctlconn *cc = vcc;
+	int r;
+
+	// We're edge-triggered, and must read until the socket's drained
+	do{
+		if(cc->pipe){
+			r = recv_ctlconn_frames(cc) ? -1 : 0;
+		}else if(cc->verlen < sizeof(cc->version)){
+			if((r = recv_ctlconn_header(cc)) > 0 && cc->verlen == sizeof(cc->version)
+					&& ntohl(cc->version) == CTLSERVER_PIPELINE_VERSION){
+				r = pipeline_ctlconn(cc) ? -1 : 1;
+			}
+		}else{
+			r = recv_ctlconn_command(cc);
+		}
+	}while(r > 0 && !ctlconn_complete(cc));
+	if(r < 0){
+		drop_ctlconn(cc);
+	}else if(r > 0){
+		dispatch_ctlconn(cc);
+	}
+}
+
+// A stalled connection's command has completed. Dispatch what's buffered,
+// and read what's arrived meanwhile (there'll be no further edge for it).
+static void
+ctlconn_woken(int fd,void *unused __attribute__ ((unused))){
+	ctlconn *cc,*next;
+	char buf[64];
+
+	while(read(fd,buf,sizeof(buf)) > 0){
+		;
+	}
+	for(cc = ctlconns ; cc ; cc = next){
+		next = cc->next;
+		if(cc->stalled){
+			cc->stalled = 0;
+			if(dispatch_frames(cc) || recv_ctlconn_frames(cc)){
+				drop_ctlconn(cc);
+			}
+		}
+	}
+}
 
-	if(*sz < 2){
-		bitch("Buffer too small (%zub)\n",*sz);
+static int
+start_ctlwake(void){
+	if(Pipe(wakefds)){
 		return -1;
 	}
-	// reads up to *sz - 1, stores amount read back in *sz...
-	if((fd = recv_fd(sd,cmdbuf,sz)) < 0){
+	if(set_fd_close_on_exec(wakefds[0]) || set_fd_close_on_exec(wakefds[1])){
 		return -1;
 	}
-	cmdbuf[*sz] = '\0';
-	// ... and thus this is safe (see comment above)
-	return fd;
+	if(set_fd_nonblocking(wakefds[0]) || set_fd_nonblocking(wakefds[1])){
+		return -1;
+	}
+	return add_fd_to_evhandler(ctlev,wakefds[0],ctlconn_woken,NULL,NULL);
 }
 
-// returns 0 if it was a server command, < 0 otherwise
+// Called once the drones have been reaped, and pending commands closed
 static int
-check_for_server_command(int sd,int errsd,const char *cmd){
-	const command *c;
-	cmd_state cs;
+close_ctlwake(void){
+	int ret = 0,z;
 
-	init_cmd_state(&cs,sd,errsd);
-	for(c = server_commands ; c->cmd ; ++c){
-		if(strcmp(cmd,c->cmd) == 0){
-			c->func(&cs);
-			close_cmd_state(&cs);
-			return 0;
+	for(z = 0 ; z < 2 ; ++z){
+		if(wakefds[z] >= 0){
+			ret |= Close(wakefds[z]);
+			wakefds[z] = -1;
+		}
+	}
+	return ret;
+}
+
+static time_t
+ctlconn_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec;
+}
+
+// Drop connections which haven't delivered their command by the deadline
+static void
+sweep_ctlconns(void){
+	time_t now = ctlconn_now();
+	ctlconn *cc,*next;
+
+	for(cc = ctlconns ; cc ; cc = next){
+		next = cc->next;
+		if(cc->pipe == NULL && cc->deadline <= now){
+			bitch("Dropping sd %d after %ds (%zub of command)\n",cc->sd,
+					CTLCONN_TIMEOUT_SEC,cc->cmdlen);
+			counter_inc(conns_timedout);
+			drop_ctlconn(cc);
 		}
 	}
-	return -1;
+}
+
+#ifdef LIB_COMPAT_LINUX
+static void
+sweep_timer(int fd,void *unused __attribute__ ((unused))){
+	uint64_t expirations;
+
+	while(read(fd,&expirations,sizeof(expirations)) == sizeof(expirations)){
+		sweep_ctlconns();
+	}
+}
+
+static int
+start_sweep_timer(void){
+	const struct itimerspec its = {
+		.it_interval = { .tv_sec = 1, .tv_nsec = 0, },
+		.it_value = { .tv_sec = 1, .tv_nsec = 0, },
+	};
+
+	if((sweepfd = Timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+		return -1;
+	}
+	if(Timerfd_settime(sweepfd,0,&its,NULL)){
+		return -1;
+	}
+	return add_fd_to_evhandler(ctlev,sweepfd,sweep_timer,NULL,NULL);
+}
+#endif
+
+// Called once the ctl evthread has been reaped
+static int
+close_ctlconns(void){
+	int ret = 0;
+
+	while(ctlconns){
+		free_ctlconn(ctlconns);
+	}
+#ifdef LIB_COMPAT_LINUX
+	if(sweepfd >= 0){
+		ret |= Close(sweepfd);
+		sweepfd = -1;
+	}
+#endif
+	return ret;
 }
 
 static void
 localaccept(int lsd,void *vstate){
 	ctlserv_marshal *cm = vstate;
-	int sd,errsd;
+	int sd;
 
 	while((sd = accept_local(lsd,&cm->suna,LIBDANK_FD_CLOEXEC)) >= 0){
-		size_t sz = sizeof(cm->cmdbuf);
+		ctlconn *cc;
 
-		// FIXME this can block!
-		if((errsd = ctlserv_accept(sd,cm->cmdbuf,&sz)) < 0){
+		if(ctlconn_count >= CTLCONN_MAX){
+			ratebitch(1,10,"%u pending connections; dropping sd %d\n",ctlconn_count,sd);
 			Close(sd);
-			return;
+			continue;
 		}
-		if(set_fd_close_on_exec(errsd)){
+		if((cc = Malloc("ctlconn",sizeof(*cc))) == NULL){
 			Close(sd);
-			Close(errsd);
-			return;
-		}
-		timenag("[%s] sd %d, errsd %d\n",cm->cmdbuf,sd,errsd);
-		// If this is a server command, handle it in our context.
-		if(check_for_server_command(sd,errsd,cm->cmdbuf) == 0){
-			return;
+			continue;
 		}
-		if(schedule(sd,errsd,cm->cmdbuf)){
-			return;
+		memset(cc,0,sizeof(*cc));
+		cc->sd = sd;
+		cc->errsd = -1;
+		cc->deadline = ctlconn_now() + CTLCONN_TIMEOUT_SEC;
+		cc->next = ctlconns;
+		ctlconns = cc;
+		++ctlconn_count;
+		// Registration reports data which has already arrived
+		if(add_fd_to_evhandler(ctlev,sd,ctlconn_readable,NULL,cc)){
+			cc->sd = -1;
+			Close(sd);
+			free_ctlconn(cc);
 		}
 	}
+#ifndef LIB_COMPAT_LINUX
+	sweep_ctlconns();
+#endif
 }
 
 int dump_lock(stringizer sfxn,pthread_mutex_t *mtx){
@@ -427,35 +1056,97 @@ int dump_lock(stringizer sfxn,pthread_mutex_t *mtx){
 }
 
 static const command server_commands[] = {
-	{"shutdown",		server_shutdown,	},
-	{"internal_noop",	server_noop,		},
-	{NULL,			NULL,			}
+	{"shutdown",		server_shutdown,	CTLPRIO_HIGH,	},
+	{"internal_noop",	server_noop,		CTLPRIO_NORMAL,	},
+	{NULL,			NULL,			CTLPRIO_NORMAL,	}
 };
 
 static const command commands[] = {
-	{"help",		server_help,		},
-	{"external_noop",	server_noop,		},
-	{NULL,			NULL,			}
+	{"help",		server_help,		CTLPRIO_HIGH,	},
+	{"external_noop",	server_noop,		CTLPRIO_NORMAL,	},
+	{NULL,			NULL,			CTLPRIO_NORMAL,	}
 };
 
 static int
-corral_the_herd(const drone *drones,unsigned count){
+unregister_ctlserver_metrics(void){
 	int ret = 0;
 
-	while(count){
-		ret |= reap_traceable_thread("drone",drones[--count].tid,NULL);
+	ret |= unregister_metric(cmds_run);
+	ret |= unregister_metric(cmds_failed);
+	ret |= unregister_metric(cmds_queued);
+	ret |= unregister_metric(cmd_usec);
+	ret |= unregister_metric(conns_timedout);
+	ret |= unregister_metric(drones_live);
+	cmds_run = cmds_failed = cmds_queued = cmd_usec = conns_timedout = NULL;
+	drones_live = NULL;
+	return ret;
+}
+
+static int
+register_ctlserver_metrics(void){
+	if((cmds_run = register_counter("ctlserver.commands")) == NULL ||
+			(cmds_failed = register_counter("ctlserver.failures")) == NULL ||
+			(cmds_queued = register_gauge("ctlserver.queued")) == NULL ||
+			(cmd_usec = register_histogram("ctlserver.command_usec")) == NULL ||
+			(conns_timedout = register_counter("ctlserver.timeouts")) == NULL ||
+			(drones_live = register_gauge("ctlserver.drones")) == NULL){
+		unregister_ctlserver_metrics();
+		return -1;
 	}
+	return 0;
+}
+
+// Called once the ctl evthread has been reaped, so the pool can't grow
+static int
+corral_the_herd(void){
+	drone *d,*herd;
+	int ret = 0;
+
+	pthread_mutex_lock(&srvrlock);
+	herd = drones;
+	drones = NULL;
+	pthread_mutex_unlock(&srvrlock);
+	while( (d = herd) ){
+		herd = d->next;
+		if(d->retired){
+			ret |= join_traceable_thread("drone",d->tid);
+		}else{
+			ret |= reap_traceable_thread("drone",d->tid,NULL);
+		}
+		Free(d);
+	}
+	drone_count = idle_drones = 0;
+	gauge_set(drones_live,0);
 	return ret;
 }
 
+// Commands still queued at shutdown are closed unrun
+static void
+drain_pending_cmds(void){
+	scheduled_cmd *sc;
+
+	while( (sc = dequeue_cmd_locked()) ){
+		if(sc->ecmd){
+			--sc->ecmd->refcount;
+		}
+		close_cmd_state(&sc->cs);
+		Free(sc);
+	}
+}
+
 static int
-sew_dragon_teeth(drone *drones,unsigned count){
+sew_dragon_teeth(void){
 	unsigned z;
 
-	nag("Creating %u drones\n",count);
-	for(z = 0 ; z < count ; ++z){
-		if(new_traceable_thread("ctldrone",&drones[z].tid,ctldrone_main,NULL)){
-			corral_the_herd(drones,z);
+	for(z = 0 ; z < CTLPRIO_COUNT ; ++z){
+		pending_cmds[z].head = NULL;
+		pending_cmds[z].tail = &pending_cmds[z].head;
+	}
+	queued_count = 0;
+	nag("Creating %u drones\n",DRONES_MIN);
+	for(z = 0 ; z < DRONES_MIN ; ++z){
+		if(spawn_drone()){
+			corral_the_herd();
 			return -1;
 		}
 	}
@@ -476,9 +1167,15 @@ int init_ctlserver(const char *sn){
 	if(Pthread_cond_init(&srvrcond,NULL)){
 		goto lockerr;
 	}
-	if(sew_dragon_teeth(drone_horde,sizeof(drone_horde) / sizeof(*drone_horde))){
+	if(Pthread_cond_init(&cmdcond,NULL)){
 		goto conderr;
 	}
+	if(register_ctlserver_metrics()){
+		goto cmdconderr;
+	}
+	if(sew_dragon_teeth()){
+		goto metricerr;
+	}
 	// FIXME we should move this inside the ctlserver_main, and use
 	// rigorous I/O utils. update doc/ctlserver if we ever do.
 	nag("ctlsock at %s\n",sn);
@@ -495,15 +1192,27 @@ int init_ctlserver(const char *sn){
 	if((ctlev = create_evthread(LIBDANK_FD_CLOEXEC)) == NULL){
 		goto cmderr;
 	}
+	if(start_ctlwake()){
+		goto cmderr;
+	}
 	if(add_fd_to_evhandler(ctlev,listenfd,localaccept,NULL,cmarsh)){
 		goto cmderr;
 	}
+#ifdef LIB_COMPAT_LINUX
+	if(start_sweep_timer()){
+		goto cmderr;
+	}
+#endif
 	return 0;
 
 cmderr:
 	delcommands(commands);
 herderr:
-	corral_the_herd(drone_horde,sizeof(drone_horde) / sizeof(*drone_horde));
+	corral_the_herd();
+metricerr:
+	unregister_ctlserver_metrics();
+cmdconderr:
+	Pthread_cond_destroy(&cmdcond);
 conderr:
 	Pthread_cond_destroy(&srvrcond);
 lockerr:
@@ -512,6 +1221,8 @@ err:
 	mainserv_close();
 	destroy_evhandler(ctlev);
 	ctlev = NULL;
+	close_ctlconns();
+	close_ctlwake();
 	Free(cmarsh);
 	return -1;
 }
@@ -526,10 +1237,15 @@ int stop_ctlserver(void){
 	ret |= delcommands(commands);
 	ret |= mainserv_close();
 	ret |= destroy_evhandler(ctlev);
-	ret |= corral_the_herd(drone_horde,sizeof(drone_horde) / sizeof(*drone_horde));
+	ret |= close_ctlconns();
+	ret |= corral_the_herd();
+	drain_pending_cmds();
+	ret |= close_ctlwake();
+	ret |= unregister_ctlserver_metrics();
 	timenag("Killed ctlserver\n");
 	ret |= Pthread_mutex_destroy(&srvrlock);
 	ret |= Pthread_cond_destroy(&srvrcond);
+	ret |= Pthread_cond_destroy(&cmdcond);
 	Free(cmarsh);
 	return ret;
 }
@@ -14,9 +14,18 @@ int stop_ctlserver(void);
 
 typedef int (*ctlserv_handler)(cmd_state *);
 
+// Queued commands are run in order of priority class, and FIFO within each.
+typedef enum {
+	CTLPRIO_NORMAL,	// the default
+	CTLPRIO_HIGH,	// cheap queries (ie health checks)
+	CTLPRIO_BULK,	// long-running or heavy (ie log_dump)
+	CTLPRIO_COUNT
+} ctlserv_prio;
+
 typedef struct command {
 	const char *cmd;
 	ctlserv_handler func;
+	ctlserv_prio prio;
 } command;
 
 int regcommands(const command *);
@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_EVCORE
+
 #include <libdank/utils/fds.h>
 #include <libdank/utils/maxfds.h>
 #include <libdank/utils/syswrap.h>
@@ -6,6 +8,7 @@
 #include <libdank/modules/events/evcore.h>
 #include <libdank/modules/events/signals.h>
 #include <libdank/modules/events/sources.h>
+#include <libdank/modules/metrics/metrics.h>
 #include <libdank/modules/tracing/threads.h>
 
 #define EVTHREAD_SIGNAL SIGURG
@@ -217,11 +220,21 @@ initialize_evhandler(evhandler *e,int fd){
 	if((e->sigarray = create_evsources(e->sigarraysize)) == NULL){
 		goto fderr;
 	}
-	if(add_evhandler_baseevents(e)){
+	if((e->events = register_counter("evcore.events")) == NULL){
 		goto sigerr;
 	}
+	if((e->errors = register_counter("evcore.errors")) == NULL){
+		goto eventserr;
+	}
+	if(add_evhandler_baseevents(e)){
+		goto errorserr;
+	}
 	return 0;
 
+errorserr:
+	unregister_metric(e->errors);
+eventserr:
+	unregister_metric(e->events);
 sigerr:
 	destroy_evsources(e->sigarray,e->sigarraysize);
 fderr:
@@ -332,6 +345,8 @@ int destroy_evhandler(evhandler *e){
 		ret |= destroy_evsources(e->sigarray,e->sigarraysize);
 		ret |= destroy_evsources(e->fdarray,e->fdarraysize);
 		destroy_evectors(e->externalvec);
+		ret |= unregister_metric(e->events);
+		ret |= unregister_metric(e->errors);
 		ret |= Close(e->fd);
 		Free(e);
 	}
@@ -367,11 +382,11 @@ handle_read_event(const kevententry *k,evhandler *eh){
 	int fd = KEVENTENTRY_FD(k);
 
 	if(fd >= eh->fdarraysize || fd < 0){
-		bitch("Received invalid fd %d\n",fd);
-		// FIXME increment stat
+		ratebitch(10,100,"Received invalid fd %d\n",fd);
+		counter_inc(eh->errors);
 		return 0;
 	}
-	nag("EVENT ON %d\n",fd);
+	dnag("EVENT ON %d\n",fd);
 	if(handle_evsource_read(eh->fdarray,fd)){
 		return -1;
 	}
@@ -380,7 +395,7 @@ handle_read_event(const kevententry *k,evhandler *eh){
 
 static inline int
 handle_write_event(const kevententry *k){
-	nag("Write event on %d\n",KEVENTENTRY_FD(k));
+	dnag("Write event on %d\n",KEVENTENTRY_FD(k));
 	// FIXME
 	return 0;
 }
@@ -392,8 +407,8 @@ handle_evfilt_signal(const kevententry *k,evhandler *eh){
 
 	// nag("Received signal %d (%s)\n",sig,strsignal(sig));
 	if(sig >= eh->sigarraysize || sig < 0){
-		bitch("Received invalid signal %d\n",sig);
-		// FIXME increment stat
+		ratebitch(10,100,"Received invalid signal %d\n",sig);
+		counter_inc(eh->errors);
 		return 0;
 	}
 	// FIXME can one represent multiple signals? if so, do we get count?
@@ -407,7 +422,7 @@ handle_evfilt_signal(const kevententry *k,evhandler *eh){
 
 static inline int
 handle_evfilt_timer(const kevententry *k){
-	nag("Timer %d expired\n",(int)k->ident);
+	dnag("Timer %d expired\n",(int)k->ident);
 	// FIXME
 	return 0;
 }
@@ -416,6 +431,7 @@ handle_evfilt_timer(const kevententry *k){
 // events must be greater than 0. ev must have at least that many events.
 static void
 handle_events(int events,evhandler *eh,evectors *ev){
+	counter_add(eh->events,(uint64_t)events);
 	while(events--){
 		const kevententry *k = nth_kevent(ev,events);
 		int ret = 0;
@@ -434,7 +450,8 @@ handle_events(int events,evhandler *eh,evectors *ev){
 		}else if(k->filter == EVFILT_TIMER){
 			ret = handle_evfilt_timer(k);
 		}else{
-			bitch("Unknown filter: %hd\n",k->filter);
+			ratebitch(10,100,"Unknown filter: %hd\n",k->filter);
+			counter_inc(eh->errors);
 		}
 #else
 		// Unlike FreeBSD, we can have multiple events per kevententry
@@ -443,7 +460,8 @@ handle_events(int events,evhandler *eh,evectors *ev){
 		if((k->events & EPOLLIN) && (ret = handle_read_event(k,eh)) ){
 		}else if((k->events & EPOLLOUT) && (ret = handle_write_event(k)) ){
 		}else if(ret){
-			bitch("Unknown events: %ju\n",(uintmax_t)k->events);
+			ratebitch(10,100,"Unknown events: %ju\n",(uintmax_t)k->events);
+			counter_inc(eh->errors);
 		}
 #endif
 		// FIXME handle a non-zero ret (close the fd)
@@ -471,7 +489,7 @@ evmain(void *unsafe_emarshal){
 		ev->changesqueued = 0;
 		if(events < 0){
 			if(errno != EINTR){ // simply loop on EINTR
-				// bump stat...FIXME
+				counter_inc(eh->errors);
 			}
 		}else if(events){
 			handle_events(events,eh,ev);
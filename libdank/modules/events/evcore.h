@@ -22,6 +22,7 @@ typedef struct evhandler {
 	int sigarraysize,fdarraysize;
 	struct evthread *threadlist;
 	struct evectors *externalvec;
+	struct metric *events,*errors; // shared among evhandlers
 } evhandler;
 
 // Takes a flag parameter, a (possibly zero) union over the LIBDANK_FD_* enum
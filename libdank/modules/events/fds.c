@@ -1,3 +1,6 @@
+#define LOG_CATEGORY LOGCAT_EVCORE
+
+#include <string.h>
 #include <libdank/utils/threads.h>
 #include <libdank/ersatz/compat.h>
 #include <libdank/utils/syswrap.h>
@@ -48,6 +51,45 @@ add_fd_event(struct evectors *ev,int fd,evcbfxn rfxn,evcbfxn tfxn){
 	return 0;
 }
 
+static inline int
+del_fd_event(struct evectors *ev,int fd,evcbfxn rfxn,evcbfxn tfxn){
+#ifdef LIB_COMPAT_LINUX
+	struct epoll_ctl_data ecd;
+	struct epoll_event ee;
+	struct kevent k;
+
+	k.events = &ee;
+	memset(&ee,0,sizeof(ee));
+	ee.data.fd = fd;
+	k.ctldata = &ecd;
+	ecd.op = EPOLL_CTL_DEL; // removes all events
+	(void)rfxn;
+	(void)tfxn;
+	if(add_evector_kevents(ev,&k,1)){
+		return -1;
+	}
+#else
+#ifdef LIB_COMPAT_FREEBSD
+	struct kevent k[2];
+	unsigned n = 0;
+
+	// Deleting an unregistered filter is an error
+	if(rfxn){
+		EV_SET(&k[n++],fd,EVFILT_READ,EV_DELETE,0,0,NULL);
+	}
+	if(tfxn){
+		EV_SET(&k[n++],fd,EVFILT_WRITE,EV_DELETE,0,0,NULL);
+	}
+	if(add_evector_kevents(ev,k,n)){
+		return -1;
+	}
+#else
+#error "No fd event implementation on this OS"
+#endif
+#endif
+	return 0;
+}
+
 int add_fd_to_evcore(evhandler *eh,struct evectors *ev,int fd,evcbfxn rfxn,
 				evcbfxn tfxn,void *cbstate){
 	if(fd >= eh->fdarraysize){
@@ -77,3 +119,23 @@ int add_fd_to_evhandler(evhandler *eh,int fd,evcbfxn rfxn,evcbfxn tfxn,
 	}
 	return -1;
 }
+
+int remove_fd_from_evhandler(evhandler *eh,int fd){
+	evcbfxn rfxn,tfxn;
+
+	if(fd < 0 || fd >= eh->fdarraysize){
+		bitch("Invalid fd %d\n",fd);
+		return -1;
+	}
+	evsource_callbacks(eh->fdarray,fd,&rfxn,&tfxn);
+	if(Pthread_mutex_lock(&eh->lock) == 0){
+		struct evectors *ev = eh->externalvec;
+
+		if(del_fd_event(ev,fd,rfxn,tfxn) == 0){
+			setup_evsource(eh->fdarray,fd,NULL,NULL,NULL);
+			return flush_evector_changes(eh,ev);
+		}
+		Pthread_mutex_unlock(&eh->lock);
+	}
+	return -1;
+}
@@ -17,6 +17,13 @@ int add_fd_to_evcore(struct evhandler *,struct evectors *,int,
 int add_fd_to_evhandler(struct evhandler *,int,evcbfxn,evcbfxn,void *)
 	__attribute__ ((nonnull (1)));
 
+// Stop watching the fd without closing it, ie to hand it off elsewhere. Its
+// callbacks are cleared. This must be called from the evhandler's own thread
+// (typically from one of the fd's callbacks), lest an event already reaped
+// by another thread be delivered following the call.
+int remove_fd_from_evhandler(struct evhandler *,int)
+	__attribute__ ((nonnull (1)));
+
 #ifdef __cplusplus
 }
 #endif
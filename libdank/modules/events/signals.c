@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_EVCORE
+
 #include <libdank/utils/threads.h>
 #include <libdank/ersatz/compat.h>
 #include <libdank/utils/syswrap.h>
@@ -5,6 +7,7 @@
 #include <libdank/modules/events/evcore.h>
 #include <libdank/modules/events/signals.h>
 #include <libdank/modules/events/sources.h>
+#include <libdank/modules/metrics/metrics.h>
 
 #ifdef LIB_COMPAT_LINUX
 #include <sys/signalfd.h>
@@ -18,8 +21,8 @@ signalfd_demultiplexer(int fd,void *cbstate){
 		if((r = read(fd,&si,sizeof(si))) == sizeof(si)){
 			handle_evsource_read(e->sigarray,si.ssi_signo);
 		}else if(r >= 0){
-			bitch("Got short read (%zd) off signalfd %d\n",r,fd);
-			// FIXME stat!
+			ratebitch(10,100,"Got short read (%zd) off signalfd %d\n",r,fd);
+			counter_inc(e->errors);
 		}
 	}while(r >= 0 && errno != EINTR);
 	if(errno != EAGAIN){
@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_EVCORE
+
 #include <string.h>
 #include <libdank/utils/threads.h>
 #include <libdank/utils/memlimit.h>
@@ -49,6 +51,11 @@ int handle_evsource_read(evsource *evs,int n){
 	return -1;
 }
 
+void evsource_callbacks(const evsource *evs,int n,evcbfxn *rfxn,evcbfxn *tfxn){
+	*rfxn = evs[n].rxfxn;
+	*tfxn = evs[n].txfxn;
+}
+
 int destroy_evsources(evsource *evs,unsigned n){
 	int ret = 0;
 	unsigned z;
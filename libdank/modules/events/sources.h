@@ -23,6 +23,9 @@ struct evsource *create_evsources(unsigned)
 void setup_evsource(struct evsource *,int,evcbfxn,evcbfxn,void *);
 int handle_evsource_read(struct evsource *,int);
 
+// The callbacks currently registered for the fd (either might be NULL)
+void evsource_callbacks(const struct evsource *,int,evcbfxn *,evcbfxn *);
+
 int destroy_evsources(struct evsource *,unsigned);
 
 #endif
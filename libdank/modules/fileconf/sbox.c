@@ -111,6 +111,19 @@ int parse_config(config_data *cfg,line_parser_cb lcb,void *arg){
 	return ret;
 }
 
+// The callback must be thread-safe, and the file is mapped; see
+// parser_byline_parallel()
+int parse_config_parallel(config_data *cfg,line_parser_cb lcb,void *arg,unsigned threads){
+	int ret = 0;
+
+	if(lock_and_load_file(cfg,O_RDONLY)){
+		return -1;
+	}
+	ret |= parser_byline_parallel(Fileno(cfg->fp),lcb,arg,threads);
+	ret |= unlock_and_unload_file(cfg);
+	return ret;
+}
+
 int parse_wconfig(config_data *cfg,wline_parser_cb wlcb,void *arg){
 	int ret = 0;
 
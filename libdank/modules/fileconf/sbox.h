@@ -17,6 +17,7 @@ int stop_fileconf(void);
 struct config_data *open_config(const char *);
 
 int parse_config(struct config_data *,line_parser_cb,void *);
+int parse_config_parallel(struct config_data *,line_parser_cb,void *,unsigned);
 int parse_wconfig(struct config_data *,wline_parser_cb,void *);
 int parse_config_xmlfile(struct config_data *,struct _xmlDoc **);
 
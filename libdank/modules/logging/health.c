@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_LOGGING
+
 #include <sys/resource.h>
 #include <libdank/utils/syswrap.h>
 #include <libdank/objects/objustring.h>
@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_LOGGING
+
 #include <stdio.h>
 #include <dirent.h>
 #include <string.h>
@@ -6,80 +8,42 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <libdank/utils/fds.h>
 #include <libdank/ersatz/compat.h>
 #include <libdank/utils/syswrap.h>
+#include <libdank/utils/memlimit.h>
 #include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
 #include <libdank/modules/logging/logdir.h>	
+#include <libdank/modules/logging/logrotate.h>
 
 #define KBYTE_SIZE 1024
 #define LOG_KBYTES 1024
+#define PREVIOUS_LOGDIR "previous"
 
 static char *logdir;
 static int use_stdio;
 static size_t logdir_avail;
 static char crash_fn[PATH_MAX];
-static FILE *crash_log,*avail_crash_log;
+static logmap crash_map;
+static logmap *crash_log,*avail_crash_log;
 static pthread_mutex_t logdir_lock = PTHREAD_MUTEX_INITIALIZER;
+// Guards the logdir and interned thread names against being freed while
+// thread_log_name() reads them. Unlike logdir_lock, it's never held while
+// logging, since logging might itself need a thread's log name.
+static pthread_mutex_t logname_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static FILE *
-open_logfile(const char *fn){
-	FILE *ret;
-
-	if( (ret = fopen(fn,"wb")) ){
-		int fd;
-
-		setlinebuf(ret);
-		if((fd = Fileno(ret)) < 0){
-			fclose(ret);
-			ret = NULL;
-		}else if(set_fd_close_on_exec(fd)){
-			fclose(ret);
-			ret = NULL;
-		}
-		// We don't necessarily want the performance hit from
-		// unbuffered logging...maybe make it an option somehow? FIXME
-		/*else if(set_fd_nonblocking(fd)){
-			fclose(ret);
-			ret = NULL;
-		}*/
-	}
-	return ret;
-}
-	
 static int
 reserve_crash_log(const char *fn){
-	int i,ret = -1;
-	char *kbyte;
-	FILE *fp;
-
 	if(crash_log){
 		return -1;
 	}
-	if((kbyte = malloc(KBYTE_SIZE)) == NULL){
-		fprintf(stderr,"Couldn't allocate %u for crashbuf\n",KBYTE_SIZE);
+	if(create_logmap(&crash_map,fn,LOG_KBYTES * KBYTE_SIZE)){
+		fprintf(stderr,"Couldn't reserve crash log at \"%s\"\n",fn);
 		return -1;
 	}
-	memset(kbyte,' ',KBYTE_SIZE);
-	if((fp = open_logfile(fn)) == NULL){
-		fprintf(stderr,"Writing to \"%s\": %s\n",fn,strerror(errno));
-		goto done;
-	}
-	for(i = 0 ; i < LOG_KBYTES ; ++i){
-		if(fwrite(kbyte,KBYTE_SIZE,1,fp) != 1){
-			fprintf(stderr,"Writing to \"%s\": %s\n",fn,strerror(errno));
-			fclose(fp);
-			goto done;
-		}
-	}
-	rewind(fp);
 	strcpy(crash_fn,fn);
-	avail_crash_log = crash_log = fp;
-	ret = 0;
-
-done:
-	free(kbyte);
-	return ret;
+	avail_crash_log = crash_log = &crash_map;
+	return 0;
 }
 
 static int
@@ -90,6 +54,9 @@ check_for_dir(scandir_arg d){
 	if(strcmp(d->d_name,"..") == 0){
 		return 0;
 	}
+	if(strcmp(d->d_name,PREVIOUS_LOGDIR) == 0){
+		return 0;
+	}
 	return 1;
 }
 
@@ -119,6 +86,43 @@ clean_logdir(const char *dfn){
 	return;
 }
 
+// Move a previous run's logs into the PREVIOUS_LOGDIR subdirectory, replacing
+// whatever was there, so that they're available for postmortems.
+static void
+preserve_logdir(const char *dfn){
+	char ffn[PATH_MAX],pfn[PATH_MAX];
+	struct dirent **namelist;
+	int num,fto,pto;
+
+	if((fto = snprintf(ffn,sizeof(ffn),"%s/",dfn)) >= (int)sizeof(ffn) || fto < 0 ||
+			(pto = snprintf(pfn,sizeof(pfn),"%s/" PREVIOUS_LOGDIR "/",dfn)) >= (int)sizeof(pfn) || pto < 0){
+		fprintf(stderr,"Couldn't preserve files from %s\n",dfn);
+		return;
+	}
+	if(mkdir(pfn,S_IRWXU)){
+		if(errno != EEXIST){
+			fprintf(stderr,"Couldn't create %s: %s\n",pfn,strerror(errno));
+			clean_logdir(dfn);
+			return;
+		}
+		clean_logdir(pfn);
+	}
+	if((num = scandir(dfn,&namelist,check_for_dir,alphasort)) < 0){
+		fprintf(stderr,"Couldn't preserve files from %s: %s\n",
+				dfn,strerror(errno));
+		return;
+	}
+	while(num--){
+		snprintf(ffn + fto,sizeof(ffn) - (size_t)fto,"%s",namelist[num]->d_name);
+		snprintf(pfn + pto,sizeof(pfn) - (size_t)pto,"%s",namelist[num]->d_name);
+		if(rename(ffn,pfn)){
+			fprintf(stderr,"Couldn't move %s: %s\n",ffn,strerror(errno));
+		}
+		free(namelist[num]);
+	}
+	free(namelist);
+}
+
 static int
 try_logdir(size_t used){
 	size_t avail = logdir_avail - used;
@@ -139,7 +143,11 @@ try_logdir(size_t used){
 					logdir,strerror(errno));
 			goto reset;
 		}
-		clean_logdir(logdir);
+		if(log_rotation_running()){
+			preserve_logdir(logdir);
+		}else{
+			clean_logdir(logdir);
+		}
 	}
 	memcpy(pos,CRASH_LOG,crashsiz);
 	if(reserve_crash_log(logdir)){
@@ -153,26 +161,86 @@ reset:
 	return ret;
 }
 
-static FILE *
-set_logdir_locked(const char *applogdir,char *fn){
+// Thread names are interned, as many threads generally share each name. The
+// strings are freed with the logdir.
+typedef struct lname {
+	struct lname *next;
+	char name[];
+} lname;
+
+static lname *lnames;
+
+// Logfiles are named for their thread and a serial number. pthread_t values
+// are reused as soon as a thread's been joined, which would have successive
+// threads (and the archiver's segments of their logmaps) share a name.
+static unsigned long log_serial;
+
+static const char *
+intern_lname_locked(const char *name){
+	size_t len = strlen(name) + 1;
+	lname *ln;
+
+	for(ln = lnames ; ln ; ln = ln->next){
+		if(strcmp(ln->name,name) == 0){
+			return ln->name;
+		}
+	}
+	if((ln = malloc(sizeof(*ln) + len)) == NULL){
+		return NULL;
+	}
+	memcpy(ln->name,name,len);
+	ln->next = lnames;
+	lnames = ln;
+	return ln->name;
+}
+
+static void
+free_lnames_locked(void){
+	lname *ln;
+
+	while( (ln = lnames) ){
+		lnames = ln->next;
+		free(ln);
+	}
+}
+
+static int
+open_thread_log_locked(const char *name,logctx *lc){
+	if(logdir == NULL){
+		lc->lfile = use_stdio ? stdout : NULL;
+		return 0;
+	}
+	if((lc->lname = intern_lname_locked(name)) == NULL){
+		return -1;
+	}
+	lc->lserial = ++log_serial;
+	return 0;
+}
+
+static int
+set_logdir_locked(const char *applogdir,logctx *lc){
 	size_t slen;
+	char *dir;
 
 	logdir_avail = PATH_MAX + 1;
 	if(logdir_avail < strlen(applogdir) + 2){
 		fprintf(stderr,"Log directory name too long: %s\n",applogdir);
-		return NULL;
+		return -1;
 	}
-	if((logdir = malloc(logdir_avail)) == NULL){
+	if((dir = malloc(logdir_avail)) == NULL){
 		fprintf(stderr,"Couldn't allocate %zu for logdir\n",logdir_avail);
-		return NULL;
+		return -1;
 	}
-	strcpy(logdir,applogdir);
-	strcat(logdir,"/");
+	strcpy(dir,applogdir);
+	strcat(dir,"/");
+	pthread_mutex_lock(&logname_lock);
+	logdir = dir;
+	pthread_mutex_unlock(&logname_lock);
 	slen = strlen(applogdir) + 1;
 	if(try_logdir(slen)){
-		return NULL;
+		return -1;
 	}
-	return open_thread_log("main",fn);
+	return open_thread_log_locked("main",lc);
 }
 
 // Indicate that stdio should be used. The logctx passed in have its lfile
@@ -204,39 +272,69 @@ int set_logdir(const char *dir){
 	if( (lc = get_thread_logctx()) ){
 		pthread_mutex_lock(&logdir_lock);
 		if(!logdir && !use_stdio){
-			if( (lc->lfile = set_logdir_locked(dir,lc->lfile_name)) ){
-				ret = 0;
-			}
+			ret = set_logdir_locked(dir,lc);
 		}
 		pthread_mutex_unlock(&logdir_lock);
 	}
 	return ret;
 }
 
-// supply the name of the thread, returns a logfile in the logdir. the name is saved
-// in fn, which should be PATH_MAX + 1 bytes long for k-radness
-FILE *open_thread_log(const char *name,char *fn){
-	int len = PATH_MAX + 1;
-	FILE *ret = NULL;
-	pthread_t tid;
+// Supply the name of the thread, and the logctx will be set up to log into a
+// logmap in the logdir (or to stdout, if stdio was selected). The logmap
+// itself is created upon first use, by open_thread_logmap().
+int open_thread_log(const char *name,logctx *lc){
+	int ret;
 
-	if(logdir == NULL){
-		return use_stdio ? stdout : NULL;
+	pthread_mutex_lock(&logdir_lock);
+	ret = open_thread_log_locked(name,lc);
+	pthread_mutex_unlock(&logdir_lock);
+	return ret;
+}
+
+int thread_log_name(const logctx *lc,char *buf,size_t len){
+	int r = -1;
+
+	pthread_mutex_lock(&logname_lock);
+	if(logdir && lc->lname){
+		r = snprintf(buf,len,"%s%s.%lu",logdir,lc->lname,lc->lserial);
+	}
+	pthread_mutex_unlock(&logname_lock);
+	return r < 0 || (size_t)r >= len ? -1 : 0;
+}
+
+int open_thread_logmap(logctx *lc){
+	char fn[PATH_MAX];
+	logmap *lm;
+
+	if(lc->lmap){
+		return 0;
+	}
+	if(lc->lmapless || thread_log_name(lc,fn,sizeof(fn))){
+		return -1;
+	}
+	lc->lmapless = 1; // Malloc() and friends might log; don't recurse
+	if((lm = Malloc("logmap",sizeof(*lm))) == NULL){
+		return -1;
 	}
-	tid = pthread_self();
-	if(snprintf(fn,(size_t)len,"%s%s."PRINTF_TIDT,logdir,name,(unsigned long)tid) < len){
-		if((ret = open_logfile(fn)) == NULL){
-			fn[0] = '\0';
+	if(create_logmap(lm,fn,LOG_KBYTES * KBYTE_SIZE)){
+		Free(lm);
+		return -1;
+	}
+	lc->lmap = lm;
+	lc->lmapless = 0;
+	if(log_rotation_running()){
+		if(rotate_logmap(fn)){
+			fprintf(stderr,"Couldn't archive %s\n",fn);
 		}
 	}
-	return ret;
+	return 0;
 }
 
 static int
 get_crash_log_locked(logctx *lc){
 	if(avail_crash_log){
 		init_private_logctx(lc);
-		lc->lfile = crash_log;
+		lc->lmap = crash_log;
 		avail_crash_log = NULL;
 		return 0;
 	}else if(use_stdio){
@@ -257,7 +355,7 @@ void get_crash_log(logctx *lc){
 
 static void
 truncate_crash_log_locked(int exit_status){
-	int fd = -1;
+	int halted = 0;
 	logctx *lc;
 
 	if((lc = get_thread_logctx()) == NULL){
@@ -269,34 +367,34 @@ truncate_crash_log_locked(int exit_status){
 	if(avail_crash_log){
 		timenag("Closing unused crash log\n");
 		avail_crash_log = NULL;
-		if(fclose(crash_log) == EOF){
+		if(close_logmap(crash_log)){
 			moan("Couldn't close crash log at %p\n",crash_log);
 		}
 		Unlink(crash_fn);
 		goto done;
 	}
-	if(lc->lfile != crash_log){
-		bitch("Crash log %p claimed, cur = %p\n",crash_log,lc->lfile);
-		goto done;
-	}
-	if((fd = fileno(crash_log)) < 0){
-		moan("Couldn't extract fd from crash log %p\n",crash_log);
+	if(lc->lmap != crash_log){
+		bitch("Crash log %p claimed, cur = %p\n",crash_log,lc->lmap);
 		goto done;
 	}
-	nag("Truncating crash log at fd %d\n",fd);
 	timenag("Halting! Exit code: %d\n",exit_status);
-	Ftruncate(fd,lc->lfile_offset);
-	// closing crash_log here in fatal sig handler context -> lockup, thus:
-	lc->lfile = NULL; // FIXME
+	halted = 1;
+	// Everything's already on disk; the crash log is static, and mustn't
+	// be freed by free_logctx().
+	lc->lmap = NULL;
+	close_logmap(crash_log);
 
 done:
-	if(fd < 0){
+	if(!halted){
 		timenag("Halting with exit code %d\n",exit_status);
 	}
 	crash_log = NULL;
 	free_logctx(lc);
+	pthread_mutex_lock(&logname_lock);
 	free(logdir);
 	logdir = NULL;
+	free_lnames_locked();
+	pthread_mutex_unlock(&logname_lock);
 	return;
 }
 
@@ -12,9 +12,15 @@ struct logctx;
 int set_log_stdio(void);
 int set_logdir(const char *);
 
-// Supply the name of the thread, returns a logfile in the logdir. The filename is saved
-// in fn, which must be at least PATH_MAX + 1 bytes long.
-FILE *open_thread_log(const char *,char *);
+// Supply the name of the thread, and the logctx will log into a new logmap in
+// the logdir (or to stdout, if stdio was selected). The logmap is created by
+// open_thread_logmap() when the thread first logs; threads which never log
+// never create a file.
+int open_thread_log(const char *,struct logctx *);
+int open_thread_logmap(struct logctx *);
+
+// Write the path of the logctx's logmap ("logdir/name.serial") into the buffer.
+int thread_log_name(const struct logctx *,char *,size_t);
 
 // call in crash handler immediately
 void get_crash_log(struct logctx *);
@@ -1,3 +1,9 @@
+#define LOG_CATEGORY LOGCAT_LOGGING
+
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,73 +13,153 @@
 #include <libdank/utils/threads.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
+#include <libdank/objects/objustring.h>
 #include <libdank/modules/tracing/oops.h>
 #include <libdank/modules/logging/logdir.h>
 #include <libdank/modules/logging/health.h>
 #include <libdank/modules/logging/logging.h>
+#include <libdank/modules/logging/logrotate.h>
 #include <libdank/modules/ctlserver/ctlserver.h>
 
 #define KBYTE_SIZE 1024
 #define LOG_KBYTES 1024
-#define MSG_QUEUE_SZ 1024 // backlog before dropping msgs
+#define ALOG_RING_SZ (64 * KBYTE_SIZE) // per-thread record ring, power of 2
+#define ALOG_REC_MAX LISTENER_MSG_SZ // largest single record
+#define ALOG_BATCH_SZ (64 * KBYTE_SIZE) // formatted output per write
+#define ALOG_PERIOD_NS 10000000 // formatter wakes at least every 10ms
+#define CONVSPEC_MAX 32
 
-typedef struct listener_msg {
-	char msg[LISTENER_MSG_SZ];
-	int len;
-} listener_msg;
+// Listeners (log_dump clients) share a single ring of variable-length
+// records, into which any number of threads log without locking: space is
+// claimed by advancing lring_reserve, and each record is committed by storing
+// its own offset into its header. Each listener follows with its own cursor.
+// Writers never wait on listeners; a listener which falls a full ring behind
+// skips ahead, and reports the loss. Records never straddle a block, so a
+// lapped listener can always resume at a block boundary. Offsets are free-
+// running, starting at LRING_SZ so that a zeroed header is never mistaken for
+// a commitment.
+#define LRING_SZ (1024 * KBYTE_SIZE) // power of 2
+#define LRING_BLOCK (8 * KBYTE_SIZE) // must hold the largest record
+#define LRING_WAIT_NS 100000000 // bounds any lost wakeup
+
+typedef struct lrec {
+	uint64_t pos;		// offset at which the record was written
+	uint32_t len;		// length of the record, including header/padding
+	uint32_t textlen;	// 0 for padding
+} lrec;
+
+// Listeners copy out as many messages as are available (up to a batch), and
+// write them with a single system call.
+#define LISTENER_BATCH_SZ (64 * KBYTE_SIZE)
 
 typedef struct listener {
-	int dropped;
-	unsigned head,tail;
-	pthread_cond_t cond;
-	pthread_mutex_t lock;
-	struct listener *next;
-	listener_msg msg_queue[MSG_QUEUE_SZ],*lm;
+	uint64_t cursor;
+	size_t len;
+	char msg[LISTENER_BATCH_SZ];
 } listener;
 
 static const off_t LOGFILE_MAX_SIZE = KBYTE_SIZE * LOG_KBYTES;
 
-static inline unsigned
-inc_qindex(unsigned i){
-	return (i + 1) % MSG_QUEUE_SZ;
-}
+static uint64_t lring_reserve = LRING_SZ;
+static lrec lring[LRING_SZ / sizeof(lrec)];
+static unsigned lring_listeners,lring_sleepers,lring_closed;
+static pthread_cond_t lring_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t lring_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static listener *listeners;
 static unsigned prohibit_new_listeners = 1;
 static pthread_mutex_t listener_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Returns zero if l->lm is a valid listener_msg, non-zero if the thread should
-// exit (the log stream has closed). Blocks until one of these is true.
+static inline lrec *
+lrec_at(uint64_t off){
+	return (lrec *)((char *)lring + off % LRING_SZ);
+}
+
+static void
+wait_on_lring(const listener *l){
+	struct timespec ts;
+
+	pthread_mutex_lock(&lring_lock);
+	__atomic_store_n(&lring_sleepers,1,__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&lrec_at(l->cursor)->pos,__ATOMIC_SEQ_CST) != l->cursor &&
+			!__atomic_load_n(&lring_closed,__ATOMIC_SEQ_CST)){
+		clock_gettime(CLOCK_REALTIME,&ts);
+		if((ts.tv_nsec += LRING_WAIT_NS) >= 1000000000){
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		pthread_cond_timedwait(&lring_cond,&lring_lock,&ts);
+	}
+	pthread_mutex_unlock(&lring_lock);
+}
+
+// Append the record at the cursor to the batch. Returns 1 if a record was
+// taken, 0 if none is available, and -1 if a writer has lapped us.
+static int
+take_lrec(listener *l){
+	const lrec *rec = lrec_at(l->cursor);
+	uint64_t reserve;
+
+	if(__atomic_load_n(&rec->pos,__ATOMIC_ACQUIRE) == l->cursor){
+		uint32_t len = rec->len,textlen = rec->textlen;
+
+		if(len >= sizeof(*rec) && len <= LRING_BLOCK){
+			// The text must lie within the record; drop it otherwise
+			if(textlen <= len - sizeof(*rec) && textlen < LISTENER_MSG_SZ){
+				memcpy(l->msg + l->len,rec + 1,textlen);
+			}else{
+				textlen = 0;
+			}
+			// Valid unless a writer has since lapped us
+			reserve = __atomic_load_n(&lring_reserve,__ATOMIC_ACQUIRE);
+			if(reserve - l->cursor <= LRING_SZ){
+				l->cursor += len;
+				l->len += textlen;
+				return 1;
+			}
+		}
+	}
+	reserve = __atomic_load_n(&lring_reserve,__ATOMIC_ACQUIRE);
+	return reserve - l->cursor > LRING_SZ ? -1 : 0;
+}
+
+// Returns zero if l->msg holds a batch of one or more messages (everything
+// available, up to the batch size), non-zero if the thread should exit (the
+// log stream has closed). Blocks until one of these is true.
 static int
 block_on_lmsg(listener *l){
-	pthread_mutex_lock(&l->lock);
-	if(l->lm){
-		if(l->dropped){
-			int drops = l->dropped;
-
-			l->dropped = 0;
-			l->lm->len = snprintf(l->lm->msg,LISTENER_MSG_SZ,
-					"%d messages dropped\n",drops);
-			pthread_mutex_unlock(&l->lock);
+	l->len = 0;
+	for( ; ; ){
+		int r = 0;
+
+		while(sizeof(l->msg) - l->len >= LISTENER_MSG_SZ){
+			if((r = take_lrec(l)) <= 0){
+				break;
+			}
+		}
+		if(r < 0){
+			uint64_t reserve = __atomic_load_n(&lring_reserve,__ATOMIC_ACQUIRE);
+
+			l->cursor = (reserve - LRING_SZ + LRING_BLOCK - 1) / LRING_BLOCK * LRING_BLOCK;
+			l->len += (size_t)snprintf(l->msg + l->len,sizeof(l->msg) - l->len,
+					"Listener lapped, messages dropped\n");
 			return 0;
-		}else{
-			l->lm = NULL;
 		}
+		if(l->len){
+			return 0;
+		}
+		// Deliver everything logged prior to closing
+		if(__atomic_load_n(&lring_closed,__ATOMIC_ACQUIRE)){
+			return -1;
+		}
+		wait_on_lring(l);
 	}
-	while(l->head == l->tail){
-		pthread_cond_wait(&l->cond,&l->lock);
-	}
-	l->lm = &l->msg_queue[l->head];
-	l->head = inc_qindex(l->head);
-	pthread_mutex_unlock(&l->lock);
-	return !l->lm->len;
 }
 
 static void
 free_listener(listener **l){
 	if(l && *l){
-		Pthread_mutex_destroy(&(*l)->lock);
-		Pthread_cond_destroy(&(*l)->cond);
+		__atomic_sub_fetch(&lring_listeners,1,__ATOMIC_RELAXED);
 		Free(*l);
 		*l = NULL;
 	}
@@ -85,45 +171,19 @@ create_listener(void){
 
 	if( (ret = Malloc("listener",sizeof(*ret))) ){
 		memset(ret,0,sizeof(*ret));
-		if(pthread_mutex_init(&ret->lock,NULL)){
-			Free(ret);
-			return NULL;
-		}
-		if(pthread_cond_init(&ret->cond,NULL)){
-			Pthread_mutex_destroy(&ret->lock);
-			Free(ret);
-			return NULL;
-		}
 		pthread_mutex_lock(&listener_lock);
 			if(prohibit_new_listeners == 0){
-				ret->next = listeners;
-				listeners = ret;
+				__atomic_add_fetch(&lring_listeners,1,__ATOMIC_SEQ_CST);
+				ret->cursor = __atomic_load_n(&lring_reserve,__ATOMIC_SEQ_CST);
 			}else{
-				free_listener(&ret);
+				Free(ret);
+				ret = NULL;
 			}
 		pthread_mutex_unlock(&listener_lock);
 	}
 	return ret;
 }
 
-static void
-purge_listener(listener **l){
-	if(l && *l){
-		pthread_mutex_lock(&listener_lock);{
-			listener **prev = &listeners;
-
-			while(*prev){
-				if(*prev == *l){
-					*prev = (*l)->next;
-					break;
-				}
-				prev = &(*prev)->next;
-			}
-		}pthread_mutex_unlock(&listener_lock);
-		free_listener(l);
-	}
-}
-
 static int
 attach_listener(int sd){
 	listener *l;
@@ -141,65 +201,888 @@ attach_listener(int sd){
 			break;
 #undef DIEMSG
 		}
-	}while(Writen(sd,l->lm->msg,(size_t)l->lm->len) == 0);
-	purge_listener(&l);
+	}while(Writen(sd,l->msg,l->len) == 0);
+	free_listener(&l);
 	return 0;
 }
 
 static void
-enqueue_msg(listener *l,const char *msg,int len){
-	listener_msg *lm;
-	int wakeup = 1;
+wake_listeners(void){
+	pthread_mutex_lock(&lring_lock);
+	pthread_cond_broadcast(&lring_cond);
+	pthread_mutex_unlock(&lring_lock);
+}
 
-	if(pthread_mutex_trylock(&l->lock)){
-		return; // Any contention will result in dropped messages!
+static void
+listener_log(const char *msg,int len){
+	uint64_t cur,pos,total;
+	size_t need;
+	lrec *rec;
+
+	if(__atomic_load_n(&lring_listeners,__ATOMIC_RELAXED) == 0 || len <= 0){
+		return;
 	}
-	if(inc_qindex(l->tail) != l->head){
-		lm = &l->msg_queue[l->tail];
-		l->tail = inc_qindex(l->tail);
+	need = sizeof(*rec) + ((size_t)len + sizeof(*rec) - 1) / sizeof(*rec) * sizeof(*rec);
+	cur = __atomic_load_n(&lring_reserve,__ATOMIC_RELAXED);
+	do{
+		size_t blockrem = LRING_BLOCK - cur % LRING_BLOCK;
 
-		lm->len = len;
-		// We rely on the entry point to this callchain (inner_vflog())
-		// to ensure this is safe...
-		strcpy(lm->msg,msg);
-	}else{
-		l->dropped++;
-		wakeup = 0;
+		pos = cur;
+		total = need;
+		if(need > blockrem){ // pad out the block
+			pos += blockrem;
+			total += blockrem;
+		}
+	}while(!__atomic_compare_exchange_n(&lring_reserve,&cur,cur + total,1,
+					__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+	if(pos != cur){
+		rec = lrec_at(cur);
+		rec->len = (uint32_t)(pos - cur);
+		rec->textlen = 0;
+		__atomic_store_n(&rec->pos,cur,__ATOMIC_RELEASE);
 	}
-	pthread_mutex_unlock(&l->lock);
-	if(wakeup){
-		pthread_cond_signal(&l->cond);
+	rec = lrec_at(pos);
+	rec->len = (uint32_t)need;
+	rec->textlen = (uint32_t)len;
+	memcpy(rec + 1,msg,(size_t)len);
+	__atomic_store_n(&rec->pos,pos,__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&lring_sleepers,__ATOMIC_SEQ_CST)){
+		__atomic_store_n(&lring_sleepers,0,__ATOMIC_RELAXED);
+		pthread_cond_broadcast(&lring_cond);
 	}
 }
 
-static inline void
-enqueue_all(const char *msg,int len){
-	listener *l;
+static void
+write_lfile(logctx *lc,const char *buf,size_t len){
+	size_t ret;
+
+	if(lc->lmap || (lc->lname && open_thread_logmap(lc) == 0)){
+		write_logmap(lc->lmap,buf,len);
+		return;
+	}
+	if(lc->lfile == NULL){
+		return;
+	}
+	if((ret = fwrite(buf,1,len,lc->lfile)) < len){
+		lc->lfile = NULL;
+	}else if(lc->lfile != stdout){
+		lc->lfile_offset += ret;
+		if(lc->lfile_offset > LOGFILE_MAX_SIZE){
+			if(ftruncate(fileno(lc->lfile),LOGFILE_MAX_SIZE)){
+				lc->lfile = NULL;
+			}else{
+				rewind(lc->lfile);
+				lc->lfile_offset = 0;
+			}
+		}
+	}
+}
+
+uint32_t log_levelmask[LOGLVL_COUNT] = {
+	[LOGLVL_ERROR] = ~0u,
+	[LOGLVL_INFO] = ~0u,
+};
+
+static const char * const loglevel_names[LOGLVL_COUNT] = {
+	[LOGLVL_ERROR] = "error",
+	[LOGLVL_INFO] = "info",
+	[LOGLVL_DEBUG] = "debug",
+};
 
-	for(l = listeners ; l ; l = l->next){
-		// FIXME if this is the magic ("", 0) sentinel for shutdown, we
-		// can't afford to drop the message...
-		enqueue_msg(l,msg,len);
+static const char * const logcategory_names[LOGCAT_COUNT] = {
+	[LOGCAT_GENERAL] = "general",
+	[LOGCAT_CTLSERVER] = "ctlserver",
+	[LOGCAT_EVCORE] = "evcore",
+	[LOGCAT_LOGGING] = "logging",
+	[LOGCAT_METRICS] = "metrics",
+	[LOGCAT_NETLINK] = "netlink",
+	[LOGCAT_SLALLOC] = "slalloc",
+};
+
+int set_log_level(unsigned cat,int lvl){
+	uint32_t bits;
+	int z;
+
+	if(cat > LOGCAT_COUNT || lvl >= LOGLVL_COUNT){
+		bitch("Invalid category/level: %u/%d\n",cat,lvl);
+		return -1;
+	}
+	bits = cat == LOGCAT_COUNT ? ~0u : 1u << cat;
+	for(z = 0 ; z < LOGLVL_COUNT ; ++z){
+		if(z <= lvl){
+			__atomic_or_fetch(&log_levelmask[z],bits,__ATOMIC_RELAXED);
+		}else{
+			__atomic_and_fetch(&log_levelmask[z],~bits,__ATOMIC_RELAXED);
+		}
+	}
+	return 0;
+}
+
+int get_log_level(unsigned cat){
+	int z;
+
+	for(z = LOGLVL_COUNT - 1 ; z >= 0 ; --z){
+		if(log_enabled(cat,z)){
+			break;
+		}
+	}
+	return z;
+}
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define LOGRATE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define LOGRATE_CLOCK CLOCK_MONOTONIC
+#endif
+
+// Many threads might share a call site, so the bucket is updated with atomics
+// rather than a lock. Whoever advances refill credits the accrued tokens. A
+// suppressed line costs a (vDSO) clock read, a few loads, and an increment.
+int log_ratelimit(lograte *lr,unsigned persec,unsigned burst){
+	uint64_t now,last,period,credits;
+	uint32_t tokens,newtokens,supp;
+	struct timespec ts;
+
+	period = 1000000000ull / (persec ? persec : 1);
+	clock_gettime(LOGRATE_CLOCK,&ts);
+	now = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+	last = __atomic_load_n(&lr->refill,__ATOMIC_RELAXED);
+	if(now - last >= period){
+		credits = (now - last) / period;
+		if(__atomic_compare_exchange_n(&lr->refill,&last,
+				credits >= burst ? now : last + credits * period,
+				0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)){
+			tokens = __atomic_load_n(&lr->tokens,__ATOMIC_RELAXED);
+			do{
+				newtokens = credits >= burst - tokens ? burst : tokens + (uint32_t)credits;
+			}while(!__atomic_compare_exchange_n(&lr->tokens,&tokens,newtokens,
+					0,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+		}
+	}
+	tokens = __atomic_load_n(&lr->tokens,__ATOMIC_RELAXED);
+	while(tokens){
+		if(__atomic_compare_exchange_n(&lr->tokens,&tokens,tokens - 1,
+				0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)){
+			supp = __atomic_exchange_n(&lr->suppressed,0,__ATOMIC_RELAXED);
+			return supp > INT_MAX ? INT_MAX : (int)supp;
+		}
 	}
+	__atomic_fetch_add(&lr->suppressed,1,__ATOMIC_RELAXED);
+	return -1;
 }
 
+// timeflog() leaders are rendered at most once per second, and shared among
+// all threads. The coarse clock is read from the vDSO without a system call,
+// so a leader costs a clock read and a memcpy(). The cache is a seqlock:
+// whoever first sees a new second renders it, bumping seq to odd beforehand
+// and back to even afterwards; readers retry should seq change beneath them.
+#define TIME_LEADER_MAX 40
+#define TIME_LEADER_SECS 19 // ctime(3)'s "Www Mmm dd hh:mm:ss"
+
+#ifdef CLOCK_REALTIME_COARSE
+#define LOG_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define LOG_CLOCK CLOCK_REALTIME
+#endif
+
+static struct {
+	unsigned seq;
+	time_t sec;
+	size_t len;
+	char text[TIME_LEADER_MAX];
+} time_leader = {
+	.sec = (time_t)-1,
+};
+static pthread_mutex_t time_leader_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned log_time_precision; // digits of sub-second precision
+
+int set_log_time_precision(unsigned digits){
+	if(digits > 9){
+		bitch("Invalid precision: %u digits\n",digits);
+		return -1;
+	}
+	__atomic_store_n(&log_time_precision,digits,__ATOMIC_RELAXED);
+	return 0;
+}
+
+// The coarse clock ticks with the scheduler (every few milliseconds), so
+// finer precision requires the full-resolution clock.
 static void
-listener_log(const char *msg,int len){
-	// We've taken listener_log and enqueue_all and turned parts of them
-	// inside out to avoid stack allocation of the message.  Since
-	// vsnprintf will not cause any listener activity, we can safely
-	// move it inside the listener_lock, and that allows us to use a
-	// file-local static buffer.
-	if(pthread_mutex_trylock(&listener_lock)){
+log_clock(struct timespec *ts){
+	clockid_t clk = LOG_CLOCK;
+
+	if(__atomic_load_n(&log_time_precision,__ATOMIC_RELAXED) > 3){
+		clk = CLOCK_REALTIME;
+	}
+	if(clock_gettime(clk,ts)){
+		ts->tv_sec = (time_t)-1;
+		ts->tv_nsec = 0;
+	}
+}
+
+// Render t as ctime_r(3) does, replacing the trailing newline with a space.
+// buf must be at least TIME_LEADER_MAX bytes. Returns the length.
+static size_t
+render_ctime(time_t t,char *buf){
+	char tbuf[TIME_LEADER_MAX];
+	char *newline;
+
+	buf[0] = '\0';
+	if(t == (time_t)-1 || ctime_r(&t,tbuf) == NULL){
+		return 0;
+	}
+	if( (newline = strchr(tbuf,'\n')) ){
+		*newline++ = ' ';
+		*newline = '\0';
+	}
+	strcpy(buf,tbuf);
+	return strlen(buf);
+}
+
+// Copy out the leader for the second t, rendering and caching it if it's not
+// the cached second. Returns the length.
+static size_t
+cached_ctime(time_t t,char *buf){
+	unsigned seq;
+	size_t len;
+
+	do{
+		if((seq = __atomic_load_n(&time_leader.seq,__ATOMIC_ACQUIRE)) & 1u){
+			break; // being rendered; don't wait for it
+		}
+		if(time_leader.sec != t){
+			break;
+		}
+		len = time_leader.len;
+		memcpy(buf,time_leader.text,sizeof(time_leader.text));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&time_leader.seq,__ATOMIC_RELAXED) == seq){
+			buf[len] = '\0';
+			return len;
+		}
+	}while(1);
+	len = render_ctime(t,buf);
+	// Only publish newer seconds; rendering old records mustn't thrash
+	if(len && pthread_mutex_trylock(&time_leader_lock) == 0){
+		if(t > time_leader.sec){
+			__atomic_store_n(&time_leader.seq,time_leader.seq + 1,__ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			time_leader.sec = t;
+			time_leader.len = len;
+			memcpy(time_leader.text,buf,len + 1);
+			__atomic_store_n(&time_leader.seq,time_leader.seq + 1,__ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&time_leader_lock);
+	}
+	return len;
+}
+
+// Render ts as a timeflog() leader, with the configured sub-second precision.
+// buf must be at least TIME_LEADER_MAX bytes. Returns the length.
+static size_t
+render_time_leader(const struct timespec *ts,char *buf){
+	unsigned digits = __atomic_load_n(&log_time_precision,__ATOMIC_RELAXED);
+	char frac[TIME_LEADER_MAX];
+	size_t len;
+	long f;
+	int z;
+
+	if((len = cached_ctime(ts->tv_sec,buf)) <= TIME_LEADER_SECS || digits == 0){
+		return len;
+	}
+	for(f = ts->tv_nsec, z = 9 ; z > (int)digits ; --z){
+		f /= 10;
+	}
+	if((z = snprintf(frac,sizeof(frac),".%0*ld",(int)digits,f)) < 0 ||
+			len + (size_t)z >= TIME_LEADER_MAX){
+		return len;
+	}
+	memmove(buf + TIME_LEADER_SECS + z,buf + TIME_LEADER_SECS,len - TIME_LEADER_SECS + 1);
+	memcpy(buf + TIME_LEADER_SECS,frac,(size_t)z);
+	return len + (size_t)z;
+}
+
+// Deferred records are laid out in the ring as a header followed by a vector
+// of arguments, each a logarg. String arguments are copied in, following
+// their logarg (which holds the length), padded to a logarg boundary.
+typedef union logarg {
+	intmax_t i;
+	double d;
+	long double ld;
+	const void *p;
+	size_t s;	// length of the copied string, or SIZE_MAX for NULL
+} logarg;
+
+#define ALOG_TIMED	0x0001
+#define ALOG_PAD	0x0002	// skip to the end of the ring
+
+typedef struct logrec {
+	uint32_t len;		// total length in bytes, a multiple of logarg
+	uint16_t flags;
+	uint16_t unused;
+	int err;		// errno at the time of the call, for %m
+	const char *fmt;
+	uintmax_t line;
+	struct timespec when;	// only meaningful with ALOG_TIMED
+	logarg args[];
+} logrec;
+
+// One producer (the owning thread) advances tail; one consumer (whoever holds
+// alog_lock) advances head. Both are free-running byte counts.
+typedef struct logring {
+	uint64_t tail;
+	unsigned dropped;
+	char pad[64 - sizeof(uint64_t) - sizeof(unsigned)]; // keep head apart
+	uint64_t head;
+	logctx *lc;
+	struct logring *next;
+	logarg slots[ALOG_RING_SZ / sizeof(logarg)];
+} logring;
+
+typedef enum {
+	LOGARG_NONE,	// %% and %m consume no argument
+	LOGARG_INT,
+	LOGARG_LONG,
+	LOGARG_LLONG,
+	LOGARG_INTMAX,
+	LOGARG_SIZE,
+	LOGARG_PTRDIFF,
+	LOGARG_DOUBLE,
+	LOGARG_LDOUBLE,
+	LOGARG_PTR,
+	LOGARG_STR,
+} logarg_type;
+
+typedef struct convspec {
+	logarg_type type;
+	int starwidth,starprec;
+	int prec;	// explicit precision, or -1
+	size_t len;	// length of the specification, including the '%'
+} convspec;
+
+static logring *alog_rings;
+static int alog_running;
+static pthread_t alog_tid;
+static char alog_batch[ALOG_BATCH_SZ];
+static pthread_cond_t alog_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t alog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse the conversion specification at fmt, which must point to a '%'.
+// Returns the first character following it, or NULL if it can't be deferred
+// (positional arguments, %n, wide strings, or anything we don't recognize).
+static const char *
+parse_conversion(const char *fmt,convspec *cs){
+	const char *f = fmt + 1;
+	char lmod = '\0';
+
+	cs->starwidth = cs->starprec = 0;
+	cs->prec = -1;
+	while(*f && strchr("-+ #0'I",*f)){
+		++f;
+	}
+	if(*f == '*'){
+		cs->starwidth = 1;
+		++f;
+	}else while(isdigit((unsigned char)*f)){
+		++f;
+	}
+	if(*f == '.'){
+		if(*++f == '*'){
+			cs->starprec = 1;
+			++f;
+		}else{
+			cs->prec = 0;
+			while(isdigit((unsigned char)*f)){
+				if(cs->prec < 65536){
+					cs->prec = cs->prec * 10 + (*f - '0');
+				}
+				++f;
+			}
+		}
+	}
+	switch(*f){
+		case 'h':
+			if(*++f == 'h'){
+				++f;
+			}
+			break;
+		case 'l':
+			lmod = *f++;
+			if(*f == 'l'){
+				lmod = 'q';
+				++f;
+			}
+			break;
+		case 'q': case 'L': case 'j': case 'z': case 'Z': case 't':
+			lmod = *f++;
+			break;
+	}
+	switch(*f){
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			switch(lmod){
+				case 'l': cs->type = LOGARG_LONG; break;
+				case 'q': case 'L': cs->type = LOGARG_LLONG; break;
+				case 'j': cs->type = LOGARG_INTMAX; break;
+				case 'z': case 'Z': cs->type = LOGARG_SIZE; break;
+				case 't': cs->type = LOGARG_PTRDIFF; break;
+				default: cs->type = LOGARG_INT; break;
+			}
+			break;
+		case 'c':
+			cs->type = LOGARG_INT;
+			break;
+		case 's':
+			if(lmod){
+				return NULL;
+			}
+			cs->type = LOGARG_STR;
+			break;
+		case 'p':
+			cs->type = LOGARG_PTR;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			cs->type = lmod == 'L' ? LOGARG_LDOUBLE : LOGARG_DOUBLE;
+			break;
+		case '%': case 'm':
+			cs->type = LOGARG_NONE;
+			break;
+		default:
+			return NULL;
+	}
+	if((cs->len = (size_t)(f + 1 - fmt)) >= CONVSPEC_MAX){
+		return NULL;
+	}
+	return f + 1;
+}
+
+// Copy a string into the record following its logarg, truncating it to the
+// precision (if one was provided) and the space remaining. Returns the next
+// free logarg.
+static logarg *
+pack_string(logarg *a,const logarg *end,const char *s,int prec){
+	size_t max;
+
+	if(s == NULL){
+		a->s = SIZE_MAX;
+		return a + 1;
+	}
+	max = (size_t)(end - (a + 1)) * sizeof(*a) - 1;
+	if(prec >= 0 && (size_t)prec < max){
+		max = (size_t)prec;
+	}
+	a->s = strnlen(s,max);
+	memcpy(a + 1,s,a->s);
+	((char *)(a + 1))[a->s] = '\0';
+	return a + 1 + (a->s + sizeof(*a)) / sizeof(*a);
+}
+
+// Pack the arguments described by fmt into the record, returning its length,
+// or 0 if the format can't be deferred.
+static uint32_t
+pack_logargs(logrec *rec,const char *fmt,va_list args){
+	const logarg *end = (const logarg *)((char *)rec + ALOG_REC_MAX);
+	logarg *a = rec->args;
+	convspec cs;
+
+	while( (fmt = strchr(fmt,'%')) ){
+		int prec;
+
+		if((fmt = parse_conversion(fmt,&cs)) == NULL){
+			return 0;
+		}
+		if(cs.type == LOGARG_NONE){
+			continue;
+		}
+		// width, precision, the argument, and a string's first slot
+		if(end - a < 4){
+			return 0;
+		}
+		if(cs.starwidth){
+			(a++)->i = va_arg(args,int);
+		}
+		prec = cs.prec;
+		if(cs.starprec){
+			prec = va_arg(args,int);
+			(a++)->i = prec;
+		}
+		switch(cs.type){
+			case LOGARG_INT: a->i = va_arg(args,int); break;
+			case LOGARG_LONG: a->i = va_arg(args,long); break;
+			case LOGARG_LLONG: a->i = va_arg(args,long long); break;
+			case LOGARG_INTMAX: a->i = va_arg(args,intmax_t); break;
+			case LOGARG_SIZE: a->i = (intmax_t)va_arg(args,size_t); break;
+			case LOGARG_PTRDIFF: a->i = va_arg(args,ptrdiff_t); break;
+			case LOGARG_DOUBLE: a->d = va_arg(args,double); break;
+			case LOGARG_LDOUBLE: a->ld = va_arg(args,long double); break;
+			case LOGARG_PTR: a->p = va_arg(args,const void *); break;
+			case LOGARG_STR:
+				a = pack_string(a,end,va_arg(args,const char *),prec);
+				continue;
+			case LOGARG_NONE: break;
+		}
+		++a;
+	}
+	return (uint32_t)((char *)a - (char *)rec);
+}
+
+// Returns space for a record of up to ALOG_REC_MAX bytes, or NULL if the ring
+// is too full. tail is set to the record's offset, which might follow padding
+// at the end of the ring; both are published together.
+static logrec *
+reserve_logrec(logring *r,uint64_t *tail){
+	uint64_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+	size_t pos = r->tail % ALOG_RING_SZ;
+	size_t avail = ALOG_RING_SZ - (r->tail - head);
+	size_t contig = ALOG_RING_SZ - pos;
+	char *buf = (char *)r->slots;
+
+	*tail = r->tail;
+	if(contig < ALOG_REC_MAX){
+		logrec *pad;
+
+		if(avail < contig + ALOG_REC_MAX){
+			return NULL;
+		}
+		pad = (logrec *)(buf + pos);
+		pad->len = (uint32_t)contig;
+		pad->flags = ALOG_PAD;
+		*tail += contig;
+		return (logrec *)buf;
+	}
+	if(avail < ALOG_REC_MAX){
+		return NULL;
+	}
+	return (logrec *)(buf + pos);
+}
+
+static void
+record_vflog(logctx *lc,unsigned flags,const char *fmt,va_list args){
+	logring *r = lc->ring;
+	uint64_t tail;
+	logrec *rec;
+	va_list ac;
+
+	if((rec = reserve_logrec(r,&tail)) == NULL){
+		__atomic_add_fetch(&r->dropped,1,__ATOMIC_RELAXED);
 		return;
 	}
-	enqueue_all(msg,len);
-	pthread_mutex_unlock(&listener_lock);
+	rec->err = errno;
+	va_copy(ac,args);
+	if((rec->len = pack_logargs(rec,fmt,ac)) == 0){
+		// Can't be deferred; render it now, and record the result.
+		char msg[LISTENER_MSG_SZ];
+		logarg *a;
+
+		vsnprintf(msg,sizeof(msg),fmt,args);
+		a = pack_string(rec->args,(const logarg *)((char *)rec + ALOG_REC_MAX),
+					msg,-1);
+		rec->len = (uint32_t)((char *)a - (char *)rec);
+		fmt = "%s";
+	}
+	va_end(ac);
+	rec->flags = (uint16_t)flags;
+	rec->fmt = fmt;
+	rec->line = lc->lineswritten++;
+	if(flags & ALOG_TIMED){
+		log_clock(&rec->when);
+	}
+	tail += rec->len;
+	__atomic_store_n(&r->tail,tail,__ATOMIC_RELEASE);
+	if(tail - __atomic_load_n(&r->head,__ATOMIC_RELAXED) > ALOG_RING_SZ / 2){
+		pthread_cond_signal(&alog_cond);
+	}
+}
+
+#define RENDER_LOGARG(val) (cs.starwidth ? (cs.starprec ? \
+	snprintf(buf + len,size - len,spec,w,p,(val)) : \
+	snprintf(buf + len,size - len,spec,w,(val))) : (cs.starprec ? \
+	snprintf(buf + len,size - len,spec,p,(val)) : \
+	snprintf(buf + len,size - len,spec,(val))))
+
+// Render a record into buf, as inner_vflog() would have, returning the length.
+// Truncated output is newline-terminated. The result is always NUL-terminated.
+static size_t
+render_logrec(const logrec *rec,char *buf,size_t size){
+	const logarg *a = rec->args;
+	char spec[CONVSPEC_MAX];
+	const char *f;
+	size_t len;
+	convspec cs;
+	int z;
+
+	if((z = snprintf(buf,size,"%ju|",rec->line)) < 0 || (size_t)z >= size){
+		goto truncated;
+	}
+	len = (size_t)z;
+	if(rec->flags & ALOG_TIMED){
+		char leader[TIME_LEADER_MAX];
+		size_t llen;
+
+		if((llen = render_time_leader(&rec->when,leader)) >= size - len){
+			snprintf(buf + len,size - len,"%s",leader);
+			goto truncated;
+		}
+		memcpy(buf + len,leader,llen);
+		len += llen;
+	}
+	f = rec->fmt;
+	while(*f){
+		const char *pct;
+		int w = 0,p = 0;
+		size_t lit;
+
+		lit = (pct = strchr(f,'%')) ? (size_t)(pct - f) : strlen(f);
+		if(lit >= size - len){
+			memcpy(buf + len,f,size - len - 1);
+			goto truncated;
+		}
+		memcpy(buf + len,f,lit);
+		len += lit;
+		if(pct == NULL){
+			break;
+		}
+		f = parse_conversion(pct,&cs); // validated by pack_logargs()
+		memcpy(spec,pct,cs.len);
+		spec[cs.len] = '\0';
+		if(cs.starwidth){
+			w = (int)(a++)->i;
+		}
+		if(cs.starprec){
+			p = (int)(a++)->i;
+		}
+		errno = rec->err;
+		switch(cs.type){
+			case LOGARG_NONE: z = snprintf(buf + len,size - len,spec,0); break;
+			case LOGARG_INT: z = RENDER_LOGARG((int)a->i); break;
+			case LOGARG_LONG: z = RENDER_LOGARG((long)a->i); break;
+			case LOGARG_LLONG: z = RENDER_LOGARG((long long)a->i); break;
+			case LOGARG_INTMAX: z = RENDER_LOGARG(a->i); break;
+			case LOGARG_SIZE: z = RENDER_LOGARG((size_t)a->i); break;
+			case LOGARG_PTRDIFF: z = RENDER_LOGARG((ptrdiff_t)a->i); break;
+			case LOGARG_DOUBLE: z = RENDER_LOGARG(a->d); break;
+			case LOGARG_LDOUBLE: z = RENDER_LOGARG(a->ld); break;
+			case LOGARG_PTR: z = RENDER_LOGARG(a->p); break;
+			case LOGARG_STR:
+				if(a->s == SIZE_MAX){
+					z = RENDER_LOGARG((const char *)NULL);
+				}else{
+					z = RENDER_LOGARG((const char *)(a + 1));
+					a += (a->s + sizeof(*a)) / sizeof(*a);
+				}
+				break;
+		}
+		if(cs.type != LOGARG_NONE){
+			++a;
+		}
+		if(z < 0){
+			z = 0;
+		}else if((size_t)z >= size - len){
+			goto truncated;
+		}
+		len += (size_t)z;
+	}
+	buf[len] = '\0';
+	return len;
+
+truncated:
+	len = size - 1;
+	buf[len - 1] = '\n';
+	buf[len] = '\0';
+	return len;
+}
+
+#undef RENDER_LOGARG
+
+// Format everything published to the ring, writing it out in batches (or, to
+// a logmap, a line at a time, keeping one record per line). alog_lock must be
+// held.
+static void
+drain_logring(logring *r){
+	uint64_t tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+	uint64_t head = r->head;
+	size_t blen = 0,len;
+	unsigned drops;
+	logmap *lm;
+
+	// Create the logmap (if there's to be one) before choosing a path, lest
+	// a batch of many lines become a single record upon its creation.
+	if(r->lc->lmap == NULL && r->lc->lname){
+		open_thread_logmap(r->lc);
+	}
+	lm = r->lc->lmap;
+	while(head != tail){
+		const logrec *rec = (const logrec *)((const char *)r->slots + head % ALOG_RING_SZ);
+
+		if((rec->flags & ALOG_PAD) == 0){
+			if(ALOG_BATCH_SZ - blen < LISTENER_MSG_SZ){
+				write_lfile(r->lc,alog_batch,blen);
+				blen = 0;
+			}
+			len = render_logrec(rec,alog_batch + blen,LISTENER_MSG_SZ);
+			listener_log(alog_batch + blen,(int)len);
+			if(lm){
+				write_logmap(lm,alog_batch + blen,len);
+			}else{
+				blen += len;
+			}
+		}
+		head += rec->len;
+		__atomic_store_n(&r->head,head,__ATOMIC_RELEASE);
+	}
+	if( (drops = __atomic_exchange_n(&r->dropped,0,__ATOMIC_RELAXED)) ){
+		if(ALOG_BATCH_SZ - blen < LISTENER_MSG_SZ){
+			write_lfile(r->lc,alog_batch,blen);
+			blen = 0;
+		}
+		len = (size_t)snprintf(alog_batch + blen,LISTENER_MSG_SZ,
+				"%u messages dropped\n",drops);
+		listener_log(alog_batch + blen,(int)len);
+		if(lm){
+			write_logmap(lm,alog_batch + blen,len);
+		}else{
+			blen += len;
+		}
+	}
+	if(blen){
+		write_lfile(r->lc,alog_batch,blen);
+	}
+}
+
+static void *
+alog_formatter(void *unused __attribute__ ((unused))){
+	pthread_mutex_lock(&alog_lock);
+	while(__atomic_load_n(&alog_running,__ATOMIC_RELAXED)){
+		struct timespec ts;
+		logring *r;
+
+		for(r = alog_rings ; r ; r = r->next){
+			drain_logring(r);
+		}
+		clock_gettime(CLOCK_REALTIME,&ts);
+		if((ts.tv_nsec += ALOG_PERIOD_NS) >= 1000000000){
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		pthread_cond_timedwait(&alog_cond,&alog_lock,&ts);
+	}
+	pthread_mutex_unlock(&alog_lock);
+	return NULL;
+}
+
+static int
+attach_logring(logctx *lc){
+	logring *r;
+
+	lc->ringless = 1; // Malloc() might log; don't recurse
+	if((r = Malloc("logring",sizeof(*r))) == NULL){
+		return -1;
+	}
+	memset(r,0,offsetof(logring,slots));
+	r->lc = lc;
+	pthread_mutex_lock(&alog_lock);
+		r->next = alog_rings;
+		alog_rings = r;
+	pthread_mutex_unlock(&alog_lock);
+	lc->ring = r;
+	lc->ringless = 0;
+	return 0;
+}
+
+// Pull the ring from the formatter's list. alog_lock must be held.
+static void
+unlink_logring_locked(logring *r){
+	logring **prev;
+
+	for(prev = &alog_rings ; *prev ; prev = &(*prev)->next){
+		if(*prev == r){
+			*prev = r->next;
+			break;
+		}
+	}
+}
+
+void retire_async_logging(logctx *lc){
+	logring *r;
+
+	if((r = lc->ring) == NULL){
+		return;
+	}
+	pthread_mutex_lock(&alog_lock);
+		unlink_logring_locked(r);
+		drain_logring(r);
+	pthread_mutex_unlock(&alog_lock);
+	lc->ring = NULL;
+	lc->ringless = 0;
+	Free(r);
+}
+
+// As retire_async_logging(), but from a crash (generally within a signal
+// handler). We mustn't block on alog_lock, since we might have crashed while
+// holding it. Nor is the ring drained: formatting might create a logmap or
+// wake listeners, neither of which is safe here. Its pending records are
+// discarded, and the ring itself is leaked rather than freed. Should the lock
+// be unavailable, the ring's left in place.
+static void
+abandon_async_logging(logctx *lc){
+	logring *r;
+
+	if((r = lc->ring) == NULL || pthread_mutex_trylock(&alog_lock)){
+		return;
+	}
+		unlink_logring_locked(r);
+	pthread_mutex_unlock(&alog_lock);
+	lc->ring = NULL;
+	lc->ringless = 1;
+}
+
+int start_async_logging(void){
+	int ret = -1,err = 0;
+
+	pthread_mutex_lock(&alog_lock);
+	if(!alog_running){
+		alog_running = 1;
+		if( (err = pthread_create(&alog_tid,NULL,alog_formatter,NULL)) ){
+			alog_running = 0;
+		}else{
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&alog_lock);
+	if(err){
+		pmoan(err,"Couldn't launch log formatter\n");
+	}
+	return ret;
+}
+
+int stop_async_logging(void){
+	pthread_t tid;
+	logctx *lc;
+	int err;
+
+	pthread_mutex_lock(&alog_lock);
+	if(!alog_running){
+		pthread_mutex_unlock(&alog_lock);
+		return -1;
+	}
+	__atomic_store_n(&alog_running,0,__ATOMIC_RELAXED);
+	tid = alog_tid;
+	pthread_cond_signal(&alog_cond);
+	pthread_mutex_unlock(&alog_lock);
+	if( (err = pthread_join(tid,NULL)) ){
+		pmoan(err,"Couldn't join log formatter\n");
+		return -1;
+	}
+	if( (lc = get_thread_logctx()) ){
+		retire_async_logging(lc);
+	}
+	return 0;
 }
 
 // concession to timevflog(), and the usefulness of printing a single leader
 static void
-inner_vflog(const char *leader,const char *fmt,va_list args){
+inner_vflog(unsigned flags,const char *fmt,va_list args){
+	char msg[LISTENER_MSG_SZ];
 	size_t avail; // available for chars, not chars + null
 	logctx *lc;
 	int len,z;
@@ -209,49 +1092,43 @@ inner_vflog(const char *leader,const char *fmt,va_list args){
 		vfprintf(stdout,fmt,args);
 		return;
 	}
-	avail = sizeof(lc->msg_buffer) - 1;
-	if((len = snprintf(lc->msg_buffer,avail,"%ju|",lc->lineswritten++)) < 0 || (size_t)len >= avail){
+	if(__atomic_load_n(&alog_running,__ATOMIC_RELAXED)){
+		if(lc->ring || (!lc->ringless && attach_logring(lc) == 0)){
+			record_vflog(lc,flags,fmt,args);
+			return;
+		}
+	}else if(lc->ring){
+		retire_async_logging(lc);
+	}
+	avail = sizeof(msg) - 1;
+	if((len = snprintf(msg,avail,"%ju|",lc->lineswritten++)) < 0 || (size_t)len >= avail){
 		return;
 	}
 	avail -= len;
-	z = leader ? strlen(leader) : 0;
-	if(z){
-		if((size_t)z < avail){
-			memcpy(lc->msg_buffer + len,leader,z + 1);
-		}else{
-			z = 0;
+	if(flags & ALOG_TIMED){
+		char leader[TIME_LEADER_MAX];
+		struct timespec ts;
+		size_t llen;
+
+		log_clock(&ts);
+		if((llen = render_time_leader(&ts,leader)) < avail){
+			memcpy(msg + len,leader,llen);
+			avail -= llen;
+			len += (int)llen;
 		}
 	}
-	avail -= z;
-	len += z;
-	if((z = vsnprintf(lc->msg_buffer + len,avail,fmt,args)) < 0 || ((size_t)z >= avail)){
-		len = sizeof(lc->msg_buffer) - 1;
-		lc->msg_buffer[len - 1] = '\n';
+	if((z = vsnprintf(msg + len,avail,fmt,args)) < 0 || ((size_t)z >= avail)){
+		len = sizeof(msg) - 1;
+		msg[len - 1] = '\n';
 	}else{
 		len += z;
 	}
-	listener_log(lc->msg_buffer,len);
-	if(lc->lfile){
-		int ret;
-
-		if((ret = fwrite(lc->msg_buffer,1,(size_t)len,lc->lfile)) < len){
-			lc->lfile = NULL;
-		}else if(lc->lfile != stdout){
-			lc->lfile_offset += ret;
-			if(lc->lfile_offset > LOGFILE_MAX_SIZE){
-				if(ftruncate(fileno(lc->lfile),LOGFILE_MAX_SIZE)){
-					lc->lfile = NULL;
-				}else{
-					rewind(lc->lfile);
-					lc->lfile_offset = 0;
-				}
-			}
-		}
-	}
+	listener_log(msg,len);
+	write_lfile(lc,msg,(size_t)len);
 }
 	
 void vflog(const char *fmt,va_list args){
-	inner_vflog(NULL,fmt,args);
+	inner_vflog(0,fmt,args);
 }
 
 void flog(const char *fmt,...){
@@ -262,30 +1139,11 @@ void flog(const char *fmt,...){
 	va_end(ap);
 }
 
-static inline void
-timevflog(const char *fmt,va_list args){
-	char buf[80];
-	time_t t;
-
-	buf[0] = '\0';
-	if((t = time(NULL)) != (time_t)-1){
-		if(ctime_r(&t,buf)){
-			char *newline;
-
-			if( (newline = strchr(buf,'\n')) ){
-				*newline++ = ' ';
-				*newline = '\0';
-			}
-		}
-	}
-	inner_vflog(buf,fmt,args);
-}
-
 void timeflog(const char *fmt,...){
 	va_list ap;
 
 	va_start(ap,fmt);
-	timevflog(fmt,ap);
+	inner_vflog(ALOG_TIMED,fmt,ap);
 	va_end(ap);
 }
 
@@ -322,7 +1180,11 @@ int init_logging(logctx *lc,const char *logdir,int stdio){
 // called immediately prior to exit() or raise(SIGKILL).
 int stop_logging(int retcode){
 	track_main("Called stop_logging()");
+	stop_async_logging();
 	truncate_crash_log(retcode);
+	if(log_rotation_running()){
+		stop_log_rotation();
+	}
 	return 0;
 }
 
@@ -333,7 +1195,15 @@ int stop_logging(int retcode){
 // resulting from crashing while truncating the crash log, so write that code
 // really well.
 void log_crash(logctx *lc){
+	logctx *cur;
+
+	// The thread's current logctx (which might be lc itself) is about to
+	// be replaced; its ring mustn't remain among those being formatted.
+	if( (cur = get_thread_logctx()) ){
+		abandon_async_logging(cur);
+	}
 	get_crash_log(lc);
+	lc->ringless = 1; // no allocating rings from signal handlers
 }
 
 static int
@@ -346,37 +1216,147 @@ srv_dump_log(cmd_state *cs){
 }
 
 static int
-srv_mem_dump(cmd_state *cs __attribute__ ((unused))){
+srv_log_segments(cmd_state *cs){
+	if(stream_log_segments(cs->sd)){
+		return -1;
+	}
+	cs->sent_success = 1;
+	return 0;
+}
+
+static int
+srv_mem_dump(cmd_state *cs){
 	int ret = -1;
 	logctx *lc;
 
 	if( (lc = get_thread_logctx()) ){
-		ret = stringize_memory_usage(lc->out);
+		if((ret = stringize_memory_usage(lc->out)) == 0){
+			ret = cmd_write_ustring(cs,lc->out);
+		}
 	}
 	return ret;
 }
 
 static int
-srv_health_dump(cmd_state *cs __attribute__ ((unused))){
+srv_health_dump(cmd_state *cs){
 	int ret = -1;
 	logctx *lc;
 
 	if( (lc = get_thread_logctx()) ){
-		ret = stringize_health(lc->out);
+		if((ret = stringize_health(lc->out)) == 0){
+			ret = cmd_write_ustring(cs,lc->out);
+		}
+	}
+	return ret;
+}
+
+static int
+stringize_log_levels(ustring *u){
+	unsigned cat;
+
+	for(cat = 0 ; cat < LOGCAT_COUNT ; ++cat){
+		int lvl = get_log_level(cat);
+
+		if(printUString(u,"%s: %s\n",logcategory_names[cat],
+				lvl < 0 ? "off" : loglevel_names[lvl]) < 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Parse a "category level" line, where the category might be "all" and the
+// level might be "off".
+static int
+parse_log_level(const char *line,unsigned *cat,int *lvl){
+	char cname[32],lname[32];
+
+	if(sscanf(line,"%31s %31s",cname,lname) != 2){
+		return -1;
+	}
+	if(strcmp(cname,"all") == 0){
+		*cat = LOGCAT_COUNT;
+	}else{
+		for(*cat = 0 ; *cat < LOGCAT_COUNT ; ++*cat){
+			if(strcmp(cname,logcategory_names[*cat]) == 0){
+				break;
+			}
+		}
+		if(*cat == LOGCAT_COUNT){
+			return -1;
+		}
+	}
+	if(strcmp(lname,"off") == 0){
+		*lvl = -1;
+		return 0;
+	}
+	for(*lvl = 0 ; *lvl < LOGLVL_COUNT ; ++*lvl){
+		if(strcmp(lname,loglevel_names[*lvl]) == 0){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Each line of input ought be "category level"; the resulting table is
+// returned. Without input, this simply dumps the table.
+static int
+srv_log_level(cmd_state *cs){
+	char *line,*next;
+	cmd_input in;
+	logctx *lc;
+	int ret = 0;
+
+	if(suck_cmd_input(cs,&in)){
+		return -1;
+	}
+	for(line = in.data ; line ; line = next){
+		unsigned cat;
+		int lvl;
+
+		if( (next = strchr(line,'\n')) ){
+			*next++ = '\0';
+		}
+		if(strspn(line," \t\r") == strlen(line)){
+			continue;
+		}
+		if(parse_log_level(line,&cat,&lvl)){
+			bitch("Expected \"category level\", got %s\n",line);
+			ret = -1;
+			break;
+		}
+		nag("Setting %s to %s\n",cat == LOGCAT_COUNT ? "all" : logcategory_names[cat],
+				lvl < 0 ? "off" : loglevel_names[lvl]);
+		if(set_log_level(cat,lvl)){
+			ret = -1;
+			break;
+		}
+	}
+	release_cmd_input(&in);
+	if(ret == 0){
+		ret = -1;
+		if( (lc = get_thread_logctx()) ){
+			ret = stringize_log_levels(lc->out);
+		}
 	}
 	return ret;
 }
 
 static command commands[] = {
-	{ .cmd = "log_dump",	.func = srv_dump_log,		},
-	{ .cmd = "mem_dump",	.func = srv_mem_dump,		},
-	{ .cmd = "health_dump", .func = srv_health_dump,	},
-	{ NULL,			NULL,				}
+	{ .cmd = "log_dump",	.func = srv_dump_log,		.prio = CTLPRIO_BULK,	},
+	{ .cmd = "mem_dump",	.func = srv_mem_dump,		.prio = CTLPRIO_HIGH,	},
+	{ .cmd = "health_dump", .func = srv_health_dump,	.prio = CTLPRIO_HIGH,	},
+	{ .cmd = "log_level",	.func = srv_log_level,		.prio = CTLPRIO_HIGH,	},
+	{ .cmd = "log_segments", .func = srv_log_segments,	.prio = CTLPRIO_BULK,	},
+	{ NULL,			NULL,				CTLPRIO_NORMAL,	}
 };
 
 // Register the CTLserver commands provided by the logging module.
 int init_log_server(void){
-	prohibit_new_listeners = 0;
+	pthread_mutex_lock(&listener_lock);
+		__atomic_store_n(&lring_closed,0,__ATOMIC_RELEASE);
+		prohibit_new_listeners = 0;
+	pthread_mutex_unlock(&listener_lock);
 	if(regcommands(commands)){
 		prohibit_new_listeners = 1;
 		return -1;
@@ -391,8 +1371,9 @@ int stop_log_server(void){
 	nag("Killing all logdumpers\n");
 	pthread_mutex_lock(&listener_lock);
 		prohibit_new_listeners = 1;
-		enqueue_all("",0); // see block_on_lmsg()
+		__atomic_store_n(&lring_closed,1,__ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&listener_lock);
+	wake_listeners(); // see block_on_lmsg()
 	ret |= delcommands(commands);
 	return ret;
 }
@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 struct logctx;
 
 int init_logging(struct logctx *,const char *,int);
@@ -16,6 +18,80 @@ void vflog(const char *,va_list);
 void flog(const char *,...) __attribute__ ((format (printf,1,2)));
 void timeflog(const char *,...) __attribute__ ((format (printf,1,2)));
 
+// Log lines have a severity level and a category, the latter generally being
+// the module which emitted them. Each level has a mask of enabled categories,
+// checked by the logging macros (see logctx.h) before evaluating any of their
+// arguments, so disabled lines cost a load and a branch. A module's lines are
+// categorized by defining LOG_CATEGORY prior to any includes.
+typedef enum {
+	LOGLVL_ERROR,	// bitch(), moan() and friends
+	LOGLVL_INFO,	// nag(), timenag()
+	LOGLVL_DEBUG,	// dnag(), disabled by default
+	LOGLVL_COUNT
+} loglevel;
+
+typedef enum {
+	LOGCAT_GENERAL,
+	LOGCAT_CTLSERVER,
+	LOGCAT_EVCORE,
+	LOGCAT_LOGGING,
+	LOGCAT_METRICS,
+	LOGCAT_NETLINK,
+	LOGCAT_SLALLOC,
+	LOGCAT_COUNT
+} logcategory;
+
+extern uint32_t log_levelmask[LOGLVL_COUNT];
+
+#define log_enabled(cat,lvl) \
+	(__atomic_load_n(&log_levelmask[(lvl)],__ATOMIC_RELAXED) & (1u << (cat)))
+
+// Enable the category's lines at the given level and all more severe levels,
+// disabling less severe levels. A negative level disables the category
+// entirely. LOGCAT_COUNT applies the setting to all categories. These can also
+// be set through the ctlserver's log_level command.
+int set_log_level(unsigned,int);
+// The least severe enabled level for the category, or -1 if it's disabled.
+int get_log_level(unsigned);
+
+// A token bucket, generally one per call site (see ratenag() and friends in
+// logctx.h), zero-initialized. Each line takes a token; tokens accrue at a
+// given rate per second, up to a given burst. Lines finding the bucket empty
+// are counted, and not otherwise formatted or written.
+typedef struct lograte {
+	uint64_t refill;	// monotonic ns through which tokens have accrued
+	uint32_t tokens;
+	uint32_t suppressed;	// lines refused since one was last admitted
+} lograte;
+
+// Returns -1 if the line ought be suppressed. Otherwise, the line ought be
+// written, and the number of lines suppressed since the last admission is
+// returned (and reset).
+int log_ratelimit(lograte *,unsigned,unsigned);
+
+// timeflog() leaders follow ctime(3), and are rendered once per second (the
+// result being shared among threads). Up to 9 digits of sub-second precision
+// can be requested, following the seconds; beyond milliseconds, this requires
+// the full-resolution clock. Defaults to 0.
+int set_log_time_precision(unsigned);
+
+// Asynchronous logging: while running, flog() and friends copy the format
+// pointer and raw arguments into a per-thread, single-producer ring, and
+// return. A formatter thread renders the records, passing them to any
+// listeners and writing them to the logfile in batches. Strings are copied at
+// the time of the call; other pointers are recorded as values, so %p is fine
+// but %n isn't (such formats are rendered immediately, as are positional
+// arguments and wide strings). The format itself must be a string literal, or
+// otherwise outlive the record. Records are dropped (and the drops reported)
+// should a thread outpace the formatter.
+int start_async_logging(void);
+// Stops the formatter thread after draining all rings, and retires the
+// calling thread's ring. Other threads' rings are retired the next time they
+// log, or as they exit.
+int stop_async_logging(void);
+// Drain and free the logctx's ring, if it has one. Called from free_logctx().
+void retire_async_logging(struct logctx *);
+
 // These allow logging to a specified file.
 
 void log_crash(struct logctx *);
@@ -0,0 +1,539 @@
+#define LOG_CATEGORY LOGCAT_LOGGING
+
+#include <time.h>
+#define ZLIB_CONST
+#include <zlib.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libdank/utils/fds.h>
+#include <libdank/ersatz/compat.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
+#include <libdank/modules/logging/logrotate.h>
+
+#define ROTATE_PERIOD_NS 100000000 // archiver wakes every 100ms
+#define ROTATE_COPY_SZ (64 * 1024)
+#define ROTATE_SEND_SZ (1024 * 1024) // bytes per sendfile(2) when streaming
+
+// The archiver runs without a logctx (as does the async formatter), so it
+// reports its own problems to stderr, as logdir.c does.
+typedef struct rotsrc {
+	logmap lm;
+	uint64_t off;		// next record to archive
+	FILE *seg;		// current segment, if one's open
+	size_t segbytes;
+	time_t segstart;
+	unsigned seq;		// current (or next) segment
+	unsigned oldest;	// oldest retained segment
+	int retired;		// writer's done; archive, and free
+	int finished;		// retired prior to archiver's latest pass
+	struct rotsrc *next;
+	char fn[PATH_MAX];
+} rotsrc;
+
+// Completed segments, in order of completion, for stream_log_segments()
+typedef struct rotseg {
+	struct rotseg *next;
+	char fn[];
+} rotseg;
+
+static logrotate_config rotate_cfg;
+static rotsrc *rotate_srcs;
+static rotseg *rotate_segs,**rotate_segs_tail = &rotate_segs;
+static int rotate_running;
+static pthread_t rotate_tid;
+static char rotate_text[LISTENER_MSG_SZ + 1];
+static pthread_cond_t rotate_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+segment_name(const rotsrc *rs,unsigned seq,int gz,char *buf){
+	int r;
+
+	r = snprintf(buf,PATH_MAX,"%s.%u%s",rs->fn,seq,gz ? ".gz" : "");
+	return r < 0 || r >= PATH_MAX ? -1 : 0;
+}
+
+static void
+catalog_segment(const char *fn){
+	size_t len = strlen(fn) + 1;
+	rotseg *seg;
+
+	if((seg = Malloc("logrotate",sizeof(*seg) + len)) == NULL){
+		return;
+	}
+	memcpy(seg->fn,fn,len);
+	seg->next = NULL;
+	pthread_mutex_lock(&rotate_lock);
+	*rotate_segs_tail = seg;
+	rotate_segs_tail = &seg->next;
+	pthread_mutex_unlock(&rotate_lock);
+}
+
+static void
+uncatalog_segment(const char *fn){
+	rotseg **prev,*seg;
+
+	pthread_mutex_lock(&rotate_lock);
+	for(prev = &rotate_segs ; (seg = *prev) ; prev = &seg->next){
+		if(strcmp(seg->fn,fn) == 0){
+			if((*prev = seg->next) == NULL){
+				rotate_segs_tail = prev;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rotate_lock);
+	Free(seg);
+}
+
+// Copy the completed segment into its compressed counterpart, and remove it.
+static int
+compress_segment(const rotsrc *rs,unsigned seq){
+	char fn[PATH_MAX],gzfn[PATH_MAX],*buf;
+	int ret = -1;
+	gzFile gz;
+	size_t r;
+	FILE *fp;
+
+	if(segment_name(rs,seq,0,fn) || segment_name(rs,seq,1,gzfn)){
+		return -1;
+	}
+	if((fp = fopen(fn,"r")) == NULL){
+		fprintf(stderr,"Couldn't open %s: %s\n",fn,strerror(errno));
+		return -1;
+	}
+	if((gz = gzopen(gzfn,"wb")) == NULL){
+		fprintf(stderr,"Couldn't open %s\n",gzfn);
+		fclose(fp);
+		return -1;
+	}
+	if((buf = Malloc("logrotate",ROTATE_COPY_SZ)) == NULL){
+		goto done;
+	}
+	while((r = fread(buf,1,ROTATE_COPY_SZ,fp)) > 0){
+		if(gzwrite(gz,buf,(unsigned)r) != (int)r){
+			fprintf(stderr,"Couldn't write to %s\n",gzfn);
+			goto done;
+		}
+	}
+	if(!ferror(fp)){
+		ret = 0;
+	}
+
+done:
+	Free(buf);
+	if(gzclose(gz) != Z_OK){
+		ret = -1;
+	}
+	fclose(fp);
+	unlink(ret ? gzfn : fn);
+	return ret;
+}
+
+static off_t
+segment_size(const rotsrc *rs,unsigned seq){
+	char fn[PATH_MAX];
+	struct stat st;
+	int z;
+
+	for(z = 1 ; z >= 0 ; --z){
+		if(segment_name(rs,seq,z,fn) == 0 && stat(fn,&st) == 0){
+			return st.st_size;
+		}
+	}
+	return 0;
+}
+
+static void
+remove_segment(const rotsrc *rs,unsigned seq){
+	char fn[PATH_MAX];
+	int z;
+
+	for(z = 1 ; z >= 0 ; --z){
+		if(segment_name(rs,seq,z,fn) == 0){
+			if(unlink(fn) == 0){
+				uncatalog_segment(fn);
+			}
+		}
+	}
+}
+
+// Remove the oldest completed segments until within the configured limits.
+static void
+prune_segments(rotsrc *rs){
+	unsigned done = rs->seq; // completed segments lie in [oldest, seq)
+
+	if(rotate_cfg.keep_segments){
+		while(done - rs->oldest > rotate_cfg.keep_segments){
+			remove_segment(rs,rs->oldest++);
+		}
+	}
+	if(rotate_cfg.keep_bytes){
+		uintmax_t total = 0;
+		unsigned s;
+
+		for(s = rs->oldest ; s < done ; ++s){
+			total += (uintmax_t)segment_size(rs,s);
+		}
+		while(rs->oldest < done && total > rotate_cfg.keep_bytes){
+			total -= (uintmax_t)segment_size(rs,rs->oldest);
+			remove_segment(rs,rs->oldest++);
+		}
+	}
+}
+
+static void
+complete_segment(rotsrc *rs){
+	char fn[PATH_MAX];
+
+	if(rs->seg == NULL){
+		return;
+	}
+	if(fclose(rs->seg)){
+		fprintf(stderr,"Couldn't close %s.%u: %s\n",rs->fn,rs->seq,strerror(errno));
+	}
+	rs->seg = NULL;
+	if(segment_name(rs,rs->seq,rotate_cfg.compress && compress_segment(rs,rs->seq) == 0,fn) == 0){
+		catalog_segment(fn);
+	}
+	++rs->seq;
+	prune_segments(rs);
+}
+
+static int
+append_segment(rotsrc *rs,const char *text,size_t len,time_t now){
+	if(rs->seg == NULL){
+		char fn[PATH_MAX];
+
+		if(segment_name(rs,rs->seq,0,fn)){
+			return -1;
+		}
+		if((rs->seg = fopen(fn,"w")) == NULL){
+			fprintf(stderr,"Couldn't open %s: %s\n",fn,strerror(errno));
+			return -1;
+		}
+		rs->segbytes = 0;
+		rs->segstart = now;
+	}
+	if(fwrite(text,1,len,rs->seg) != len){
+		fprintf(stderr,"Couldn't write %zub to %s.%u\n",len,rs->fn,rs->seq);
+		return -1;
+	}
+	rs->segbytes += len;
+	if(rotate_cfg.segment_bytes && rs->segbytes >= rotate_cfg.segment_bytes){
+		complete_segment(rs);
+	}
+	return 0;
+}
+
+// Archive everything the writer's published since our last visit.
+static void
+archive_logmap(rotsrc *rs,time_t now){
+	uint64_t nsec;
+	int len;
+
+	for( ; ; ){
+		uint64_t head;
+
+		if((len = read_logmap(&rs->lm,&rs->off,&nsec,rotate_text,sizeof(rotate_text))) >= 0){
+			size_t tlen = strlen(rotate_text);
+
+			if(append_segment(rs,rotate_text,tlen,now)){
+				break;
+			}
+			continue;
+		}
+		// Either we've caught up, or the writer's lapped us
+		head = __atomic_load_n(&rs->lm.hdr->head,__ATOMIC_ACQUIRE);
+		if(head <= rs->off){
+			break;
+		}
+		len = snprintf(rotate_text,sizeof(rotate_text),"*** %ju bytes of log lost\n",
+				(uintmax_t)(head - rs->off));
+		rs->off = head;
+		if(len > 0 && append_segment(rs,rotate_text,(size_t)len,now)){
+			break;
+		}
+	}
+	if(rs->seg && rotate_cfg.segment_secs && now - rs->segstart >= (time_t)rotate_cfg.segment_secs){
+		complete_segment(rs);
+	}
+}
+
+static void
+free_rotsrc(rotsrc *rs){
+	complete_segment(rs);
+	close_logmap(&rs->lm);
+	Free(rs);
+}
+
+// Archive all logmaps, completing and freeing those which have been retired.
+// The lock is only held to walk the list; sources are only ever added to its
+// head, and only removed here, so our snapshot remains valid. A source
+// retired before we archive it has been archived to completion.
+static void
+archive_logmaps(void){
+	rotsrc **prev,*rs,*dead = NULL;
+	time_t now;
+
+	pthread_mutex_lock(&rotate_lock);
+	rs = rotate_srcs;
+	pthread_mutex_unlock(&rotate_lock);
+	now = time(NULL);
+	for( ; rs ; rs = rs->next){
+		rs->finished = __atomic_load_n(&rs->retired,__ATOMIC_ACQUIRE);
+		archive_logmap(rs,now);
+	}
+	pthread_mutex_lock(&rotate_lock);
+	for(prev = &rotate_srcs ; (rs = *prev) ; ){
+		if(rs->finished){
+			*prev = rs->next;
+			rs->next = dead;
+			dead = rs;
+		}else{
+			prev = &rs->next;
+		}
+	}
+	pthread_mutex_unlock(&rotate_lock);
+	while( (rs = dead) ){
+		dead = rs->next;
+		free_rotsrc(rs);
+	}
+}
+
+static void *
+log_archiver(void *unused __attribute__ ((unused))){
+	pthread_mutex_lock(&rotate_lock);
+	while(rotate_running){
+		struct timespec ts;
+
+		pthread_mutex_unlock(&rotate_lock);
+		archive_logmaps();
+		clock_gettime(CLOCK_REALTIME,&ts);
+		if((ts.tv_nsec += ROTATE_PERIOD_NS) >= 1000000000){
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		pthread_mutex_lock(&rotate_lock);
+		if(rotate_running){
+			pthread_cond_timedwait(&rotate_cond,&rotate_lock,&ts);
+		}
+	}
+	pthread_mutex_unlock(&rotate_lock);
+	return NULL;
+}
+
+int start_log_rotation(const logrotate_config *cfg){
+	int ret = -1,err = 0;
+
+	pthread_mutex_lock(&rotate_lock);
+	if(!rotate_running){
+		rotate_cfg = *cfg;
+		rotate_running = 1;
+		if( (err = pthread_create(&rotate_tid,NULL,log_archiver,NULL)) ){
+			rotate_running = 0;
+		}else{
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&rotate_lock);
+	if(err){
+		pmoan(err,"Couldn't launch log archiver\n");
+	}
+	return ret;
+}
+
+int stop_log_rotation(void){
+	rotseg *seg;
+	rotsrc *rs;
+	int err;
+
+	pthread_mutex_lock(&rotate_lock);
+	if(!rotate_running){
+		pthread_mutex_unlock(&rotate_lock);
+		return -1;
+	}
+	rotate_running = 0;
+	pthread_cond_signal(&rotate_cond);
+	pthread_mutex_unlock(&rotate_lock);
+	if( (err = pthread_join(rotate_tid,NULL)) ){
+		pmoan(err,"Couldn't join log archiver\n");
+		return -1;
+	}
+	// Nothing else can be running now; finish everything off
+	archive_logmaps();
+	while( (rs = rotate_srcs) ){
+		rotate_srcs = rs->next;
+		free_rotsrc(rs);
+	}
+	// The segments themselves remain on disk
+	while( (seg = rotate_segs) ){
+		rotate_segs = seg->next;
+		Free(seg);
+	}
+	rotate_segs_tail = &rotate_segs;
+	return 0;
+}
+
+int log_rotation_running(void){
+	int ret;
+
+	pthread_mutex_lock(&rotate_lock);
+	ret = rotate_running;
+	pthread_mutex_unlock(&rotate_lock);
+	return ret;
+}
+
+int rotate_logmap(const char *fn){
+	rotsrc *rs;
+
+	if(strlen(fn) >= sizeof(rs->fn)){
+		return -1;
+	}
+	if((rs = Malloc("logrotate",sizeof(*rs))) == NULL){
+		return -1;
+	}
+	memset(rs,0,sizeof(*rs));
+	strcpy(rs->fn,fn);
+	rs->seq = rs->oldest = 1;
+	// Map it now, lest the writer's retired (and the file unlinked) before
+	// the archiver gets to it.
+	if(open_logmap(&rs->lm,fn)){
+		Free(rs);
+		return -1;
+	}
+	rs->off = rs->lm.hdr->head;
+	pthread_mutex_lock(&rotate_lock);
+	if(!rotate_running){
+		pthread_mutex_unlock(&rotate_lock);
+		close_logmap(&rs->lm);
+		Free(rs);
+		return -1;
+	}
+	rs->next = rotate_srcs;
+	rotate_srcs = rs;
+	pthread_mutex_unlock(&rotate_lock);
+	return 0;
+}
+
+int retire_logmap(const char *fn){
+	int ret = 0;
+	rotsrc *rs;
+
+	pthread_mutex_lock(&rotate_lock);
+	for(rs = rotate_srcs ; rs ; rs = rs->next){
+		if(!__atomic_load_n(&rs->retired,__ATOMIC_RELAXED) && strcmp(rs->fn,fn) == 0){
+			// Our mapping keeps the contents around for the archiver
+			if(unlink(fn)){
+				ret = -1;
+			}else{
+				ret = 1;
+			}
+			__atomic_store_n(&rs->retired,1,__ATOMIC_RELEASE);
+			pthread_cond_signal(&rotate_cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rotate_lock);
+	return ret;
+}
+
+// Compress the text into a standalone gzip member, which can be concatenated
+// with those of the segments. Returns the length, or 0 on failure.
+static size_t
+gzip_member(const char *text,unsigned char *buf,size_t len){
+	z_stream zs;
+	size_t ret;
+
+	memset(&zs,0,sizeof(zs));
+	// 16 + MAX_WBITS requests a gzip wrapper, rather than zlib's
+	if(deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,16 + MAX_WBITS,8,
+				Z_DEFAULT_STRATEGY) != Z_OK){
+		return 0;
+	}
+	zs.next_in = (z_const Bytef *)text;
+	zs.avail_in = (uInt)strlen(text);
+	zs.next_out = buf;
+	zs.avail_out = (uInt)len;
+	ret = deflate(&zs,Z_FINISH) == Z_STREAM_END ? len - zs.avail_out : 0;
+	deflateEnd(&zs);
+	return ret;
+}
+
+// Send a "==> name <==" header, and then the file itself, straight from the
+// page cache. Compressed segments get a compressed header.
+static int
+stream_segment(int sd,const char *fn){
+	unsigned char gzhdr[1024];
+	char hdr[PATH_MAX + 16];
+	const char *base;
+	struct stat st;
+	size_t hlen;
+	off_t off;
+	int fd;
+
+	if((fd = open(fn,O_RDONLY | O_CLOEXEC)) < 0){
+		return errno == ENOENT ? 0 : -1; // pruned since our snapshot
+	}
+	if(fstat(fd,&st)){
+		close(fd);
+		return -1;
+	}
+	base = (base = strrchr(fn,'/')) ? base + 1 : fn;
+	snprintf(hdr,sizeof(hdr),"==> %s <==\n",base);
+	hlen = strlen(fn) > 3 && strcmp(fn + strlen(fn) - 3,".gz") == 0 ?
+		gzip_member(hdr,gzhdr,sizeof(gzhdr)) : 0;
+	if(hlen ? Writen(sd,gzhdr,hlen) : Writen(sd,hdr,strlen(hdr))){
+		close(fd);
+		return -1;
+	}
+	for(off = 0 ; off < st.st_size ; ){
+		size_t left = (size_t)(st.st_size - off);
+		ssize_t r;
+
+		if((r = sendfile_compat(sd,fd,&off,left > ROTATE_SEND_SZ ? ROTATE_SEND_SZ : left)) <= 0){
+			if(r < 0 && errno == EINTR){
+				continue;
+			}
+			moan("Couldn't send %s\n",fn);
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+int stream_log_segments(int sd){
+	size_t len = 0;
+	char *names,*n;
+	rotseg *seg;
+	int ret = 0;
+
+	// Copy out the names, so that the archiver needn't wait on the client
+	pthread_mutex_lock(&rotate_lock);
+	for(seg = rotate_segs ; seg ; seg = seg->next){
+		len += strlen(seg->fn) + 1;
+	}
+	if((names = Malloc("logrotate",len + 1)) == NULL){
+		pthread_mutex_unlock(&rotate_lock);
+		return -1;
+	}
+	for(n = names, seg = rotate_segs ; seg ; seg = seg->next){
+		strcpy(n,seg->fn);
+		n += strlen(n) + 1;
+	}
+	*n = '\0';
+	pthread_mutex_unlock(&rotate_lock);
+	for(n = names ; *n && ret == 0 ; n += strlen(n) + 1){
+		ret = stream_segment(sd,n);
+	}
+	Free(names);
+	return ret;
+}
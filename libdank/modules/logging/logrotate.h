@@ -0,0 +1,49 @@
+#ifndef MODULES_LOGGING_LOGROTATE
+#define MODULES_LOGGING_LOGROTATE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Each thread logs into a fixed-size logmap, which wraps, discarding the
+// oldest records. When rotation is running, an archiver thread follows each
+// logmap (through a read-only mapping of its own), appending new records to
+// numbered segments alongside it ("main.3.1", "main.3.2", ...).
+// Completed segments are compressed ("main.3.1.gz") and the oldest are
+// pruned. Writers never wait on the archiver; should a writer lap it, the
+// segment notes the loss. Should rotation be running when set_logdir() is
+// called, a previous run's logs are moved into the "previous" subdirectory,
+// rather than being removed.
+typedef struct logrotate_config {
+	size_t segment_bytes;	// complete segments at this size (0: no limit)
+	unsigned segment_secs;	// ...or once this old (0: no limit)
+	unsigned keep_segments;	// completed segments kept per log (0: no limit)
+	size_t keep_bytes;	// bytes of completed segments per log (0: no limit)
+	int compress;		// gzip completed segments
+} logrotate_config;
+
+// The configuration is copied. Call prior to init_logging().
+int start_log_rotation(const logrotate_config *);
+// Archives everything outstanding, completing all segments.
+int stop_log_rotation(void);
+int log_rotation_running(void);
+
+// Begin archiving the logmap at the path. Called by open_thread_logmap().
+int rotate_logmap(const char *);
+// The logmap's writer has finished. It is unlinked (so that its name can be
+// reused), and archived to completion in the background. Returns 1 if the
+// logmap was being archived, 0 if it was not, and -1 on error.
+int retire_logmap(const char *);
+
+// Write each completed segment to the descriptor (in order of completion),
+// preceded by a "==> name <==" header, using sendfile(2). Compressed segments
+// and their headers form a multi-member gzip stream, suitable for zcat(1).
+int stream_log_segments(int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
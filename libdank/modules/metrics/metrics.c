@@ -0,0 +1,315 @@
+#define LOG_CATEGORY LOGCAT_METRICS
+
+#include <string.h>
+#include <pthread.h>
+#include <libdank/utils/string.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/objustring.h>
+#include <libdank/modules/metrics/metrics.h>
+#include <libdank/modules/ctlserver/ctlserver.h>
+
+__thread unsigned metric_shard_plus1;
+
+static unsigned next_shard;
+static metric *metrics,**metrics_tail = &metrics;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char * const metric_type_names[] = {
+	[METRIC_COUNTER] = "counter",
+	[METRIC_GAUGE] = "gauge",
+	[METRIC_HISTOGRAM] = "histogram",
+};
+
+unsigned assign_metric_shard(void){
+	unsigned s;
+
+	s = __atomic_fetch_add(&next_shard,1,__ATOMIC_RELAXED) % METRIC_SHARDS;
+	metric_shard_plus1 = s + 1;
+	return s;
+}
+
+static size_t
+metric_shard_words(metric_type type){
+	switch(type){
+		case METRIC_COUNTER:
+			return METRIC_SHARDS * METRIC_SHARD_STRIDE;
+		case METRIC_HISTOGRAM:
+			return METRIC_SHARDS * METRIC_HIST_ROW;
+		case METRIC_GAUGE:
+			break;
+	}
+	return 0;
+}
+
+static metric *
+create_metric(const char *name,metric_type type){
+	size_t words = metric_shard_words(type);
+	metric *m;
+
+	if((m = Malloc("metric",sizeof(*m))) == NULL){
+		return NULL;
+	}
+	memset(m,0,sizeof(*m));
+	if((m->name = Strdup(name)) == NULL){
+		Free(m);
+		return NULL;
+	}
+	if(words){
+		if((m->shards = Malloc("metric shards",sizeof(*m->shards) * words)) == NULL){
+			Free(m->name);
+			Free(m);
+			return NULL;
+		}
+		memset(m->shards,0,sizeof(*m->shards) * words);
+	}
+	m->type = type;
+	m->refcount = 1;
+	return m;
+}
+
+static void
+free_metric(metric *m){
+	Free(m->shards);
+	Free(m->name);
+	Free(m);
+}
+
+static metric *
+register_metric(const char *name,metric_type type){
+	metric *m;
+
+	if(strspn(name,"abcdefghijklmnopqrstuvwxyz0123456789_.") != strlen(name) || !*name){
+		bitch("Invalid metric name: %s\n",name);
+		return NULL;
+	}
+	pthread_mutex_lock(&metrics_lock);
+	for(m = metrics ; m ; m = m->next){
+		if(strcmp(m->name,name) == 0){
+			break;
+		}
+	}
+	if(m){
+		if(m->type != type){
+			pthread_mutex_unlock(&metrics_lock);
+			bitch("%s is already a %s\n",name,metric_type_names[m->type]);
+			return NULL;
+		}
+		++m->refcount;
+	}else if( (m = create_metric(name,type)) ){
+		*metrics_tail = m;
+		metrics_tail = &m->next;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	return m;
+}
+
+metric *register_counter(const char *name){
+	return register_metric(name,METRIC_COUNTER);
+}
+
+metric *register_gauge(const char *name){
+	return register_metric(name,METRIC_GAUGE);
+}
+
+metric *register_histogram(const char *name){
+	return register_metric(name,METRIC_HISTOGRAM);
+}
+
+int unregister_metric(metric *m){
+	metric **pre,*cur;
+
+	if(m == NULL){
+		return 0;
+	}
+	pthread_mutex_lock(&metrics_lock);
+	for(pre = &metrics ; (cur = *pre) ; pre = &cur->next){
+		if(cur == m){
+			break;
+		}
+	}
+	if(cur && --cur->refcount == 0){
+		if((*pre = cur->next) == NULL){
+			metrics_tail = pre;
+		}
+	}else{
+		m = NULL;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	if(cur == NULL){
+		bitch("Metric wasn't registered\n");
+		return -1;
+	}
+	if(m){
+		free_metric(m);
+	}
+	return 0;
+}
+
+uint64_t counter_value(const metric *m){
+	uint64_t v = 0;
+	unsigned s;
+
+	for(s = 0 ; s < METRIC_SHARDS ; ++s){
+		v += __atomic_load_n(&m->shards[s * METRIC_SHARD_STRIDE],__ATOMIC_RELAXED);
+	}
+	return v;
+}
+
+int64_t gauge_value(const metric *m){
+	return __atomic_load_n(&m->gauge,__ATOMIC_RELAXED);
+}
+
+uint64_t histogram_snapshot(const metric *m,uint64_t *buckets,uint64_t *sum){
+	uint64_t count = 0;
+	unsigned s,b;
+
+	memset(buckets,0,sizeof(*buckets) * METRIC_HIST_BUCKETS);
+	*sum = 0;
+	for(s = 0 ; s < METRIC_SHARDS ; ++s){
+		const uint64_t *row = &m->shards[s * METRIC_HIST_ROW];
+
+		for(b = 0 ; b < METRIC_HIST_BUCKETS ; ++b){
+			buckets[b] += __atomic_load_n(&row[b],__ATOMIC_RELAXED);
+		}
+		count += __atomic_load_n(&row[METRIC_HIST_COUNT],__ATOMIC_RELAXED);
+		*sum += __atomic_load_n(&row[METRIC_HIST_SUM],__ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+uint64_t histogram_quantile(const uint64_t *buckets,uint64_t count,unsigned permille){
+	uint64_t target,seen = 0;
+	unsigned b;
+
+	if(count == 0){
+		return 0;
+	}
+	// The count is read separately from the buckets, and might disagree
+	target = (count * permille + 999) / 1000;
+	for(b = 0 ; b < METRIC_HIST_BUCKETS ; ++b){
+		if(buckets[b] && (seen += buckets[b]) >= target){
+			return metric_hist_floor(b);
+		}
+	}
+	while(b--){
+		if(buckets[b]){
+			return metric_hist_floor(b);
+		}
+	}
+	return 0;
+}
+
+static int
+stringize_histogram(ustring *u,const metric *m,uint64_t *buckets){
+	uint64_t count,sum;
+	unsigned b;
+
+	count = histogram_snapshot(m,buckets,&sum);
+	if(printUString(u," %ju %ju %ju %ju %ju %ju",(uintmax_t)count,(uintmax_t)sum,
+			(uintmax_t)histogram_quantile(buckets,count,500),
+			(uintmax_t)histogram_quantile(buckets,count,900),
+			(uintmax_t)histogram_quantile(buckets,count,990),
+			(uintmax_t)histogram_quantile(buckets,count,1000)) < 0){
+		return -1;
+	}
+	for(b = 0 ; b < METRIC_HIST_BUCKETS ; ++b){
+		if(buckets[b]){
+			if(printUString(u," %ju:%ju",(uintmax_t)metric_hist_floor(b),
+						(uintmax_t)buckets[b]) < 0){
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+stringize_metric(ustring *u,const metric *m,uint64_t *buckets){
+	int ret = 0;
+
+	if(printUString(u,"%s %s",metric_type_names[m->type],m->name) < 0){
+		return -1;
+	}
+	switch(m->type){
+		case METRIC_COUNTER:
+			ret = printUString(u," %ju",(uintmax_t)counter_value(m)) < 0 ? -1 : 0;
+			break;
+		case METRIC_GAUGE:
+			ret = printUString(u," %jd",(intmax_t)gauge_value(m)) < 0 ? -1 : 0;
+			break;
+		case METRIC_HISTOGRAM:
+			ret = stringize_histogram(u,m,buckets);
+			break;
+	}
+	if(ret == 0 && printUString(u,"\n") < 0){
+		ret = -1;
+	}
+	return ret;
+}
+
+int stringize_metrics(ustring *u){
+	uint64_t *buckets;
+	const metric *m;
+	int ret = 0;
+
+	if((buckets = Malloc("metric snapshot",sizeof(*buckets) * METRIC_HIST_BUCKETS)) == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&metrics_lock);
+	for(m = metrics ; m && ret == 0 ; m = m->next){
+		ret = stringize_metric(u,m,buckets);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	Free(buckets);
+	return ret;
+}
+
+// Metrics are formatted a chunk at a time, and each chunk sent without
+// metrics_lock held, lest a client which stops reading block registration.
+// Those (un)registered in between might be skipped or repeated.
+static int
+srv_metrics_dump(cmd_state *cs){
+	unsigned sent = 0,z;
+	uint64_t *buckets;
+	const metric *m;
+	int ret = 0;
+	logctx *lc;
+
+	if((lc = get_thread_logctx()) == NULL){
+		return -1;
+	}
+	if((buckets = Malloc("metric snapshot",sizeof(*buckets) * METRIC_HIST_BUCKETS)) == NULL){
+		return -1;
+	}
+	do{
+		pthread_mutex_lock(&metrics_lock);
+		for(m = metrics, z = 0 ; m && z < sent ; m = m->next, ++z){
+			;
+		}
+		while(m && ret == 0 && lc->out->current < CMD_OUTBUF_SIZE){
+			ret = stringize_metric(lc->out,m,buckets);
+			m = m->next;
+			++sent;
+		}
+		pthread_mutex_unlock(&metrics_lock);
+		if(ret == 0){
+			ret = cmd_write_ustring(cs,lc->out);
+		}
+	}while(m && ret == 0);
+	Free(buckets);
+	return ret;
+}
+
+static command commands[] = {
+	{ .cmd = "metrics_dump",	.func = srv_metrics_dump,	.prio = CTLPRIO_HIGH,	},
+	{ NULL,				NULL,				CTLPRIO_NORMAL,	}
+};
+
+int init_metrics_server(void){
+	return regcommands(commands);
+}
+
+int stop_metrics_server(void){
+	return delcommands(commands);
+}
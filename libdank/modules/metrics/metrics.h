@@ -0,0 +1,142 @@
+#ifndef MODULES_METRICS_METRICS
+#define MODULES_METRICS_METRICS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct ustring;
+
+// Named counters, gauges and histograms, registered by any module and dumped
+// together through the ctlserver's metrics_dump command. Counters and
+// histograms are sharded: each thread updates one of METRIC_SHARDS slots
+// (a cacheline apart) with a relaxed atomic add, and a snapshot sums the
+// shards. Updates thus never take a lock, and rarely share a cacheline.
+//
+// Registering an existing name (of the same type) returns the existing
+// metric, taking a reference, so that several instances of a module (ie,
+// evhandlers) can share their metrics. Each registration is balanced by an
+// unregister_metric().
+typedef enum {
+	METRIC_COUNTER,		// monotonically increasing
+	METRIC_GAUGE,		// set or adjusted; a single, unsharded value
+	METRIC_HISTOGRAM	// distribution of unsigned values
+} metric_type;
+
+#define METRIC_SHARDS 16
+#define METRIC_SHARD_STRIDE (64 / sizeof(uint64_t)) // one cacheline
+
+// Histograms are log-linear, as in HdrHistogram: values below 16 each have
+// a bucket, and each subsequent power of two is split into 8 buckets, for a
+// worst-case error of 1/8th of the value. Each shard carries the buckets,
+// followed by a count and sum.
+#define METRIC_HIST_SUBBITS 3
+#define METRIC_HIST_BUCKETS ((65 - METRIC_HIST_SUBBITS) << METRIC_HIST_SUBBITS)
+#define METRIC_HIST_COUNT METRIC_HIST_BUCKETS
+#define METRIC_HIST_SUM (METRIC_HIST_BUCKETS + 1)
+#define METRIC_HIST_ROW (METRIC_HIST_BUCKETS + METRIC_SHARD_STRIDE)
+
+typedef struct metric {
+	metric_type type;
+	int64_t gauge;
+	uint64_t *shards;
+	char *name;
+	unsigned refcount;
+	struct metric *next;
+} metric;
+
+metric *register_counter(const char *);
+metric *register_gauge(const char *);
+metric *register_histogram(const char *);
+int unregister_metric(metric *);
+
+// The calling thread's shard, assigned round-robin on first use
+extern __thread unsigned metric_shard_plus1;
+unsigned assign_metric_shard(void);
+
+static inline unsigned
+metric_shard(void){
+	unsigned s = metric_shard_plus1;
+
+	return s ? s - 1 : assign_metric_shard();
+}
+
+static inline void
+counter_add(metric *m,uint64_t n){
+	__atomic_fetch_add(&m->shards[metric_shard() * METRIC_SHARD_STRIDE],n,__ATOMIC_RELAXED);
+}
+
+static inline void
+counter_inc(metric *m){
+	counter_add(m,1);
+}
+
+static inline void
+gauge_set(metric *m,int64_t v){
+	__atomic_store_n(&m->gauge,v,__ATOMIC_RELAXED);
+}
+
+static inline void
+gauge_add(metric *m,int64_t v){
+	__atomic_fetch_add(&m->gauge,v,__ATOMIC_RELAXED);
+}
+
+static inline unsigned
+metric_hist_bucket(uint64_t v){
+	unsigned shift;
+
+	if(v < (2u << METRIC_HIST_SUBBITS)){
+		return (unsigned)v;
+	}
+	shift = (unsigned)(63 - __builtin_clzll(v)) - METRIC_HIST_SUBBITS;
+	return (shift << METRIC_HIST_SUBBITS) + (unsigned)(v >> shift);
+}
+
+// The smallest value falling into the bucket
+static inline uint64_t
+metric_hist_floor(unsigned b){
+	unsigned q = b >> METRIC_HIST_SUBBITS;
+
+	if(q == 0){
+		return b;
+	}
+	return (uint64_t)((1u << METRIC_HIST_SUBBITS) + (b & ((1u << METRIC_HIST_SUBBITS) - 1))) << (q - 1);
+}
+
+static inline void
+histogram_record(metric *m,uint64_t v){
+	uint64_t *row = &m->shards[metric_shard() * METRIC_HIST_ROW];
+
+	__atomic_fetch_add(&row[metric_hist_bucket(v)],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&row[METRIC_HIST_COUNT],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&row[METRIC_HIST_SUM],v,__ATOMIC_RELAXED);
+}
+
+// Snapshots. Concurrent updates might or might not be reflected.
+uint64_t counter_value(const metric *);
+int64_t gauge_value(const metric *);
+// Sums the shards into the METRIC_HIST_BUCKETS buckets provided, returning
+// the count of recorded values (and their sum through the pointer).
+uint64_t histogram_snapshot(const metric *,uint64_t *,uint64_t *);
+// The floor of the bucket holding the value at the given permille, from a
+// snapshot.
+uint64_t histogram_quantile(const uint64_t *,uint64_t,unsigned);
+
+// One line per metric, in order of registration:
+//  counter name value
+//  gauge name value
+//  histogram name count sum p50 p90 p99 max floor:count...
+// where the histogram's buckets are those with a nonzero count.
+int stringize_metrics(struct ustring *);
+
+// Register the metrics_dump ctlserver command
+int init_metrics_server(void);
+int stop_metrics_server(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
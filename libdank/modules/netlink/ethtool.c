@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_NETLINK
+
 #include <libdank/ersatz/compat.h>
 
 #ifdef LIB_COMPAT_LINUX
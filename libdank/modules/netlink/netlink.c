@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_NETLINK
+
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
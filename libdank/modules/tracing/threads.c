@@ -293,8 +293,7 @@ int new_traceable_detached(const char *name,logged_tfxn tfxn,void *arg){
 		return -1;
 	}
 	if(Pthread_create(sw->name,&tid,&pat,stack_wrapperfxn,sw)){
-		free_logctx(sw->lc);
-		Free(sw->lc);
+		Free(sw->lc); // never initialized; that's done by the thread
 		free_stack_wrapper(&sw);
 		pthread_attr_destroy(&pat);
 		return -1;
@@ -321,8 +320,7 @@ int new_traceable_thread(const char *name,pthread_t *tid,
 	// Once pthread_create() returns success, we must never free the
 	// sigstack wrapper. The spawned thread will handle it in all cases.
 	if(Pthread_create(sw->name,tid,NULL,stack_wrapperfxn,sw)){
-		free_logctx(sw->lc);
-		Free(sw->lc);
+		Free(sw->lc); // never initialized; that's done by the thread
 		free_stack_wrapper(&sw);
 		return -1;
 	}
@@ -0,0 +1,570 @@
+#include <stdlib.h>
+#include <string.h>
+#include <libdank/objects/ipset.h>
+#include <libdank/utils/threads.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/portset.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/classifier.h>
+
+// Fields, in flowkey order: source address, destination address, source port,
+// destination port, protocol.
+#define CLASSIFIER_DIMS		5
+#define CLASSIFIER_LEAF		CLASSIFIER_DIMS
+#define CLASSIFIER_LEAFRULES	8	// stop cutting at this many rules
+#define CLASSIFIER_MAXDEPTH	64
+#define CLASSIFIER_MAXSUBRULES	(1u << 20u)
+#define CLASSIFIER_BATCH	16
+
+static const uint32_t dimmax[CLASSIFIER_DIMS] = {
+	UINT32_MAX, UINT32_MAX, 0xffffu, 0xffffu, 0xffu,
+};
+
+// A rule restricted to a single range in each field. Leaves hold copies of
+// these, so that they might be scanned without further indirection.
+typedef struct subrule {
+	uint32_t lo[CLASSIFIER_DIMS],hi[CLASSIFIER_DIMS];
+	unsigned rule;
+} subrule;
+
+typedef struct crange {
+	uint32_t lo,hi;
+} crange;
+
+typedef struct cbox {
+	uint32_t lo[CLASSIFIER_DIMS],hi[CLASSIFIER_DIMS];
+} cbox;
+
+// Interior nodes send keys below split left, others right. For leaves, left
+// and right are the offset and count of the leaf's rules in leafrules.
+typedef struct cnode {
+	uint32_t split;
+	unsigned dim;
+	unsigned left,right;
+} cnode;
+
+typedef struct classifier_table {
+	cnode *nodes;
+	unsigned nodecount,nodemax;
+	subrule *leafrules;
+	unsigned leafcount,leafmax;
+	unsigned subrulecount;
+	unsigned refs;		// taken under the classifier's lock, dropped atomically
+} classifier_table;
+
+typedef struct classifier {
+	pthread_mutex_t lock;
+	classifier_table *cur;
+} classifier;
+
+static inline void
+flowkey_fields(const flowkey *fk,uint32_t *k){
+	k[0] = fk->saddr;
+	k[1] = fk->daddr;
+	k[2] = fk->sport;
+	k[3] = fk->dport;
+	k[4] = fk->proto;
+}
+
+static inline int
+subrule_matches(const subrule *sr,const uint32_t *k){
+	unsigned d;
+	int m = 1;
+
+	// & vs && is an optimization to avoid branching, not an error!
+	for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+		m &= (k[d] >= sr->lo[d]) & (k[d] <= sr->hi[d]);
+	}
+	return m;
+}
+
+static inline int
+subrule_covers(const subrule *sr,const cbox *b){
+	unsigned d;
+
+	for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+		if(sr->lo[d] > b->lo[d] || sr->hi[d] < b->hi[d]){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Returns the number of ranges written, or -1 on error
+static int
+rule_ranges(const classifier_rule *r,unsigned dim,crange **cr){
+	const portset *ps = NULL;
+	const ipset *is = NULL;
+	unsigned z,count;
+
+	switch(dim){
+		case 0: is = r->src; break;
+		case 1: is = r->dst; break;
+		case 2: ps = r->sport; break;
+		case 3: ps = r->dport; break;
+	}
+	if(is){
+		count = is->rangecount;
+	}else if(ps){
+		count = ps->rangecount;
+	}else{
+		count = 1;
+	}
+	if(count == 0){
+		*cr = NULL;
+		return 0;
+	}
+	if((*cr = Malloc("classifier ranges",sizeof(**cr) * count)) == NULL){
+		return -1;
+	}
+	if(is){
+		for(z = 0 ; z < count ; ++z){
+			(*cr)[z].lo = is->ranges[z].lower;
+			(*cr)[z].hi = is->ranges[z].upper;
+		}
+	}else if(ps){
+		for(z = 0 ; z < count ; ++z){
+			(*cr)[z].lo = ps->ranges[z].lower;
+			(*cr)[z].hi = ps->ranges[z].upper;
+		}
+	}else if(dim == 4 && r->proto >= 0){
+		if(r->proto > 0xff){
+			bitch("Invalid protocol %d\n",r->proto);
+			Free(*cr);
+			return -1;
+		}
+		(*cr)[0].lo = (*cr)[0].hi = r->proto;
+	}else{
+		(*cr)[0].lo = 0;
+		(*cr)[0].hi = dimmax[dim];
+	}
+	return count;
+}
+
+// Expand each rule into the cross product of its fields' ranges, in priority
+// order. Returns the number of subrules, or -1 on error.
+static int
+expand_rules(const classifier_rule *rules,unsigned count,subrule **srs){
+	unsigned z,n = 0,max = 0;
+	int ret = -1;
+
+	*srs = NULL;
+	for(z = 0 ; z < count ; ++z){
+		crange *cr[CLASSIFIER_DIMS];
+		unsigned d,idx[CLASSIFIER_DIMS],rc[CLASSIFIER_DIMS];
+		unsigned long long product = 1;
+		int c;
+
+		for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+			if((c = rule_ranges(&rules[z],d,&cr[d])) < 0){
+				while(d--){
+					Free(cr[d]);
+				}
+				goto done;
+			}
+			rc[d] = c;
+			idx[d] = 0;
+			product *= c;
+		}
+		if(product + n > CLASSIFIER_MAXSUBRULES){
+			bitch("Rule %u expanded beyond %u subrules\n",z,CLASSIFIER_MAXSUBRULES);
+			for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+				Free(cr[d]);
+			}
+			goto done;
+		}
+		if(n + product > max){
+			subrule *tmp;
+
+			max = (n + product) * 2;
+			if((tmp = Realloc("classifier subrules",*srs,sizeof(*tmp) * max)) == NULL){
+				for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+					Free(cr[d]);
+				}
+				goto done;
+			}
+			*srs = tmp;
+		}
+		// odometer over the ranges of each field
+		while(product){
+			subrule *sr = &(*srs)[n++];
+
+			for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+				sr->lo[d] = cr[d][idx[d]].lo;
+				sr->hi[d] = cr[d][idx[d]].hi;
+			}
+			sr->rule = z;
+			for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+				if(++idx[d] < rc[d]){
+					break;
+				}
+				idx[d] = 0;
+			}
+			if(d == CLASSIFIER_DIMS){
+				break;
+			}
+		}
+		for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+			Free(cr[d]);
+		}
+	}
+	ret = n;
+
+done:
+	if(ret < 0){
+		Free(*srs);
+		*srs = NULL;
+	}
+	return ret;
+}
+
+static int
+alloc_node(classifier_table *t){
+	if(t->nodecount == t->nodemax){
+		unsigned newmax = t->nodemax ? t->nodemax * 2 : 64;
+		cnode *tmp;
+
+		if((tmp = Realloc("classifier nodes",t->nodes,sizeof(*tmp) * newmax)) == NULL){
+			return -1;
+		}
+		t->nodes = tmp;
+		t->nodemax = newmax;
+	}
+	return t->nodecount++;
+}
+
+static int
+make_leaf(classifier_table *t,unsigned nidx,const subrule *srs,
+			const unsigned *ids,unsigned n){
+	unsigned z;
+
+	if(t->leafcount + n > t->leafmax){
+		unsigned newmax = (t->leafcount + n) * 2;
+		subrule *tmp;
+
+		if((tmp = Realloc("classifier leaves",t->leafrules,sizeof(*tmp) * newmax)) == NULL){
+			return -1;
+		}
+		t->leafrules = tmp;
+		t->leafmax = newmax;
+	}
+	t->nodes[nidx].dim = CLASSIFIER_LEAF;
+	t->nodes[nidx].split = 0;
+	t->nodes[nidx].left = t->leafcount;
+	t->nodes[nidx].right = n;
+	for(z = 0 ; z < n ; ++z){
+		t->leafrules[t->leafcount++] = srs[ids[z]];
+	}
+	return 0;
+}
+
+static int
+uint32_cmp(const void *a,const void *b){
+	uint32_t ua = *(const uint32_t *)a,ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+// Choose the field with the most distinct rule boundaries within the box, and
+// cut it at the median boundary (weighting boundaries by their frequency).
+// Returns -1 if no field can be cut, or on error.
+static int
+choose_split(const subrule *srs,const unsigned *ids,unsigned n,const cbox *b,
+			unsigned *dim,uint32_t *split){
+	unsigned d,z,best = 0;
+	uint32_t *pts;
+
+	if((pts = Malloc("classifier bounds",sizeof(*pts) * n * 2)) == NULL){
+		return -1;
+	}
+	for(d = 0 ; d < CLASSIFIER_DIMS ; ++d){
+		unsigned m = 0,distinct;
+
+		for(z = 0 ; z < n ; ++z){
+			const subrule *sr = &srs[ids[z]];
+
+			if(sr->lo[d] > b->lo[d]){
+				pts[m++] = sr->lo[d];
+			}
+			if(sr->hi[d] < b->hi[d]){
+				pts[m++] = sr->hi[d] + 1;
+			}
+		}
+		if(m == 0){
+			continue;
+		}
+		qsort(pts,m,sizeof(*pts),uint32_cmp);
+		for(z = 1, distinct = 1 ; z < m ; ++z){
+			distinct += pts[z] != pts[z - 1];
+		}
+		if(distinct > best){
+			best = distinct;
+			*dim = d;
+			*split = pts[m / 2];
+		}
+	}
+	Free(pts);
+	return best ? 0 : -1;
+}
+
+static int
+build_node(classifier_table *t,const subrule *srs,const unsigned *ids,
+			unsigned n,const cbox *b,unsigned depth){
+	unsigned *lids,*rids,ln = 0,rn = 0,z,dim;
+	int nidx,l,r;
+	uint32_t split;
+	cbox lb,rb;
+
+	// nothing following a rule covering the entire box can ever match
+	for(z = 0 ; z < n ; ++z){
+		if(subrule_covers(&srs[ids[z]],b)){
+			n = z + 1;
+			break;
+		}
+	}
+	if((nidx = alloc_node(t)) < 0){
+		return -1;
+	}
+	if(n <= CLASSIFIER_LEAFRULES || depth == CLASSIFIER_MAXDEPTH ||
+			choose_split(srs,ids,n,b,&dim,&split)){
+		return make_leaf(t,nidx,srs,ids,n) ? -1 : nidx;
+	}
+	if((lids = Malloc("classifier partition",sizeof(*lids) * n * 2)) == NULL){
+		return -1;
+	}
+	rids = lids + n;
+	for(z = 0 ; z < n ; ++z){
+		if(srs[ids[z]].lo[dim] < split){
+			lids[ln++] = ids[z];
+		}
+		if(srs[ids[z]].hi[dim] >= split){
+			rids[rn++] = ids[z];
+		}
+	}
+	lb = rb = *b;
+	lb.hi[dim] = split - 1;
+	rb.lo[dim] = split;
+	if((l = build_node(t,srs,lids,ln,&lb,depth + 1)) < 0 ||
+			(r = build_node(t,srs,rids,rn,&rb,depth + 1)) < 0){
+		Free(lids);
+		return -1;
+	}
+	Free(lids);
+	t->nodes[nidx].dim = dim;
+	t->nodes[nidx].split = split;
+	t->nodes[nidx].left = l;
+	t->nodes[nidx].right = r;
+	return nidx;
+}
+
+classifier_table *compile_classifier(const classifier_rule *rules,unsigned count){
+	classifier_table *ret;
+	unsigned *ids = NULL,z;
+	subrule *srs;
+	cbox root;
+	int n;
+
+	if((n = expand_rules(rules,count,&srs)) < 0){
+		return NULL;
+	}
+	if((ret = Malloc("classifier table",sizeof(*ret))) == NULL){
+		Free(srs);
+		return NULL;
+	}
+	memset(ret,0,sizeof(*ret));
+	ret->subrulecount = n;
+	if(n && (ids = Malloc("classifier ids",sizeof(*ids) * n)) == NULL){
+		goto err;
+	}
+	for(z = 0 ; z < (unsigned)n ; ++z){
+		ids[z] = z;
+	}
+	for(z = 0 ; z < CLASSIFIER_DIMS ; ++z){
+		root.lo[z] = 0;
+		root.hi[z] = dimmax[z];
+	}
+	if(build_node(ret,srs,ids,n,&root,0) < 0){
+		goto err;
+	}
+	Free(ids);
+	Free(srs);
+	return ret;
+
+err:
+	Free(ids);
+	Free(srs);
+	free_classifier_table(ret);
+	return NULL;
+}
+
+void free_classifier_table(classifier_table *t){
+	if(t){
+		Free(t->nodes);
+		Free(t->leafrules);
+		Free(t);
+	}
+}
+
+static inline int
+classify_leaf(const classifier_table *t,const cnode *n,const uint32_t *k){
+	const subrule *sr = t->leafrules + n->left;
+	unsigned z;
+
+	for(z = 0 ; z < n->right ; ++z){
+		if(subrule_matches(&sr[z],k)){
+			return sr[z].rule;
+		}
+	}
+	return -1;
+}
+
+int classify_table(const classifier_table *t,const flowkey *fk){
+	uint32_t k[CLASSIFIER_DIMS];
+	const cnode *n = t->nodes;
+
+	flowkey_fields(fk,k);
+	while(n->dim != CLASSIFIER_LEAF){
+		n = t->nodes + (k[n->dim] < n->split ? n->left : n->right);
+	}
+	return classify_leaf(t,n,k);
+}
+
+void classify_table_batch(const classifier_table *t,const flowkey *fks,
+				int *results,unsigned count){
+	uint32_t k[CLASSIFIER_BATCH][CLASSIFIER_DIMS];
+	const cnode *n[CLASSIFIER_BATCH];
+	unsigned z,i,b,active;
+
+	for(z = 0 ; z < count ; z += b){
+		b = count - z < CLASSIFIER_BATCH ? count - z : CLASSIFIER_BATCH;
+		for(i = 0 ; i < b ; ++i){
+			flowkey_fields(&fks[z + i],k[i]);
+			n[i] = t->nodes;
+		}
+		do{
+			active = 0;
+			for(i = 0 ; i < b ; ++i){
+				if(n[i]->dim != CLASSIFIER_LEAF){
+					n[i] = t->nodes + (k[i][n[i]->dim] < n[i]->split ?
+							n[i]->left : n[i]->right);
+					__builtin_prefetch(n[i]);
+					++active;
+				}
+			}
+		}while(active);
+		for(i = 0 ; i < b ; ++i){
+			__builtin_prefetch(t->leafrules + n[i]->left);
+		}
+		for(i = 0 ; i < b ; ++i){
+			results[z + i] = classify_leaf(t,n[i],k[i]);
+		}
+	}
+}
+
+unsigned nodes_classifier_table(const classifier_table *t){
+	return t->nodecount;
+}
+
+unsigned subrules_classifier_table(const classifier_table *t){
+	return t->subrulecount;
+}
+
+classifier *create_classifier(void){
+	classifier *ret;
+
+	if( (ret = Malloc("classifier",sizeof(*ret))) ){
+		if(Pthread_mutex_init(&ret->lock,NULL)){
+			Free(ret);
+			return NULL;
+		}
+		ret->cur = NULL;
+	}
+	return ret;
+}
+
+classifier_table *acquire_classifier(classifier *c){
+	classifier_table *ret;
+
+	if(Pthread_mutex_lock(&c->lock)){
+		return NULL;
+	}
+	if( (ret = c->cur) ){
+		__atomic_add_fetch(&ret->refs,1,__ATOMIC_RELAXED);
+	}
+	Pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+// The installed table holds a reference of its own, so a table can only be
+// acquired while its count is non-zero; once swapped out, its count only
+// falls. Releasing thus needn't take the lock.
+void release_classifier(classifier *c __attribute__ ((unused)),classifier_table *t){
+	if(t == NULL){
+		return;
+	}
+	if(__atomic_sub_fetch(&t->refs,1,__ATOMIC_ACQ_REL) == 0){
+		free_classifier_table(t);
+	}
+}
+
+int swap_classifier(classifier *c,classifier_table *t){
+	classifier_table *old;
+
+	if(Pthread_mutex_lock(&c->lock)){
+		return -1;
+	}
+	old = c->cur;
+	t->refs = 1;
+	c->cur = t;
+	Pthread_mutex_unlock(&c->lock);
+	release_classifier(c,old);
+	return 0;
+}
+
+int update_classifier(classifier *c,const classifier_rule *rules,unsigned count){
+	classifier_table *t;
+
+	if((t = compile_classifier(rules,count)) == NULL){
+		return -1;
+	}
+	if(swap_classifier(c,t)){
+		free_classifier_table(t);
+		return -1;
+	}
+	return 0;
+}
+
+int classify(classifier *c,const flowkey *fk){
+	classifier_table *t;
+	int ret = -1;
+
+	if( (t = acquire_classifier(c)) ){
+		ret = classify_table(t,fk);
+		release_classifier(c,t);
+	}
+	return ret;
+}
+
+void classify_batch(classifier *c,const flowkey *fks,int *results,unsigned count){
+	classifier_table *t;
+
+	if( (t = acquire_classifier(c)) ){
+		classify_table_batch(t,fks,results,count);
+		release_classifier(c,t);
+	}else{
+		unsigned z;
+
+		for(z = 0 ; z < count ; ++z){
+			results[z] = -1;
+		}
+	}
+}
+
+// Any outstanding readers must have released their tables.
+void free_classifier(classifier *c){
+	if(c){
+		release_classifier(c,c->cur);
+		Pthread_mutex_destroy(&c->lock);
+		Free(c);
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef LIBDANK_OBJECTS_CLASSIFIER
+#define LIBDANK_OBJECTS_CLASSIFIER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct ipset;
+struct portset;
+struct classifier;
+struct classifier_table;
+
+// A rule matches flows whose fields lie within each of its sets. NULL sets
+// match anything; empty sets match nothing. A negative protocol matches any.
+// Rules are ordered by priority: the first matching rule wins.
+typedef struct classifier_rule {
+	const struct ipset *src,*dst;
+	const struct portset *sport,*dport;
+	int proto;
+} classifier_rule;
+
+// Everything is host-byte order, as with ipset and portset.
+typedef struct flowkey {
+	uint32_t saddr,daddr;
+	uint16_t sport,dport;
+	uint8_t proto;
+} flowkey;
+
+// Compile an ordered rule list into a decision tree (ala HyperSplit): each
+// interior node bisects one field's range, and leaves hold a handful of rules
+// to be checked in priority order. Rules spanning several ranges in some field
+// are expanded into the cross product of their ranges. The rules' sets are not
+// referenced after compilation.
+struct classifier_table *compile_classifier(const classifier_rule *,unsigned);
+void free_classifier_table(struct classifier_table *);
+
+// Returns the index of the first matching rule, or -1 if none match.
+int classify_table(const struct classifier_table *,const flowkey *);
+// Classify each of n flows, writing results to the corresponding elements of
+// the output vector. Flows descend the tree in lockstep, prefetching nodes.
+void classify_table_batch(const struct classifier_table *,const flowkey *,
+				int *,unsigned);
+
+// Diagnostic functions -- query the number of tree nodes, or expanded rules
+unsigned nodes_classifier_table(const struct classifier_table *);
+unsigned subrules_classifier_table(const struct classifier_table *);
+
+// A classifier wraps a reference-counted table, allowing rule updates to be
+// compiled (in any thread, at leisure) while classification continues against
+// the previous table. Installing the new table is a pointer swap; the old
+// table is freed once the last reader releases it.
+struct classifier *create_classifier(void);
+void free_classifier(struct classifier *);
+
+// Compile the rules and install the result. On failure, the existing table
+// (if any) remains in place.
+int update_classifier(struct classifier *,const classifier_rule *,unsigned);
+// Install a compiled table, taking ownership of it.
+int swap_classifier(struct classifier *,struct classifier_table *);
+
+// Readers holding a table across many lookups avoid the classifier's lock.
+// acquire_classifier() returns NULL if no table has been installed. Releasing
+// is lock-free; acquiring takes the lock.
+struct classifier_table *acquire_classifier(struct classifier *);
+void release_classifier(struct classifier *,struct classifier_table *);
+
+// Conveniences which acquire and release the table about each call. Every
+// call thus takes the classifier's lock, serializing concurrent callers; they
+// are the slow path. Hot (per-flow) callers ought hold the table via
+// acquire_classifier() across many lookups, using classify_table() and
+// classify_table_batch(), and reacquire it periodically to pick up updates.
+int classify(struct classifier *,const flowkey *);
+void classify_batch(struct classifier *,const flowkey *,int *,unsigned);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
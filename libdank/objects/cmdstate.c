@@ -1,13 +1,20 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 #include <libdank/utils/fds.h>
+#include <libdank/utils/string.h>
 #include <libdank/utils/netio.h>
 #include <libdank/utils/syswrap.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/objects/logctx.h>
 #include <libdank/objects/cmdstate.h>
 #include <libdank/objects/objustring.h>
+#include <libdank/modules/ctlserver/ctlproto.h>
 
 void init_cmd_state(cmd_state *cs,int sd,int errsd){
 	memset(cs,0,sizeof(*cs));
@@ -15,63 +22,417 @@ void init_cmd_state(cmd_state *cs,int sd,int errsd){
 	cs->sd = sd;
 }
 
+cmd_pipe *create_cmd_pipe(int sd,int errsd,int wakefd){
+	cmd_pipe *cp;
+
+	if((cp = Malloc("cmd pipe",sizeof(*cp))) == NULL){
+		return NULL;
+	}
+	if(pthread_mutex_init(&cp->lock,NULL)){
+		bitch("Couldn't initialize mutex\n");
+		Free(cp);
+		return NULL;
+	}
+	cp->sd = sd;
+	cp->errsd = errsd;
+	cp->refcount = 1;
+	cp->inflight = 0;
+	cp->stalled = 0;
+	cp->wakefd = wakefd;
+	return cp;
+}
+
+int release_cmd_pipe(cmd_pipe *cp){
+	int ret = 0;
+
+	if(__atomic_sub_fetch(&cp->refcount,1,__ATOMIC_ACQ_REL)){
+		return 0;
+	}
+	nag("Closing pipelined sd's %d and %d\n",cp->sd,cp->errsd);
+	ret |= Close(cp->sd);
+	ret |= Close(cp->errsd);
+	pthread_mutex_destroy(&cp->lock);
+	Free(cp);
+	return ret;
+}
+
+void init_piped_cmd_state(cmd_state *cs,cmd_pipe *cp,uint32_t id,char *input,size_t inlen){
+	init_cmd_state(cs,cp->sd,cp->errsd);
+	__atomic_add_fetch(&cp->refcount,1,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&cp->inflight,1,__ATOMIC_SEQ_CST);
+	cs->pipe = cp;
+	cs->reqid = id;
+	cs->input = input;
+	cs->inlen = inlen;
+}
+
+// iov[0] is reserved for a frame header, used only if the command is piped
+static int
+emit_cmd_output(cmd_state *cs,uint32_t status,struct iovec *iov,int iovcnt){
+	ctlframe hdr;
+	size_t len;
+	int ret,i;
+
+	if(cs->pipe == NULL){
+		return Writevn(cs->sd,iov + 1,iovcnt - 1);
+	}
+	for(len = 0, i = 1 ; i < iovcnt ; ++i){
+		len += iov[i].iov_len;
+	}
+	hdr.len = htonl((uint32_t)len);
+	hdr.id = htonl(cs->reqid);
+	hdr.status = htonl(status);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	// Frames of concurrent commands mustn't interleave. Only drones write
+	// frames (never the ctl evthread), but each blocks here while the
+	// client isn't reading; the ctl evthread bounds how many drones one
+	// connection can hold this way (see stall_cmd_pipe()).
+	pthread_mutex_lock(&cs->pipe->lock);
+	ret = Writevn(cs->sd,iov,iovcnt);
+	pthread_mutex_unlock(&cs->pipe->lock);
+	return ret;
+}
+
+// The stall is published before inflight is rechecked, and completions
+// decrement inflight before checking for a stall, so one side or the other
+// sees the wakeup is needed.
+int stall_cmd_pipe(cmd_pipe *cp,unsigned limit){
+	if(__atomic_load_n(&cp->inflight,__ATOMIC_SEQ_CST) < limit){
+		return 0;
+	}
+	__atomic_store_n(&cp->stalled,1,__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&cp->inflight,__ATOMIC_SEQ_CST) < limit){
+		__atomic_store_n(&cp->stalled,0,__ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+complete_piped_cmd(cmd_pipe *cp){
+	const char wake = 0;
+
+	__atomic_sub_fetch(&cp->inflight,1,__ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(&cp->stalled,0,__ATOMIC_SEQ_CST) && cp->wakefd >= 0){
+		// EAGAIN means a wakeup is already pending
+		if(write(cp->wakefd,&wake,sizeof(wake)) < 0 && errno != EAGAIN){
+			moan("Couldn't wake stalled sd %d\n",cp->sd);
+		}
+	}
+}
+
+int cmd_flush(cmd_state *cs){
+	struct iovec iov[2];
+
+	if(cs->olen == 0){
+		return 0;
+	}
+	iov[1].iov_base = cs->obuf;
+	iov[1].iov_len = cs->olen;
+	cs->olen = 0;
+	return emit_cmd_output(cs,CTLFRAME_MORE,iov,2);
+}
+
 int close_cmd_state(cmd_state *cs){
 	int ret = 0;
 
-	nag("Closing sd's %d and %d\n",cs->sd,cs->errsd);
-	if(cs->sd >= 0){
-		ret |= Close(cs->sd);
-		cs->sd = -1;
+	if(cs->pipe){
+		struct iovec iov[1];
+
+		nag("Completing request %u on %d\n",cs->reqid,cs->sd);
+		ret |= cmd_flush(cs);
+		ret |= emit_cmd_output(cs,cs->status,iov,1);
+		complete_piped_cmd(cs->pipe);
+		ret |= release_cmd_pipe(cs->pipe);
+		cs->pipe = NULL;
+		cs->sd = cs->errsd = -1;
+		Free(cs->input);
+		cs->input = NULL;
+	}else{
+		nag("Closing sd's %d and %d\n",cs->sd,cs->errsd);
+		if(cs->sd >= 0){
+			ret |= cmd_flush(cs);
+			ret |= Close(cs->sd);
+			cs->sd = -1;
+		}
+		if(cs->errsd >= 0){
+			ret |= Close(cs->errsd);
+			cs->errsd = -1;
+		}
 	}
-	if(cs->errsd >= 0){
-		ret |= Close(cs->errsd);
-		cs->errsd = -1;
+	Free(cs->obuf);
+	cs->obuf = NULL;
+	cs->olen = 0;
+	return ret;
+}
+
+int cmd_write(cmd_state *cs,const void *buf,size_t s){
+	struct iovec iov[3];
+
+	if(s <= CMD_OUTBUF_SIZE - cs->olen){
+		if(cs->obuf == NULL){
+			if((cs->obuf = Malloc("cmd output",CMD_OUTBUF_SIZE)) == NULL){
+				return -1;
+			}
+		}
+		memcpy(cs->obuf + cs->olen,buf,s);
+		if((cs->olen += s) < CMD_OUTBUF_SIZE){
+			return 0;
+		}
+		return cmd_flush(cs);
+	}
+	// Doesn't fit; send it along with whatever's buffered
+	iov[1].iov_base = cs->obuf;
+	iov[1].iov_len = cs->olen;
+	iov[2].iov_base = (void *)(uintptr_t)buf; // writev() won't modify it
+	iov[2].iov_len = s;
+	cs->olen = 0;
+	return emit_cmd_output(cs,CTLFRAME_MORE,iov,3);
+}
+
+int cmd_printf(cmd_state *cs,const char *fmt,...){
+	ustring u = USTRING_INITIALIZER;
+	va_list ap;
+	int ret;
+
+	if(cs->obuf || (cs->obuf = Malloc("cmd output",CMD_OUTBUF_SIZE))){
+		va_start(ap,fmt);
+		ret = vsnprintf(cs->obuf + cs->olen,CMD_OUTBUF_SIZE - cs->olen,fmt,ap);
+		va_end(ap);
+		if(ret >= 0 && (size_t)ret < CMD_OUTBUF_SIZE - cs->olen){
+			if((cs->olen += (size_t)ret) < CMD_OUTBUF_SIZE - 1){
+				return 0;
+			}
+			return cmd_flush(cs);
+		}
+	}
+	// Didn't fit in the chunk; format it on the heap
+	va_start(ap,fmt);
+	ret = vprintUString(&u,fmt,ap);
+	va_end(ap);
+	if(ret >= 0){
+		ret = cmd_write(cs,u.string,u.current);
+	}
+	reset_ustring(&u);
+	return ret < 0 ? -1 : 0;
+}
+
+int cmd_write_ustring(cmd_state *cs,ustring *u){
+	int ret;
+
+	if(u->current == 0){
+		return 0;
+	}
+	ret = cmd_write(cs,u->string,u->current);
+	u->current = 0;
+	if(u->string){
+		u->string[0] = '\0';
 	}
 	return ret;
 }
 
-// FIXME speed this up; we do it this retarded way now
-FILE *suck_socket_tmpfile(cmd_state *cs){
-	unsigned tot = 0;
-	FILE *tmp;
+// Memory-backed until CMD_INPUT_INCORE, and a scratch map thereafter
+static int
+grow_cmd_input(char **buf,size_t len,size_t *size,int *fd){
+	size_t nsize = *size * 2;
+	char *tmp;
 
-	if((tmp = Tmpfile()) == NULL){
-		return NULL;
+	if(*fd < 0 && nsize <= CMD_INPUT_INCORE){
+		if((tmp = Realloc("cmd input",*buf,nsize)) == NULL){
+			return -1;
+		}
+	}else if(*fd < 0){
+		FILE *fp;
+
+		if((fp = Tmpfile()) == NULL){
+			return -1;
+		}
+		*fd = Dup(fileno(fp));
+		Fclose(fp);
+		if(*fd < 0){
+			return -1;
+		}
+		if((tmp = mremap_and_truncate(*fd,NULL,0,nsize,PROT_READ|PROT_WRITE,
+						MAP_SHARED)) == MAP_FAILED){
+			Close(*fd);
+			*fd = -1;
+			return -1;
+		}
+		nag("Spilling %zu bytes of input to a scratch file\n",len);
+		memcpy(tmp,*buf,len);
+		Free(*buf);
+	}else if((tmp = mremap_and_truncate(*fd,*buf,*size,nsize,PROT_READ|PROT_WRITE,
+						MAP_SHARED)) == MAP_FAILED){
+		return -1;
+	}
+	*buf = tmp;
+	*size = nsize;
+	return 0;
+}
+
+// If scratchfd is non-NULL, input which spilled leaves its scratch file open
+// there (otherwise, *scratchfd is set to -1).
+static int
+suck_cmd_input_fd(cmd_state *cs,cmd_input *in,int *scratchfd){
+	size_t size = BUFSIZ;
+	int fd = -1;
+	char *buf;
+
+	if(scratchfd){
+		*scratchfd = -1;
+	}
+	memset(in,0,sizeof(*in));
+	// Pipelined commands' input arrived with the request
+	if(cs->input){
+		const char *nul;
+
+		in->data = cs->input;
+		if( (nul = memchr(cs->input,'\0',cs->inlen)) ){
+			in->len = (size_t)(nul - cs->input);
+		}else{
+			in->len = cs->inlen;
+		}
+		cs->input = NULL;
+		return 0;
+	}
+	if((buf = Malloc("cmd input",size)) == NULL){
+		return -1;
 	}
 	for( ; ; ){
-		ssize_t s;
-		char c;
+		const char *nul;
+		ssize_t r;
 
-		if((s = read(cs->sd,&c,1)) == 0){
+		// Always leave room for the terminator
+		if(size - in->len < BUFSIZ){
+			if(grow_cmd_input(&buf,in->len,&size,&fd)){
+				goto err;
+			}
+		}
+		if((r = read(cs->sd,buf + in->len,size - in->len - 1)) == 0){
 			break;
-		}else if(s < 0){
+		}else if(r < 0){
 			if(errno == EINTR){
 				continue;
 			}
 			moan("Couldn't read from socket %d\n",cs->sd);
-			fclose(tmp);
-			return NULL;
+			goto err;
 		}
-		if(c == '\0'){
+		if( (nul = memchr(buf + in->len,'\0',(size_t)r)) ){
+			in->len = (size_t)(nul - buf);
 			break;
+		}
+		in->len += (size_t)r;
+	}
+	buf[in->len] = '\0';
+	in->data = buf;
+	if(fd >= 0){
+		in->maplen = size;
+		if(scratchfd){
+			*scratchfd = fd;
 		}else{
-			if(fwrite(&c,1,1,tmp) != 1){
-				moan("Couldn't write 1b to tmpfile\n");
-				fclose(tmp);
-				return NULL;
-			}
+			Close(fd); // the map remains valid
 		}
-		++tot;
+	}
+	nag("Read %zu bytes of input\n",in->len);
+	return 0;
+
+err:
+	if(fd >= 0){
+		mremap_munmap(buf,size);
+		Close(fd);
+	}else{
+		Free(buf);
+	}
+	return -1;
+}
+
+int suck_cmd_input(cmd_state *cs,cmd_input *in){
+	return suck_cmd_input_fd(cs,in,NULL);
+}
+
+void release_cmd_input(cmd_input *in){
+	if(in->maplen){
+		mremap_munmap(in->data,in->maplen);
+	}else{
+		Free(in->data);
+	}
+	memset(in,0,sizeof(*in));
+}
+
+// Input which spilled is already in a scratch file; trim it to the input, and
+// hand it over (rewound: growing it moved the offset). Otherwise, copy the
+// input to a new one.
+static FILE *
+scratch_tmpfile(cmd_input *in,int fd){
+	size_t len = in->len;
+	FILE *tmp;
+
+	release_cmd_input(in);
+	if(Ftruncate(fd,(off_t)len)){
+		Close(fd);
+		return NULL;
+	}
+	if((tmp = Fdopen(fd,"r+")) == NULL){
+		Close(fd);
+		return NULL;
 	}
 	if(fseek(tmp,0,SEEK_SET)){
 		moan("Couldn't seek within tmpfile\n");
 		fclose(tmp);
 		return NULL;
 	}
-	nag("Wrote temporary file of %u bytes\n",tot);
+	return tmp;
+}
+
+FILE *suck_socket_tmpfile(cmd_state *cs){
+	cmd_input in;
+	FILE *tmp;
+	int fd;
+
+	if(suck_cmd_input_fd(cs,&in,&fd)){
+		return NULL;
+	}
+	if(fd >= 0){
+		return scratch_tmpfile(&in,fd);
+	}
+	if((tmp = Tmpfile()) == NULL){
+		release_cmd_input(&in);
+		return NULL;
+	}
+	if(in.len && fwrite(in.data,1,in.len,tmp) != in.len){
+		moan("Couldn't write %zub to tmpfile\n",in.len);
+		release_cmd_input(&in);
+		fclose(tmp);
+		return NULL;
+	}
+	release_cmd_input(&in);
+	if(fseek(tmp,0,SEEK_SET)){
+		moan("Couldn't seek within tmpfile\n");
+		fclose(tmp);
+		return NULL;
+	}
 	return tmp;
 }
 
 int dynsuck_socket_line(cmd_state *cs,char **buf){
-	return read_socket_dynline(cs->sd,buf);
+	const char *end;
+	size_t len;
+
+	if(cs->pipe == NULL){
+		return read_socket_dynline(cs->sd,buf);
+	}
+	// Pipelined input arrived with the request; the sd carries other frames
+	*buf = NULL;
+	if(cs->input == NULL || (len = strcspn(cs->input,"\n")) == 0){
+		return -1;
+	}
+	if((*buf = Strndup(cs->input,len)) == NULL){
+		return -1;
+	}
+	end = cs->input + len + (cs->input[len] == '\n');
+	cs->inlen -= (size_t)(end - cs->input);
+	memmove(cs->input,end,cs->inlen);
+	cs->input[cs->inlen] = '\0';
+	return 0;
 }
@@ -6,16 +6,90 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct ustring;
+
+// Output written with cmd_write() or cmd_printf() is buffered in chunks of
+// CMD_OUTBUF_SIZE, each sent to sd as it fills, so that large dumps needn't
+// accumulate in memory. Writes too large for the chunk are sent directly,
+// along with the chunk, using a single writev(2).
+#define CMD_OUTBUF_SIZE 16384
+
+// A pipelined connection, shared by its in-flight commands (see
+// modules/ctlserver/ctlproto.h). Their output is framed, and the descriptors
+// are closed with the last reference.
+//
+// Commands writing to a client which has stopped reading block, so the
+// reader limits each pipe's in-flight commands with stall_cmd_pipe(). Once a
+// stalled pipe's command completes, a byte is written to wakefd (if
+// nonnegative; it ought be nonblocking).
+typedef struct cmd_pipe {
+	int sd,errsd;
+	unsigned refcount;
+	pthread_mutex_t lock;	// serializes frames
+	unsigned inflight;	// commands not yet closed
+	int stalled;
+	int wakefd;
+} cmd_pipe;
+
+// Takes ownership of sd and errsd (but not wakefd), returning with a single
+// reference.
+cmd_pipe *create_cmd_pipe(int,int,int);
+int release_cmd_pipe(cmd_pipe *);
+
+// Returns 1 if the pipe has at least the specified number of commands in
+// flight, in which case wakefd will be written once one completes; 0
+// otherwise.
+int stall_cmd_pipe(cmd_pipe *,unsigned);
 
 // both sd's are guaranteed to be valid, but not necessarily distinct.
 typedef struct cmd_state {
 	int sd,errsd;
 	int sent_success; // used for log_dump
+	char *obuf;	// streaming output chunk, allocated on first write
+	size_t olen;
+	// Pipelined commands only: the shared connection, the request's id and
+	// status (for the final frame), and its input.
+	cmd_pipe *pipe;
+	uint32_t reqid,status;
+	char *input;
+	size_t inlen;
 } cmd_state;
 
 void init_cmd_state(cmd_state *,int,int);
+// Takes a reference on the pipe, and ownership of the (heap-allocated,
+// NUL-terminated) input.
+void init_piped_cmd_state(cmd_state *,cmd_pipe *,uint32_t,char *,size_t);
+// Flushes any streamed output prior to closing the sd's. Pipelined commands
+// instead send their final frame, and release the pipe.
 int close_cmd_state(cmd_state *);
 
+int cmd_write(cmd_state *,const void *,size_t);
+int cmd_printf(cmd_state *,const char *,...)
+	__attribute__ ((format (printf,2,3)));
+int cmd_flush(cmd_state *);
+// Sends the ustring's contents (following any buffered output), and empties
+// it. Handlers building output in lc->out can use this to send as they go.
+int cmd_write_ustring(cmd_state *,struct ustring *);
+
+// The command's input, read to EOF or the first NUL, with large reads
+// directly into memory. Input beyond CMD_INPUT_INCORE spills to an unlinked
+// scratch file, which is mapped in its place. data is always NUL-terminated.
+#define CMD_INPUT_INCORE (1024 * 1024)
+
+typedef struct cmd_input {
+	char *data;
+	size_t len;
+	size_t maplen;	// nonzero iff data maps a scratch file
+} cmd_input;
+
+int suck_cmd_input(cmd_state *,cmd_input *);
+void release_cmd_input(cmd_input *);
+
+// The command's input as an unlinked temporary file, positioned at its start.
+// Input which spilled is returned in its scratch file, without a copy.
 FILE *suck_socket_tmpfile(cmd_state *);
 int dynsuck_socket_line(cmd_state *,char **);
 
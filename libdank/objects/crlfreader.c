@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <string.h>
 #include <unistd.h>
 #include <libdank/utils/string.h>
 #include <libdank/utils/syswrap.h>
@@ -60,6 +61,9 @@ void reset_crlf_reader(crlf_reader *cr){
 	}
 }
 
+// Data is read to the end of the buffer. Unconsumed data is slid back to
+// the front only once the buffer's tail is exhausted, rather than on every
+// read; the buffer grows only when unconsumed data fills it.
 static crlf_read_res
 read_cr_data(crlf_reader *cr,int sd){
 	char *readstart;
@@ -69,24 +73,22 @@ read_cr_data(crlf_reader *cr,int sd){
 	if(cr->eof){
 		return CRLF_READ_EOF;
 	}
-	if(cr->count == cr->total){
-		errno = 0;
-		if(grow_buf(cr)){
-			if(errno == ENOMEM){
-				return CRLF_READ_SYSERR;
+	if(cr->base + cr->count == cr->total){
+		if(cr->base){
+			memmove(cr->buf,cr->buf + cr->base,cr->count);
+			cr->base = 0;
+		}else{
+			errno = 0;
+			if(grow_buf(cr)){
+				if(errno == ENOMEM){
+					return CRLF_READ_SYSERR;
+				}
+				return CRLF_READ_LONGLINE;
 			}
-			return CRLF_READ_LONGLINE;
 		}
 	}
-	if(cr->count > cr->base){
-		memmove(cr->buf,cr->buf + cr->base,cr->count);
-	}else if(cr->base && cr->count){
-		memcpy(cr->buf,cr->buf + cr->base,cr->count);
-	}
-	cr->base = 0;
-	tlen = cr->total - cr->count;
-	readstart = cr->buf + cr->count; // cr->base = 0 from above
-	// nag("Reading %x from %d:%p + %x\n",tlen,sd,cr->buf,cr->count);
+	readstart = cr->buf + cr->base + cr->count;
+	tlen = cr->total - cr->base - cr->count;
 	cr->readreq = 0;
 	while((ret = read(sd,readstart,tlen)) < 0){ // loop on EINTR
 		if(errno == EAGAIN || errno == EWOULDBLOCK){
@@ -112,12 +114,11 @@ read_cr_data(crlf_reader *cr,int sd){
 // we have a more complicated issue due to the dual-character line ending
 // (CRLF, 0x0d 0x0a).  no watching for comments, though, or trimming leading
 // whitespace.
-crlf_read_res read_crlf_line(crlf_reader *cr,int sd){
-	char *linefeed = NULL;
+crlf_read_res read_crlf_view(crlf_reader *cr,int sd){
 	crlf_read_res res;
 
 	for( ; ; ){
-		char *examstart,*bufstart;
+		char *examstart,*bufstart,*linefeed;
 		size_t slen;
 
 		// we need to read more if everything's been examined.
@@ -132,37 +133,24 @@ crlf_read_res read_crlf_line(crlf_reader *cr,int sd){
 				return res;
 			}
 		}
-		// cr->count - cr->examined > 0. look for a CRLF
+		// cr->count - cr->examined > 0. look for a CRLF. memchr() is
+		// vectorized by libc, unlike strnchr().
 		slen = cr->count - cr->examined;
 		bufstart = cr->buf + cr->base;
 		examstart = bufstart + cr->examined;
-		linefeed = strnchr(examstart,'\xa',slen);
+		linefeed = memchr(examstart,'\xa',slen);
 		if(linefeed == NULL){
 			cr->examined = cr->count;
-		// special case; if we're at the beginning of a new
-		// read, check the previous char *unless* there was no
-		// previously-examined read, which is unsafe + useless
-		}else if(cr->examined == 0 && linefeed == bufstart){
-			cr->examined = 1;
-		}else if(*(linefeed - 1) != '\xd'){
+		// a linefeed leading the buffer can't follow a CR
+		}else if(linefeed == bufstart || *(linefeed - 1) != '\xd'){
 			cr->examined = linefeed - bufstart + 1;
 		}else{
-			char *newbuf;
-			size_t len;
+			size_t len = linefeed - bufstart + 1;
 
-			// we want to retain length + 1 (for artificial
-			// null byte) but return only length, so
-			// allocate yet another + 1 after this.
-			len = linefeed - bufstart + 1;
-			if((newbuf = Malloc("recv copy",len + 1)) == NULL){
-				return CRLF_READ_SYSERR;
-			}
-			memcpy(newbuf,bufstart,len);
-			newbuf[len] = '\0';
-			cr->iv.iov_base = newbuf;
+			cr->iv.iov_base = bufstart;
 			cr->iv.iov_len = len;
 			cr->count -= len;
-			cr->base += len;
+			cr->base = cr->count ? cr->base + len : 0;
 			cr->examined = 0;
 			if(cr->count || cr->eof){
 				return CRLF_READ_MOREDATA;
@@ -172,3 +160,22 @@ crlf_read_res read_crlf_line(crlf_reader *cr,int sd){
 		}
 	}
 }
+
+crlf_read_res read_crlf_line(crlf_reader *cr,int sd){
+	crlf_read_res res;
+	char *newbuf;
+
+	res = read_crlf_view(cr,sd);
+	if(res != CRLF_READ_SUCCESS && res != CRLF_READ_MOREDATA){
+		return res;
+	}
+	// we want to retain length + 1 (for artificial null byte) but
+	// return only length.
+	if((newbuf = Malloc("recv copy",cr->iv.iov_len + 1)) == NULL){
+		return CRLF_READ_SYSERR;
+	}
+	memcpy(newbuf,cr->iv.iov_base,cr->iv.iov_len);
+	newbuf[cr->iv.iov_len] = '\0';
+	cr->iv.iov_base = newbuf;
+	return res;
+}
@@ -54,6 +54,11 @@ typedef enum {
 // free()d in this case. On error, the reader still must be cleaned up.
 crlf_read_res read_crlf_line(crlf_reader *,int);
 
+// As read_crlf_line(), but iv is a view into the reader's buffer, valid only
+// until the next call on the reader. It is not NUL-terminated, and mustn't
+// be freed. This avoids an allocation and copy per line.
+crlf_read_res read_crlf_view(crlf_reader *,int);
+
 void reset_crlf_reader(crlf_reader *);
 
 #ifdef __cplusplus
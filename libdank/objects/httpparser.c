@@ -0,0 +1,487 @@
+#include <string.h>
+#include <strings.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/httpparser.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+enum {
+	HTTP_STATE_START,
+	HTTP_STATE_HEADERS,
+	HTTP_STATE_BODY,
+	HTTP_STATE_CHUNK_SIZE,
+	HTTP_STATE_CHUNK_DATA,
+	HTTP_STATE_CHUNK_END,
+	HTTP_STATE_TRAILERS,
+	HTTP_STATE_DONE,
+	HTTP_STATE_ERROR,
+};
+
+// Character classes, per RFC 9110 5.6.2 (tchar) and 5.5 (field-vchar,
+// including obs-text).
+#define HC_TCHAR	0x01	// token constituent
+#define HC_VALUE	0x02	// allowed in field values (including SP and HTAB)
+#define HC_VISIBLE	0x04	// visible, ie allowed in the request-target
+
+#define T (HC_TCHAR | HC_VALUE | HC_VISIBLE)
+#define V (HC_VALUE | HC_VISIBLE)
+
+static const unsigned char http_ctype[256] = {
+	['\t'] = HC_VALUE,
+	[' '] = HC_VALUE,
+	['!'] = T,
+	['"'] = V,
+	['#' ... '\''] = T,
+	['(' ... ')'] = V,
+	['*' ... '+'] = T,
+	[','] = V,
+	['-' ... '.'] = T,
+	['/'] = V,
+	['0' ... '9'] = T,
+	[':' ... '@'] = V,
+	['A' ... 'Z'] = T,
+	['[' ... ']'] = V,
+	['^' ... 'z'] = T,
+	['{'] = V,
+	['|'] = T,
+	['}'] = V,
+	['~'] = T,
+	[0x80 ... 0xff] = V,
+};
+
+#undef V
+#undef T
+
+static inline int
+http_class(char c,unsigned char class){
+	return http_ctype[(unsigned char)c] & class;
+}
+
+// Length of the initial run of s having the class
+static inline size_t
+http_span_class(const char *s,size_t len,unsigned char class){
+	size_t i;
+
+	for(i = 0 ; i < len && http_class(s[i],class) ; ++i){
+		;
+	}
+	return i;
+}
+
+// Field values make up the bulk of most messages. With SSE4.2, PCMPESTRI
+// finds the first disallowed byte (any control aside from HTAB, or DEL)
+// sixteen bytes at a time, leaving only the tail to the table.
+static size_t
+http_span_value(const char *s,size_t len){
+	size_t i = 0;
+#ifdef __SSE4_2__
+	static const char ranges[16] __attribute__ ((aligned (16))) =
+		{ '\x00', '\x08', '\x0a', '\x1f', '\x7f', '\x7f', };
+	const __m128i r = _mm_load_si128((const __m128i *)ranges);
+
+	while(len - i >= 16){
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+		int idx = _mm_cmpestri(r,6,b,16,_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+					_SIDD_LEAST_SIGNIFICANT);
+
+		if(idx != 16){
+			return i + (size_t)idx;
+		}
+		i += 16;
+	}
+#endif
+	return i + http_span_class(s + i,len - i,HC_VALUE);
+}
+
+static void
+init_http_parser(http_parser *hp,int response){
+	memset(hp,0,sizeof(*hp));
+	hp->response = response;
+	hp->state = HTTP_STATE_START;
+}
+
+void init_http_request_parser(http_parser *hp){
+	init_http_parser(hp,0);
+}
+
+void init_http_response_parser(http_parser *hp){
+	init_http_parser(hp,1);
+}
+
+void http_parser_rebase(http_parser *hp,size_t n){
+	hp->pos -= n;
+	hp->scanned = hp->scanned > n ? hp->scanned - n : 0;
+}
+
+// Finds the line at pos, less its line ending. 1 if a complete line is
+// available (and *next is set past it), 0 if more data is needed, and -1 if
+// the line is too long. Data already searched isn't searched again.
+static int
+next_http_line(http_parser *hp,const char *buf,size_t len,size_t *llen,size_t *next){
+	const char *nl;
+	size_t from;
+
+	from = hp->scanned > hp->pos ? hp->scanned : hp->pos;
+	if(from < len && (nl = memchr(buf + from,'\n',len - from))){
+		*next = (size_t)(nl - buf) + 1;
+		*llen = (size_t)(nl - buf) - hp->pos;
+		if(*llen && buf[hp->pos + *llen - 1] == '\r'){
+			--*llen;
+		}
+		hp->scanned = *next;
+		return *llen > HTTP_MAX_LINE ? -1 : 1;
+	}
+	hp->scanned = len;
+	return len - hp->pos > HTTP_MAX_LINE ? -1 : 0;
+}
+
+// "HTTP/1.x"
+static int
+parse_http_version(http_parser *hp,const char *s,size_t len){
+	if(len != 8 || memcmp(s,"HTTP/1.",7) || s[7] < '0' || s[7] > '9'){
+		return -1;
+	}
+	hp->version = 10 + (unsigned)(s[7] - '0');
+	return 0;
+}
+
+// method SP request-target SP HTTP-version, at off within buf
+static int
+parse_request_line(http_parser *hp,const char *buf,size_t off,size_t len){
+	const char *line = buf + off;
+	size_t m,t;
+
+	if((m = http_span_class(line,len,HC_TCHAR)) == 0 || m == len || line[m] != ' '){
+		return -1;
+	}
+	t = http_span_class(line + m + 1,len - m - 1,HC_VISIBLE);
+	if(t == 0 || m + 1 + t == len || line[m + 1 + t] != ' '){
+		return -1;
+	}
+	hp->method.off = off;
+	hp->method.len = m;
+	hp->target.off = off + m + 1;
+	hp->target.len = t;
+	return parse_http_version(hp,line + m + t + 2,len - m - t - 2);
+}
+
+// HTTP-version SP status-code SP [ reason-phrase ]
+static int
+parse_status_line(http_parser *hp,const char *buf,size_t off,size_t len){
+	const char *line = buf + off;
+	size_t z;
+
+	if(len < 12 || line[8] != ' ' || parse_http_version(hp,line,8)){
+		return -1;
+	}
+	for(hp->status = 0, z = 9 ; z < 12 ; ++z){
+		if(line[z] < '0' || line[z] > '9'){
+			return -1;
+		}
+		hp->status = hp->status * 10 + (unsigned)(line[z] - '0');
+	}
+	if(hp->status < 100){
+		return -1;
+	}
+	// Some servers omit the SP preceding an empty reason
+	if(len > 12 && line[12] != ' '){
+		return -1;
+	}
+	hp->reason.off = off + (len > 12 ? 13 : 12);
+	hp->reason.len = len > 12 ? len - 13 : 0;
+	if(http_span_value(line + 12,len - 12) != len - 12){
+		return -1;
+	}
+	return 0;
+}
+
+// field-name ":" OWS field-value OWS
+static int
+parse_field(const char *buf,size_t off,size_t len,http_header *h){
+	const char *line = buf + off;
+	size_t n,v,vlen;
+
+	if((n = http_span_class(line,len,HC_TCHAR)) == 0 || n == len || line[n] != ':'){
+		return -1;
+	}
+	for(v = n + 1 ; v < len && (line[v] == ' ' || line[v] == '\t') ; ++v){
+		;
+	}
+	if(http_span_value(line + v,len - v) != len - v){
+		return -1;
+	}
+	for(vlen = len - v ; vlen && (line[v + vlen - 1] == ' ' || line[v + vlen - 1] == '\t') ; --vlen){
+		;
+	}
+	h->name.off = off;
+	h->name.len = n;
+	h->value.off = off + v;
+	h->value.len = vlen;
+	return 0;
+}
+
+static int
+parse_content_length(const char *s,size_t len,uint64_t *cl){
+	uint64_t v = 0;
+	size_t z;
+
+	if(len == 0){
+		return -1;
+	}
+	for(z = 0 ; z < len ; ++z){
+		if(s[z] < '0' || s[z] > '9' || v > (UINT64_MAX - 9) / 10){
+			return -1;
+		}
+		v = v * 10 + (uint64_t)(s[z] - '0');
+	}
+	*cl = v;
+	return 0;
+}
+
+// Is chunked the final transfer coding listed?
+static int
+chunked_is_final(const char *s,size_t len){
+	const char *comma;
+	size_t z;
+
+	if( (comma = memrchr(s,',',len)) ){
+		len -= (size_t)(comma + 1 - s);
+		s = comma + 1;
+	}
+	for(z = 0 ; z < len && (s[z] == ' ' || s[z] == '\t') ; ++z){
+		;
+	}
+	return len - z == 7 && strncasecmp(s + z,"chunked",7) == 0;
+}
+
+// Notes the framing headers as they go by
+static int
+note_field(http_parser *hp,const char *buf,const http_header *h){
+	const char *name = buf + h->name.off,*value = buf + h->value.off;
+
+	if(h->name.len == 17 && strncasecmp(name,"transfer-encoding",17) == 0){
+		hp->chunked_te = 1 + chunked_is_final(value,h->value.len);
+	}else if(h->name.len == 14 && strncasecmp(name,"content-length",14) == 0){
+		uint64_t cl;
+
+		if(parse_content_length(value,h->value.len,&cl)){
+			return -1;
+		}
+		if(hp->have_length && cl != hp->content_length){
+			return -1;
+		}
+		hp->have_length = 1;
+		hp->content_length = cl;
+	}
+	return 0;
+}
+
+// RFC 9112 6.3
+static int
+determine_body(http_parser *hp){
+	if(hp->response && (hp->nobody || hp->status < 200 ||
+				hp->status == 204 || hp->status == 304)){
+		hp->bodytype = HTTP_BODY_NONE;
+	}else if(hp->chunked_te == 2){
+		hp->bodytype = HTTP_BODY_CHUNKED;
+	}else if(hp->chunked_te){
+		if(!hp->response){
+			return -1;
+		}
+		hp->bodytype = HTTP_BODY_CLOSE;
+	}else if(hp->have_length){
+		hp->bodytype = HTTP_BODY_LENGTH;
+		hp->remaining = hp->content_length;
+	}else if(hp->response){
+		hp->bodytype = HTTP_BODY_CLOSE;
+	}else{
+		hp->bodytype = HTTP_BODY_NONE;
+	}
+	return 0;
+}
+
+// chunk-size [ chunk-ext ], with BWS tolerated
+static int
+parse_chunk_size(const char *line,size_t len,uint64_t *size){
+	uint64_t v = 0;
+	size_t z;
+
+	for(z = 0 ; z < len ; ++z){
+		unsigned d;
+
+		if(line[z] >= '0' && line[z] <= '9'){
+			d = (unsigned)(line[z] - '0');
+		}else if((line[z] | 0x20) >= 'a' && (line[z] | 0x20) <= 'f'){
+			d = (unsigned)((line[z] | 0x20) - 'a' + 10);
+		}else{
+			break;
+		}
+		if(v >> 60){
+			return -1;
+		}
+		v = (v << 4) | d;
+	}
+	if(z == 0){
+		return -1;
+	}
+	while(z < len && (line[z] == ' ' || line[z] == '\t')){
+		++z;
+	}
+	if(z < len && (line[z] != ';' || http_span_value(line + z,len - z) != len - z)){
+		return -1;
+	}
+	*size = v;
+	return 0;
+}
+
+// Hands out as much of the remaining body as is available
+static http_parse_res
+body_piece(http_parser *hp,size_t len,int unbounded){
+	size_t take = len - hp->pos;
+
+	if(take == 0){
+		return HTTP_PARSE_MORE;
+	}
+	if(!unbounded && take > hp->remaining){
+		take = (size_t)hp->remaining;
+	}
+	hp->body.off = hp->pos;
+	hp->body.len = take;
+	hp->pos += take;
+	if(!unbounded){
+		hp->remaining -= take;
+	}
+	return HTTP_PARSE_BODY;
+}
+
+static http_parse_res
+http_parse_error(http_parser *hp,const char *why){
+	nag("Malformed HTTP message at %zu: %s\n",hp->pos,why);
+	hp->state = HTTP_STATE_ERROR;
+	return HTTP_PARSE_ERROR;
+}
+
+http_parse_res http_parse(http_parser *hp,const char *buf,size_t len){
+	for( ; ; ){
+		size_t llen,next;
+		const char *line;
+		int r;
+
+		switch(hp->state){
+		case HTTP_STATE_BODY:
+			if(hp->bodytype == HTTP_BODY_CLOSE){
+				return body_piece(hp,len,1);
+			}
+			if(hp->remaining == 0){
+				hp->state = HTTP_STATE_DONE;
+				return HTTP_PARSE_DONE;
+			}
+			return body_piece(hp,len,0);
+		case HTTP_STATE_CHUNK_DATA:
+			if(hp->remaining == 0){
+				hp->state = HTTP_STATE_CHUNK_END;
+				continue;
+			}
+			return body_piece(hp,len,0);
+		case HTTP_STATE_DONE:
+			return HTTP_PARSE_DONE;
+		case HTTP_STATE_ERROR:
+			return HTTP_PARSE_ERROR;
+		default:
+			break;
+		}
+		// Everything else is line-oriented
+		if((r = next_http_line(hp,buf,len,&llen,&next)) <= 0){
+			return r ? http_parse_error(hp,"overlong line") : HTTP_PARSE_MORE;
+		}
+		line = buf + hp->pos;
+		switch(hp->state){
+		case HTTP_STATE_START:
+			// Empty lines preceding the start line are ignored
+			if(llen){
+				if((hp->response ? parse_status_line(hp,buf,hp->pos,llen) :
+						parse_request_line(hp,buf,hp->pos,llen))){
+					return http_parse_error(hp,"bad start line");
+				}
+				hp->state = HTTP_STATE_HEADERS;
+			}
+			break;
+		case HTTP_STATE_HEADERS: case HTTP_STATE_TRAILERS:
+			if(llen == 0){
+				hp->pos = next;
+				if(hp->state == HTTP_STATE_TRAILERS){
+					hp->state = HTTP_STATE_DONE;
+					return HTTP_PARSE_DONE;
+				}
+				if(determine_body(hp)){
+					return http_parse_error(hp,"bad framing");
+				}
+				hp->state = hp->bodytype == HTTP_BODY_CHUNKED ?
+					HTTP_STATE_CHUNK_SIZE : HTTP_STATE_BODY;
+				if(hp->bodytype == HTTP_BODY_NONE){
+					hp->state = HTTP_STATE_DONE;
+				}
+				return HTTP_PARSE_HEADERS;
+			}else{
+				http_header h;
+
+				if(line[0] == ' ' || line[0] == '\t'){
+					return http_parse_error(hp,"obsolete line folding");
+				}
+				if(parse_field(buf,hp->pos,llen,&h)){
+					return http_parse_error(hp,"bad field");
+				}
+				// Trailers are checked, but not recorded
+				if(hp->state == HTTP_STATE_HEADERS){
+					if(hp->headercount == HTTP_MAX_HEADERS){
+						return http_parse_error(hp,"too many fields");
+					}
+					if(note_field(hp,buf,&h)){
+						return http_parse_error(hp,"bad framing field");
+					}
+					hp->headers[hp->headercount++] = h;
+				}
+			}
+			break;
+		case HTTP_STATE_CHUNK_SIZE:
+			if(parse_chunk_size(line,llen,&hp->remaining)){
+				return http_parse_error(hp,"bad chunk size");
+			}
+			hp->state = hp->remaining ? HTTP_STATE_CHUNK_DATA : HTTP_STATE_TRAILERS;
+			break;
+		case HTTP_STATE_CHUNK_END:
+			if(llen){
+				return http_parse_error(hp,"overlong chunk");
+			}
+			hp->state = HTTP_STATE_CHUNK_SIZE;
+			break;
+		}
+		hp->pos = next;
+	}
+}
+
+http_parse_res http_parse_eof(http_parser *hp){
+	if(hp->state == HTTP_STATE_DONE){
+		return HTTP_PARSE_DONE;
+	}
+	if(hp->state == HTTP_STATE_BODY && hp->bodytype == HTTP_BODY_CLOSE){
+		hp->state = HTTP_STATE_DONE;
+		return HTTP_PARSE_DONE;
+	}
+	return http_parse_error(hp,"premature close");
+}
+
+const http_header *http_find_header(const http_parser *hp,const char *buf,const char *name){
+	size_t nlen = strlen(name);
+	unsigned z;
+
+	for(z = 0 ; z < hp->headercount ; ++z){
+		const http_header *h = &hp->headers[z];
+
+		if(h->name.len == nlen && strncasecmp(buf + h->name.off,name,nlen) == 0){
+			return h;
+		}
+	}
+	return NULL;
+}
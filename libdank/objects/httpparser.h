@@ -0,0 +1,97 @@
+#ifndef OBJECTS_HTTPPARSER
+#define OBJECTS_HTTPPARSER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental HTTP/1.x request and response parser (RFC 9112). Nothing is
+// copied: the start line, headers and body pieces are recorded as offsets
+// into the caller's buffer, which holds the message as received so far
+// (typically the buffer of a crlf_reader or evhandler connection, appended to
+// as data arrives). Each call resumes where the last left off, without
+// rescanning, so the buffer can be handed over after every read.
+//
+// Lines may end with CRLF or a bare LF. Obsolete line folding is refused, as
+// are lines longer than HTTP_MAX_LINE and more than HTTP_MAX_HEADERS fields.
+
+#define HTTP_MAX_HEADERS	64
+#define HTTP_MAX_LINE		0x10000
+
+typedef struct http_span {
+	size_t off,len;		// relative to the start of the caller's buffer
+} http_span;
+
+typedef struct http_header {
+	http_span name,value;	// the value is stripped of surrounding whitespace
+} http_header;
+
+typedef enum {
+	HTTP_BODY_NONE,
+	HTTP_BODY_LENGTH,	// Content-Length
+	HTTP_BODY_CHUNKED,	// Transfer-Encoding: chunked
+	HTTP_BODY_CLOSE,	// responses only: delimited by the connection's close
+} http_body_type;
+
+typedef enum {
+	HTTP_PARSE_MORE,	// all available data was consumed; supply more
+	HTTP_PARSE_HEADERS,	// the start line and headers are complete
+	HTTP_PARSE_BODY,	// body holds a piece of the (de-chunked) body
+	HTTP_PARSE_DONE,	// the message is complete
+	HTTP_PARSE_ERROR,	// the message is malformed
+} http_parse_res;
+
+typedef struct http_parser {
+	// Set by the caller prior to parsing a response to a HEAD request, or
+	// other response which mustn't have a body.
+	int nobody;
+	// Requests have method and target; responses, status and reason
+	http_span method,target,reason;
+	unsigned status;
+	unsigned version;	// 10 for HTTP/1.0, 11 for HTTP/1.1
+	http_header headers[HTTP_MAX_HEADERS];
+	unsigned headercount;
+	http_body_type bodytype;
+	uint64_t content_length;
+	http_span body;		// valid following HTTP_PARSE_BODY
+	// internal to http_parser; don't touch
+	int response,state,chunked_te,have_length;
+	size_t pos,scanned;
+	uint64_t remaining;
+} http_parser;
+
+void init_http_request_parser(http_parser *);
+void init_http_response_parser(http_parser *);
+
+// The buffer must hold the message from its first byte (or from the last
+// rebase), and len must never decrease. Call again following any result
+// other than MORE, DONE or ERROR; following MORE, call again with more data.
+http_parse_res http_parse(http_parser *,const char *,size_t);
+
+// The connection has closed. DONE if this completes a close-delimited body,
+// and ERROR otherwise.
+http_parse_res http_parse_eof(http_parser *);
+
+// Bytes of the buffer consumed so far. Following HTTP_PARSE_DONE, any bytes
+// beyond this belong to the next (pipelined) message.
+static inline size_t
+http_parser_consumed(const http_parser *hp){
+	return hp->pos;
+}
+
+// The caller has discarded the first n (<= consumed) bytes of its buffer,
+// perhaps to make room for more body. Spans previously handed out become
+// invalid.
+void http_parser_rebase(http_parser *,size_t);
+
+// The first header with the given (case-insensitive) name, or NULL
+const http_header *http_find_header(const http_parser *,const char *,const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,13 +1,36 @@
+#include <stdlib.h>
 #include <libdank/objects/logctx.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/objects/intervaltree.h>
 
+#define FROZEN_BATCH	16	// lookups interleaved by the batched search
+
+// A treap ordered on (lbound ascending, ubound descending), each node
+// augmented with the greatest ubound found in its subtree. The latter allows
+// any subtree which cannot contain a matching interval to be skipped.
 typedef struct interval_tree {
 	struct interval_tree *l,*r;
 	interval ival;
 	void *data;
+	uint32_t maxub;		// greatest ubound in this subtree
+	uint32_t prio;		// heap-ordered treap priority
 } interval_tree;
 
+// Priorities needn't be random, merely uncorrelated with the keys; mixing the
+// node's address (ala MurmurHash3's finalizer) suffices, and requires no
+// shared state.
+static inline uint32_t
+node_priority(const void *n){
+	uint64_t h = (uintptr_t)n;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return (uint32_t)h;
+}
+
 static interval_tree *
 create_interval_tree_node(const interval *ival,void *v){
 	interval_tree *ret;
@@ -16,142 +39,273 @@ create_interval_tree_node(const interval *ival,void *v){
 		ret->l = ret->r = NULL;
 		ret->ival = *ival;
 		ret->data = v;
+		ret->maxub = ival->ubound;
+		ret->prio = node_priority(ret);
 	}
 	return ret;
 }
 
-// Tests for distinctness of intervals (non-overlapping, *not* mere inequality)
 static inline int
-intervals_distinct(const interval *i1,const interval *i2){
+intervals_equal(const interval *i1,const interval *i2){
+	return (i1->lbound == i2->lbound) & (i1->ubound == i2->ubound);
+}
+
+static inline int
+interval_cmp(const interval *i1,const interval *i2){
+	if(i1->lbound != i2->lbound){
+		return i1->lbound < i2->lbound ? -1 : 1;
+	}
+	if(i1->ubound != i2->ubound){
+		return i1->ubound > i2->ubound ? -1 : 1;
+	}
+	return 0;
+}
+
+static inline int
+key_in_interval(const interval *ival,uint32_t key){
 	// & vs && is an optimization to avoid branching, not an error!
-	return (i1->ubound < i2->lbound) & (i2->ubound < i1->lbound);
+	return (key >= ival->lbound) & (key <= ival->ubound);
 }
 
 static inline int
-intervals_equal(const interval *i1,const interval *i2){
-	return (i1->lbound == i2->lbound) & (i1->ubound == i2->ubound);
+intervals_overlap(const interval *i1,const interval *i2){
+	return (i1->lbound <= i2->ubound) & (i2->lbound <= i1->ubound);
 }
 
-int insert_interval_tree(interval_tree **it,const interval *ival,void *v){
-	if(*it){
-		if(ival->ubound < (*it)->ival.lbound){
-			return insert_interval_tree(&(*it)->l,ival,v);
-		}else if((*it)->ival.ubound < ival->lbound){
-			return insert_interval_tree(&(*it)->r,ival,v);
-		}else{
-			bitch("Supplied overlapping intervals\n");
+static inline void
+update_maxub(interval_tree *it){
+	uint32_t m = it->ival.ubound;
+
+	if(it->l && it->l->maxub > m){
+		m = it->l->maxub;
+	}
+	if(it->r && it->r->maxub > m){
+		m = it->r->maxub;
+	}
+	it->maxub = m;
+}
+
+static void
+rotate_right(interval_tree **it){
+	interval_tree *x = *it,*l = x->l;
+
+	x->l = l->r;
+	l->r = x;
+	update_maxub(x);
+	update_maxub(l);
+	*it = l;
+}
+
+static void
+rotate_left(interval_tree **it){
+	interval_tree *x = *it,*r = x->r;
+
+	x->r = r->l;
+	r->l = x;
+	update_maxub(x);
+	update_maxub(r);
+	*it = r;
+}
+
+static int
+insert_node(interval_tree **it,interval_tree *n){
+	int c;
+
+	if(*it == NULL){
+		*it = n;
+		return 0;
+	}
+	if((c = interval_cmp(&n->ival,&(*it)->ival)) == 0){
+		bitch("Supplied duplicate interval [%u:%u]\n",n->ival.lbound,n->ival.ubound);
+		return -1;
+	}
+	if(c < 0){
+		if(insert_node(&(*it)->l,n)){
 			return -1;
 		}
+		if((*it)->l->prio > (*it)->prio){
+			rotate_right(it);
+		}
 	}else{
-		if((*it = create_interval_tree_node(ival,v)) == NULL){
+		if(insert_node(&(*it)->r,n)){
 			return -1;
 		}
+		if((*it)->r->prio > (*it)->prio){
+			rotate_left(it);
+		}
 	}
+	update_maxub(*it);
 	return 0;
 }
 
-int replace_interval_tree(interval_tree **it,const interval *ival,void *v,
-				void(*freefxn)(void *)){
-	if(*it){
-		if(ival->ubound < (*it)->ival.lbound){
-			return replace_interval_tree(&(*it)->l,ival,v,freefxn);
-		}else if((*it)->ival.ubound < ival->lbound){
-			return replace_interval_tree(&(*it)->r,ival,v,freefxn);
-		}else if(intervals_equal(&(*it)->ival,ival)){
-			if(freefxn){
-				freefxn((*it)->data);
-			}
-			(*it)->data = v;
-		}else{
-			bitch("Supplied overlapping intervals\n");
-			return -1;
-		}
-	}else{
-		if((*it = create_interval_tree_node(ival,v)) == NULL){
-			return -1;
+static interval_tree *
+find_node(interval_tree *it,const interval *ival){
+	while(it){
+		int c;
+
+		if((c = interval_cmp(ival,&it->ival)) == 0){
+			break;
 		}
+		it = c < 0 ? it->l : it->r;
+	}
+	return it;
+}
+
+// Join two treaps, all of l's keys preceding all of r's
+static interval_tree *
+merge_treaps(interval_tree *l,interval_tree *r){
+	if(l == NULL){
+		return r;
+	}else if(r == NULL){
+		return l;
+	}
+	if(l->prio > r->prio){
+		l->r = merge_treaps(l->r,r);
+		update_maxub(l);
+		return l;
+	}
+	r->l = merge_treaps(l,r->l);
+	update_maxub(r);
+	return r;
+}
+
+// Detach and return the node bearing this exact interval, or NULL
+static interval_tree *
+unlink_node(interval_tree **it,const interval *ival){
+	interval_tree *ret;
+	int c;
+
+	if(*it == NULL){
+		return NULL;
+	}
+	if((c = interval_cmp(ival,&(*it)->ival)) == 0){
+		ret = *it;
+		*it = merge_treaps(ret->l,ret->r);
+		return ret;
+	}
+	if( (ret = unlink_node(c < 0 ? &(*it)->l : &(*it)->r,ival)) ){
+		update_maxub(*it);
+	}
+	return ret;
+}
+
+int insert_interval_tree(interval_tree **it,const interval *ival,void *v){
+	interval_tree *n;
+
+	if(ival->lbound > ival->ubound){
+		bitch("Invalid interval [%u:%u]\n",ival->lbound,ival->ubound);
+		return -1;
+	}
+	if((n = create_interval_tree_node(ival,v)) == NULL){
+		return -1;
+	}
+	if(insert_node(it,n)){
+		Free(n);
+		return -1;
 	}
 	return 0;
 }
 
-static void
-splice_out_node(interval_tree **it){
-	interval_tree *l,*r;
+int replace_interval_tree(interval_tree **it,const interval *ival,void *v,
+				void(*freefxn)(void *)){
+	interval_tree *n;
 
-	l = (*it)->l;
-	r = (*it)->r;
-	Free(*it);
-	*it = r;
-	if(l){
-		if(r){
-			while(r->l){
-				r = r->l;
-			}
-			r->l = l;
-		}else{
-			*it = l;
+	if( (n = find_node(*it,ival)) ){
+		if(freefxn){
+			freefxn(n->data);
 		}
+		n->data = v;
+		return 0;
 	}
+	return insert_interval_tree(it,ival,v);
 }
 
 int remove_interval_tree(interval_tree **it,const interval *ival,
 				void (*freefxn)(void *)){
-	if(*it){
-		if(ival->ubound < (*it)->ival.lbound){
-			return remove_interval_tree(&(*it)->l,ival,freefxn);
-		}else if((*it)->ival.ubound < ival->lbound){
-			return remove_interval_tree(&(*it)->r,ival,freefxn);
-		}else if(intervals_equal(&(*it)->ival,ival)){
-			if(freefxn){
-				freefxn((*it)->data);
-			}
-			splice_out_node(it);
-			return 0;
-		}else{
-			bitch("Supplied overlapping intervals\n");
-		}
+	interval_tree *n;
+
+	if((n = unlink_node(it,ival)) == NULL){
+		return -1;
 	}
-	return -1;
+	if(freefxn){
+		freefxn(n->data);
+	}
+	Free(n);
+	return 0;
 }
 
 int extract_interval_tree(interval_tree **it,const interval *ival,void **v){
-	if(*it){
-		if(ival->ubound < (*it)->ival.lbound){
-			return extract_interval_tree(&(*it)->l,ival,v);
-		}else if((*it)->ival.ubound < ival->lbound){
-			return extract_interval_tree(&(*it)->r,ival,v);
-		}else if(intervals_equal(&(*it)->ival,ival)){
-			if(v){
-				*v = (*it)->data;
-			}
-			splice_out_node(it);
-			return 0;
-		}else{
-			bitch("Supplied overlapping intervals\n");
-		}
+	interval_tree *n;
+
+	if((n = unlink_node(it,ival)) == NULL){
+		return -1;
+	}
+	if(v){
+		*v = n->data;
 	}
-	return -1;
+	Free(n);
+	return 0;
 }
 
-static inline int
-key_in_interval(const interval *ival,uint32_t key){
-	// & vs && is an optimization to avoid branching, not an error!
-	return (key >= ival->lbound) & (key <= ival->ubound);
+// Returns the last node (in tree order) containing key. Subtrees whose
+// greatest ubound precedes the key are never entered; once a subtree lying
+// entirely at or below the key is entered, it is certain to yield a match.
+static const interval_tree *
+last_stabbing_node(const interval_tree *it,uint32_t key){
+	const interval_tree *ret;
+
+	if(it == NULL || it->maxub < key){
+		return NULL;
+	}
+	if(it->ival.lbound > key){
+		return last_stabbing_node(it->l,key);
+	}
+	if( (ret = last_stabbing_node(it->r,key)) ){
+		return ret;
+	}
+	if(key_in_interval(&it->ival,key)){
+		return it;
+	}
+	return last_stabbing_node(it->l,key);
 }
 
 void *lookup_interval_tree(const interval_tree *it,uint32_t key){
-	if(it){
-		if(key_in_interval(&it->ival,key)){
-			return it->data;
-		}else if(key < it->ival.lbound){
-			return lookup_interval_tree(it->l,key);
-		}else{
-			return lookup_interval_tree(it->r,key);
-		}
+	const interval_tree *n;
+
+	if( (n = last_stabbing_node(it,key)) ){
+		return n->data;
 	}
 	return NULL;
 }
 
+int range_interval_tree(const interval_tree *it,const interval *ival,
+				interval_cb cb,void *opaque){
+	int ret;
+
+	if(it == NULL || it->maxub < ival->lbound){
+		return 0;
+	}
+	if( (ret = range_interval_tree(it->l,ival,cb,opaque)) ){
+		return ret;
+	}
+	if(it->ival.lbound > ival->ubound){
+		return 0; // neither we nor our right subtree can overlap
+	}
+	if(intervals_overlap(&it->ival,ival)){
+		if( (ret = cb(&it->ival,it->data,opaque)) ){
+			return ret;
+		}
+	}
+	return range_interval_tree(it->r,ival,cb,opaque);
+}
+
+int stab_interval_tree(const interval_tree *it,uint32_t key,interval_cb cb,
+				void *opaque){
+	const interval ival = { .lbound = key, .ubound = key, };
+
+	return range_interval_tree(it,&ival,cb,opaque);
+}
+
 unsigned depth_interval_tree(const interval_tree *it){
 	if(it){
 		unsigned lm,rm;
@@ -171,85 +325,186 @@ unsigned population_interval_tree(const interval_tree *it){
 	return 0;
 }
 
-// balancing helper -- linearize the interval tree into a sorted linked list
-// (->l will be NULL for all nodes; ->r will be non-NULL for all but one (the
-// last) node). Takes a pointer to an interval tree, which will be reset to the
-// head of the list. Returns a pointer to the end of the list's (non-NULL) ->r.
-static interval_tree **
-linearize_interval_tree(interval_tree **it){
-	interval_tree **join,*cur;
+// The treap is kept balanced (in expectation) across all updates; there's
+// nothing left for us to do but report.
+void balance_interval_tree(interval_tree **it){
+	unsigned pop;
 
-	if((cur = *it) == NULL){
-		return NULL;
+	if( (pop = population_interval_tree(*it)) ){
+		nag("Current depth: %u (%u nodes)\n",depth_interval_tree(*it),pop);
 	}
-	if( (join = linearize_interval_tree(&cur->l)) ){
-		*it = cur->l;
-		cur->l = NULL;
-		*join = cur;
+}
+
+void free_interval_tree(interval_tree **it,void (*freefxn)(void *)){
+	if(*it){
+		if(freefxn){
+			freefxn((*it)->data);
+		}
+		free_interval_tree(&(*it)->l,freefxn);
+		free_interval_tree(&(*it)->r,freefxn);
+		Free(*it);
+		*it = NULL;
 	}
-	if((join = linearize_interval_tree(&cur->r)) == NULL){
-		join = &cur->r;
+}
+
+// A frozen tree is the tree's lookup function, resolved over the elementary
+// segments defined by all interval bounds. Segment boundaries (excluding the
+// implicit 0) are stored in Eytzinger (BFS) order, 1-indexed, each alongside
+// the state of the segment *preceding* it. Finding the first boundary greater
+// than the key thus yields the result directly; should there be no such
+// boundary, the search terminates on index 0, which holds the final segment.
+typedef struct frozen_interval_tree {
+	uint32_t *keys;		// keys[1..count]; keys[0] is unused
+	void **vals;		// vals[0..count]
+	unsigned count;
+} frozen_interval_tree;
+
+static unsigned
+collect_bounds(const interval_tree *it,uint32_t *bounds,unsigned n){
+	if(it){
+		n = collect_bounds(it->l,bounds,n);
+		bounds[n++] = it->ival.lbound;
+		if(it->ival.ubound != UINT32_MAX){
+			bounds[n++] = it->ival.ubound + 1;
+		}
+		n = collect_bounds(it->r,bounds,n);
 	}
-	return join;
+	return n;
 }
 
-static interval_tree **
-vectorize_list(interval_tree *it,unsigned count){
-	interval_tree **ret;
+static int
+uint32_cmp(const void *a,const void *b){
+	uint32_t ua = *(const uint32_t *)a,ub = *(const uint32_t *)b;
 
-	if( (ret = Malloc("tree vector",sizeof(*ret) * count)) ){
-		unsigned i;
+	return ua < ub ? -1 : ua > ub;
+}
 
-		for(i = 0 ; i < count ; ++i){
-			ret[i] = it;
-			it = it->r;
-		}
+static unsigned
+eytzinger_fill(frozen_interval_tree *fit,const uint32_t *sk,void * const *sv,
+					unsigned i,unsigned k){
+	if(k <= fit->count){
+		i = eytzinger_fill(fit,sk,sv,i,2 * k);
+		fit->keys[k] = sk[i];
+		fit->vals[k] = sv[i];
+		i = eytzinger_fill(fit,sk,sv,i + 1,2 * k + 1);
 	}
-	return ret;
+	return i;
 }
 
-static interval_tree *
-bbstize_vector(interval_tree **it,unsigned count){
-	interval_tree *ret;
+frozen_interval_tree *freeze_interval_tree(const interval_tree *it){
+	frozen_interval_tree *ret;
+	unsigned pop,n,z,segs;
+	uint32_t *bounds;
+	void **segvals;
 
-	if(count == 0){
+	pop = population_interval_tree(it);
+	if((bounds = Malloc("frozen bounds",sizeof(*bounds) * (2 * pop + 1))) == NULL){
 		return NULL;
 	}
-	ret = it[count / 2];
-	ret->l = bbstize_vector(it,count / 2);
-	ret->r = bbstize_vector(it + (count / 2) + 1,count - (count / 2) - 1);
+	if((segvals = Malloc("frozen segments",sizeof(*segvals) * (2 * pop + 1))) == NULL){
+		Free(bounds);
+		return NULL;
+	}
+	bounds[0] = 0;
+	n = collect_bounds(it,bounds,1);
+	qsort(bounds,n,sizeof(*bounds),uint32_cmp);
+	// bounds[0] is always 0. Resolve each distinct boundary, coalescing
+	// adjacent segments which resolve identically.
+	segvals[0] = lookup_interval_tree(it,0);
+	for(z = 1, segs = 1 ; z < n ; ++z){
+		void *v;
+
+		if(bounds[z] == bounds[segs - 1]){
+			continue;
+		}
+		if((v = lookup_interval_tree(it,bounds[z])) == segvals[segs - 1]){
+			continue;
+		}
+		bounds[segs] = bounds[z];
+		segvals[segs++] = v;
+	}
+	if((ret = Malloc("frozen interval tree",sizeof(*ret))) == NULL){
+		goto err;
+	}
+	ret->count = segs - 1;
+	if((ret->keys = Malloc("frozen keys",sizeof(*ret->keys) * segs)) == NULL){
+		Free(ret);
+		goto err;
+	}
+	if((ret->vals = Malloc("frozen vals",sizeof(*ret->vals) * segs)) == NULL){
+		Free(ret->keys);
+		Free(ret);
+		goto err;
+	}
+	ret->keys[0] = 0;
+	ret->vals[0] = segvals[segs - 1];
+	eytzinger_fill(ret,bounds + 1,segvals,0,1);
+	Free(segvals);
+	Free(bounds);
 	return ret;
+
+err:
+	Free(segvals);
+	Free(bounds);
+	return NULL;
 }
 
-void balance_interval_tree(interval_tree **it){
-	interval_tree **tmp;
-	unsigned depth,upop;
-	float pop;
-
-	pop = upop = population_interval_tree(*it);
-	depth = depth_interval_tree(*it);
-	nag("Current depth: %u (%2.2f%% of N)\n",depth,depth / pop * 100);
-	linearize_interval_tree(it);
-	depth = depth_interval_tree(*it);
-	nag("Current depth: %u (%2.2f%% of N)\n",depth,depth / pop * 100);
-	// FIXME if this allocation fails, we leave the tree in its pessimal
-	// form! surely we can rebalance in O(1) state...
-	if( (tmp = vectorize_list(*it,upop)) ){
-		*it = bbstize_vector(tmp,upop);
-		Free(tmp);
-		depth = depth_interval_tree(*it);
-		nag("Current depth: %u (%2.2f%% of N)\n",depth,depth / pop * 100);
+// Each step descends to 2k (key < boundary) or 2k + 1 (key >= boundary).
+// Upon falling off the tree, the trailing 1s of k are the final run of
+// rightward steps; shifting them (and the last leftward step) away recovers
+// the last node at which we went left, ie the first boundary above the key.
+static inline unsigned
+eytzinger_terminus(unsigned k){
+	return k >> __builtin_ffs(~k);
+}
+
+void *lookup_frozen_interval_tree(const frozen_interval_tree *fit,uint32_t key){
+	const uint32_t *keys = fit->keys;
+	unsigned k = 1;
+
+	while(k <= fit->count){
+		// four levels down lie 16 nodes, a cacheline of uint32_ts
+		__builtin_prefetch(keys + 16 * k);
+		k = 2 * k + (keys[k] <= key);
 	}
+	return fit->vals[eytzinger_terminus(k)];
 }
 
-void free_interval_tree(interval_tree **it,void (*freefxn)(void *)){
-	if(*it){
-		if(freefxn){
-			freefxn((*it)->data);
+void lookup_frozen_interval_tree_batch(const frozen_interval_tree *fit,
+			const uint32_t *keys,void **vals,unsigned n){
+	unsigned k[FROZEN_BATCH];
+	unsigned z,i,b,active;
+
+	for(z = 0 ; z < n ; z += b){
+		b = n - z < FROZEN_BATCH ? n - z : FROZEN_BATCH;
+		for(i = 0 ; i < b ; ++i){
+			k[i] = 1;
 		}
-		free_interval_tree(&(*it)->l,freefxn);
-		free_interval_tree(&(*it)->r,freefxn);
-		Free(*it);
-		*it = NULL;
+		// all keys traverse either floor(lg(count)) or one more levels
+		do{
+			active = 0;
+			for(i = 0 ; i < b ; ++i){
+				if(k[i] <= fit->count){
+					k[i] = 2 * k[i] + (fit->keys[k[i]] <= keys[z + i]);
+					__builtin_prefetch(fit->keys + 16 * k[i]);
+					++active;
+				}
+			}
+		}while(active);
+		for(i = 0 ; i < b ; ++i){
+			vals[z + i] = fit->vals[eytzinger_terminus(k[i])];
+		}
+	}
+}
+
+unsigned segments_frozen_interval_tree(const frozen_interval_tree *fit){
+	return fit->count + 1;
+}
+
+void free_frozen_interval_tree(frozen_interval_tree *fit){
+	if(fit){
+		Free(fit->keys);
+		Free(fit->vals);
+		Free(fit);
 	}
 }
@@ -8,6 +8,7 @@ extern "C" {
 #include <stdint.h>
 
 struct interval_tree;
+struct frozen_interval_tree;
 
 typedef struct interval {
 	uint32_t lbound,ubound;
@@ -15,24 +16,56 @@ typedef struct interval {
 
 // All intervals are closed. State will be retained, and must be valid across
 // the interval tree's life; the intervals passed will be copied and thus
-// needn't persist past the function call. Overlapping intervals are not (yet)
-// supported. An unordered tree is used; balance_interval_tree() may be used to
-// explicitly request a balancing.
+// needn't persist past the function call. Intervals may overlap, but an
+// identical interval may not be inserted twice; replacement, removal and
+// extraction match only the identical interval. The tree is a treap augmented
+// with each subtree's greatest upper bound, and remains O(lgN) deep (in
+// expectation) regardless of insertion order.
 int insert_interval_tree(struct interval_tree **,const interval *,void *);
 int replace_interval_tree(struct interval_tree **,const interval *,void *,
 				void (*)(void *));
 int extract_interval_tree(struct interval_tree **,const interval *,void **);
 int remove_interval_tree(struct interval_tree **,const interval *,
 				void (*)(void *));
-void *lookup_interval_tree(const struct interval_tree *,uint32_t);
 void free_interval_tree(struct interval_tree **,void (*)(void *));
 
-// Perform an O(N) time, O(N) space balancing.
+// Returns the state of an interval containing the key. Where several do, that
+// with the greatest lbound wins (the narrowest, should lbounds be equal), ie
+// the innermost of nested intervals.
+void *lookup_interval_tree(const struct interval_tree *,uint32_t);
+
+// Invoked with each matching interval, its state, and the opaque argument. A
+// non-zero return terminates the query, and is returned from it.
+typedef int (*interval_cb)(const interval *,void *,void *);
+
+// Invoke the callback on all intervals containing the key (stabbing query),
+// or on all intervals overlapping the provided interval (range query), in
+// order of ascending lbound. Returns 0 if the walk wasn't terminated early.
+int stab_interval_tree(const struct interval_tree *,uint32_t,interval_cb,void *);
+int range_interval_tree(const struct interval_tree *,const interval *,
+				interval_cb,void *);
+
+// Formerly an O(N) rebalancing; the tree is now kept balanced on update, and
+// this merely reports its shape.
 void balance_interval_tree(struct interval_tree **);
 
+// Compile the tree into a static index for read-mostly use. Lookups return
+// precisely what lookup_interval_tree() would have at the time of freezing.
+// The index is two contiguous arrays (boundaries and states) in Eytzinger
+// order, searched without data-dependent branches. State is shared with the
+// tree, not copied; the index must be refrozen following any update.
+struct frozen_interval_tree *freeze_interval_tree(const struct interval_tree *);
+void *lookup_frozen_interval_tree(const struct frozen_interval_tree *,uint32_t);
+// Look up each of the n keys, writing the results to the output vector. Keys
+// are advanced a level at a time in lockstep, prefetching their next nodes.
+void lookup_frozen_interval_tree_batch(const struct frozen_interval_tree *,
+				const uint32_t *,void **,unsigned);
+void free_frozen_interval_tree(struct frozen_interval_tree *);
+
 // Diagnostic functions -- query the maximum depth, or population
 unsigned depth_interval_tree(const struct interval_tree *);
 unsigned population_interval_tree(const struct interval_tree *);
+unsigned segments_frozen_interval_tree(const struct frozen_interval_tree *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,125 @@
+#include <string.h>
+#include <unistd.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/linereader.h>
+
+int init_line_reader(line_reader *lr,size_t maxline){
+	memset(lr,0,sizeof(*lr));
+	lr->maxline = maxline ? maxline : LINE_READER_MAXLINE;
+	// Room for the longest line plus its terminator, if that's less
+	lr->total = LINE_READER_CHUNK;
+	if(lr->total > lr->maxline + 1){
+		lr->total = lr->maxline + 1;
+	}
+	if((lr->buf = Malloc("line reader",lr->total)) == NULL){
+		return -1;
+	}
+	return 0;
+}
+
+void reset_line_reader(line_reader *lr){
+	if(lr){
+		Free(lr->buf);
+		memset(lr,0,sizeof(*lr));
+	}
+}
+
+// Searches the unexamined data for either terminator
+static char *
+find_line_end(line_reader *lr){
+	const char *start = lr->buf + lr->base + lr->examined;
+	size_t len = lr->count - lr->examined;
+	char *nl,*nul;
+
+	if( (nl = memchr(start,'\n',len)) ){
+		len = (size_t)(nl - start);
+	}
+	if( (nul = memchr(start,'\0',len)) ){
+		return nul;
+	}
+	return nl;
+}
+
+static line_read_res
+hand_out_line(line_reader *lr,char *end,char **line,size_t *len){
+	*end = '\0';
+	*line = lr->buf + lr->base;
+	*len = (size_t)(end - *line);
+	// An unterminated line at EOF has its NUL in the spare byte
+	if(*len < lr->count){
+		++end;
+	}
+	lr->count -= (size_t)(end - *line);
+	lr->base = lr->count ? (size_t)(end - lr->buf) : 0;
+	lr->examined = 0;
+	return LINE_READ_SUCCESS;
+}
+
+// Slide any partial line to the front, and make room for a chunk (always
+// leaving a byte for the terminator). A partial line of exactly maxline
+// characters is kept; only its terminator can follow.
+static line_read_res
+make_room(line_reader *lr){
+	if(lr->base){
+		memmove(lr->buf,lr->buf + lr->base,lr->count);
+		lr->base = 0;
+	}
+	if(lr->count > lr->maxline){
+		bitch("Refusing to buffer past %zub for a single line\n",lr->maxline);
+		return LINE_READ_LONGLINE;
+	}
+	if(lr->total - lr->count - 1 < LINE_READER_CHUNK / 2 && lr->total <= lr->maxline){
+		size_t nsize = lr->total * 2;
+		char *tmp;
+
+		if(nsize > lr->maxline + 1){
+			nsize = lr->maxline + 1;
+		}
+		if((tmp = Realloc("line reader",lr->buf,nsize)) == NULL){
+			return LINE_READ_SYSERR;
+		}
+		lr->buf = tmp;
+		lr->total = nsize;
+	}
+	return LINE_READ_SUCCESS;
+}
+
+line_read_res read_buffered_line(line_reader *lr,int fd,char **line,size_t *len){
+	for( ; ; ){
+		line_read_res res;
+		size_t want;
+		char *end;
+		ssize_t r;
+
+		if(lr->examined < lr->count){
+			if( (end = find_line_end(lr)) ){
+				return hand_out_line(lr,end,line,len);
+			}
+			lr->examined = lr->count;
+		}
+		if(lr->eof){
+			if(lr->count == 0){
+				return LINE_READ_EOF;
+			}
+			return hand_out_line(lr,lr->buf + lr->base + lr->count,line,len);
+		}
+		if((res = make_room(lr)) != LINE_READ_SUCCESS){
+			return res;
+		}
+		// A full-length line reads its terminator into the spare byte
+		want = lr->count < lr->maxline ? lr->total - lr->count - 1 : 1;
+		while((r = read(fd,lr->buf + lr->count,want)) < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				return LINE_READ_NBLOCK;
+			}else if(errno != EINTR){
+				moan("Couldn't read from %d\n",fd);
+				return LINE_READ_SYSERR;
+			}
+		}
+		if(r == 0){
+			lr->eof = 1;
+		}
+		lr->count += (size_t)r;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef OBJECTS_LINEREADER
+#define OBJECTS_LINEREADER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Buffered line reader for descriptors, after the design of crlf_reader, but
+// handing out lines as views into its buffer rather than as copies. Reads are
+// made LINE_READER_CHUNK at a time, and each buffered line is found with a
+// memchr(3) scan, so a stream of many short lines costs one syscall per chunk
+// rather than one per byte.
+//
+// Lines end with a newline or a NUL. The terminator is overwritten with a NUL,
+// and isn't counted in the line's length. An unterminated line followed by EOF
+// is returned as a line. Lines longer than the reader's maximum are refused
+// with LINE_READ_LONGLINE.
+#define LINE_READER_CHUNK	0x10000
+#define LINE_READER_MAXLINE	0x100000
+
+typedef struct line_reader {
+	// internal to line_reader; don't touch
+	char *buf;
+	int eof;
+	size_t total,base,count,examined,maxline;
+} line_reader;
+
+typedef enum {
+	LINE_READ_SUCCESS,
+	LINE_READ_LONGLINE,
+	LINE_READ_EOF,
+	LINE_READ_NBLOCK,	// only from non-blocking descriptors
+	LINE_READ_SYSERR,
+} line_read_res;
+
+// A maxline of 0 selects LINE_READER_MAXLINE. 0 on success.
+int init_line_reader(line_reader *,size_t);
+
+// On LINE_READ_SUCCESS, the line and its length are stored. The line remains
+// valid (and may be modified in place) until the next call on the reader.
+// Lines already buffered are returned without reading, so non-blocking users
+// must call again until LINE_READ_NBLOCK before waiting on the descriptor.
+line_read_res read_buffered_line(line_reader *,int,char **,size_t *);
+
+void reset_line_reader(line_reader *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
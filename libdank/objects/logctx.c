@@ -7,9 +7,11 @@
 #include <libdank/utils/netio.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
 #include <libdank/objects/objustring.h>
 #include <libdank/modules/logging/logdir.h>
 #include <libdank/modules/logging/logging.h>
+#include <libdank/modules/logging/logrotate.h>
 
 // Must only be called within the thread owning this logctx, or after that
 // thread has perished. Thus, it is registered with linuxthreads and called
@@ -27,7 +29,8 @@ void free_logctx(logctx *lc){
 		if(err){
 			free_ustring(&err);
 		}
-		if(lc->lfile){
+		retire_async_logging(lc);
+		if(lc->lmap || lc->lfile){
 			char buf[80];
 			time_t t;
 
@@ -37,27 +40,45 @@ void free_logctx(logctx *lc){
 			if((t = time(NULL)) == (time_t)-1 || !ctime_r(&t,buf)){
 				strcpy(buf,"\n");
 			}
-			fprintf(lc->lfile,"%ju|thread ends %s",lc->lineswritten++,buf);
-			if(lc->lfile != stdout){
-				fclose(lc->lfile);
-			}
-			lc->lfile = NULL;
-			if(lc->cleanup){
-				remove(lc->lfile_name);
+			if(lc->lmap){
+				char line[128],fn[PATH_MAX];
+				int len;
+
+				len = snprintf(line,sizeof(line),"%ju|thread ends %s",
+						lc->lineswritten++,buf);
+				if(len > 0 && (size_t)len < sizeof(line)){
+					write_logmap(lc->lmap,line,(size_t)len);
+				}
+				close_logmap(lc->lmap);
+				Free(lc->lmap);
+				lc->lmap = NULL;
+				// A rotated logmap is unlinked once archived
+				if(thread_log_name(lc,fn,sizeof(fn)) == 0){
+					if(retire_logmap(fn) == 0 && lc->cleanup){
+						remove(fn);
+					}
+				}
 			}else{
-				if(truncate(lc->lfile_name,lc->lfile_offset)){
-					remove(lc->lfile_name);
+				fprintf(lc->lfile,"%ju|thread ends %s",lc->lineswritten++,buf);
+				if(lc->lfile != stdout){
+					fclose(lc->lfile);
 				}
+				lc->lfile = NULL;
 			}
 		}
 	}
 }
 
+// The key exists only to run free_logctx_wrapper() upon thread exit; lookups
+// use the thread-local pointer.
 static pthread_key_t lfile_key;
 static pthread_once_t lfile_key_once = PTHREAD_ONCE_INIT;
+static __thread logctx *thread_lc;
+static __thread char strerrbuf[80]; // FIXME just a guess
 
 static void
 free_logctx_wrapper(void *unsafe_lc){
+	thread_lc = NULL;
 	free_logctx(unsafe_lc);
 	deeperfree(unsafe_lc);
 }
@@ -77,10 +98,11 @@ set_logctx_tsd(logctx *lc){
 	if(pthread_setspecific(lfile_key,lc)){
 		pthread_exit(NULL);
 	}
+	thread_lc = lc;
 }
 
 logctx *get_thread_logctx(void){
-	return pthread_getspecific(lfile_key);
+	return thread_lc;
 }
 
 // intitialize with mask and NULL ustrings, file
@@ -90,12 +112,7 @@ void init_private_logctx(logctx *lc){
 }
 
 const char *logctx_strerror_r(int err){
-	logctx *lctx;
-	
-	if((lctx = get_thread_logctx()) == NULL){
-		return "";
-	}
-	return strerror_r(err,lctx->strerrbuf,sizeof(lctx->strerrbuf));
+	return strerror_r(err,strerrbuf,sizeof(strerrbuf));
 }
 
 // intitialize a logctx with the provided flags, NULL out/err ustrings,
@@ -105,12 +122,12 @@ const char *logctx_strerror_r(int err){
 // context is the user's task.
 void init_thread_logctx(logctx *lc,const char *tname){
 	init_private_logctx(lc);
-	lc->lfile = open_thread_log(tname,lc->lfile_name);
+	open_thread_log(tname,lc);
 }
 
 void init_detached_thread_logctx(logctx *lc,const char *tname){
 	init_private_logctx(lc);
-	lc->lfile = open_thread_log(tname,lc->lfile_name);
+	open_thread_log(tname,lc);
 	lc->cleanup = 1;
 }
 
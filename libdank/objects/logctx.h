@@ -14,7 +14,9 @@ extern "C" {
 #include <sys/types.h>
 #include <libdank/modules/logging/logging.h>
 
+struct logmap;
 struct ustring;
+struct logring;
 
 // logctx's provide a general interface to logfiles, listeners, and ctlserver
 // command feedback. There's one logctx per created thread, and one for
@@ -22,16 +24,22 @@ struct ustring;
 
 #define LISTENER_MSG_SZ PIPE_BUF
 
+// Thousands of short-lived threads might each carry a logctx, so they're kept
+// small: messages are rendered on the stack, the logfile's name is derived
+// from the (interned) thread name and a serial number, and the logfile itself
+// is only created once the thread first logs.
 typedef struct logctx {
-	FILE *lfile;
+	struct logmap *lmap; // memory-mapped logfile, if using a logdir
+	FILE *lfile; // otherwise, stdio
 	off_t lfile_offset;
 	uintmax_t lineswritten;
 	struct ustring *out,*err;
-	char msg_buffer[LISTENER_MSG_SZ];
-	char timebuf[27]; // see asctime_r(3)
-	char lfile_name[PATH_MAX + 1];
-	char strerrbuf[80]; // FIXME just a guess
+	const char *lname; // interned thread name, if using a logdir
+	unsigned long lserial; // never reused, unlike the thread id
 	int cleanup;
+	int lmapless; // don't create the logmap (attempt failed, or under way)
+	struct logring *ring; // deferred records, when logging asynchronously
+	int ringless; // don't attach a ring (attempt failed, or crash context)
 } logctx;
 
 void init_private_logctx(logctx *);
@@ -43,37 +51,54 @@ void free_logctx_ustrings(void);
 
 void reset_logctx_ustrings(void);
 
-// Get the current thread's logctx, if possible. This can fail due to internal
-// limitations of the pthread library, logging not having been initialized, or
-// the thread not having been properly created using the threading framework.
-// In any such case, the return value will be NULL, and we fall back to stdio.
+// Get the current thread's logctx, if possible. This can fail due to logging
+// not having been initialized, or the thread not having been properly created
+// using the threading framework. In any such case, the return value will be
+// NULL, and we fall back to stdio. This is a thread-local load.
 logctx *get_thread_logctx(void);
 
-// Uses the logctx's strerrbuf, unlike strerror() which shares one global buf
+// Uses a thread-local buffer, unlike strerror() which shares one global buf
 const char *logctx_strerror_r(int);
 
+// Files define LOG_CATEGORY prior to their includes to categorize their lines
+#ifndef LOG_CATEGORY
+#define LOG_CATEGORY LOGCAT_GENERAL
+#endif
+
+// Log at the level in the file's category, should it be enabled. Arguments
+// are not evaluated otherwise.
+#define lvlflog(lvl,fmt,...) \
+	(log_enabled(LOG_CATEGORY,(lvl)) ? flog(fmt ,##__VA_ARGS__) : (void)0)
+
+#define lvltimeflog(lvl,fmt,...) \
+	(log_enabled(LOG_CATEGORY,(lvl)) ? timeflog(fmt ,##__VA_ARGS__) : (void)0)
+
 // FIXME these functions ought suffix with \n, since they're logically line-
 // based (given that they prefix with the function name). It'll be a big PITA
 // going through every caller and killing the \n's already there, though.
 #define nag(fmt,...) \
-	flog("%s] "fmt,__func__ ,##__VA_ARGS__)
+	lvlflog(LOGLVL_INFO,"%s] "fmt,__func__ ,##__VA_ARGS__)
+
+// Per-event chatter, disabled unless LOGLVL_DEBUG is enabled for the category
+#define dnag(fmt,...) \
+	lvlflog(LOGLVL_DEBUG,"%s] "fmt,__func__ ,##__VA_ARGS__)
 
 #define nagonbehalf(caller,fmt,...) \
-	flog("%s] "fmt,caller ,##__VA_ARGS__)
+	lvlflog(LOGLVL_INFO,"%s] "fmt,caller ,##__VA_ARGS__)
 
 #define timenag(fmt,...) \
-	timeflog("%s] "fmt,__func__ ,##__VA_ARGS__)
+	lvltimeflog(LOGLVL_INFO,"%s] "fmt,__func__ ,##__VA_ARGS__)
 
 #define bitch(fmt,...) \
-	flog("***** Error in %s] "fmt,__func__ ,##__VA_ARGS__)
+	lvlflog(LOGLVL_ERROR,"***** Error in %s] "fmt,__func__ ,##__VA_ARGS__)
 
 #define pmoan(errcode,fmt,...) \
-	flog("***** Error (%s) in %s(): "fmt,logctx_strerror_r(errcode),\
-			__func__ ,##__VA_ARGS__)
+	lvlflog(LOGLVL_ERROR,"***** Error (%s) in %s(): "fmt,\
+			logctx_strerror_r(errcode),__func__ ,##__VA_ARGS__)
 
 #define pmoanonbehalf(errcode,caller,fmt,...) \
-	flog("***** Error (%s) in %s(): "fmt,logctx_strerror_r(errcode),\
-			 caller ,##__VA_ARGS__)
+	lvlflog(LOGLVL_ERROR,"***** Error (%s) in %s(): "fmt,\
+			logctx_strerror_r(errcode),caller ,##__VA_ARGS__)
 
 // Preserves errno across flog()
 #define moan(fmt,...) do{ \
@@ -88,6 +113,43 @@ const char *logctx_strerror_r(int);
 	errno = m_err; \
 }while(0);
 
+// Rate-limited lines, for paths which malformed input might drive at line
+// rate. Each call site has its own (static) token bucket, admitting persec
+// lines per second in bursts of up to burst lines. Suppressed lines are not
+// formatted; their count is reported ahead of the next admitted line.
+#define ratelvlflog(lvl,persec,burst,fmt,...) do{ \
+	static lograte lr_site; \
+	int lr_supp; \
+	if(log_enabled(LOG_CATEGORY,(lvl)) && \
+			(lr_supp = log_ratelimit(&lr_site,(persec),(burst))) >= 0){ \
+		if(lr_supp){ \
+			flog("%s] (%d similar lines suppressed)\n",__func__,lr_supp); \
+		} \
+		flog(fmt ,##__VA_ARGS__); \
+	} \
+}while(0)
+
+#define ratenag(persec,burst,fmt,...) \
+	ratelvlflog(LOGLVL_INFO,persec,burst,"%s] "fmt,__func__ ,##__VA_ARGS__)
+
+#define ratebitch(persec,burst,fmt,...) \
+	ratelvlflog(LOGLVL_ERROR,persec,burst,"***** Error in %s] "fmt,__func__ ,##__VA_ARGS__)
+
+// Sampled lines: only every nth call at the site is written, marked "[1/n]".
+#define samplelvlflog(lvl,n,fmt,...) do{ \
+	static unsigned ls_site; \
+	if(log_enabled(LOG_CATEGORY,(lvl)) && \
+			__atomic_fetch_add(&ls_site,1,__ATOMIC_RELAXED) % (n) == 0){ \
+		flog(fmt ,##__VA_ARGS__); \
+	} \
+}while(0)
+
+#define samplenag(n,fmt,...) \
+	samplelvlflog(LOGLVL_INFO,n,"%s] [1/%u] "fmt,__func__,(unsigned)(n) ,##__VA_ARGS__)
+
+#define samplebitch(n,fmt,...) \
+	samplelvlflog(LOGLVL_ERROR,n,"***** Error in %s] [1/%u] "fmt,__func__,(unsigned)(n) ,##__VA_ARGS__)
+
 void free_logctx(logctx *);
 
 #ifdef __cplusplus
@@ -0,0 +1,195 @@
+#include <time.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libdank/utils/syswrap.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
+
+#define LOGMAP_PERMS (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
+
+// Space occupied by a record carrying len bytes of text
+static inline uint64_t
+logmap_reclen(size_t len){
+	const size_t rl = sizeof(logmap_rec);
+
+	return rl + (len + rl - 1) / rl * rl;
+}
+
+static void
+setup_logmap(logmap *lm,size_t hdrlen){
+	lm->hdr = (logmap_header *)scratchfile_ring_ptrto(&lm->sr,0);
+	lm->ring = scratchfile_ring_ptrto(&lm->sr,hdrlen);
+	lm->ringlen = (size_t)lm->hdr->ringlen;
+}
+
+int create_logmap(logmap *lm,const char *fn,size_t ringlen){
+	int fd,pgsiz,err;
+	size_t len;
+
+	if((pgsiz = Getpagesize()) <= 0){
+		return -1;
+	}
+	if(ringlen == 0 || ringlen % (size_t)pgsiz){
+		bitch("Invalid ring length: %zu\n",ringlen);
+		return -1;
+	}
+	len = (size_t)pgsiz + ringlen;
+	if((fd = OpenCreat(fn,O_RDWR | O_CREAT | O_TRUNC,LOGMAP_PERMS)) < 0){
+		return -1;
+	}
+	if( (err = posix_fallocate(fd,0,(off_t)len)) ){
+		pmoan(err,"Couldn't reserve %zu bytes for %s\n",len,fn);
+		Close(fd);
+		return -1;
+	}
+	if(initialize_scratchfile_ring(&lm->sr,fd,PROT_READ | PROT_WRITE,len)){
+		Close(fd);
+		return -1;
+	}
+	// The map holds its own reference to the file
+	lm->sr.fd = -1;
+	if(Close(fd)){
+		release_scratchfile_ring(&lm->sr);
+		return -1;
+	}
+	lm->hdr = (logmap_header *)scratchfile_ring_ptrto(&lm->sr,0);
+	lm->hdr->magic = LOGMAP_MAGIC;
+	lm->hdr->version = LOGMAP_VERSION;
+	lm->hdr->hdrlen = (uint32_t)pgsiz;
+	lm->hdr->ringlen = ringlen;
+	lm->hdr->head = lm->hdr->tail = 0;
+	setup_logmap(lm,(size_t)pgsiz);
+	return 0;
+}
+
+void write_logmap(logmap *lm,const char *text,size_t len){
+	const size_t rl = sizeof(logmap_rec);
+	logmap_header *hdr = lm->hdr;
+	uint64_t head,tail,need;
+	struct timespec ts;
+	logmap_rec *rec;
+	size_t pos,first;
+
+	if(len > lm->ringlen - rl){
+		len = lm->ringlen - rl;
+	}
+	need = logmap_reclen(len);
+	head = hdr->head;
+	tail = hdr->tail;
+	if(tail + need - head > lm->ringlen){
+		// Retire the oldest records, publishing the new head before we
+		// overwrite them.
+		do{
+			const logmap_rec *old;
+
+			old = (const logmap_rec *)(lm->ring + head % lm->ringlen);
+			head += logmap_reclen(old->len);
+		}while(head < tail && tail + need - head > lm->ringlen);
+		if(head > tail){ // corrupt record; start anew
+			head = tail;
+		}
+		__atomic_store_n(&hdr->head,head,__ATOMIC_RELEASE);
+	}
+	clock_gettime(CLOCK_REALTIME,&ts);
+	pos = tail % lm->ringlen;
+	rec = (logmap_rec *)(lm->ring + pos);
+	rec->nsec = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+	rec->len = (uint32_t)len;
+	if((pos += rl) == lm->ringlen){
+		pos = 0;
+	}
+	if((first = lm->ringlen - pos) > len){
+		first = len;
+	}
+	memcpy(lm->ring + pos,text,first);
+	memcpy(lm->ring,text + first,len - first);
+	__atomic_store_n(&hdr->tail,tail + need,__ATOMIC_RELEASE);
+}
+
+int open_logmap(logmap *lm,const char *fn){
+	const logmap_header *hdr;
+	struct stat st;
+	int fd;
+
+	if((fd = Open(fn,O_RDONLY)) < 0){
+		return -1;
+	}
+	if(Fstat(fd,&st)){
+		Close(fd);
+		return -1;
+	}
+	if((size_t)st.st_size < sizeof(*hdr)){
+		bitch("%s is too small (%jd) to be a logmap\n",fn,(intmax_t)st.st_size);
+		Close(fd);
+		return -1;
+	}
+	if(initialize_scratchfile_ring(&lm->sr,fd,PROT_READ,(size_t)st.st_size)){
+		Close(fd);
+		return -1;
+	}
+	lm->sr.fd = -1;
+	if(Close(fd)){
+		release_scratchfile_ring(&lm->sr);
+		return -1;
+	}
+	hdr = (const logmap_header *)scratchfile_ring_const_ptrto(&lm->sr,0);
+	if(hdr->magic != LOGMAP_MAGIC || hdr->version != LOGMAP_VERSION){
+		bitch("%s is not a logmap\n",fn);
+		release_scratchfile_ring(&lm->sr);
+		return -1;
+	}
+	if(hdr->hdrlen < sizeof(*hdr) || hdr->ringlen == 0 ||
+			hdr->ringlen % sizeof(logmap_rec) ||
+			hdr->hdrlen + hdr->ringlen > (uint64_t)st.st_size){
+		bitch("%s has an invalid geometry\n",fn);
+		release_scratchfile_ring(&lm->sr);
+		return -1;
+	}
+	setup_logmap(lm,hdr->hdrlen);
+	return 0;
+}
+
+int read_logmap(const logmap *lm,uint64_t *off,uint64_t *nsec,char *buf,size_t buflen){
+	const size_t rl = sizeof(logmap_rec);
+	uint64_t tail;
+	logmap_rec rec;
+	size_t pos,len,first;
+
+	tail = __atomic_load_n(&lm->hdr->tail,__ATOMIC_ACQUIRE);
+	if(*off + rl > tail || tail - *off > lm->ringlen || buflen == 0){
+		return -1;
+	}
+	pos = *off % lm->ringlen;
+	memcpy(&rec,lm->ring + pos,rl);
+	if(rec.len > lm->ringlen - rl || *off + logmap_reclen(rec.len) > tail){
+		return -1;
+	}
+	if((len = rec.len) >= buflen){
+		len = buflen - 1;
+	}
+	if((pos += rl) == lm->ringlen){
+		pos = 0;
+	}
+	if((first = lm->ringlen - pos) > len){
+		first = len;
+	}
+	memcpy(buf,lm->ring + pos,first);
+	memcpy(buf + first,lm->ring,len - first);
+	buf[len] = '\0';
+	// A live writer might have lapped us while we were copying
+	if(__atomic_load_n(&lm->hdr->head,__ATOMIC_ACQUIRE) > *off){
+		return -1;
+	}
+	*off += logmap_reclen(rec.len);
+	*nsec = rec.nsec;
+	return (int)rec.len;
+}
+
+int close_logmap(logmap *lm){
+	lm->hdr = NULL;
+	lm->ring = NULL;
+	return release_scratchfile_ring(&lm->sr);
+}
@@ -0,0 +1,66 @@
+#ifndef LIBDANK_OBJECTS_LOGMAP
+#define LIBDANK_OBJECTS_LOGMAP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libdank/objects/ringbufs.h>
+
+// A logmap is a fixed-size logfile, mapped shared and used as a ring of
+// timestamped text records. Logging is a memcpy() and a few stores, with no
+// system calls; since the pages belong to the file, everything logged
+// survives the process (even a SIGKILL). The writer publishes the oldest
+// complete record before overwriting it and the end of the log after writing,
+// so the file is consistent at every instant. Space is allocated up front,
+// lest a full filesystem deliver SIGBUS through the map.
+#define LOGMAP_MAGIC 0x70616d676f6c6b64ULL // "dklogmap", little-endian
+#define LOGMAP_VERSION 1
+
+typedef struct logmap_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t hdrlen;	// offset of the ring within the file
+	uint64_t ringlen;
+	uint64_t head,tail;	// free-running offsets: oldest record, and end
+} logmap_header;
+
+// Each record is a header and its text, padded to a multiple of the header.
+typedef struct logmap_rec {
+	uint64_t nsec;		// CLOCK_REALTIME, nanoseconds since the epoch
+	uint32_t len;		// bytes of text, which might wrap the ring
+	uint32_t unused;
+} logmap_rec;
+
+typedef struct logmap {
+	scratchfile_ring sr;
+	logmap_header *hdr;
+	char *ring;
+	size_t ringlen;
+} logmap;
+
+// Create (or truncate) the file, reserving space for a ring of the given
+// length (which must be a multiple of the page size).
+int create_logmap(logmap *,const char *,size_t);
+
+// Append the text as one record, truncating it should it exceed the ring.
+void write_logmap(logmap *,const char *,size_t);
+
+// Map an existing logmap read-only, verifying its header.
+int open_logmap(logmap *,const char *);
+
+// Copy out the record at *off (initialize *off to the header's head), and
+// advance *off. Text is truncated to the buffer, and always NUL-terminated.
+// Returns the length of the (untruncated) text, or -1 once the tail has been
+// reached, or should the record have been overwritten by a live writer.
+int read_logmap(const logmap *,uint64_t *,uint64_t *,char *,size_t);
+
+int close_logmap(logmap *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
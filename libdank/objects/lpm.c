@@ -0,0 +1,610 @@
+#include <string.h>
+#include <netinet/in.h>
+#include <libdank/objects/lpm.h>
+#include <libdank/objects/ipset.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/utils/memlimit.h>
+
+#define LPM_ROOT_BITS	16
+#define LPM_ROOT_SIZE	(1u << LPM_ROOT_BITS)
+#define LPM_GROUP_BITS	8
+#define LPM_GROUP_SIZE	(1u << LPM_GROUP_BITS)
+#define LPM_MAXLEVELS	(1 + (128 - LPM_ROOT_BITS) / LPM_GROUP_BITS)
+#define LPM_BATCH	8
+
+// Each slot of the trie is a single word: an extension bit, the length of the
+// prefix which painted it, and a 23-bit index. Extended slots index a group;
+// all others index the value vector, element 0 of which is always NULL (thus
+// an empty slot, being all zeroes, requires no special casing on lookup).
+typedef uint32_t lpm_entry;
+
+#define LPM_EXT		0x80000000u
+#define LPM_DEPTH_SHIFT	23
+#define LPM_INDEX_MASK	0x007fffffu
+
+static inline lpm_entry
+lpm_leaf(unsigned depth,unsigned vidx){
+	return (depth << LPM_DEPTH_SHIFT) | vidx;
+}
+
+static inline unsigned
+lpm_depth(lpm_entry e){
+	return (e >> LPM_DEPTH_SHIFT) & 0xffu;
+}
+
+static inline unsigned
+lpm_index(lpm_entry e){
+	return e & LPM_INDEX_MASK;
+}
+
+// The authoritative rule set, as a binary trie on the prefix bits. Only
+// consulted on update, to find the prefix exposed by a removal.
+typedef struct lpm_rule {
+	struct lpm_rule *child[2];
+	unsigned vidx; // 0 if no prefix terminates here
+} lpm_rule;
+
+typedef struct lpm_table {
+	lpm_entry *root;
+	lpm_entry *groups;	// groupmax groups of LPM_GROUP_SIZE slots
+	unsigned groupcount,groupmax,groupsused;
+	unsigned freegroups;	// head of free group chain + 1, 0 if empty
+	void **values;
+	unsigned *freevals;
+	unsigned valuecount,valuemax,freevalcount;
+	lpm_rule *rules;
+	unsigned keybits,population;
+} lpm_table;
+
+static inline lpm_entry *
+lpm_group(const lpm_table *t,unsigned gidx){
+	return t->groups + (size_t)gidx * LPM_GROUP_SIZE;
+}
+
+// The slot indexed by the key at the given level of the multibit trie
+static inline unsigned
+key_slot(const uint8_t *key,unsigned level){
+	if(level == 0){
+		return ((unsigned)key[0] << 8u) | key[1];
+	}
+	return key[level + 1];
+}
+
+// Number of key bits consumed through the given level
+static inline unsigned
+level_limit(unsigned level){
+	return LPM_ROOT_BITS + level * LPM_GROUP_BITS;
+}
+
+static inline unsigned
+key_bit(const uint8_t *key,unsigned bit){
+	return (key[bit / 8] >> (7 - bit % 8)) & 1u;
+}
+
+static inline void
+lpm4_key(uint8_t *key,uint32_t ip){
+	key[0] = ip >> 24u;
+	key[1] = (ip >> 16u) & 0xffu;
+	key[2] = (ip >> 8u) & 0xffu;
+	key[3] = ip & 0xffu;
+}
+
+// Returns 0 on failure, as element 0 is reserved
+static unsigned
+alloc_value(lpm_table *t,void *v){
+	unsigned vidx;
+
+	if(t->freevalcount){
+		vidx = t->freevals[--t->freevalcount];
+	}else{
+		if(t->valuecount == t->valuemax){
+			unsigned newmax = t->valuemax * 2;
+			unsigned *ftmp;
+			void **vtmp;
+
+			if(newmax - 1 > LPM_INDEX_MASK){
+				bitch("Too many prefixes (%u)\n",t->valuecount);
+				return 0;
+			}
+			if((vtmp = Realloc("lpm values",t->values,sizeof(*vtmp) * newmax)) == NULL){
+				return 0;
+			}
+			t->values = vtmp;
+			if((ftmp = Realloc("lpm freevals",t->freevals,sizeof(*ftmp) * newmax)) == NULL){
+				return 0;
+			}
+			t->freevals = ftmp;
+			t->valuemax = newmax;
+		}
+		vidx = t->valuecount++;
+	}
+	t->values[vidx] = v;
+	return vidx;
+}
+
+static void
+release_value(lpm_table *t,unsigned vidx){
+	t->values[vidx] = NULL;
+	t->freevals[t->freevalcount++] = vidx;
+}
+
+static int
+alloc_group(lpm_table *t,lpm_entry fill){
+	lpm_entry *g;
+	unsigned z;
+	int gidx;
+
+	if(t->freegroups){
+		gidx = t->freegroups - 1;
+		t->freegroups = *lpm_group(t,gidx);
+	}else{
+		if(t->groupcount == t->groupmax){
+			unsigned newmax = t->groupmax ? t->groupmax * 2 : 16;
+			lpm_entry *tmp;
+
+			if(newmax - 1 > LPM_INDEX_MASK){
+				bitch("Too many trie groups (%u)\n",t->groupcount);
+				return -1;
+			}
+			if((tmp = Realloc("lpm groups",t->groups,sizeof(*tmp) *
+					LPM_GROUP_SIZE * (size_t)newmax)) == NULL){
+				return -1;
+			}
+			t->groups = tmp;
+			t->groupmax = newmax;
+		}
+		gidx = t->groupcount++;
+	}
+	g = lpm_group(t,gidx);
+	for(z = 0 ; z < LPM_GROUP_SIZE ; ++z){
+		g[z] = fill;
+	}
+	++t->groupsused;
+	return gidx;
+}
+
+static void
+release_group(lpm_table *t,unsigned gidx){
+	*lpm_group(t,gidx) = t->freegroups;
+	t->freegroups = gidx + 1;
+	--t->groupsused;
+}
+
+// If the group referenced by this (extended) slot has become uniform, fold it
+// back into the slot.
+static void
+collapse_slot(lpm_table *t,lpm_entry *tbl,unsigned slot){
+	const lpm_entry *g;
+	unsigned z;
+
+	if(!(tbl[slot] & LPM_EXT)){
+		return;
+	}
+	g = lpm_group(t,lpm_index(tbl[slot]));
+	if(g[0] & LPM_EXT){
+		return;
+	}
+	for(z = 1 ; z < LPM_GROUP_SIZE ; ++z){
+		if(g[z] != g[0]){
+			return;
+		}
+	}
+	z = lpm_index(tbl[slot]);
+	tbl[slot] = g[0];
+	release_group(t,z);
+}
+
+// Paint ent over the count slots starting at first, descending into any
+// groups. On insertion, we overwrite slots painted by prefixes no longer than
+// our own; on deletion, those painted by the prefix being removed (and then
+// fold any groups left uniform).
+static void
+paint_slots(lpm_table *t,lpm_entry *tbl,unsigned first,unsigned count,
+			unsigned depth,lpm_entry ent,int del){
+	unsigned z;
+
+	for(z = first ; z < first + count ; ++z){
+		lpm_entry e = tbl[z];
+
+		if(e & LPM_EXT){
+			paint_slots(t,lpm_group(t,lpm_index(e)),0,LPM_GROUP_SIZE,
+					depth,ent,del);
+			if(del){
+				collapse_slot(t,tbl,z);
+			}
+		}else if(del ? lpm_depth(e) == depth : lpm_depth(e) <= depth){
+			tbl[z] = ent;
+		}
+	}
+}
+
+static int
+lpm_paint(lpm_table *t,const uint8_t *key,unsigned len,lpm_entry ent,int del){
+	int gidx = -1,path[LPM_MAXLEVELS];
+	unsigned level,pslot[LPM_MAXLEVELS];
+	lpm_entry *tbl;
+
+	for(level = 0 ; ; ++level){
+		unsigned slot = key_slot(key,level);
+		unsigned lim = level_limit(level);
+
+		tbl = gidx < 0 ? t->root : lpm_group(t,gidx);
+		if(len <= lim){
+			unsigned span = lim - len;
+
+			slot &= ~((1u << span) - 1);
+			paint_slots(t,tbl,slot,1u << span,len,ent,del);
+			break;
+		}
+		if(!(tbl[slot] & LPM_EXT)){
+			int child;
+
+			if(del){ // nothing below here can carry our depth
+				break;
+			}
+			if((child = alloc_group(t,tbl[slot])) < 0){
+				return -1;
+			}
+			// alloc_group() might have moved the groups
+			tbl = gidx < 0 ? t->root : lpm_group(t,gidx);
+			tbl[slot] = LPM_EXT | (unsigned)child;
+		}
+		path[level] = gidx;
+		pslot[level] = slot;
+		gidx = lpm_index(tbl[slot]);
+	}
+	if(del){
+		while(level--){
+			tbl = path[level] < 0 ? t->root : lpm_group(t,path[level]);
+			collapse_slot(t,tbl,pslot[level]);
+		}
+	}
+	return 0;
+}
+
+// Find the rule node for the prefix, creating it and any ancestors if asked
+static lpm_rule *
+find_rule(lpm_table *t,const uint8_t *key,unsigned len,int create){
+	lpm_rule **r = &t->rules;
+	unsigned bit;
+
+	for(bit = 0 ; ; ++bit){
+		if(*r == NULL){
+			if(!create){
+				return NULL;
+			}
+			if((*r = Malloc("lpm rule",sizeof(**r))) == NULL){
+				return NULL;
+			}
+			memset(*r,0,sizeof(**r));
+		}
+		if(bit == len){
+			return *r;
+		}
+		r = &(*r)->child[key_bit(key,bit)];
+	}
+}
+
+// Free any nodes along the prefix's path which no longer lead to a rule
+static void
+prune_rules(lpm_rule **r,const uint8_t *key,unsigned bit,unsigned len){
+	if(*r){
+		if(bit < len){
+			prune_rules(&(*r)->child[key_bit(key,bit)],key,bit + 1,len);
+		}
+		if(!(*r)->vidx && !(*r)->child[0] && !(*r)->child[1]){
+			Free(*r);
+			*r = NULL;
+		}
+	}
+}
+
+// The slot which the longest rule of at most maxlen bits covering the key
+// would paint, or an empty slot if no such rule exists.
+static lpm_entry
+longest_rule(const lpm_table *t,const uint8_t *key,int maxlen){
+	const lpm_rule *r = t->rules;
+	lpm_entry best = 0;
+	int bit;
+
+	if(maxlen < 0){
+		return 0;
+	}
+	for(bit = 0 ; r ; ++bit){
+		if(r->vidx){
+			best = lpm_leaf(bit,r->vidx);
+		}
+		if(bit == maxlen){
+			break;
+		}
+		r = r->child[key_bit(key,bit)];
+	}
+	return best;
+}
+
+static int
+lpm_insert(lpm_table *t,const uint8_t *key,unsigned len,void *v,int replace,
+			void (*freefxn)(void *)){
+	unsigned vidx;
+	lpm_rule *r;
+
+	if(len > t->keybits){
+		bitch("Invalid prefix length %u (max %u)\n",len,t->keybits);
+		return -1;
+	}
+	if((r = find_rule(t,key,len,1)) == NULL){
+		prune_rules(&t->rules,key,0,len);
+		return -1;
+	}
+	if(r->vidx){
+		if(!replace){
+			bitch("Supplied duplicate prefix\n");
+			return -1;
+		}
+		if(freefxn){
+			freefxn(t->values[r->vidx]);
+		}
+		t->values[r->vidx] = v;
+		return 0;
+	}
+	if((vidx = alloc_value(t,v)) == 0){
+		prune_rules(&t->rules,key,0,len);
+		return -1;
+	}
+	if(lpm_paint(t,key,len,lpm_leaf(len,vidx),0)){
+		// back out whatever we managed to paint
+		lpm_paint(t,key,len,longest_rule(t,key,(int)len - 1),1);
+		release_value(t,vidx);
+		prune_rules(&t->rules,key,0,len);
+		return -1;
+	}
+	r->vidx = vidx;
+	++t->population;
+	return 0;
+}
+
+static int
+lpm_remove(lpm_table *t,const uint8_t *key,unsigned len,void (*freefxn)(void *)){
+	unsigned vidx;
+	lpm_rule *r;
+
+	if(len > t->keybits){
+		bitch("Invalid prefix length %u (max %u)\n",len,t->keybits);
+		return -1;
+	}
+	if((r = find_rule(t,key,len,0)) == NULL || r->vidx == 0){
+		bitch("Couldn't find /%u prefix\n",len);
+		return -1;
+	}
+	vidx = r->vidx;
+	r->vidx = 0;
+	lpm_paint(t,key,len,longest_rule(t,key,(int)len - 1),1);
+	if(freefxn){
+		freefxn(t->values[vidx]);
+	}
+	release_value(t,vidx);
+	prune_rules(&t->rules,key,0,len);
+	--t->population;
+	return 0;
+}
+
+static lpm_table *
+create_lpm(unsigned keybits){
+	const unsigned VALUES_INITIAL = 16;
+	lpm_table *ret;
+
+	if((ret = Malloc("lpm table",sizeof(*ret))) == NULL){
+		return NULL;
+	}
+	memset(ret,0,sizeof(*ret));
+	if((ret->root = Malloc("lpm root",sizeof(*ret->root) * LPM_ROOT_SIZE)) == NULL){
+		goto err;
+	}
+	memset(ret->root,0,sizeof(*ret->root) * LPM_ROOT_SIZE);
+	if((ret->values = Malloc("lpm values",sizeof(*ret->values) * VALUES_INITIAL)) == NULL){
+		goto err;
+	}
+	if((ret->freevals = Malloc("lpm freevals",sizeof(*ret->freevals) * VALUES_INITIAL)) == NULL){
+		goto err;
+	}
+	ret->values[0] = NULL;
+	ret->valuecount = 1;
+	ret->valuemax = VALUES_INITIAL;
+	ret->keybits = keybits;
+	return ret;
+
+err:
+	Free(ret->values);
+	Free(ret->root);
+	Free(ret);
+	return NULL;
+}
+
+lpm_table *create_lpm4(void){
+	return create_lpm(32);
+}
+
+lpm_table *create_lpm6(void){
+	return create_lpm(128);
+}
+
+int insert_lpm4(lpm_table *t,uint32_t ip,unsigned len,void *v){
+	uint8_t key[4];
+
+	lpm4_key(key,ip);
+	return lpm_insert(t,key,len,v,0,NULL);
+}
+
+int insert_lpm6(lpm_table *t,const struct in6_addr *ip,unsigned len,void *v){
+	return lpm_insert(t,ip->s6_addr,len,v,0,NULL);
+}
+
+int replace_lpm4(lpm_table *t,uint32_t ip,unsigned len,void *v,
+			void (*freefxn)(void *)){
+	uint8_t key[4];
+
+	lpm4_key(key,ip);
+	return lpm_insert(t,key,len,v,1,freefxn);
+}
+
+int replace_lpm6(lpm_table *t,const struct in6_addr *ip,unsigned len,void *v,
+			void (*freefxn)(void *)){
+	return lpm_insert(t,ip->s6_addr,len,v,1,freefxn);
+}
+
+int remove_lpm4(lpm_table *t,uint32_t ip,unsigned len,void (*freefxn)(void *)){
+	uint8_t key[4];
+
+	lpm4_key(key,ip);
+	return lpm_remove(t,key,len,freefxn);
+}
+
+int remove_lpm6(lpm_table *t,const struct in6_addr *ip,unsigned len,
+			void (*freefxn)(void *)){
+	return lpm_remove(t,ip->s6_addr,len,freefxn);
+}
+
+void *lookup_lpm4(const lpm_table *t,uint32_t ip){
+	lpm_entry e;
+
+	e = t->root[ip >> 16u];
+	if(e & LPM_EXT){
+		e = lpm_group(t,lpm_index(e))[(ip >> 8u) & 0xffu];
+		if(e & LPM_EXT){
+			e = lpm_group(t,lpm_index(e))[ip & 0xffu];
+		}
+	}
+	return t->values[lpm_index(e)];
+}
+
+void *lookup_lpm6(const lpm_table *t,const struct in6_addr *ip){
+	const uint8_t *key = ip->s6_addr;
+	unsigned level = 0;
+	lpm_entry e;
+
+	e = t->root[key_slot(key,0)];
+	while(e & LPM_EXT){
+		e = lpm_group(t,lpm_index(e))[key_slot(key,++level)];
+	}
+	return t->values[lpm_index(e)];
+}
+
+void lookup_lpm4_batch(const lpm_table *t,const uint32_t *ips,void **vals,
+				unsigned n){
+	lpm_entry e[LPM_BATCH];
+	unsigned z,i,b;
+
+	for(z = 0 ; z < n ; z += b){
+		const uint32_t *ip = ips + z;
+
+		b = n - z < LPM_BATCH ? n - z : LPM_BATCH;
+		for(i = 0 ; i < b ; ++i){
+			e[i] = t->root[ip[i] >> 16u];
+			if(e[i] & LPM_EXT){
+				__builtin_prefetch(lpm_group(t,lpm_index(e[i])) +
+						((ip[i] >> 8u) & 0xffu));
+			}
+		}
+		for(i = 0 ; i < b ; ++i){
+			if(e[i] & LPM_EXT){
+				e[i] = lpm_group(t,lpm_index(e[i]))[(ip[i] >> 8u) & 0xffu];
+				if(e[i] & LPM_EXT){
+					__builtin_prefetch(lpm_group(t,lpm_index(e[i])) +
+							(ip[i] & 0xffu));
+				}
+			}
+		}
+		for(i = 0 ; i < b ; ++i){
+			if(e[i] & LPM_EXT){
+				e[i] = lpm_group(t,lpm_index(e[i]))[ip[i] & 0xffu];
+			}
+			vals[z + i] = t->values[lpm_index(e[i])];
+		}
+	}
+}
+
+void lookup_lpm6_batch(const lpm_table *t,const struct in6_addr *ips,
+				void **vals,unsigned n){
+	lpm_entry e[LPM_BATCH];
+	unsigned z,i,b;
+
+	for(z = 0 ; z < n ; z += b){
+		const struct in6_addr *ip = ips + z;
+		unsigned level = 0;
+		int pending = 0;
+
+		b = n - z < LPM_BATCH ? n - z : LPM_BATCH;
+		for(i = 0 ; i < b ; ++i){
+			e[i] = t->root[key_slot(ip[i].s6_addr,0)];
+			if(e[i] & LPM_EXT){
+				__builtin_prefetch(lpm_group(t,lpm_index(e[i])) +
+						key_slot(ip[i].s6_addr,1));
+				pending = 1;
+			}
+		}
+		while(pending){
+			pending = 0;
+			++level;
+			for(i = 0 ; i < b ; ++i){
+				if(e[i] & LPM_EXT){
+					e[i] = lpm_group(t,lpm_index(e[i]))[key_slot(ip[i].s6_addr,level)];
+					if(e[i] & LPM_EXT){
+						__builtin_prefetch(lpm_group(t,lpm_index(e[i])) +
+							key_slot(ip[i].s6_addr,level + 1));
+						pending = 1;
+					}
+				}
+			}
+		}
+		for(i = 0 ; i < b ; ++i){
+			vals[z + i] = t->values[lpm_index(e[i])];
+		}
+	}
+}
+
+void *lookup_lpm4_ipset(const lpm_table *t,const ipset *is){
+	uint32_t lo,hi;
+	uint8_t key[4];
+	int len;
+
+	if(is->rangecount == 0){
+		return NULL;
+	}
+	// ipset ranges are sorted; the prefix must span the lowest and highest
+	lo = is->ranges[0].lower;
+	hi = is->ranges[is->rangecount - 1].upper;
+	len = lo == hi ? 32 : __builtin_clz(lo ^ hi);
+	lpm4_key(key,lo);
+	return t->values[lpm_index(longest_rule(t,key,len))];
+}
+
+static void
+free_rules(lpm_table *t,lpm_rule *r,void (*freefxn)(void *)){
+	if(r){
+		free_rules(t,r->child[0],freefxn);
+		free_rules(t,r->child[1],freefxn);
+		if(r->vidx && freefxn){
+			freefxn(t->values[r->vidx]);
+		}
+		Free(r);
+	}
+}
+
+void free_lpm(lpm_table *t,void (*freefxn)(void *)){
+	if(t){
+		free_rules(t,t->rules,freefxn);
+		Free(t->freevals);
+		Free(t->values);
+		Free(t->groups);
+		Free(t->root);
+		Free(t);
+	}
+}
+
+unsigned population_lpm(const lpm_table *t){
+	return t->population;
+}
+
+unsigned groups_lpm(const lpm_table *t){
+	return t->groupsused;
+}
@@ -0,0 +1,64 @@
+#ifndef LIBDANK_OBJECTS_LPM
+#define LIBDANK_OBJECTS_LPM
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct ipset;
+struct in6_addr;
+struct lpm_table;
+
+// Longest-prefix-match tables, mapping IPv4 or IPv6 prefixes onto opaque
+// state. Lookups are served from a multibit trie laid out DIR-16-8-8 (a
+// 65536-entry root indexed by the top 16 bits of the key, followed by 256-entry
+// groups for each further octet), each slot holding a single 32-bit word:
+// IPv4 lookups thus resolve in at most three dependent loads. Prefixes are
+// expanded into the trie (controlled prefix expansion); an authoritative binary
+// trie of the rules themselves is retained to support incremental removal.
+//
+// IPv4 addresses and prefixes are host-byte order, as with ipset. IPv6 are
+// struct in6_addrs (network-byte order). State is retained and must be valid
+// across the table's life; NULL state cannot be distinguished from a failed
+// lookup. Updates must be serialized against lookups by the caller.
+struct lpm_table *create_lpm4(void);
+struct lpm_table *create_lpm6(void);
+
+// Fails on an existing identical prefix; use replace_lpm*() to overwrite.
+int insert_lpm4(struct lpm_table *,uint32_t,unsigned,void *);
+int insert_lpm6(struct lpm_table *,const struct in6_addr *,unsigned,void *);
+int replace_lpm4(struct lpm_table *,uint32_t,unsigned,void *,void (*)(void *));
+int replace_lpm6(struct lpm_table *,const struct in6_addr *,unsigned,void *,
+			void (*)(void *));
+int remove_lpm4(struct lpm_table *,uint32_t,unsigned,void (*)(void *));
+int remove_lpm6(struct lpm_table *,const struct in6_addr *,unsigned,
+			void (*)(void *));
+
+void *lookup_lpm4(const struct lpm_table *,uint32_t);
+void *lookup_lpm6(const struct lpm_table *,const struct in6_addr *);
+
+// Look up each of the n keys, writing the results to the corresponding
+// elements of the output vector. Loads are issued a batch at a time, with the
+// next level of each key's trie prefetched before any are resolved.
+void lookup_lpm4_batch(const struct lpm_table *,const uint32_t *,void **,
+				unsigned);
+void lookup_lpm6_batch(const struct lpm_table *,const struct in6_addr *,
+				void **,unsigned);
+
+// Return the state of the longest prefix enclosing the entirety of the ipset
+// (ala srcroute_to_ipset()), or NULL if no prefix does so.
+void *lookup_lpm4_ipset(const struct lpm_table *,const struct ipset *);
+
+void free_lpm(struct lpm_table *,void (*)(void *));
+
+// Diagnostic functions -- query the number of prefixes, or trie groups
+unsigned population_lpm(const struct lpm_table *);
+unsigned groups_lpm(const struct lpm_table *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -44,12 +44,43 @@ int printUString(ustring *u,const char *fmt,...){
 	return r;
 }
 
-int vprintUString(ustring *u,const char *fmt,va_list v){
+// Grows the heap to heap bytes. Should we need to log an allocation failure,
+// the thread's log context mustn't be writing to the very ustring we're
+// growing, so it is detached for the duration.
+static int
+grow_ustring(ustring *u,size_t heap){
+	ustring *out = NULL,*err = NULL;
 	logctx *lc;
+	char *tmp;
+
+	if( (lc = get_thread_logctx()) ){
+		if((out = lc->out) == u){
+			lc->out = NULL;
+		}
+		if((err = lc->err) == u){
+			lc->err = NULL;
+		}
+	}
+	tmp = Realloc("string extension",u->string,heap);
+	if(lc){
+		lc->err = err;
+		lc->out = out;
+	}
+	if(tmp == NULL){
+		if(u->total != u->current){
+			u->string[u->current] = '\0';
+		}
+		return -1;
+	}
+	u->total = heap;
+	u->string = tmp;
+	return 0;
+}
+
+int vprintUString(ustring *u,const char *fmt,va_list v){
 	va_list tv;
 	int ret;
 
-	lc = get_thread_logctx();
 	va_copy(tv,v);
 	// Old (pre-ANSI, basically) snprintf() implementations return -1 instead of
 	// the number of characters (not including the terminator) that would be
@@ -58,42 +89,30 @@ int vprintUString(ustring *u,const char *fmt,va_list v){
 	// such an implementation require O(N) allocs!
 	while((ret = vsnprintf(u->string + u->current,u->total - u->current,fmt,tv)) < 0
 			|| (size_t)ret >= u->total - u->current){
-		ustring *out = NULL,*err = NULL;
-		size_t heap;
-		char *tmp;
-
 		va_end(tv);
-		if(lc){
-			if((out = lc->out) == u){
-				lc->out = NULL;
-			}
-			if((err = lc->err) == u){
-				lc->err = NULL;
-			}
-		}
 		if(ret < 0){
 			ret = 1;
 		}
-		heap = u->total + ret + BUFSIZ;
-		if((tmp = Realloc("string extension",u->string,heap)) == NULL){
-			if(u->total != u->current){
-				u->string[u->current] = '\0';
-			}
-			if(lc){
-				lc->err = err;
-				lc->out = out;
-			}
+		if(grow_ustring(u,u->total + ret + BUFSIZ)){
 			return -1;
 		}
-		u->total = heap;
-		u->string = tmp;
-		if(lc){
-			lc->err = err;
-			lc->out = out;
-		}
 		va_copy(tv,v);
 	}
 	va_end(tv);
 	u->current += ret;
 	return ret;
 }
+
+char *ustring_reserve(ustring *u,size_t n){
+	if(u->total - u->current <= n){
+		size_t heap = u->current + n + 1 + BUFSIZ;
+
+		if(heap < u->total * 2){
+			heap = u->total * 2;
+		}
+		if(grow_ustring(u,heap)){
+			return NULL;
+		}
+	}
+	return u->string + u->current;
+}
@@ -28,6 +28,12 @@ int printUString(ustring *,const char *,...)
 
 int vprintUString(ustring *,const char *,va_list);
 
+// Ensures room for n more characters and a NUL terminator, growing the heap
+// geometrically, and returns the end of the string. The caller may write
+// there directly, advancing current (and terminating the string) itself.
+// Returns NULL on allocation failure.
+char *ustring_reserve(ustring *,size_t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -226,21 +226,40 @@ merge_portset(portset *p,const portrange *merge){
 	return 0;
 }
 
+// Both sets are sorted and internally disjoint, so a single pass over the two
+// (ala mergesort) suffices, coalescing abutting and overlapping ranges.
 int merge_portsets(portset *portsum,const portset *add){
-	portset pstmp;
-	unsigned z;
+	unsigned a = 0,b = 0,n = 0;
+	portrange *ranges;
+	size_t s;
 
-	if(clone_portset(&pstmp,portsum)){
+	if(add->rangecount == 0){
+		return 0;
+	}
+	s = sizeof(*ranges) * (portsum->rangecount + add->rangecount);
+	if((ranges = Malloc("portset array",s)) == NULL){
 		return -1;
 	}
-	for(z = 0 ; z < add->rangecount ; ++z){
-		if(merge_portset(&pstmp,&add->ranges[z])){
-			free_portset(&pstmp);
-			return -1;
+	while(a < portsum->rangecount || b < add->rangecount){
+		const portrange *next;
+
+		if(b == add->rangecount || (a < portsum->rangecount &&
+				portsum->ranges[a].lower <= add->ranges[b].lower)){
+			next = &portsum->ranges[a++];
+		}else{
+			next = &add->ranges[b++];
+		}
+		if(n && ranges[n - 1].upper + 1u >= next->lower){
+			if(next->upper > ranges[n - 1].upper){
+				ranges[n - 1].upper = next->upper;
+			}
+		}else{
+			ranges[n++] = *next;
 		}
 	}
-	free_portset(portsum);
-	*portsum = pstmp;
+	Free(portsum->ranges);
+	portsum->ranges = ranges;
+	portsum->rangecount = n;
 	return 0;
 }
 
@@ -466,3 +485,125 @@ int portset_cmp(const portset *ps0,const portset *ps1){
 	return ps0->rangecount < ps1->rangecount ? -1 :
 		ps0->rangecount > ps1->rangecount;
 }
+
+// GCC generic vectors lower to AVX2 or SSE2 as -march allows. may_alias
+// permits them to be laid over the bitmap's words.
+typedef uint64_t portvec __attribute__ ((vector_size (32),may_alias));
+
+#define PORTBITMAP_VECS (sizeof(portbitmap) / sizeof(portvec))
+
+void init_portbitmap(portbitmap *pb){
+	memset(pb,0,sizeof(*pb));
+}
+
+static void
+portbitmap_set_range(portbitmap *pb,unsigned lower,unsigned upper){
+	unsigned lw = lower >> 6u,uw = upper >> 6u;
+	uint64_t lmask = ~0ull << (lower & 63u);
+	uint64_t umask = ~0ull >> (63u - (upper & 63u));
+
+	if(lw == uw){
+		pb->words[lw] |= lmask & umask;
+		return;
+	}
+	pb->words[lw] |= lmask;
+	while(++lw < uw){
+		pb->words[lw] = ~0ull;
+	}
+	pb->words[uw] |= umask;
+}
+
+void portbitmap_from_portset(portbitmap *pb,const portset *ps){
+	unsigned z;
+
+	init_portbitmap(pb);
+	for(z = 0 ; z < ps->rangecount ; ++z){
+		portbitmap_set_range(pb,ps->ranges[z].lower,ps->ranges[z].upper);
+	}
+}
+
+// Find the first port at or above from which is set (or unset, if set is 0).
+// Returns 65536 if there is none such.
+static unsigned
+portbitmap_scan(const portbitmap *pb,unsigned from,int set){
+	const uint64_t flip = set ? 0 : ~0ull;
+	unsigned w = from >> 6u;
+	uint64_t word;
+
+	if(w >= PORTBITMAP_WORDS){
+		return 65536;
+	}
+	word = (pb->words[w] ^ flip) & (~0ull << (from & 63u));
+	while(word == 0){
+		if(++w == PORTBITMAP_WORDS){
+			return 65536;
+		}
+		word = pb->words[w] ^ flip;
+	}
+	return w * 64 + __builtin_ctzll(word);
+}
+
+int portset_from_portbitmap(portset *ps,const portbitmap *pb){
+	unsigned port,count = 0;
+	portrange *ranges = NULL;
+
+	// size the array exactly, then fill it
+	for(port = 0 ; (port = portbitmap_scan(pb,port,1)) < 65536 ; ){
+		port = portbitmap_scan(pb,port,0);
+		++count;
+	}
+	if(count){
+		if((ranges = Malloc("portset array",sizeof(*ranges) * count)) == NULL){
+			return -1;
+		}
+		count = 0;
+		for(port = 0 ; (port = portbitmap_scan(pb,port,1)) < 65536 ; ){
+			ranges[count].lower = port;
+			port = portbitmap_scan(pb,port,0);
+			ranges[count++].upper = port - 1;
+		}
+	}
+	free_portset(ps);
+	ps->ranges = ranges;
+	ps->rangecount = count;
+	return 0;
+}
+
+void union_portbitmaps(portbitmap *dst,const portbitmap *src){
+	portvec *d = (portvec *)dst->words;
+	const portvec *s = (const portvec *)src->words;
+	unsigned z;
+
+	for(z = 0 ; z < PORTBITMAP_VECS ; ++z){
+		d[z] |= s[z];
+	}
+}
+
+void intersect_portbitmaps(portbitmap *dst,const portbitmap *src){
+	portvec *d = (portvec *)dst->words;
+	const portvec *s = (const portvec *)src->words;
+	unsigned z;
+
+	for(z = 0 ; z < PORTBITMAP_VECS ; ++z){
+		d[z] &= s[z];
+	}
+}
+
+void subtract_portbitmaps(portbitmap *dst,const portbitmap *src){
+	portvec *d = (portvec *)dst->words;
+	const portvec *s = (const portvec *)src->words;
+	unsigned z;
+
+	for(z = 0 ; z < PORTBITMAP_VECS ; ++z){
+		d[z] &= ~s[z];
+	}
+}
+
+unsigned portbitmap_portcount(const portbitmap *pb){
+	unsigned z,count = 0;
+
+	for(z = 0 ; z < PORTBITMAP_WORDS ; ++z){
+		count += __builtin_popcountll(pb->words[z]);
+	}
+	return count;
+}
@@ -60,6 +60,31 @@ int contains_port(const portset *p,uint16_t port){
 	return 0;
 }
 
+// An alternative, fixed-size representation: one bit per port, 8KB in all.
+// Membership is O(1), and set algebra proceeds a vector register at a time.
+#define PORTBITMAP_WORDS (65536 / 64)
+
+typedef struct portbitmap {
+	uint64_t words[PORTBITMAP_WORDS];
+} __attribute__ ((aligned (32))) portbitmap;
+
+void init_portbitmap(portbitmap *);
+void portbitmap_from_portset(portbitmap *,const portset *);
+int portset_from_portbitmap(portset *,const portbitmap *);
+
+// The first argument is updated with the result of the operation
+void union_portbitmaps(portbitmap *,const portbitmap *);
+void intersect_portbitmaps(portbitmap *,const portbitmap *);
+void subtract_portbitmaps(portbitmap *,const portbitmap *);
+
+// Unlike portset_portcount(), a complete set (65536 ports) is representable
+unsigned portbitmap_portcount(const portbitmap *);
+
+static inline
+int portbitmap_contains_port(const portbitmap *pb,uint16_t port){
+	return (pb->words[port >> 6u] >> (port & 63u)) & 1u;
+}
+
 typedef struct portset_iterator {
 	const portset *ps;
 	int priter;
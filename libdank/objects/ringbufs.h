@@ -5,7 +5,9 @@
 extern "C" {
 #endif
 
+#include <sys/mman.h>
 #include <libdank/utils/mmap.h>
+#include <libdank/utils/syswrap.h>
 
 // Ring buffer using a single underlying mmap()able file descriptor (possibly a
 // shared memory segment) -- presumably one we've created -- or an anonymous
@@ -1,3 +1,5 @@
+#define LOG_CATEGORY LOGCAT_SLALLOC
+
 #include <stddef.h>
 #include <sys/mman.h>
 #include <libdank/utils/magic.h>
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
@@ -131,3 +132,35 @@ int Writen(int fd,const void *buf,size_t unsafe_s){
 	}
 	return 0;
 }
+
+int Writevn(int fd,struct iovec *iov,int iovcnt){
+	while(iovcnt){
+		ssize_t ret;
+
+		if(iov->iov_len == 0){
+			++iov;
+			--iovcnt;
+			continue;
+		}
+		if((ret = writev(fd,iov,iovcnt > IOV_MAX ? IOV_MAX : iovcnt)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			moan("Error writing %d iovecs to %d\n",iovcnt,fd);
+			return -1;
+		}else if(ret == 0){
+			bitch("EOF writing %d iovecs to %d\n",iovcnt,fd);
+			return -1;
+		}
+		while(iovcnt && (size_t)ret >= iov->iov_len){
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if(ret){
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= (size_t)ret;
+		}
+	}
+	return 0;
+}
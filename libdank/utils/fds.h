@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <libdank/utils/fcntl.h>
 
@@ -16,6 +17,9 @@ off_t fd_offset(int);
 
 int Readn(int,void *,size_t);
 int Writen(int,const void *,size_t);
+// Writes each of the iovecs in their entirety, retrying partial writes. The
+// iovecs are consumed (advanced past whatever was written).
+int Writevn(int,struct iovec *,int);
 
 // Linux has extended fd-generation functions (open(), accept(), epoll() etc)
 // to take *_NONBLOCK/*_CLOEXEC flags. We use these on Linux, and emulate them
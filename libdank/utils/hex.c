@@ -4,61 +4,304 @@
 #include <sys/types.h>
 #include <libdank/utils/hex.h>
 #include <libdank/objects/logctx.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_X86
+#endif
 
-// Decode a string with precisely len pairs of hex digits, seperated by sep
-// (which may be EOF to indicate no seperator), into buf. If this many hex
-// digits are not available, return NULL. buf will not be NUL-terminated.
-unsigned char *hextoascii(const char * restrict hex,unsigned char * restrict buf,
-					int sep,size_t len){
-	size_t off = 0;
+#define HEXDIG(x)	((x) < 10 ? '0' + (x) : 'A' + (x) - 10)
+#define HP(n)		{ HEXDIG((n) >> 4), HEXDIG((n) & 0xf) }
+#define HP4(n)		HP(n), HP((n) + 1), HP((n) + 2), HP((n) + 3)
+#define HP16(n)		HP4(n), HP4((n) + 4), HP4((n) + 8), HP4((n) + 12)
+#define HP64(n)		HP16(n), HP16((n) + 16), HP16((n) + 32), HP16((n) + 48)
+
+// The two hex digits of each byte value
+static const char hexpairs[256][2] = {
+	HP64(0), HP64(64), HP64(128), HP64(192),
+};
+
+#undef HP64
+#undef HP16
+#undef HP4
+#undef HP
+#undef HEXDIG
+
+// The value of each hex digit, or'd with HEXVALID. Other characters are 0.
+#define HEXVALID	0x10
+#define HV(c,v)		[c] = HEXVALID | (v)
+
+static const unsigned char hexvals[256] = {
+	HV('0',0x0), HV('1',0x1), HV('2',0x2), HV('3',0x3), HV('4',0x4),
+	HV('5',0x5), HV('6',0x6), HV('7',0x7), HV('8',0x8), HV('9',0x9),
+	HV('A',0xa), HV('B',0xb), HV('C',0xc), HV('D',0xd), HV('E',0xe), HV('F',0xf),
+	HV('a',0xa), HV('b',0xb), HV('c',0xc), HV('d',0xd), HV('e',0xe), HV('f',0xf),
+};
+
+#undef HV
+
+// Encodes n bytes, following each with sep (unless it is EOF), and returns the
+// end of the output. The vector kernels share this contract, leaving partial
+// blocks to the table.
+static char *
+hex_encode_table(const unsigned char *buf,char *hex,int sep,size_t n){
+	if(sep == EOF){
+		while(n--){
+			memcpy(hex,hexpairs[*buf++],2);
+			hex += 2;
+		}
+	}else{
+		while(n--){
+			memcpy(hex,hexpairs[*buf++],2);
+			hex[2] = (char)sep;
+			hex += 3;
+		}
+	}
+	return hex;
+}
+
+#ifdef HEX_X86
+// These are built for their instruction sets regardless of the compiler's
+// target, and only called once the CPU has been found to support them.
+#define SSSE3	__attribute__ ((target ("ssse3")))
+#define AVX2	__attribute__ ((target ("avx2")))
+
+SSSE3 static char *
+hex_encode_ssse3(const unsigned char *buf,char *hex,int sep,size_t n){
+	const __m128i digits = _mm_setr_epi8('0','1','2','3','4','5','6','7',
+					'8','9','A','B','C','D','E','F');
+	const __m128i nibble = _mm_set1_epi8(0xf);
+
+	if(sep == EOF){
+		for( ; n >= 16 ; n -= 16){
+			__m128i v = _mm_loadu_si128((const __m128i *)buf);
+			__m128i h = _mm_shuffle_epi8(digits,_mm_and_si128(_mm_srli_epi16(v,4),nibble));
+			__m128i l = _mm_shuffle_epi8(digits,_mm_and_si128(v,nibble));
+
+			_mm_storeu_si128((__m128i *)hex,_mm_unpacklo_epi8(h,l));
+			_mm_storeu_si128((__m128i *)(hex + 16),_mm_unpackhi_epi8(h,l));
+			buf += 16;
+			hex += 32;
+		}
+	}else{
+		// Sixteen bytes become 48 characters: pairs drawn from the
+		// 32 digits, with every third character a separator.
+		const __m128i s = _mm_set1_epi8((char)sep);
+		const __m128i m0 = _mm_setr_epi8(0,1,-1,2,3,-1,4,5,-1,6,7,-1,8,9,-1,10);
+		const __m128i m1a = _mm_setr_epi8(11,-1,12,13,-1,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+		const __m128i m1b = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,0,1,-1,2,3,-1,4,5);
+		const __m128i m2 = _mm_setr_epi8(-1,6,7,-1,8,9,-1,10,11,-1,12,13,-1,14,15,-1);
+		const __m128i s0 = _mm_and_si128(s,_mm_setr_epi8(0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0));
+		const __m128i s1 = _mm_and_si128(s,_mm_setr_epi8(0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0));
+		const __m128i s2 = _mm_and_si128(s,_mm_setr_epi8(-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1));
+
+		for( ; n >= 16 ; n -= 16){
+			__m128i v = _mm_loadu_si128((const __m128i *)buf);
+			__m128i h = _mm_shuffle_epi8(digits,_mm_and_si128(_mm_srli_epi16(v,4),nibble));
+			__m128i l = _mm_shuffle_epi8(digits,_mm_and_si128(v,nibble));
+			__m128i p0 = _mm_unpacklo_epi8(h,l),p1 = _mm_unpackhi_epi8(h,l);
+
+			_mm_storeu_si128((__m128i *)hex,_mm_or_si128(_mm_shuffle_epi8(p0,m0),s0));
+			_mm_storeu_si128((__m128i *)(hex + 16),_mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(p0,m1a),_mm_shuffle_epi8(p1,m1b)),s1));
+			_mm_storeu_si128((__m128i *)(hex + 32),_mm_or_si128(_mm_shuffle_epi8(p1,m2),s2));
+			buf += 16;
+			hex += 48;
+		}
+	}
+	return hex_encode_table(buf,hex,sep,n);
+}
+
+AVX2 static char *
+hex_encode_avx2(const unsigned char *buf,char *hex,int sep,size_t n){
+	const __m256i digits = _mm256_setr_epi8('0','1','2','3','4','5','6','7',
+					'8','9','A','B','C','D','E','F',
+					'0','1','2','3','4','5','6','7',
+					'8','9','A','B','C','D','E','F');
+	const __m256i nibble = _mm256_set1_epi8(0xf);
+
+	if(sep != EOF){
+		return hex_encode_ssse3(buf,hex,sep,n);
+	}
+	for( ; n >= 32 ; n -= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i *)buf);
+		__m256i h = _mm256_shuffle_epi8(digits,_mm256_and_si256(_mm256_srli_epi16(v,4),nibble));
+		__m256i l = _mm256_shuffle_epi8(digits,_mm256_and_si256(v,nibble));
+		// Unpacking works within 128-bit lanes
+		__m256i p0 = _mm256_unpacklo_epi8(h,l),p1 = _mm256_unpackhi_epi8(h,l);
+
+		_mm256_storeu_si256((__m256i *)hex,_mm256_permute2x128_si256(p0,p1,0x20));
+		_mm256_storeu_si256((__m256i *)(hex + 32),_mm256_permute2x128_si256(p0,p1,0x31));
+		buf += 32;
+		hex += 64;
+	}
+	return hex_encode_ssse3(buf,hex,sep,n);
+}
+
+// Sixteen characters to nibble values, setting *valid to all-ones for each
+// hex digit. Digits are c - '0' <= 9; letters (either case) (c | 0x20) - 'a'
+// <= 5, unsigned.
+SSSE3 static inline __m128i
+hex_nibbles_ssse3(__m128i c,__m128i *valid){
+	__m128i d = _mm_sub_epi8(c,_mm_set1_epi8('0'));
+	__m128i a = _mm_sub_epi8(_mm_or_si128(c,_mm_set1_epi8(0x20)),_mm_set1_epi8('a'));
+	__m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(d,_mm_set1_epi8(9)),d);
+	__m128i isa = _mm_cmpeq_epi8(_mm_min_epu8(a,_mm_set1_epi8(5)),a);
+
+	*valid = _mm_or_si128(isd,isa);
+	return _mm_or_si128(_mm_and_si128(isd,d),
+			_mm_and_si128(isa,_mm_add_epi8(a,_mm_set1_epi8(10))));
+}
+
+// Decodes whole blocks of undelimited pairs, stopping at the first block
+// holding anything other than hex digits. Returns the bytes decoded.
+SSSE3 static size_t
+hex_decode_ssse3(const char *hex,unsigned char *buf,size_t n){
+	const __m128i weights = _mm_set1_epi16(0x0110);	// high nibble first
+	size_t done = 0;
+
+	for( ; n - done >= 16 ; done += 16){
+		__m128i v0,v1,ok0,ok1;
+
+		v0 = hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(hex + done * 2)),&ok0);
+		v1 = hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(hex + done * 2 + 16)),&ok1);
+		if(_mm_movemask_epi8(_mm_and_si128(ok0,ok1)) != 0xffff){
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(buf + done),_mm_packus_epi16(
+			_mm_maddubs_epi16(v0,weights),_mm_maddubs_epi16(v1,weights)));
+	}
+	return done;
+}
+
+AVX2 static inline __m256i
+hex_nibbles_avx2(__m256i c,__m256i *valid){
+	__m256i d = _mm256_sub_epi8(c,_mm256_set1_epi8('0'));
+	__m256i a = _mm256_sub_epi8(_mm256_or_si256(c,_mm256_set1_epi8(0x20)),_mm256_set1_epi8('a'));
+	__m256i isd = _mm256_cmpeq_epi8(_mm256_min_epu8(d,_mm256_set1_epi8(9)),d);
+	__m256i isa = _mm256_cmpeq_epi8(_mm256_min_epu8(a,_mm256_set1_epi8(5)),a);
+
+	*valid = _mm256_or_si256(isd,isa);
+	return _mm256_or_si256(_mm256_and_si256(isd,d),
+			_mm256_and_si256(isa,_mm256_add_epi8(a,_mm256_set1_epi8(10))));
+}
+
+AVX2 static size_t
+hex_decode_avx2(const char *hex,unsigned char *buf,size_t n){
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	size_t done = 0;
+
+	for( ; n - done >= 32 ; done += 32){
+		__m256i v0,v1,ok0,ok1,packed;
+
+		v0 = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hex + done * 2)),&ok0);
+		v1 = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hex + done * 2 + 32)),&ok1);
+		if(_mm256_movemask_epi8(_mm256_and_si256(ok0,ok1)) != -1){
+			break;
+		}
+		// Packing works within 128-bit lanes, interleaving quadwords
+		packed = _mm256_packus_epi16(_mm256_maddubs_epi16(v0,weights),
+						_mm256_maddubs_epi16(v1,weights));
+		_mm256_storeu_si256((__m256i *)(buf + done),_mm256_permute4x64_epi64(packed,0xd8));
+	}
+	return done + hex_decode_ssse3(hex + done * 2,buf + done,n - done);
+}
+
+#undef AVX2
+#undef SSSE3
+#endif
+
+// -1 until the CPU has been examined
+static int hex_active = -1;
+
+static hex_kernel
+detect_hex_kernel(void){
+#ifdef HEX_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		return HEX_KERNEL_AVX2;
+	}
+	if(__builtin_cpu_supports("ssse3")){
+		return HEX_KERNEL_SSSE3;
+	}
+#endif
+	return HEX_KERNEL_SCALAR;
+}
+
+// Racing threads all arrive at the same answer, so no lock is needed
+static inline int
+active_hex_kernel(void){
+	int k;
+
+	if((k = __atomic_load_n(&hex_active,__ATOMIC_RELAXED)) < 0){
+		k = detect_hex_kernel();
+		__atomic_store_n(&hex_active,k,__ATOMIC_RELAXED);
+	}
+	return k;
+}
+
+hex_kernel limit_hex_kernel(hex_kernel k){
+	hex_kernel best = detect_hex_kernel();
+
+	if(k > best){
+		k = best;
+	}
+	__atomic_store_n(&hex_active,k,__ATOMIC_RELAXED);
+	return k;
+}
+
+static char *
+hex_encode(const unsigned char *buf,char *hex,int sep,size_t n){
+	switch(active_hex_kernel()){
+#ifdef HEX_X86
+		case HEX_KERNEL_AVX2: return hex_encode_avx2(buf,hex,sep,n);
+		case HEX_KERNEL_SSSE3: return hex_encode_ssse3(buf,hex,sep,n);
+#endif
+		default: break;
+	}
+	return hex_encode_table(buf,hex,sep,n);
+}
+
+// Separators go between pairs, not after the last
+static char *
+hex_encode_delimited(const unsigned char *buf,char *hex,int sep,size_t len){
+	if(sep != EOF && len){
+		hex = hex_encode(buf,hex,sep,len - 1);
+		memcpy(hex,hexpairs[buf[len - 1]],2);
+		return hex + 2;
+	}
+	return hex_encode(buf,hex,sep,len);
+}
+
+// Decodes as many leading undelimited pairs as the vector kernels can,
+// returning the number of bytes decoded.
+static size_t
+hex_decode(const char *hex,unsigned char *buf,size_t n){
+	switch(active_hex_kernel()){
+#ifdef HEX_X86
+		case HEX_KERNEL_AVX2: return hex_decode_avx2(hex,buf,n);
+		case HEX_KERNEL_SSSE3: return hex_decode_ssse3(hex,buf,n);
+#endif
+		default: break;
+	}
+	return 0;
+}
 
+static unsigned char *
+hextoascii_table(const char *hex,unsigned char *buf,int sep,size_t len){
 	while(len){
-		switch(hex[0]){
-			case 'F':  case 'f':  buf[off] = 0xF0; break;
-			case 'E':  case 'e':  buf[off] = 0xE0; break;
-			case 'D':  case 'd':  buf[off] = 0xD0; break;
-			case 'C':  case 'c':  buf[off] = 0xC0; break;
-			case 'B':  case 'b':  buf[off] = 0xB0; break;
-			case 'A':  case 'a':  buf[off] = 0xA0; break;
-			case '9':  buf[off] = 0x90; break;
-			case '8':  buf[off] = 0x80; break;
-			case '7':  buf[off] = 0x70; break;
-			case '6':  buf[off] = 0x60; break;
-			case '5':  buf[off] = 0x50; break;
-			case '4':  buf[off] = 0x40; break;
-			case '3':  buf[off] = 0x30; break;
-			case '2':  buf[off] = 0x20; break;
-			case '1':  buf[off] = 0x10; break;
-			case '0':  buf[off] = 0; break;
-			default:
-				bitch("Expected hex digit, got %s\n",hex);
-				return NULL;
+		unsigned hi,lo;
+
+		if(!((hi = hexvals[(unsigned char)hex[0]]) & HEXVALID)){
+			bitch("Expected hex digit, got %s\n",hex);
+			return NULL;
 		}
-		switch(hex[1]){
-			case 'F':  case 'f':  buf[off] |= 0xF; break;
-			case 'E':  case 'e':  buf[off] |= 0xE; break;
-			case 'D':  case 'd':  buf[off] |= 0xD; break;
-			case 'C':  case 'c':  buf[off] |= 0xC; break;
-			case 'B':  case 'b':  buf[off] |= 0xB; break;
-			case 'A':  case 'a':  buf[off] |= 0xA; break;
-			case '9':  buf[off] |= 0x9; break;
-			case '8':  buf[off] |= 0x8; break;
-			case '7':  buf[off] |= 0x7; break;
-			case '6':  buf[off] |= 0x6; break;
-			case '5':  buf[off] |= 0x5; break;
-			case '4':  buf[off] |= 0x4; break;
-			case '3':  buf[off] |= 0x3; break;
-			case '2':  buf[off] |= 0x2; break;
-			case '1':  buf[off] |= 0x1; break;
-			case '0':  break;
-			default:
-				bitch("Expected hex digpair, got %s\n",hex);
-				return NULL;
+		if(!((lo = hexvals[(unsigned char)hex[1]]) & HEXVALID)){
+			bitch("Expected hex digpair, got %s\n",hex);
+			return NULL;
 		}
-		--len;
-		++buf;
+		*buf++ = (unsigned char)((hi << 4) | (lo & 0xf));
 		hex += 2;
-		if(len){
+		if(--len){
 			if(sep != EOF){
 				if(*hex != sep){
 					bitch("Expected %c, got %s\n",sep,hex);
@@ -68,7 +311,25 @@ unsigned char *hextoascii(const char * restrict hex,unsigned char * restrict buf
 			}
 		}
 	}
-	return buf - off;
+	return buf;
+}
+
+// Decode a string with precisely len pairs of hex digits, seperated by sep
+// (which may be EOF to indicate no seperator), into buf. If this many hex
+// digits are not available, return NULL. buf will not be NUL-terminated.
+unsigned char *hextoascii(const char * restrict hex,unsigned char * restrict buf,
+					int sep,size_t len){
+	// The vector kernels read whole blocks, so first ensure the digits are
+	// all there. Anything they can't handle (including a short or invalid
+	// string) is left to the table, which reports the problem.
+	if(sep == EOF && len >= 16 && strnlen(hex,len * 2) == len * 2){
+		size_t done = hex_decode(hex,buf,len);
+
+		hex += done * 2;
+		buf += done;
+		len -= done;
+	}
+	return hextoascii_table(hex,buf,sep,len);
 }
 
 // Decode len characters from buf into a NUL-terminated ascii representation in
@@ -76,52 +337,42 @@ unsigned char *hextoascii(const char * restrict hex,unsigned char * restrict buf
 // 2*len+1 bytes, or 3*len+1 if sep != EOF. Result is always NUL-terminated.
 void asciitohex(const void * restrict voidbuf,char * restrict hex,
 				int sep,size_t len){
-	const char *hexdig = "0123456789ABCDEF";
-	const unsigned char *buf = voidbuf;
-	int i = 0;
-
-	while(len > 1){
-		hex[i++] = hexdig[*buf >> 4];
-		hex[i++] = hexdig[*buf & 0x0f];
-		if(sep != EOF){
-			hex[i++] = sep;
-		}
-		++buf;
-		--len;
+	hex = hex_encode_delimited(voidbuf,hex,sep,len);
+	*hex = '\0';
+}
+
+void init_ustring_hexer(ustring_hexer *uh,ustring *us,int sep){
+	uh->us = us;
+	uh->sep = sep;
+	uh->encoded = 0;
+}
+
+// Encodes directly into the ustring's heap, which is grown once per write
+int ustring_hexer_write(ustring_hexer *uh,const void *buf,size_t len){
+	char *hex,*start;
+
+	if(len == 0){
+		return 0;
+	}
+	if((start = ustring_reserve(uh->us,len * (uh->sep == EOF ? 2 : 3))) == NULL){
+		return -1;
 	}
-	if(len){
-		hex[i++] = hexdig[*buf >> 4];
-		hex[i++] = hexdig[*buf & 0x0f];
-		++buf;
-		--len;
+	hex = start;
+	if(uh->sep != EOF && uh->encoded){
+		*hex++ = (char)uh->sep;
 	}
-	hex[i] = '\0';
+	hex = hex_encode_delimited(buf,hex,uh->sep,len);
+	*hex = '\0';
+	uh->us->current += (size_t)(hex - start);
+	uh->encoded += len;
+	return 0;
 }
 
 // Like the above, but writes to a ustring; returns true on error
 int us_asciitohex(const void * restrict voidbuf,ustring * restrict us_hex,
 			int sep,size_t len){
-	const unsigned char *buf = voidbuf;
-
-	while(len > 1){
-		if(sep != EOF){
-		  if(printUString(us_hex,"%02hhX%c",*buf,sep) < 0) {
-		    return -1;
-		  }
-		}else{
-		  if(printUString(us_hex,"%02hhX",*buf) < 0) {
-		    return -1;
-		  }
-		}
-		++buf;
-		--len;
-	}
-	if(len == 1){
-	  if(printUString(us_hex,"%02hhX",*buf) < 0 ) {
-	    return -1;
-	  }
-	  ++buf;
-	  --len;
-	}
-	return 0;
+	ustring_hexer uh;
+
+	init_ustring_hexer(&uh,us_hex,sep);
+	return ustring_hexer_write(&uh,voidbuf,len);
 }
@@ -1,6 +1,7 @@
 #ifndef UTILS_HEX
 #define UTILS_HEX
 
+#include <stdint.h>
 #include <libdank/objects/objustring.h>
 
 #ifdef __cplusplus
@@ -12,6 +13,29 @@ unsigned char *hextoascii(const char * restrict,unsigned char * restrict,
 void asciitohex(const void * restrict,char * restrict,int,size_t);
 int us_asciitohex(const void * restrict,ustring * restrict,int,size_t);
 
+// Streaming encoder, appending to a ustring. Successive writes produce the
+// same text as a single us_asciitohex() of their concatenation, separators
+// included.
+typedef struct ustring_hexer {
+	ustring *us;
+	int sep;
+	uintmax_t encoded;	// bytes encoded thus far
+} ustring_hexer;
+
+void init_ustring_hexer(ustring_hexer *,ustring *,int);
+int ustring_hexer_write(ustring_hexer *,const void *,size_t);
+
+// Bulk conversions are vectorized where the CPU allows, as determined at
+// runtime. The kernel can be limited (for testing or benchmarking); the
+// kernel actually in use thereafter is returned.
+typedef enum {
+	HEX_KERNEL_SCALAR,	// table-driven
+	HEX_KERNEL_SSSE3,	// 16 bytes per iteration
+	HEX_KERNEL_AVX2,	// 32 bytes per iteration
+} hex_kernel;
+
+hex_kernel limit_hex_kernel(hex_kernel);
+
 #ifdef __cplusplus
 }
 #endif
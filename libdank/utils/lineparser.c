@@ -1,21 +1,122 @@
 #include <ctype.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libdank/utils/string.h>
+#include <libdank/utils/syswrap.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/utils/lineparser.h>
+#include <libdank/modules/tracing/threads.h>
+
+static inline int
+is_comment(const char *buf,size_t offset){
+	return *(buf + offset) == '#';
+}
+
+// Map the remainder of a regular file, copy-on-write, so that lines can be
+// terminated and joined in place. Anything else is read.
+static int
+map_line_parser(line_parser_ctx *ctx,int fd){
+	struct stat st;
+	off_t off;
+	char *map;
+
+	if(fstat(fd,&st) || !S_ISREG(st.st_mode)){
+		return -1;
+	}
+	if((off = lseek(fd,0,SEEK_CUR)) < 0 || st.st_size <= off){
+		return -1;
+	}
+	map = mmap(NULL,(size_t)st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+	if(map == MAP_FAILED){
+		return -1;
+	}
+	track_allocation("line parser map");
+	madvise(map,(size_t)st.st_size,MADV_SEQUENTIAL);
+	ctx->map = map;
+	ctx->maplen = (size_t)st.st_size;
+	ctx->mappos = map + off;
+	ctx->mapend = map + ctx->maplen;
+	return 0;
+}
 
 int prepare_line_parser(line_parser_ctx *ctx,int fd){
 	memset(ctx,0,sizeof(*ctx));
+	ctx->fd = fd;
 	if((ctx->buf = Malloc("line parser buffer",BUFSIZ)) == NULL){
 		return -1;
 	}
 	ctx->total = BUFSIZ;
-	ctx->fd = fd;
 	return 0;
 }
 
-static inline int
-is_comment(const char *buf,size_t offset){
-	return *(buf + offset) == '#';
+int prepare_mapped_line_parser(line_parser_ctx *ctx,int fd){
+	memset(ctx,0,sizeof(*ctx));
+	ctx->fd = fd;
+	if(map_line_parser(ctx,fd) == 0){
+		return 0;
+	}
+	return prepare_line_parser(ctx,fd);
+}
+
+// A newline preceded (ignoring whitespace) by a backslash continues the line.
+// Returns the backslash, if any.
+static char *
+line_continuation(char *line,char *nl){
+	char *t = nl;
+
+	while(t > line){
+		if(*--t == '\\'){
+			return t;
+		}else if(!isspace((unsigned char)*t)){
+			break;
+		}
+	}
+	return NULL;
+}
+
+// The mapped equivalent of the read loop in line_parser_next(), with the same
+// treatment of leading whitespace, continuations and comments. memchr() is
+// vectorized by libc, and the continuation and comment checks touch only the
+// ends of each line. The final line, if unterminated, is copied to *tail, as
+// the map might have no room for its NUL.
+static char *
+next_mapped_line(char **pos,char *end,char **tail){
+	char *p = *pos;
+
+	for( ; ; ){
+		char *line,*nl,*bs;
+
+		while(p < end && isspace((unsigned char)*p)){
+			++p;
+		}
+		if(p == end){
+			*pos = p;
+			errno = 0;
+			return NULL;
+		}
+		line = p;
+		while((nl = memchr(p,'\n',(size_t)(end - p))) && (bs = line_continuation(line,nl))){
+			*bs = ' ';
+			*nl = ' ';
+			p = nl + 1;
+		}
+		*pos = p = nl ? nl + 1 : end;
+		if(is_comment(line,0)){
+			continue;
+		}
+		if(nl){
+			*nl = '\0';
+			return line;
+		}
+		Free(*tail);
+		if((*tail = Strndup(line,(size_t)(end - line))) == NULL){
+			errno = ENOMEM;
+			return NULL;
+		}
+		return *tail;
+	}
 }
 
 // Heap allocates and returns the next line, as delimited by '\n'. Caller must
@@ -25,6 +126,10 @@ is_comment(const char *buf,size_t offset){
 char *line_parser_next(line_parser_ctx *ctx){
 	unsigned examined = 0;
 
+	if(ctx->map){
+		return next_mapped_line(&ctx->mappos,ctx->mapend,&ctx->tail);
+	}
+
 	while(ctx->count > examined || !ctx->eof){
 		char *end;
 
@@ -151,39 +256,185 @@ char *line_parser_next(line_parser_ctx *ctx){
 }
 
 void destroy_line_parser(line_parser_ctx *ctx){
+	if(ctx->map){
+		Munmap(ctx->map,ctx->maplen);
+		track_deallocation();
+	}
+	Free(ctx->tail);
 	Free(ctx->buf);
 	memset(ctx,0,sizeof(*ctx));
 	ctx->fd = -1;
 }
 
-int parser_byline(int fd,line_parser_cb lcb,void *arg){
-	int ret = -1,lines = 0;
-	line_parser_ctx ctx;
+// Runs the callback over the parser's lines, returning the number parsed, or
+// -1 on failure.
+static int
+run_line_parser(line_parser_ctx *ctx,line_parser_cb lcb,void *arg){
+	int lines = 0;
 	char *line;
 
-	if(prepare_line_parser(&ctx,fd)){
-		return -1;
-	}
-	if(!lcb){
-		nag("Not executing any parser callbacks\n");
-	}
 	errno = 0;
-	while( (line = line_parser_next(&ctx)) ){
+	while( (line = line_parser_next(ctx)) ){
 		++lines;
 		if(lcb && lcb(line,arg)){
 			bitch("Failure in parse function, exiting\n");
-			goto done;
+			return -1;
 		}
 		errno = 0;
 	}
 	if(errno){
 		bitch("Failure reading data for parsing at line %d\n",lines);
-	}else{
+		return -1;
+	}
+	return lines;
+}
+
+// Runs the callback over a prepared parser's lines, and destroys it.
+static int
+parse_prepared_lines(line_parser_ctx *ctx,line_parser_cb lcb,void *arg){
+	int lines;
+
+	if(!lcb){
+		nag("Not executing any parser callbacks\n");
+	}
+	if((lines = run_line_parser(ctx,lcb,arg)) >= 0){
 		nag("Read %d lines\n",lines);
-		ret = 0;
 	}
+	destroy_line_parser(ctx);
+	return lines < 0 ? -1 : 0;
+}
+
+int parser_byline(int fd,line_parser_cb lcb,void *arg){
+	line_parser_ctx ctx;
+
+	if(prepare_line_parser(&ctx,fd)){
+		return -1;
+	}
+	return parse_prepared_lines(&ctx,lcb,arg);
+}
+
+int parser_byline_mapped(int fd,line_parser_cb lcb,void *arg){
+	line_parser_ctx ctx;
+
+	if(prepare_mapped_line_parser(&ctx,fd)){
+		return -1;
+	}
+	return parse_prepared_lines(&ctx,lcb,arg);
+}
+
+typedef struct line_segment {
+	char *pos,*end;
+	line_parser_cb lcb;
+	void *arg;
+	int *failed;	// shared by all segments
+	int ret,spawned;
+	unsigned lines;
+	pthread_t tid;
+} line_segment;
+
+static void
+parse_line_segment(void *v){
+	line_segment *seg = v;
+	char *tail = NULL,*line;
+
+	errno = 0;
+	while( (line = next_mapped_line(&seg->pos,seg->end,&tail)) ){
+		++seg->lines;
+		if(seg->lcb && seg->lcb(line,seg->arg)){
+			bitch("Failure in parse function, exiting\n");
+			seg->ret = -1;
+			break;
+		}
+		if(__atomic_load_n(seg->failed,__ATOMIC_RELAXED)){
+			break;
+		}
+		errno = 0;
+	}
+	if(line == NULL && errno){
+		bitch("Failure reading data for parsing\n");
+		seg->ret = -1;
+	}
+	if(seg->ret){
+		__atomic_store_n(seg->failed,1,__ATOMIC_RELAXED);
+	}
+	Free(tail);
+}
+
+// The first line boundary at or after p. Rather than work out whether a
+// newline's been continued from earlier lines, only split at newlines which
+// directly follow something other than whitespace or a backslash; these
+// can't be continuations, however the parse arrived at them.
+static char *
+next_line_boundary(char *p,char *start,char *end){
+	char *nl;
+
+	while( (nl = memchr(p,'\n',(size_t)(end - p))) ){
+		if(nl > start && nl[-1] != '\\' && !isspace((unsigned char)nl[-1])){
+			return nl + 1;
+		}
+		p = nl + 1;
+	}
+	return end;
+}
 
-done:
+int parser_byline_parallel(int fd,line_parser_cb lcb,void *arg,unsigned threads){
+	line_segment *segs;
+	line_parser_ctx ctx;
+	unsigned z,n,lines;
+	int ret = 0,failed = 0;
+	size_t span;
+	char *p;
+
+	if(prepare_mapped_line_parser(&ctx,fd)){
+		return -1;
+	}
+	span = ctx.map ? (size_t)(ctx.mapend - ctx.mappos) : 0;
+	if((n = span / LINEPARSER_SEGMENT) > threads){
+		n = threads;
+	}
+	if(n <= 1){
+		return parse_prepared_lines(&ctx,lcb,arg);
+	}
+	if((segs = Malloc("line segments",sizeof(*segs) * n)) == NULL){
+		destroy_line_parser(&ctx);
+		return -1;
+	}
+	memset(segs,0,sizeof(*segs) * n);
+	for(p = ctx.mappos, z = 0 ; z < n ; ++z){
+		segs[z].pos = p;
+		if(z + 1 < n){
+			p = next_line_boundary(p > ctx.mappos + span * (z + 1) / n ? p :
+					ctx.mappos + span * (z + 1) / n,ctx.mappos,ctx.mapend);
+		}else{
+			p = ctx.mapend;
+		}
+		segs[z].end = p;
+		segs[z].lcb = lcb;
+		segs[z].arg = arg;
+		segs[z].failed = &failed;
+	}
+	// The first segment is ours; the others get threads where possible
+	for(z = 1 ; z < n ; ++z){
+		if(segs[z].pos < segs[z].end){
+			if(new_traceable_thread("lineparser",&segs[z].tid,parse_line_segment,&segs[z]) == 0){
+				segs[z].spawned = 1;
+			}
+		}
+	}
+	parse_line_segment(&segs[0]);
+	for(lines = 0, z = 0 ; z < n ; ++z){
+		if(segs[z].spawned){
+			ret |= join_traceable_thread("lineparser",segs[z].tid);
+		}else if(z && segs[z].pos < segs[z].end){
+			parse_line_segment(&segs[z]);
+		}
+		ret |= segs[z].ret;
+		lines += segs[z].lines;
+	}
+	if(ret == 0){
+		nag("Read %u lines in %u pieces\n",lines,n);
+	}
+	Free(segs);
 	destroy_line_parser(&ctx);
 	return ret;
 }
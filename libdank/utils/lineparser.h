@@ -7,10 +7,16 @@ extern "C" {
 
 #include <libdank/objects/logctx.h>
 
+// Descriptors are read in BUFSIZ chunks. Where the caller opts in, regular
+// files are instead mapped privately, and parsed in place. A mapped file must
+// not be truncated while it's being parsed: touching pages beyond the new end
+// of the file raises SIGBUS.
 typedef struct line_parser_ctx {
 	int fd;
 	char *buf;
 	unsigned count,total,base,eof;
+	char *map,*mappos,*mapend,*tail;
+	size_t maplen;
 } line_parser_ctx;
 
 typedef int (*line_parser_cb)(char *,void *);
@@ -19,8 +25,20 @@ typedef int (*line_parser_cb)(char *,void *);
 // Return non-zero on any failure, parsing- or system-related.
 int parser_byline(int,line_parser_cb,void *);
 
+// As parser_byline(), but regular files are mapped.
+int parser_byline_mapped(int,line_parser_cb,void *);
+
+// As parser_byline_mapped(), but a mapped file of at least LINEPARSER_SEGMENT bytes
+// is split at line boundaries, and the pieces are parsed on up to the given
+// number of threads. The callback must thus be thread-safe. Lines are passed
+// in order within each piece, but the pieces run concurrently. Following a
+// failure, remaining pieces are abandoned.
+#define LINEPARSER_SEGMENT (1024 * 1024)
+int parser_byline_parallel(int,line_parser_cb,void *,unsigned);
+
 // For objects building atop lineparser
 int prepare_line_parser(line_parser_ctx *,int);
+int prepare_mapped_line_parser(line_parser_ctx *,int);
 char *line_parser_next(line_parser_ctx *);
 void destroy_line_parser(line_parser_ctx *);
 
@@ -1,3 +1,4 @@
+#include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -152,61 +153,66 @@ int log_socket_errors(int sd){
 	return 0;
 }
 
-static int
-suck_sd_line(int sd,char *buffer,size_t s){
-	size_t len = 0;
-	int r = 0;
-
-	while(len < s){
-		if((r = read(sd,buffer + len,1)) == 0){
-			buffer[len] = '\0';
-			return len;
-		}else if(r < 0){
-			if(errno == EINTR){
-				continue;
-			}
-			moan("Couldn't read from socket %d.\n",sd);
-			return -1;
-		}
-		if(buffer[len] == '\n' || buffer[len] == '\0'){
-			buffer[len] = '\0';
-			return len;
-		}
-		++len;
-	}
-	bitch("Input larger than %zu-byte buffer.\n",s);
-	return -1;
-}
-
+// Lines end with a newline or NUL. Rather than reading a byte at a time so as
+// not to consume anything past the line, peek at whatever's arrived, and then
+// consume exactly through the terminator.
 int read_socket_dynline(int sd,char **buf){
-	size_t len = 0;
-	int ret;
+	size_t len = 0,size = 0;
+	char *tmp;
 
 	*buf = NULL;
-	do{
-		char *tmp;
-		int err;
-
-		len += BUFSIZ;
-		if((tmp = Realloc("socket line",*buf,len)) == NULL){
-			Free(*buf);
-			*buf = NULL;
-			return -1;
+	for( ; ; ){
+		const char *end,*nl;
+		ssize_t r,take;
+
+		if(size - len < BUFSIZ){
+			if((tmp = Realloc("socket line",*buf,size + BUFSIZ * 4)) == NULL){
+				goto err;
+			}
+			*buf = tmp;
+			size += BUFSIZ * 4;
 		}
-		*buf = tmp;
-		errno = 0;
-		if((ret = suck_sd_line(sd,*buf + len - BUFSIZ,BUFSIZ)) >= 0){
-			err = errno;
-			nag("Copied %d bytes from socket\n",ret);
-			errno = err;
+		// Always leave room for the terminator
+		while((r = recv(sd,*buf + len,size - len - 1,MSG_PEEK)) < 0){
+			if(errno != EINTR){
+				moan("Couldn't read from socket %d.\n",sd);
+				goto err;
+			}
 		}
-	}while(ret < 0 && errno == 0); // allocate more
-	if(ret <= 0){
-		Free(*buf);
-		*buf = NULL;
-		return -1;
+		if(r == 0){
+			break;
+		}
+		if( (nl = memchr(*buf + len,'\n',(size_t)r)) ){
+			take = nl - (*buf + len) + 1;
+		}else{
+			take = r;
+		}
+		if( (end = memchr(*buf + len,'\0',(size_t)take)) ){
+			take = end - (*buf + len) + 1;
+		}else{
+			end = nl;
+		}
+		if(recv(sd,*buf + len,(size_t)take,0) != take){
+			moan("Couldn't consume %zd bytes from socket %d.\n",take,sd);
+			goto err;
+		}
+		if(end){
+			len += (size_t)take - 1;
+			break;
+		}
+		len += (size_t)take;
+	}
+	if(len == 0){
+		goto err;
 	}
+	(*buf)[len] = '\0';
+	nag("Copied %zu bytes from socket\n",len);
 	return 0;
+
+err:
+	Free(*buf);
+	*buf = NULL;
+	return -1;
 }
 
 int is_sock_listening(int fd){
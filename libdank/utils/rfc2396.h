@@ -10,7 +10,8 @@ extern "C" {
 struct ustring;
 struct sockaddr_in;
 
-// FIXME update this for RFC 3986: http://labs.apache.org/webarch/uri/rfc/rfc3986.html#changes
+// RFC 3986 obsoletes RFC 2396. For allocation-free parsing of RFC 3986 URIs,
+// see rfc3986.h.
 
 // Verify that this is a legal URI by RFC 2396's specification, having the
 // proper scheme (case-insensitive match). Advances the pointer past the URI.
@@ -0,0 +1,376 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <libdank/utils/rfc3986.h>
+
+// Character classes of RFC 3986, 2.2 and 2.3, and Appendix A. Percent-encoded
+// octets are handled separately, by uri_span().
+#define UC_UNRESERVED	0x01	// ALPHA / DIGIT / "-" / "." / "_" / "~"
+#define UC_SUBDELIM	0x02	// "!" / "$" / "&" / "'" / "(" / ")" / "*" / "+" / "," / ";" / "="
+#define UC_COLON	0x04
+#define UC_AT		0x08
+#define UC_SLASH	0x10
+#define UC_QUESTION	0x20
+#define UC_SCHEME	0x40	// ALPHA / DIGIT / "+" / "-" / "."
+#define UC_HEX		0x80
+
+#define UC_REGNAME	(UC_UNRESERVED | UC_SUBDELIM)
+#define UC_USERINFO	(UC_REGNAME | UC_COLON)
+#define UC_PCHAR	(UC_USERINFO | UC_AT)
+#define UC_PATH		(UC_PCHAR | UC_SLASH)
+#define UC_QUERY	(UC_PATH | UC_QUESTION)	// and fragment
+
+#define S UC_SUBDELIM
+#define A (UC_UNRESERVED | UC_SCHEME)
+
+static const unsigned char uri_ctype[256] = {
+	['!'] = S,
+	['$'] = S,
+	['&' ... '*'] = S,
+	['+'] = S | UC_SCHEME,
+	[','] = S,
+	['-' ... '.'] = A,
+	['/'] = UC_SLASH,
+	['0' ... '9'] = A | UC_HEX,
+	[':'] = UC_COLON,
+	[';'] = S,
+	['='] = S,
+	['?'] = UC_QUESTION,
+	['@'] = UC_AT,
+	['A' ... 'F'] = A | UC_HEX,
+	['G' ... 'Z'] = A,
+	['_'] = UC_UNRESERVED,
+	['a' ... 'f'] = A | UC_HEX,
+	['g' ... 'z'] = A,
+	['~'] = UC_UNRESERVED,
+};
+
+#undef A
+#undef S
+
+static inline int
+uri_class(char c,unsigned char class){
+	return uri_ctype[(unsigned char)c] & class;
+}
+
+static inline int
+uri_alpha(char c){
+	return (unsigned)((c | 0x20) - 'a') < 26;
+}
+
+static inline unsigned
+uri_hexval(char c){
+	return c <= '9' ? (unsigned)(c - '0') : (unsigned)((c | 0x20) - 'a' + 10);
+}
+
+// Length of the initial run of s made up of the class and percent-encoded
+// octets.
+static size_t
+uri_span(const char *s,size_t len,unsigned char class){
+	size_t i = 0;
+
+	while(i < len){
+		if(uri_class(s[i],class)){
+			++i;
+		}else if(s[i] == '%' && i + 2 < len && uri_class(s[i + 1],UC_HEX)
+				&& uri_class(s[i + 2],UC_HEX)){
+			i += 3;
+		}else{
+			break;
+		}
+	}
+	return i;
+}
+
+// IP-literal = "[" ( IPv6address / IPvFuture ) "]", less the brackets.
+// IPv6 addresses are checked by inet_pton(3), from a stack copy.
+static int
+parse_ip_literal(const char *s,size_t len,uri_ref *u){
+	char addr[INET6_ADDRSTRLEN];
+	struct in6_addr in6;
+	size_t i;
+
+	if(len && (s[0] == 'v' || s[0] == 'V')){
+		// IPvFuture = "v" 1*HEXDIG "." 1*( unreserved / sub-delims / ":" )
+		for(i = 1 ; i < len && uri_class(s[i],UC_HEX) ; ++i){
+			;
+		}
+		if(i == 1 || i + 1 >= len || s[i] != '.'){
+			return -1;
+		}
+		for(++i ; i < len && uri_class(s[i],UC_USERINFO) ; ++i){
+			;
+		}
+		if(i != len){
+			return -1;
+		}
+		u->flags |= URI_HOST_IPVFUTURE;
+		return 0;
+	}
+	if(len >= sizeof(addr)){
+		return -1;
+	}
+	memcpy(addr,s,len);
+	addr[len] = '\0';
+	if(inet_pton(AF_INET6,addr,&in6) != 1){
+		return -1;
+	}
+	u->flags |= URI_HOST_IPV6;
+	return 0;
+}
+
+// A reg-name which is also an IPv4address (dec-octets, without leading zeroes)
+static int
+is_ipv4_host(const char *s,size_t len){
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr in;
+
+	if(len < 7 || len >= sizeof(addr)){
+		return 0;
+	}
+	memcpy(addr,s,len);
+	addr[len] = '\0';
+	return inet_pton(AF_INET,addr,&in) == 1;
+}
+
+// authority = [ userinfo "@" ] host [ ":" port ], spanning [off, end)
+static int
+parse_authority(const char *buf,size_t off,size_t end,uri_ref *u){
+	const char *at;
+	size_t n;
+
+	u->flags |= URI_HAS_AUTHORITY;
+	if( (at = memchr(buf + off,'@',end - off)) ){
+		n = (size_t)(at - buf) - off;
+		if(uri_span(buf + off,n,UC_USERINFO) != n){
+			return -1;
+		}
+		u->userinfo.off = off;
+		u->userinfo.len = n;
+		u->flags |= URI_HAS_USERINFO;
+		off += n + 1;
+	}
+	if(off < end && buf[off] == '['){
+		const char *close;
+
+		if((close = memchr(buf + off,']',end - off)) == NULL){
+			return -1;
+		}
+		u->host.off = off + 1;
+		u->host.len = (size_t)(close - buf) - u->host.off;
+		if(parse_ip_literal(buf + u->host.off,u->host.len,u)){
+			return -1;
+		}
+		off = (size_t)(close - buf) + 1;
+	}else{
+		u->host.off = off;
+		u->host.len = uri_span(buf + off,end - off,UC_REGNAME);
+		if(is_ipv4_host(buf + off,u->host.len)){
+			u->flags |= URI_HOST_IPV4;
+		}
+		off += u->host.len;
+	}
+	if(off < end){
+		if(buf[off++] != ':'){
+			return -1;
+		}
+		u->flags |= URI_HAS_PORT;
+		u->port.off = off;
+		for( ; off < end ; ++off){
+			if(buf[off] < '0' || buf[off] > '9'){
+				return -1;
+			}
+			if((u->portnum = u->portnum * 10 + (unsigned)(buf[off] - '0')) > 65535){
+				return -1;
+			}
+		}
+		u->port.len = off - u->port.off;
+	}
+	return 0;
+}
+
+int parse_uri_ref(const char *buf,size_t len,uri_ref *u){
+	size_t pos = 0,end;
+
+	memset(u,0,sizeof(*u));
+	// scheme = ALPHA *( ALPHA / DIGIT / "+" / "-" / "." ), followed by ':'.
+	// Otherwise, this is a relative reference.
+	if(len && uri_alpha(buf[0])){
+		for(end = 1 ; end < len && uri_class(buf[end],UC_SCHEME) ; ++end){
+			;
+		}
+		if(end < len && buf[end] == ':'){
+			u->scheme.len = end;
+			u->flags |= URI_HAS_SCHEME;
+			pos = end + 1;
+		}
+	}
+	if(len - pos >= 2 && buf[pos] == '/' && buf[pos + 1] == '/'){
+		pos += 2;
+		for(end = pos ; end < len ; ++end){
+			if(buf[end] == '/' || buf[end] == '?' || buf[end] == '#'){
+				break;
+			}
+		}
+		if(parse_authority(buf,pos,end,u)){
+			return -1;
+		}
+		pos = end;
+	}
+	// Following an authority, the path is empty or begins with '/', as
+	// guaranteed by the authority's terminators.
+	u->path.off = pos;
+	u->path.len = uri_span(buf + pos,len - pos,UC_PATH);
+	pos += u->path.len;
+	// path-noscheme: the first segment of a relative-path reference
+	// mustn't contain a colon (it would be taken for a scheme).
+	if(!(u->flags & (URI_HAS_SCHEME | URI_HAS_AUTHORITY)) && u->path.len &&
+			buf[u->path.off] != '/'){
+		const char *slash = memchr(buf + u->path.off,'/',u->path.len);
+		size_t seg = slash ? (size_t)(slash - buf) - u->path.off : u->path.len;
+
+		if(memchr(buf + u->path.off,':',seg)){
+			return -1;
+		}
+	}
+	if(pos < len && buf[pos] == '?'){
+		u->query.off = ++pos;
+		u->query.len = uri_span(buf + pos,len - pos,UC_QUERY);
+		u->flags |= URI_HAS_QUERY;
+		pos += u->query.len;
+	}
+	if(pos < len && buf[pos] == '#'){
+		u->fragment.off = ++pos;
+		u->fragment.len = uri_span(buf + pos,len - pos,UC_QUERY);
+		u->flags |= URI_HAS_FRAGMENT;
+		pos += u->fragment.len;
+	}
+	return pos == len ? 0 : -1;
+}
+
+static const char UPPER_HEX[] = "0123456789ABCDEF";
+
+// Copies the (already validated) component, decoding percent-encoded
+// unreserved characters, uppercasing the remaining percent-encodings, and
+// optionally lowercasing everything else (RFC 3986, 6.2.2.1 and 6.2.2.2).
+static size_t
+normalize_component(const char *s,size_t len,char *out,int lower){
+	size_t i,o = 0;
+
+	for(i = 0 ; i < len ; ++i){
+		char c = s[i];
+
+		if(c == '%'){
+			unsigned v = uri_hexval(s[i + 1]) * 16 + uri_hexval(s[i + 2]);
+
+			i += 2;
+			if(uri_class((char)v,UC_UNRESERVED)){
+				c = (char)v;
+			}else{
+				out[o++] = '%';
+				out[o++] = UPPER_HEX[v >> 4];
+				out[o++] = UPPER_HEX[v & 0xf];
+				continue;
+			}
+		}
+		if(lower && c >= 'A' && c <= 'Z'){
+			c |= 0x20;
+		}
+		out[o++] = c;
+	}
+	return o;
+}
+
+// RFC 3986, 5.2.4 "Remove Dot Segments", in place. The output never outgrows
+// the input, so we can write behind the read position.
+static size_t
+remove_dot_segments(char *p,size_t len){
+	size_t in = 0,out = 0;
+
+	while(in < len){
+		size_t left = len - in;
+
+		if(left >= 3 && memcmp(p + in,"../",3) == 0){		// A
+			in += 3;
+		}else if(left >= 2 && memcmp(p + in,"./",2) == 0){
+			in += 2;
+		}else if(left >= 3 && memcmp(p + in,"/./",3) == 0){	// B
+			in += 2;
+		}else if(left == 2 && memcmp(p + in,"/.",2) == 0){
+			p[out++] = '/';
+			break;
+		}else if((left >= 4 && memcmp(p + in,"/../",4) == 0) ||	// C
+				(left == 3 && memcmp(p + in,"/..",3) == 0)){
+			while(out && p[--out] != '/'){
+				;
+			}
+			if(left == 3){
+				p[out++] = '/';
+				break;
+			}
+			in += 3;
+		}else if((left == 1 && p[in] == '.') ||			// D
+				(left == 2 && memcmp(p + in,"..",2) == 0)){
+			break;
+		}else{							// E
+			do{
+				p[out++] = p[in++];
+			}while(in < len && p[in] != '/');
+		}
+	}
+	return out;
+}
+
+size_t normalize_uri_ref(const char *buf,const uri_ref *u,char *out){
+	size_t o = 0,path;
+
+	if(u->flags & URI_HAS_SCHEME){
+		o += normalize_component(buf + u->scheme.off,u->scheme.len,out + o,1);
+		out[o++] = ':';
+	}
+	if(u->flags & URI_HAS_AUTHORITY){
+		out[o++] = '/';
+		out[o++] = '/';
+		if(u->flags & URI_HAS_USERINFO){
+			o += normalize_component(buf + u->userinfo.off,u->userinfo.len,out + o,0);
+			out[o++] = '@';
+		}
+		if(u->flags & (URI_HOST_IPV6 | URI_HOST_IPVFUTURE)){
+			out[o++] = '[';
+			o += normalize_component(buf + u->host.off,u->host.len,out + o,1);
+			out[o++] = ']';
+		}else{
+			o += normalize_component(buf + u->host.off,u->host.len,out + o,1);
+		}
+		if(u->port.len){
+			out[o++] = ':';
+			memcpy(out + o,buf + u->port.off,u->port.len);
+			o += u->port.len;
+		}
+	}
+	path = o;
+	o += normalize_component(buf + u->path.off,u->path.len,out + o,0);
+	if(o > path && out[path] == '/'){
+		o = path + remove_dot_segments(out + path,o - path);
+		// "a:/.//b" mustn't become "a://b", which has an authority
+		if(!(u->flags & URI_HAS_AUTHORITY) && o - path >= 2 &&
+				out[path] == '/' && out[path + 1] == '/'){
+			memmove(out + path + 2,out + path,o - path);
+			out[path] = '/';
+			out[path + 1] = '.';
+			o += 2;
+		}
+	}
+	if((u->flags & URI_HAS_AUTHORITY) && o == path){
+		out[o++] = '/';
+	}
+	if(u->flags & URI_HAS_QUERY){
+		out[o++] = '?';
+		o += normalize_component(buf + u->query.off,u->query.len,out + o,0);
+	}
+	if(u->flags & URI_HAS_FRAGMENT){
+		out[o++] = '#';
+		o += normalize_component(buf + u->fragment.off,u->fragment.len,out + o,0);
+	}
+	out[o] = '\0';
+	return o;
+}
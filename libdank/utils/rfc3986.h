@@ -0,0 +1,69 @@
+#ifndef UTILS_RFC3986
+#define UTILS_RFC3986
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+// Zero-copy URI-reference parsing per RFC 3986 (which obsoletes RFC 2396 and
+// RFC 2732). Rather than allocating a uri and duplicating its components, as
+// extract_uri() does, the components are recorded as slices of the caller's
+// buffer, which needn't be NUL-terminated. Nothing is allocated. Conformance
+// is strict: RFC 2396's "unwise" characters and %uXXXX escapes are refused.
+
+typedef struct uri_slice {
+	size_t off,len;		// relative to the start of the caller's buffer
+} uri_slice;
+
+#define URI_HAS_SCHEME		0x0001
+#define URI_HAS_AUTHORITY	0x0002	// "//" was present (host may be empty)
+#define URI_HAS_USERINFO	0x0004
+#define URI_HAS_PORT		0x0008	// ':' was present (port may be empty)
+#define URI_HAS_QUERY		0x0010
+#define URI_HAS_FRAGMENT	0x0020
+#define URI_HOST_IPV4		0x0040
+#define URI_HOST_IPV6		0x0080	// the host slice excludes the brackets
+#define URI_HOST_IPVFUTURE	0x0100	// likewise
+
+typedef struct uri_ref {
+	// Absent components have zero length; use the flags to distinguish
+	// them from those present but empty ("http://h/?" has an empty query).
+	uri_slice scheme,userinfo,host,port,path,query,fragment;
+	unsigned flags;
+	unsigned portnum;	// 0 if there's no port, or it's empty
+} uri_ref;
+
+// Parses the entirety of the buffer as a URI-reference (a URI, or a relative
+// reference). Returns -1 if it is malformed.
+int parse_uri_ref(const char *,size_t,uri_ref *);
+
+// Case-insensitive match of the URI's scheme
+static inline int
+uri_scheme_is(const char *buf,const uri_ref *u,const char *scheme){
+	return (u->flags & URI_HAS_SCHEME) && u->scheme.len == strlen(scheme) &&
+		strncasecmp(buf + u->scheme.off,scheme,u->scheme.len) == 0;
+}
+
+// The normal form never exceeds the source by more than this (including the
+// terminating NUL).
+#define URI_NORMALIZED_LEN(len)	((len) + 2)
+
+// Writes the syntax-based normal form (RFC 3986, 6.2.2) of a parsed URI into
+// the caller's buffer, which must hold URI_NORMALIZED_LEN() of the source's
+// length, returning the length written (less the NUL). The scheme and host
+// are lowercased, as are the hexadecimal digits of IP literals; percent-
+// encodings of unreserved characters are decoded, and the rest uppercased;
+// dot-segments are removed from absolute paths (rootless paths, as found in
+// relative references and URNs, are left alone). Empty ports are dropped, and empty paths following an
+// authority become "/" (6.2.3).
+size_t normalize_uri_ref(const char *,const uri_ref *,char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,5 +1,7 @@
+#include <poll.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -98,24 +100,215 @@ int send_ctlrequest_buf(int sd,const char *cmd,const char *buf){
 	return 0;
 }
 
+#define REPLY_CHUNK 65536
+
 int recv_ctlreply(int sd){
 	ssize_t ret,t = 0;
-	char buf[128];
+	char *buf;
 
-	while((ret = read(sd,buf,sizeof(buf))) > 0){
+	if((buf = malloc(REPLY_CHUNK)) == NULL){
+		fprintf(stderr,"Couldn't allocate read buffer\n");
+		return -1;
+	}
+	while((ret = read(sd,buf,REPLY_CHUNK)) > 0){
 		size_t nb = ret;
 
 		t += ret;
 		if(fwrite(buf,1,nb,stdout) != nb){
 			printf("Writing %zu bytes to stdout: %s\n",
 					nb,strerror(errno));
+			free(buf);
 			return -1;
 		}
 	}
+	free(buf);
 	return ret < 0 ? ret : t;
 }
 
-int crosier_connect(const char *path,int errfd){
+// Write as much of the request as the socket will take, starting at byte off
+// of its frame. Returns the new offset, or -1 on error.
+static ssize_t
+send_batch_request(int sd,const crosier_req *req,uint32_t id,size_t off){
+	struct iovec iov[3],*cur = iov;
+	size_t cmdlen = strlen(req->cmd) + 1;
+	int iovcnt = 3;
+	ctlframe hdr;
+	ssize_t r;
+
+	hdr.len = htonl((uint32_t)(cmdlen + req->inlen));
+	hdr.id = htonl(id);
+	hdr.status = 0;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	// writev() won't modify them
+	iov[1].iov_base = (void *)(uintptr_t)req->cmd;
+	iov[1].iov_len = cmdlen;
+	iov[2].iov_base = (void *)(uintptr_t)req->input;
+	iov[2].iov_len = req->inlen;
+	for(r = off ; iovcnt && (size_t)r >= cur->iov_len ; --iovcnt){
+		r -= cur->iov_len;
+		++cur;
+	}
+	if(iovcnt){
+		cur->iov_base = (char *)cur->iov_base + r;
+		cur->iov_len -= r;
+	}
+	if((r = writev(sd,cur,iovcnt)) < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+			return off;
+		}
+		fprintf(stderr,"Error writing request %u: %s\n",id,strerror(errno));
+		return -1;
+	}
+	return off + r;
+}
+
+// Consume each complete reply frame in the buffer. Returns the number of
+// requests completed, or -1 on error.
+static int
+recv_batch_replies(char *buf,size_t *len,crosier_req *reqs,unsigned n){
+	size_t off = 0;
+	int done = 0;
+
+	while(*len - off >= sizeof(ctlframe)){
+		uint32_t flen,id,status;
+		crosier_req *req;
+		ctlframe hdr;
+
+		memcpy(&hdr,buf + off,sizeof(hdr));
+		flen = ntohl(hdr.len);
+		id = ntohl(hdr.id);
+		status = ntohl(hdr.status);
+		if(*len - off - sizeof(hdr) < flen){
+			break;
+		}
+		if(id >= n || (req = &reqs[id])->status != CTLFRAME_MORE){
+			fprintf(stderr,"Reply for unknown request %u\n",id);
+			return -1;
+		}
+		if(flen){
+			char *tmp;
+
+			if((tmp = realloc(req->out,req->outlen + flen + 1)) == NULL){
+				fprintf(stderr,"Couldn't allocate %zu bytes of reply\n",
+						req->outlen + flen + 1);
+				return -1;
+			}
+			req->out = tmp;
+			memcpy(req->out + req->outlen,buf + off + sizeof(hdr),flen);
+			req->outlen += flen;
+			req->out[req->outlen] = '\0';
+		}
+		if(status != CTLFRAME_MORE){
+			req->status = status;
+			++done;
+		}
+		off += sizeof(hdr) + flen;
+	}
+	memmove(buf,buf + off,*len - off);
+	*len -= off;
+	return done;
+}
+
+int crosier_batch(int sd,crosier_req *reqs,unsigned n){
+	size_t len = 0,size = REPLY_CHUNK * 2,off = 0;
+	unsigned z,sent = 0,done = 0;
+	int flags,ret = -1;
+	char *buf;
+
+	for(z = 0 ; z < n ; ++z){
+		reqs[z].status = CTLFRAME_MORE;
+		reqs[z].out = NULL;
+		reqs[z].outlen = 0;
+	}
+	if((flags = fcntl(sd,F_GETFL)) < 0 || fcntl(sd,F_SETFL,flags | O_NONBLOCK)){
+		perror("fcntl O_NONBLOCK");
+		return -1;
+	}
+	if((buf = malloc(size)) == NULL){
+		fprintf(stderr,"Couldn't allocate read buffer\n");
+		goto done;
+	}
+	// Requests go out as the socket accepts them, while replies are read,
+	// lest both directions fill.
+	while(done < n){
+		struct pollfd pfd;
+		ssize_t r;
+		int d;
+
+		pfd.fd = sd;
+		pfd.events = POLLIN | (sent < n ? POLLOUT : 0);
+		if(poll(&pfd,1,-1) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("poll");
+			goto done;
+		}
+		while(sent < n && (pfd.revents & POLLOUT)){
+			ssize_t noff;
+
+			if((noff = send_batch_request(sd,&reqs[sent],sent,off)) < 0){
+				goto done;
+			}
+			if((size_t)noff == off){
+				break; // socket's full
+			}
+			off = noff;
+			if(off == sizeof(ctlframe) + strlen(reqs[sent].cmd) + 1 + reqs[sent].inlen){
+				off = 0;
+				++sent;
+			}
+		}
+		if(size - len < REPLY_CHUNK){
+			char *tmp;
+
+			if((tmp = realloc(buf,size * 2)) == NULL){
+				fprintf(stderr,"Couldn't allocate read buffer\n");
+				goto done;
+			}
+			buf = tmp;
+			size *= 2;
+		}
+		if((r = read(sd,buf + len,size - len)) == 0){
+			fprintf(stderr,"EOF with %u/%u replies\n",done,n);
+			goto done;
+		}else if(r < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+				fprintf(stderr,"Error reading replies: %s\n",strerror(errno));
+				goto done;
+			}
+			continue;
+		}
+		len += r;
+		if((d = recv_batch_replies(buf,&len,reqs,n)) < 0){
+			goto done;
+		}
+		done += d;
+	}
+	ret = 0;
+
+done:
+	free(buf);
+	if(fcntl(sd,F_SETFL,flags)){
+		perror("fcntl ~O_NONBLOCK");
+		ret = -1;
+	}
+	return ret;
+}
+
+void crosier_batch_free(crosier_req *reqs,unsigned n){
+	unsigned z;
+
+	for(z = 0 ; z < n ; ++z){
+		free(reqs[z].out);
+		reqs[z].out = NULL;
+		reqs[z].outlen = 0;
+	}
+}
+
+static int
+connect_version(const char *path,int errfd,uint32_t hostversion){
 	struct sockaddr_un suna;
 	uint32_t version;
 	long fdflags;
@@ -151,7 +344,7 @@ int crosier_connect(const char *path,int errfd){
 				sd,suna.sun_path,strerror(errno));
 		goto err;
 	}
-	version = htonl(CTLSERVER_PROTOCOL_VERSION);
+	version = htonl(hostversion);
 	if(send_fd(sd,errfd,&version,sizeof(version))){
 		goto err;
 	}
@@ -163,3 +356,11 @@ err:
 	}
 	return -1;
 }
+
+int crosier_connect(const char *path,int errfd){
+	return connect_version(path,errfd,CTLSERVER_PROTOCOL_VERSION);
+}
+
+int crosier_connect_pipelined(const char *path,int errfd){
+	return connect_version(path,errfd,CTLSERVER_PIPELINE_VERSION);
+}
@@ -6,14 +6,32 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <libdank/modules/ctlserver/ctlproto.h>
 
 int crosier_connect(const char *,int);
+// A persistent connection, for use with crosier_batch()
+int crosier_connect_pipelined(const char *,int);
 
 int send_ctlrequest(int,const char *,FILE *);
 int send_ctlrequest_buf(int,const char *,const char *);
 
 int recv_ctlreply(int);
 
+typedef struct crosier_req {
+	const char *cmd;
+	const char *input;	// NULL if inlen is 0
+	size_t inlen;
+	uint32_t status;	// results: CTLFRAME_OK on success
+	char *out;		// malloc()d and NUL-terminated, or NULL
+	size_t outlen;
+} crosier_req;
+
+// Runs the requests concurrently over a pipelined connection, returning once
+// each has completed (0), or on error (-1). The connection can be reused for
+// further batches. Release replies with crosier_batch_free().
+int crosier_batch(int,crosier_req *,unsigned);
+void crosier_batch_free(crosier_req *,unsigned);
+
 #ifdef __cplusplus
 }
 #endif
@@ -52,14 +52,19 @@ static const declared_test *BUILTIN_TEST_SUITES[] = {
 	USTRING_TESTS,
 	STRING_TESTS,
 	LOGCTX_TESTS,
+	LOGMAP_TESTS,
 	TIMEVAL_TESTS,
 	XML_TESTS,
 	FILECONF_TESTS,
 	PROCFS_TESTS,
 	CRLFREADER_TESTS,
+	HTTPPARSER_TESTS,
+	LINEREADER_TESTS,
+	LINEPARSER_TESTS,
 	CTLSERVER_TESTS,
 	HEALTH_TESTS,
 	RFC2396_TESTS,
+	RFC3986_TESTS,
 	RFC3330_TESTS,
 	NETLINK_TESTS,
 	HEX_TESTS,
@@ -67,6 +72,10 @@ static const declared_test *BUILTIN_TEST_SUITES[] = {
 	SLALLOC_TESTS,
 	LRUPAT_TESTS,
 	INTERVAL_TREE_TESTS,
+	LPM_TESTS,
+	PORTSET_TESTS,
+	CLASSIFIER_TESTS,
+	METRICS_TESTS,
 	NULL
 };
 
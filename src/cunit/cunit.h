@@ -31,20 +31,29 @@ extern const declared_test USTRING_TESTS[];
 extern const declared_test SLALLOC_TESTS[];
 extern const declared_test STRING_TESTS[];
 extern const declared_test LOGCTX_TESTS[];
+extern const declared_test LOGMAP_TESTS[];
 extern const declared_test TIMEVAL_TESTS[];
 extern const declared_test XML_TESTS[];
 extern const declared_test FILECONF_TESTS[];
 extern const declared_test PROCFS_TESTS[];
 extern const declared_test CRLFREADER_TESTS[];
+extern const declared_test HTTPPARSER_TESTS[];
+extern const declared_test LINEREADER_TESTS[];
+extern const declared_test LINEPARSER_TESTS[];
 extern const declared_test CTLSERVER_TESTS[];
 extern const declared_test HEALTH_TESTS[];
 extern const declared_test RFC2396_TESTS[];
+extern const declared_test RFC3986_TESTS[];
 extern const declared_test RFC3330_TESTS[];
 extern const declared_test LRUPAT_TESTS[];
 extern const declared_test NETLINK_TESTS[];
 extern const declared_test HEX_TESTS[];
 extern const declared_test DLSYM_TESTS[];
 extern const declared_test INTERVAL_TREE_TESTS[];
+extern const declared_test LPM_TESTS[];
+extern const declared_test PORTSET_TESTS[];
+extern const declared_test CLASSIFIER_TESTS[];
+extern const declared_test METRICS_TESTS[];
 
 int ctlclient_quiet(const char *cmd);
 pid_t ctlclient_quiet_nowait(const char *cmd);
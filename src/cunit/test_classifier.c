@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <cunit/cunit.h>
+#include <libdank/objects/ipset.h>
+#include <libdank/objects/portset.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/classifier.h>
+
+static int
+test_classifier_empty(void){
+	struct classifier_table *ct;
+	struct classifier *c;
+	flowkey fk = { .saddr = 0x0a000001, .daddr = 0x0a000002,
+			.sport = 1024, .dport = 80, .proto = 6, };
+	int ret = -1;
+
+	if((c = create_classifier()) == NULL){
+		return -1;
+	}
+	if(classify(c,&fk) != -1){
+		goto done;
+	}
+	if((ct = compile_classifier(NULL,0)) == NULL){
+		goto done;
+	}
+	if(classify_table(ct,&fk) != -1){
+		free_classifier_table(ct);
+		goto done;
+	}
+	if(swap_classifier(c,ct)){
+		free_classifier_table(ct);
+		goto done;
+	}
+	if(classify(c,&fk) != -1){
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free_classifier(c);
+	return ret;
+}
+
+#define RULECOUNT 400
+#define FLOWCOUNT 4096
+
+typedef struct testrule {
+	ipset src,dst;
+	portset sport,dport;
+	int hassrc,hasdst,hassport,hasdport;
+} testrule;
+
+static testrule testrules[RULECOUNT];
+static classifier_rule crules[RULECOUNT];
+
+static int
+linear_classify(const flowkey *fk,unsigned rulecount){
+	unsigned z;
+
+	for(z = 0 ; z < rulecount ; ++z){
+		const classifier_rule *cr = &crules[z];
+
+		if(cr->src && !ip_in_set(cr->src,fk->saddr)){
+			continue;
+		}
+		if(cr->dst && !ip_in_set(cr->dst,fk->daddr)){
+			continue;
+		}
+		if(cr->sport && !contains_port(cr->sport,fk->sport)){
+			continue;
+		}
+		if(cr->dport && !contains_port(cr->dport,fk->dport)){
+			continue;
+		}
+		if(cr->proto >= 0 && cr->proto != fk->proto){
+			continue;
+		}
+		return z;
+	}
+	return -1;
+}
+
+static void
+random_ipset(ipset *is){
+	char buf[80];
+	unsigned base = 0x0a000000 | (random() & 0xff00);
+
+	if(random() % 3){
+		snprintf(buf,sizeof(buf),"%u.%u.%u.0/%u",base >> 24,(base >> 16) & 0xff,
+				(base >> 8) & 0xff,20 + (unsigned)(random() % 9));
+	}else{
+		snprintf(buf,sizeof(buf),"[%u.%u.%u.1-%u.%u.%u.20,10.0.0.%u]",
+				base >> 24,(base >> 16) & 0xff,(base >> 8) & 0xff,
+				base >> 24,(base >> 16) & 0xff,(base >> 8) & 0xff,
+				(unsigned)(random() % 256));
+	}
+	parse_ipset(buf,is);
+}
+
+static void
+random_portset(portset *ps){
+	static const char *sets[] = {
+		"80", "443", "22,80,443", "1-1023", "1024-65535", "!53", "6000-6010",
+	};
+	init_portset(ps);
+	parse_portset(sets[random() % (sizeof(sets) / sizeof(*sets))],ps);
+}
+
+static void
+random_flow(flowkey *fk){
+	static const uint16_t ports[] = { 22, 53, 80, 443, 1000, 1023, 1024, 6005, 40000, };
+
+	fk->saddr = 0x0a000000 | (random() & 0xffff);
+	fk->daddr = 0x0a000000 | (random() & 0xffff);
+	fk->sport = ports[random() % (sizeof(ports) / sizeof(*ports))];
+	fk->dport = ports[random() % (sizeof(ports) / sizeof(*ports))];
+	fk->proto = random() % 2 ? 6 : 17;
+}
+
+static void
+free_testrules(void){
+	unsigned z;
+
+	for(z = 0 ; z < RULECOUNT ; ++z){
+		free_ipset(&testrules[z].src);
+		free_ipset(&testrules[z].dst);
+		free_portset(&testrules[z].sport);
+		free_portset(&testrules[z].dport);
+	}
+}
+
+static void
+build_testrules(void){
+	unsigned z;
+
+	for(z = 0 ; z < RULECOUNT ; ++z){
+		testrule *tr = &testrules[z];
+
+		init_ipset(&tr->src);
+		init_ipset(&tr->dst);
+		init_portset(&tr->sport);
+		init_portset(&tr->dport);
+		if(random() % 2){
+			random_ipset(&tr->src);
+		}
+		random_ipset(&tr->dst);
+		if(random() % 4 == 0){
+			random_portset(&tr->sport);
+		}
+		if(random() % 4){
+			random_portset(&tr->dport);
+		}
+		crules[z].src = tr->src.rangecount ? &tr->src : NULL;
+		crules[z].dst = tr->dst.rangecount ? &tr->dst : NULL;
+		crules[z].sport = tr->sport.rangecount ? &tr->sport : NULL;
+		crules[z].dport = tr->dport.rangecount ? &tr->dport : NULL;
+		crules[z].proto = random() % 3 == 0 ? -1 : random() % 2 ? 6 : 17;
+	}
+}
+
+static int
+test_classifier_random(void){
+	flowkey flows[FLOWCOUNT];
+	int results[FLOWCOUNT];
+	struct classifier *c;
+	struct classifier_table *ct;
+	unsigned z,rulecount;
+	int ret = -1;
+
+	srandom(0);
+	build_testrules();
+	for(z = 0 ; z < FLOWCOUNT ; ++z){
+		random_flow(&flows[z]);
+	}
+	if((c = create_classifier()) == NULL){
+		free_testrules();
+		return -1;
+	}
+	// install half the rules, then swap in the full set
+	for(rulecount = RULECOUNT / 2 ; rulecount <= RULECOUNT ; rulecount += RULECOUNT / 2){
+		unsigned matched = 0;
+
+		if(update_classifier(c,crules,rulecount)){
+			goto done;
+		}
+		if((ct = acquire_classifier(c)) == NULL){
+			goto done;
+		}
+		printf(" %u rules: %u subrules, %u nodes.\n",rulecount,
+				subrules_classifier_table(ct),nodes_classifier_table(ct));
+		for(z = 0 ; z < FLOWCOUNT ; ++z){
+			int expect = linear_classify(&flows[z],rulecount);
+
+			if(classify_table(ct,&flows[z]) != expect){
+				fprintf(stderr," Mismatch on flow %u (wanted %d).\n",z,expect);
+				release_classifier(c,ct);
+				goto done;
+			}
+			matched += expect >= 0;
+		}
+		release_classifier(c,ct);
+		classify_batch(c,flows,results,FLOWCOUNT);
+		for(z = 0 ; z < FLOWCOUNT ; ++z){
+			if(results[z] != linear_classify(&flows[z],rulecount)){
+				fprintf(stderr," Batch mismatch on flow %u.\n",z);
+				goto done;
+			}
+		}
+		printf(" %u/%u flows matched.\n",matched,FLOWCOUNT);
+	}
+	ret = 0;
+
+done:
+	free_classifier(c);
+	free_testrules();
+	return ret;
+}
+#undef FLOWCOUNT
+#undef RULECOUNT
+
+const declared_test CLASSIFIER_TESTS[] = {
+	{	.name = "classifier_empty",
+		.testfxn = test_classifier_empty,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "classifier_random",
+		.testfxn = test_classifier_random,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
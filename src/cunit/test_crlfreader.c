@@ -3,6 +3,7 @@
 #include <libdank/utils/syswrap.h>
 #include <libdank/utils/memlimit.h>
 #include <libdank/objects/crlfreader.h>
+#include <libdank/objects/objustring.h>
 
 #define CRLF "\xd\xa"
 
@@ -82,12 +83,84 @@ test_crlfreader(void){
 	return 0;
 }
 
+#define VIEW_LINES 2000
+
+// Views must match the lines written, across buffer refills and compactions.
+// Some lines carry a bare LF, which doesn't end them.
+static int
+test_crlfreader_view(void){
+	int filedes[2],ret = -1,z;
+	ustring u = USTRING_INITIALIZER;
+	crlf_reader cr;
+
+	for(z = 0 ; z < VIEW_LINES ; ++z){
+		if(printUString(&u,"line %d%s" CRLF,z,z % 5 ? "" : "\xa" "bare") < 0){
+			reset_ustring(&u);
+			return -1;
+		}
+	}
+	if(Pipe(filedes)){
+		reset_ustring(&u);
+		return -1;
+	}
+	// Fits in the pipe's buffer
+	if(Writen(filedes[1],u.string,u.current)){
+		goto done;
+	}
+	if(Close(filedes[1])){
+		filedes[1] = -1;
+		goto done;
+	}
+	filedes[1] = -1;
+	if(init_crlf_reader(&cr)){
+		goto done;
+	}
+	for(z = 0 ; z < VIEW_LINES ; ++z){
+		crlf_read_res res;
+		char expect[32];
+		int len;
+
+		len = snprintf(expect,sizeof(expect),"line %d%s" CRLF,z,z % 5 ? "" : "\xa" "bare");
+		res = read_crlf_view(&cr,filedes[0]);
+		if(res != CRLF_READ_SUCCESS && res != CRLF_READ_MOREDATA){
+			fprintf(stderr," Expected line %d, got %d\n",z,res);
+			break;
+		}
+		if(cr.iv.iov_len != (size_t)len || memcmp(cr.iv.iov_base,expect,(size_t)len)){
+			fprintf(stderr," Bad view of line %d (%zub)\n",z,cr.iv.iov_len);
+			break;
+		}
+	}
+	if(z == VIEW_LINES){
+		if(read_crlf_view(&cr,filedes[0]) != CRLF_READ_EOF){
+			fprintf(stderr," Expected EOF\n");
+		}else{
+			printf(" Viewed %d lines (%zub).\n",z,u.current);
+			ret = 0;
+		}
+	}
+	reset_crlf_reader(&cr);
+
+done:
+	reset_ustring(&u);
+	if(filedes[1] >= 0){
+		Close(filedes[1]);
+	}
+	ret |= Close(filedes[0]);
+	return ret;
+}
+
 const declared_test CRLFREADER_TESTS[] = {
 	{	.name = "crlfreader",
 		.testfxn = test_crlfreader,
 		.expected_result = EXIT_TESTSUCCESS,
 		.sec_required = 0, .mb_required = 0, .disabled = 0,
 	},
+	{	.name = "crlfreader-view",
+		.testfxn = test_crlfreader_view,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
 	{	.name = NULL,
 		.testfxn = NULL,
 		.expected_result = EXIT_TESTSUCCESS,
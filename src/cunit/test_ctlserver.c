@@ -1,11 +1,19 @@
+#include <poll.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <arpa/inet.h>
 #include <cunit/cunit.h>
+#include <crosier/libcrosier.h>
+#include <libdank/utils/fds.h>
 #include <libdank/utils/string.h>
 #include <libdank/utils/syswrap.h>
 #include <libdank/utils/memlimit.h>
+#include <libdank/utils/localsock.h>
+#include <libdank/modules/metrics/metrics.h>
 #include <libdank/modules/ctlserver/ctlserver.h>
 
 static int
@@ -46,15 +54,23 @@ int ctlclient_quiet(const char *cmd){
 	return -1;
 }
 
-pid_t ctlclient_quiet_nowait(const char *cmd){
+// Run the client with the given command, its stdout redirected to outfd if
+// outfd is non-negative.
+static pid_t
+spawn_ctlclient(const char *cmd,int outfd){
+	char *cmddup;
 	pid_t pid;
 
+	// The child mustn't allocate or log: other threads might have held
+	// those locks across the fork(2).
+	if((cmddup = Strdup(cmd)) == NULL){
+		return -1;
+	}
 	fflush(stdout);
 	fflush(stderr);
 	if((pid = Fork()) == 0){ // client
 		char CUNIT_CTLCLIENT[] = "bin/crosier-nullin";
 		char SERVER[] = CUNIT_CTLSERVER;
-		char *cmddup = Strdup(cmd);
 		char * const argv[] = {
 			CUNIT_CTLCLIENT,
 			SERVER,
@@ -63,9 +79,15 @@ pid_t ctlclient_quiet_nowait(const char *cmd){
 		};
 		int i;
 
-		if(Setpgid(0,0)){
+		if(setpgid(0,0)){
 			_exit(EXIT_FAILURE);
 		}
+		if(outfd >= 0){
+			if(dup2(outfd,STDOUT_FILENO) < 0){
+				_exit(EXIT_FAILURE);
+			}
+			close(outfd);
+		}
 		// FIXME without these, unit tests hang...why? what is fd 4? it
 		// is the fd we accept(2) off the PF_UNIX socket...unsolvable
 		// race condition (see receive_fd() in libcrosier) :/
@@ -74,20 +96,21 @@ pid_t ctlclient_quiet_nowait(const char *cmd){
 
 			if((flags = fcntl(i,F_GETFD)) >= 0){
 				if(!(flags & FD_CLOEXEC)){
-					nag("BLEEDING FD %d!\n",i);
-					Close(i);
+					close(i);
 				}
-			}else{
-				close(i);
 			}
 		}
-		Execvp(CUNIT_CTLCLIENT,argv);
-		Free(cmddup);
+		execvp(CUNIT_CTLCLIENT,argv);
 		_exit(EXIT_FAILURE);
 	}
+	Free(cmddup);
 	return pid;
 }
 
+pid_t ctlclient_quiet_nowait(const char *cmd){
+	return spawn_ctlclient(cmd,-1);
+}
+
 static int
 test_ctlserver_internal(void){
 	char SERVER[] = CUNIT_CTLSERVER;
@@ -157,6 +180,709 @@ done:
 	return ret;
 }
 
+static int
+test_ctlserver_loglevel(void){
+	char SERVER[] = CUNIT_CTLSERVER;
+	int ret = -1;
+
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(init_log_server()){
+		goto done;
+	}
+	printf(" Testing external log_level CTLserver path...\n");
+	ret = ctlclient_quiet("log_level");
+	printf("\n");
+
+done:
+	ret |= stop_log_server();
+	ret |= stop_ctlserver();
+	return ret;
+}
+
+#define LOGDUMP_MARKER "logdump marker"
+#define LOGDUMP_LINES 1000
+
+// Read whatever's available from the nonblocking fd into the buffer, growing
+// it as necessary. Returns -1 on error, 1 on EOF.
+static int
+read_logdump(int fd,char **buf,size_t *len,size_t *size){
+	ssize_t r;
+
+	for( ; ; ){
+		if(*size - *len < 4096){
+			char *tmp;
+
+			if((tmp = Realloc("logdump",*buf,*size * 2)) == NULL){
+				return -1;
+			}
+			*buf = tmp;
+			*size *= 2;
+		}
+		if((r = read(fd,*buf + *len,*size - *len - 1)) > 0){
+			*len += (size_t)r;
+			(*buf)[*len] = '\0';
+		}else if(r == 0){
+			return 1;
+		}else{
+			return errno == EAGAIN ? 0 : -1;
+		}
+	}
+}
+
+// Every line logged while a log_dump client is attached ought reach it, in
+// order, ahead of the closing message.
+static int
+test_ctlserver_logdump(void){
+	char SERVER[] = CUNIT_CTLSERVER,needle[80];
+	size_t len = 0,size = 4096 * 2;
+	int ret = -1,pfd[2] = { -1, -1 },i,status,logserver = 0;
+	char *buf = NULL;
+	const char *cur;
+	pid_t pid = -1;
+
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(init_log_server()){
+		goto done;
+	}
+	logserver = 1;
+	if((buf = Malloc("logdump",size)) == NULL){
+		goto done;
+	}
+	buf[0] = '\0';
+	if(pipe(pfd)){
+		goto done;
+	}
+	pid = spawn_ctlclient("log_dump",pfd[1]);
+	close(pfd[1]);
+	if(pid < 0){
+		goto done;
+	}
+	if(set_fd_nonblocking(pfd[0])){
+		goto done;
+	}
+	// Log a marker until the client reports it, so we know it's attached
+	for(i = 0 ; i < 500 && !strstr(buf,LOGDUMP_MARKER) ; ++i){
+		nag(LOGDUMP_MARKER "\n");
+		usleep(10000);
+		if(read_logdump(pfd[0],&buf,&len,&size)){
+			goto done;
+		}
+	}
+	if(!strstr(buf,LOGDUMP_MARKER)){
+		fprintf(stderr," Client never attached.\n");
+		goto done;
+	}
+	printf(" Client attached; logging %d lines...\n",LOGDUMP_LINES);
+	for(i = 0 ; i < LOGDUMP_LINES ; ++i){
+		nag("logdump line %d\n",i);
+	}
+	logserver = 0;
+	if(stop_log_server()){
+		goto done;
+	}
+	while((status = read_logdump(pfd[0],&buf,&len,&size)) == 0){
+		usleep(10000);
+	}
+	if(status < 0){
+		goto done;
+	}
+	cur = buf;
+	for(i = 0 ; i < LOGDUMP_LINES ; ++i){
+		snprintf(needle,sizeof(needle),"] logdump line %d\n",i);
+		if((cur = strstr(cur,needle)) == NULL){
+			fprintf(stderr," Didn't get line %d.\n",i);
+			goto done;
+		}
+	}
+	if(!strstr(cur,"logdumper")){
+		fprintf(stderr," Didn't get closing message.\n");
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(logserver){
+		ret |= stop_log_server();
+	}
+	if(pid > 0){
+		if(Waitpid(pid,&status,0) != pid){
+			ret = -1;
+		}
+	}
+	if(pfd[0] >= 0){
+		close(pfd[0]);
+	}
+	Free(buf);
+	ret |= stop_ctlserver();
+	return ret;
+}
+
+// metrics_dump ought reflect the ctlserver's own instrumentation
+static int
+test_ctlserver_metrics(void){
+	char SERVER[] = CUNIT_CTLSERVER;
+	size_t len = 0,size = 4096 * 2;
+	int ret = -1,pfd[2] = { -1, -1 },status,metricserver = 0;
+	char *buf = NULL;
+	pid_t pid = -1;
+
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(init_metrics_server()){
+		goto done;
+	}
+	metricserver = 1;
+	if(ctlclient_quiet("external_noop")){
+		goto done;
+	}
+	if((buf = Malloc("metrics",size)) == NULL){
+		goto done;
+	}
+	buf[0] = '\0';
+	if(pipe(pfd)){
+		goto done;
+	}
+	pid = spawn_ctlclient("metrics_dump",pfd[1]);
+	close(pfd[1]);
+	if(pid < 0){
+		goto done;
+	}
+	while((status = read_logdump(pfd[0],&buf,&len,&size)) == 0){
+		usleep(10000);
+	}
+	if(status < 0){
+		goto done;
+	}
+	printf("%s",buf);
+	if(!strstr(buf,"counter ctlserver.commands 1\n") ||
+			!strstr(buf,"histogram ctlserver.command_usec 1 ") ||
+			!strstr(buf,"gauge ctlserver.queued 0\n") ||
+			!strstr(buf,"counter evcore.events ")){
+		fprintf(stderr," Missing metrics.\n");
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(metricserver){
+		ret |= stop_metrics_server();
+	}
+	if(pid > 0){
+		if(Waitpid(pid,&status,0) != pid){
+			ret = -1;
+		}
+	}
+	if(pfd[0] >= 0){
+		close(pfd[0]);
+	}
+	Free(buf);
+	ret |= stop_ctlserver();
+	return ret;
+}
+
+// Clients which connect but never send (or send only part of) their command
+// mustn't hold up anyone else.
+static int
+test_ctlserver_stalled(void){
+	char SERVER[] = CUNIT_CTLSERVER;
+	int ret = -1,silent = -1,partial = -1;
+
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if((silent = connect_local(SERVER)) < 0){
+		goto done;
+	}
+	if((partial = connect_local(SERVER)) < 0){
+		goto done;
+	}
+	if(write(partial,"\0\0",2) != 2){
+		goto done;
+	}
+	printf(" Testing external_noop past stalled clients...\n");
+	ret = ctlclient_quiet("external_noop");
+
+done:
+	if(silent >= 0){
+		close(silent);
+	}
+	if(partial >= 0){
+		close(partial);
+	}
+	ret |= stop_ctlserver();
+	return ret;
+}
+
+// Long-running commands (here, log_dumps held open until the log server
+// stops) mustn't starve short ones; the drone pool grows to the backlog.
+static int
+test_ctlserver_drones(void){
+	#define DUMPERS 4
+	char SERVER[] = CUNIT_CTLSERVER;
+	int ret = -1,i,started = 0,status,logserver = 0,devnull = -1;
+	pid_t pids[DUMPERS];
+	metric *drones = NULL;
+
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(init_log_server()){
+		goto done;
+	}
+	logserver = 1;
+	if((drones = register_gauge("ctlserver.drones")) == NULL){
+		goto done;
+	}
+	if((devnull = open("/dev/null",O_WRONLY)) < 0){
+		goto done;
+	}
+	for(started = 0 ; started < DUMPERS ; ++started){
+		if((pids[started] = spawn_ctlclient("log_dump",devnull)) < 0){
+			goto done;
+		}
+	}
+	// Each attached log_dump occupies a drone, beyond the initial pool
+	for(i = 0 ; i < 500 && gauge_value(drones) < DUMPERS ; ++i){
+		usleep(10000);
+	}
+	printf(" %jd drones with %d log_dumps attached...\n",
+			(intmax_t)gauge_value(drones),DUMPERS);
+	if(gauge_value(drones) < DUMPERS){
+		fprintf(stderr," Drone pool didn't grow.\n");
+		goto done;
+	}
+	if(ctlclient_quiet("mem_dump")){
+		goto done;
+	}
+	if(gauge_value(drones) <= DUMPERS){
+		fprintf(stderr," mem_dump didn't get its own drone.\n");
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(logserver){
+		ret |= stop_log_server();
+	}
+	// Clients whose commands never ran are released by the shutdown
+	ret |= stop_ctlserver();
+	for(i = 0 ; i < started ; ++i){
+		if(Waitpid(pids[i],&status,0) != pids[i]){
+			ret = -1;
+		}
+	}
+	if(devnull >= 0){
+		close(devnull);
+	}
+	ret |= unregister_metric(drones);
+	return ret;
+	#undef DUMPERS
+}
+
+#define ECHO_PIECE 1000
+
+// Echoes its input back in small pieces, followed by its length
+static int
+srv_test_echo(cmd_state *cs){
+	cmd_input in;
+	size_t off;
+	int ret = 0;
+
+	if(suck_cmd_input(cs,&in)){
+		return -1;
+	}
+	for(off = 0 ; off < in.len && ret == 0 ; off += ECHO_PIECE){
+		ret = cmd_write(cs,in.data + off,in.len - off < ECHO_PIECE ? in.len - off : ECHO_PIECE);
+	}
+	if(ret == 0){
+		ret = cmd_printf(cs,"\n%zu %s\n",in.len,in.maplen ? "mapped" : "incore");
+	}
+	release_cmd_input(&in);
+	return ret;
+}
+
+// As srv_test_echo, but by way of suck_socket_tmpfile()
+static int
+srv_test_echo_file(cmd_state *cs){
+	char buf[ECHO_PIECE];
+	size_t len = 0,r;
+	FILE *fp;
+	int ret = 0;
+
+	if((fp = suck_socket_tmpfile(cs)) == NULL){
+		return -1;
+	}
+	while(ret == 0 && (r = fread(buf,1,sizeof(buf),fp)) > 0){
+		ret = cmd_write(cs,buf,r);
+		len += r;
+	}
+	if(ret == 0 && ferror(fp)){
+		ret = -1;
+	}
+	if(ret == 0){
+		ret = cmd_printf(cs,"\n%zu file\n",len);
+	}
+	fclose(fp);
+	return ret;
+}
+
+static const command echo_commands[] = {
+	{ .cmd = "test_echo",		.func = srv_test_echo,		.prio = CTLPRIO_NORMAL,	},
+	{ .cmd = "test_echo_file",	.func = srv_test_echo_file,	.prio = CTLPRIO_NORMAL,	},
+	{ NULL,				NULL,				CTLPRIO_NORMAL,	}
+};
+
+#define ECHO_LEN (CMD_INPUT_INCORE * 3)
+
+// Input large enough to spill from memory ought come back intact, streamed,
+// followed by the given trailer.
+static int
+stream_echo(const char *cmd,const char *how){
+	char SERVER[] = CUNIT_CTLSERVER,trailer[80];
+	int ret = -1,sd = -1,devnull = -1,regd = 0;
+	char *in = NULL,*out = NULL;
+	size_t z,len = 0;
+	ssize_t r;
+
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(regcommands(echo_commands)){
+		goto done;
+	}
+	regd = 1;
+	if((in = Malloc("echo input",ECHO_LEN + 1)) == NULL){
+		goto done;
+	}
+	if((out = Malloc("echo output",ECHO_LEN * 2)) == NULL){
+		goto done;
+	}
+	for(z = 0 ; z < ECHO_LEN ; ++z){
+		in[z] = (char)('a' + z % 26);
+	}
+	in[ECHO_LEN] = '\0';
+	if((devnull = open("/dev/null",O_WRONLY)) < 0){
+		goto done;
+	}
+	if((sd = crosier_connect(SERVER,devnull)) < 0){
+		goto done;
+	}
+	printf(" Echoing %d bytes via %s...\n",ECHO_LEN,cmd);
+	if(send_ctlrequest_buf(sd,cmd,in)){
+		goto done;
+	}
+	while((r = read(sd,out + len,ECHO_LEN * 2 - len)) > 0){
+		len += (size_t)r;
+	}
+	if(r < 0){
+		fprintf(stderr," Error reading reply (%s).\n",strerror(errno));
+		goto done;
+	}
+	snprintf(trailer,sizeof(trailer),"\n%d %s\n",ECHO_LEN,how);
+	if(len != ECHO_LEN + strlen(trailer) || memcmp(out,in,ECHO_LEN) ||
+			memcmp(out + ECHO_LEN,trailer,strlen(trailer))){
+		fprintf(stderr," Bad reply (%zu bytes).\n",len);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(sd >= 0){
+		close(sd);
+	}
+	if(devnull >= 0){
+		close(devnull);
+	}
+	Free(out);
+	Free(in);
+	if(regd){
+		ret |= delcommands(echo_commands);
+	}
+	ret |= stop_ctlserver();
+	return ret;
+}
+
+static int
+test_ctlserver_stream(void){
+	return stream_echo("test_echo","mapped");
+}
+
+// The spilled input's scratch file ought be handed over as-is
+static int
+test_ctlserver_stream_tmpfile(void){
+	return stream_echo("test_echo_file","file");
+}
+
+#define PIPELINE_BATCH 64
+
+// Build a batch of echoes (each with its own input), noops, and requests
+// which ought be refused.
+static int
+build_pipeline_batch(crosier_req *reqs,char inputs[][32]){
+	unsigned z;
+
+	for(z = 0 ; z < PIPELINE_BATCH ; ++z){
+		memset(&reqs[z],0,sizeof(reqs[z]));
+		switch(z % 4){
+			case 0: case 1:
+				reqs[z].cmd = "test_echo";
+				snprintf(inputs[z],sizeof(*inputs),"request %u",z);
+				reqs[z].input = inputs[z];
+				reqs[z].inlen = strlen(inputs[z]);
+				break;
+			case 2: // server commands, too, are run by drones
+				reqs[z].cmd = z % 8 == 2 ? "external_noop" : "internal_noop";
+				break;
+			case 3:
+				reqs[z].cmd = z % 8 == 3 ? "log_dump" : "no_such_command";
+				break;
+		}
+	}
+	return 0;
+}
+
+static int
+check_pipeline_batch(const crosier_req *reqs,char inputs[][32]){
+	char expected[80];
+	unsigned z;
+
+	for(z = 0 ; z < PIPELINE_BATCH ; ++z){
+		switch(z % 4){
+			case 0: case 1:
+				snprintf(expected,sizeof(expected),"%s\n%zu incore\n",
+						inputs[z],strlen(inputs[z]));
+				if(reqs[z].status != CTLFRAME_OK || reqs[z].out == NULL ||
+						strcmp(reqs[z].out,expected)){
+					fprintf(stderr," Bad echo for %u (%u).\n",z,reqs[z].status);
+					return -1;
+				}
+				break;
+			case 2:
+				if(reqs[z].status != CTLFRAME_OK || reqs[z].outlen){
+					fprintf(stderr," Bad noop for %u (%u).\n",z,reqs[z].status);
+					return -1;
+				}
+				break;
+			case 3:
+				if(reqs[z].status != CTLFRAME_REFUSED){
+					fprintf(stderr," %s wasn't refused (%u).\n",
+							reqs[z].cmd,reqs[z].status);
+					return -1;
+				}
+				break;
+		}
+	}
+	return 0;
+}
+
+// Several batches over one pipelined connection
+static int
+test_ctlserver_pipeline(void){
+	char SERVER[] = CUNIT_CTLSERVER,inputs[PIPELINE_BATCH][32];
+	int ret = -1,sd = -1,devnull = -1,regd = 0,logserver = 0,i;
+	crosier_req reqs[PIPELINE_BATCH];
+
+	memset(reqs,0,sizeof(reqs));
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(init_log_server()){
+		goto done;
+	}
+	logserver = 1;
+	if(regcommands(echo_commands)){
+		goto done;
+	}
+	regd = 1;
+	if((devnull = open("/dev/null",O_WRONLY)) < 0){
+		goto done;
+	}
+	if((sd = crosier_connect_pipelined(SERVER,devnull)) < 0){
+		goto done;
+	}
+	for(i = 0 ; i < 3 ; ++i){
+		printf(" Running batch %d of %d requests...\n",i,PIPELINE_BATCH);
+		build_pipeline_batch(reqs,inputs);
+		if(crosier_batch(sd,reqs,PIPELINE_BATCH)){
+			goto done;
+		}
+		if(check_pipeline_batch(reqs,inputs)){
+			goto done;
+		}
+		crosier_batch_free(reqs,PIPELINE_BATCH);
+	}
+	ret = 0;
+
+done:
+	crosier_batch_free(reqs,PIPELINE_BATCH);
+	if(sd >= 0){
+		close(sd);
+	}
+	if(devnull >= 0){
+		close(devnull);
+	}
+	if(regd){
+		ret |= delcommands(echo_commands);
+	}
+	if(logserver){
+		ret |= stop_log_server();
+	}
+	ret |= stop_ctlserver();
+	return ret;
+}
+
+#define HOG_INPUT (64 * 1024)
+#define HOG_REQUESTS 128
+
+// Send echo requests without blocking until the server stops accepting them.
+// Returns the number of complete requests sent, or -1 on error.
+static int
+send_hog_requests(int sd,const char *in){
+	static const char cmd[] = "test_echo";
+	struct pollfd pfd;
+	int sent;
+
+	pfd.fd = sd;
+	pfd.events = POLLOUT;
+	for(sent = 0 ; sent < HOG_REQUESTS ; ++sent){
+		struct iovec iov[3];
+		size_t off = 0,len;
+		ctlframe hdr;
+
+		hdr.len = htonl((uint32_t)(sizeof(cmd) + HOG_INPUT));
+		hdr.id = htonl((uint32_t)sent);
+		hdr.status = 0;
+		len = sizeof(hdr) + sizeof(cmd) + HOG_INPUT;
+		while(off < len){
+			ssize_t r;
+			int i;
+
+			iov[0].iov_base = &hdr;
+			iov[0].iov_len = sizeof(hdr);
+			iov[1].iov_base = (void *)(uintptr_t)cmd;
+			iov[1].iov_len = sizeof(cmd);
+			iov[2].iov_base = (void *)(uintptr_t)in;
+			iov[2].iov_len = HOG_INPUT;
+			for(r = (ssize_t)off, i = 0 ; (size_t)r >= iov[i].iov_len ; ++i){
+				r -= (ssize_t)iov[i].iov_len;
+			}
+			iov[i].iov_base = (char *)iov[i].iov_base + r;
+			iov[i].iov_len -= (size_t)r;
+			if((r = writev(sd,iov + i,3 - i)) < 0){
+				if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+					fprintf(stderr," Error writing request (%s).\n",strerror(errno));
+					return -1;
+				}
+				// The server's stopped reading us
+				if(poll(&pfd,1,500) == 0){
+					return sent;
+				}
+				continue;
+			}
+			off += (size_t)r;
+		}
+	}
+	return sent;
+}
+
+// A pipelined client which never reads its replies mustn't be able to hold
+// every drone, starving other clients' commands. It ought hold well under
+// half of them.
+static int
+test_ctlserver_pipeline_hog(void){
+	char SERVER[] = CUNIT_CTLSERVER;
+	int ret = -1,sd = -1,devnull = -1,regd = 0,sent,status,i;
+	metric *drones = NULL;
+	pid_t pid = -1;
+	char *in = NULL;
+
+	// Our drones' writes fail once we close the unread connection
+	signal(SIGPIPE,SIG_IGN);
+	if(init_ctlserver(SERVER)){
+		goto done;
+	}
+	if(regcommands(echo_commands)){
+		goto done;
+	}
+	regd = 1;
+	if((drones = register_gauge("ctlserver.drones")) == NULL){
+		goto done;
+	}
+	if((in = Malloc("hog input",HOG_INPUT)) == NULL){
+		goto done;
+	}
+	memset(in,'h',HOG_INPUT);
+	if((devnull = open("/dev/null",O_WRONLY)) < 0){
+		goto done;
+	}
+	if((sd = crosier_connect_pipelined(SERVER,devnull)) < 0){
+		goto done;
+	}
+	if(set_fd_nonblocking(sd)){
+		goto done;
+	}
+	if((sent = send_hog_requests(sd,in)) < 0){
+		goto done;
+	}
+	printf(" Server stopped reading after %d requests (%jd drones)...\n",
+			sent,(intmax_t)gauge_value(drones));
+	if(sent == HOG_REQUESTS){
+		fprintf(stderr," Server never stopped reading.\n");
+		goto done;
+	}
+	if(gauge_value(drones) >= 16){
+		fprintf(stderr," Connection held too many drones.\n");
+		goto done;
+	}
+	if((pid = ctlclient_quiet_nowait("mem_dump")) < 0){
+		goto done;
+	}
+	for(i = 0 ; i < 1000 ; ++i){
+		pid_t w;
+
+		if((w = waitpid(pid,&status,WNOHANG)) < 0){
+			goto done;
+		}else if(w == pid){
+			pid = -1;
+			break;
+		}
+		usleep(10000);
+	}
+	if(pid >= 0){
+		fprintf(stderr," mem_dump was starved.\n");
+		goto done;
+	}
+	if(!WIFEXITED(status) || WEXITSTATUS(status)){
+		fprintf(stderr," mem_dump failed.\n");
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(sd >= 0){
+		close(sd);
+	}
+	if(pid >= 0){
+		kill(pid,SIGKILL);
+		Waitpid(pid,&status,0);
+	}
+	if(devnull >= 0){
+		close(devnull);
+	}
+	Free(in);
+	if(regd){
+		ret |= delcommands(echo_commands);
+	}
+	ret |= stop_ctlserver();
+	ret |= unregister_metric(drones);
+	return ret;
+}
+
 static int
 test_ctlserver_noop_repeat(void){
 	char SERVER[] = CUNIT_CTLSERVER;
@@ -227,6 +953,16 @@ const declared_test CTLSERVER_TESTS[] = {
 		.expected_result = EXIT_TESTSUCCESS,
 		.sec_required = 0, .mb_required = 0, .disabled = 0,
 	},
+	{	.name = "ctlserver-loglevel",
+		.testfxn = test_ctlserver_loglevel,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-logdump",
+		.testfxn = test_ctlserver_logdump,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
 	{	.name = "ctlserver-noop-repeat",
 		.testfxn = test_ctlserver_noop_repeat,
 		.expected_result = EXIT_TESTSUCCESS,
@@ -237,6 +973,41 @@ const declared_test CTLSERVER_TESTS[] = {
 		.expected_result = EXIT_TESTFAILED | EXIT_MEMLEAK,
 		.sec_required = 0, .mb_required = 0, .disabled = 1, // FIXME
 	},
+	{	.name = "ctlserver-metrics",
+		.testfxn = test_ctlserver_metrics,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-stalled",
+		.testfxn = test_ctlserver_stalled,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-drones",
+		.testfxn = test_ctlserver_drones,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-stream",
+		.testfxn = test_ctlserver_stream,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-stream-tmpfile",
+		.testfxn = test_ctlserver_stream_tmpfile,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-pipeline",
+		.testfxn = test_ctlserver_pipeline,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "ctlserver-pipeline-hog",
+		.testfxn = test_ctlserver_pipeline_hog,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
 	{	.name = NULL,
 		.testfxn = NULL,
 		.expected_result = EXIT_TESTSUCCESS,
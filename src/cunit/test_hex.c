@@ -1,4 +1,8 @@
+#include <ctype.h>
+#include <stdlib.h>
 #include <libdank/utils/hex.h>
+#include <libdank/utils/time.h>
+#include <libdank/utils/memlimit.h>
 #include <cunit/cunit.h>
 
 static const struct {
@@ -116,6 +120,172 @@ test_us_asciitohex(void){
 	return 0;
 }
 
+// Checks the active kernel against snprintf() for every length up to a few
+// blocks, with and without separators, and decodes the results (in lowercase,
+// too) back. A corrupted digit must be caught wherever it lands.
+static int
+check_hex_kernel(const unsigned char *data,size_t maxlen){
+	static const int seps[] = { EOF, ':', };
+	char *hex,*expect;
+	unsigned char *dec;
+	size_t len,z;
+	unsigned s;
+	int ret = -1;
+
+	hex = Malloc("hex",maxlen * 3 + 1);
+	expect = Malloc("hex",maxlen * 3 + 1);
+	dec = Malloc("hex",maxlen);
+	if(hex == NULL || expect == NULL || dec == NULL){
+		goto done;
+	}
+	for(s = 0 ; s < sizeof(seps) / sizeof(*seps) ; ++s){
+		for(len = 0 ; len <= maxlen ; ++len){
+			size_t off = 0;
+
+			for(z = 0 ; z < len ; ++z){
+				off += (size_t)sprintf(expect + off,"%02X",data[z]);
+				if(seps[s] != EOF && z + 1 < len){
+					expect[off++] = (char)seps[s];
+				}
+			}
+			expect[off] = '\0';
+			asciitohex(data,hex,seps[s],len);
+			if(strcmp(hex,expect)){
+				fprintf(stderr," Bad encoding of %zub: %s\n",len,hex);
+				goto done;
+			}
+			for(z = 0 ; z < off ; ++z){
+				hex[z] = (char)tolower(hex[z]);
+			}
+			if(hextoascii(hex,dec,seps[s],len) == NULL || memcmp(dec,data,len)){
+				fprintf(stderr," Bad decoding of %zub: %s\n",len,hex);
+				goto done;
+			}
+			if(len){
+				z = (size_t)random() % off;
+				hex[z] = hex[z] == (char)seps[s] ? 'x' : 'g';
+				if(hextoascii(hex,dec,seps[s],len)){
+					fprintf(stderr," Accepted %s\n",hex);
+					goto done;
+				}
+			}
+		}
+	}
+	ret = 0;
+
+done:
+	Free(dec);
+	Free(expect);
+	Free(hex);
+	return ret;
+}
+
+#define KERNEL_LEN 200
+
+static int
+test_hex_kernels(void){
+	unsigned char data[KERNEL_LEN];
+	hex_kernel k,best;
+	int ret = 0;
+	size_t z;
+
+	for(z = 0 ; z < sizeof(data) ; ++z){
+		data[z] = (unsigned char)random();
+	}
+	best = limit_hex_kernel(HEX_KERNEL_AVX2);
+	for(k = HEX_KERNEL_SCALAR ; k <= best ; ++k){
+		printf(" Testing kernel %d of %d...\n",k,best);
+		if(limit_hex_kernel(k) != k || check_hex_kernel(data,sizeof(data))){
+			ret = -1;
+			break;
+		}
+	}
+	limit_hex_kernel(best);
+	return ret;
+}
+
+// Successive writes must join up as would a single conversion
+static int
+test_hex_stream(void){
+	unsigned char data[KERNEL_LEN];
+	ustring whole = USTRING_INITIALIZER,pieces = USTRING_INITIALIZER;
+	ustring_hexer uh;
+	size_t z,piece;
+	int ret = -1;
+
+	for(z = 0 ; z < sizeof(data) ; ++z){
+		data[z] = (unsigned char)z;
+	}
+	if(us_asciitohex(data,&whole,' ',sizeof(data))){
+		goto done;
+	}
+	init_ustring_hexer(&uh,&pieces,' ');
+	for(z = 0 ; z < sizeof(data) ; z += piece){
+		piece = z % 7 + 1 < sizeof(data) - z ? z % 7 + 1 : sizeof(data) - z;
+		if(ustring_hexer_write(&uh,data + z,piece) || ustring_hexer_write(&uh,data,0)){
+			goto done;
+		}
+	}
+	if(pieces.current != sizeof(data) * 3 - 1 || strcmp(whole.string,pieces.string)){
+		fprintf(stderr," Expected %s\n Got %s\n",whole.string,pieces.string);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	reset_ustring(&whole);
+	reset_ustring(&pieces);
+	return ret;
+}
+
+#define BULK_LEN (4 * 1024 * 1024)
+
+// Times each kernel over a large buffer
+static int
+test_hex_bulk(void){
+	unsigned char *data,*dec;
+	hex_kernel k,best;
+	int ret = -1;
+	char *hex;
+	size_t z;
+
+	data = Malloc("hex",BULK_LEN);
+	dec = Malloc("hex",BULK_LEN);
+	hex = Malloc("hex",BULK_LEN * 3 + 1);
+	if(data == NULL || dec == NULL || hex == NULL){
+		goto done;
+	}
+	for(z = 0 ; z < BULK_LEN ; ++z){
+		data[z] = (unsigned char)random();
+	}
+	best = limit_hex_kernel(HEX_KERNEL_AVX2);
+	for(k = HEX_KERNEL_SCALAR ; k <= best ; ++k){
+		struct timeval t0,t1,t2,t3;
+
+		limit_hex_kernel(k);
+		gettimeofday(&t0,NULL);
+		asciitohex(data,hex,EOF,BULK_LEN);
+		gettimeofday(&t1,NULL);
+		if(hextoascii(hex,dec,EOF,BULK_LEN) == NULL || memcmp(data,dec,BULK_LEN)){
+			goto done;
+		}
+		gettimeofday(&t2,NULL);
+		asciitohex(data,hex,':',BULK_LEN);
+		gettimeofday(&t3,NULL);
+		printf(" Kernel %d: %jdus encode, %jdus decode, %jdus encode (delimited)\n",
+			k,timeval_subtract_usec(&t1,&t0),timeval_subtract_usec(&t2,&t1),
+			timeval_subtract_usec(&t3,&t2));
+	}
+	ret = 0;
+
+done:
+	limit_hex_kernel(HEX_KERNEL_AVX2);
+	Free(hex);
+	Free(dec);
+	Free(data);
+	return ret;
+}
+
 const declared_test HEX_TESTS[] = {
 	{	.name = "hextoascii",
 		.testfxn = test_hextoascii,
@@ -137,6 +307,21 @@ const declared_test HEX_TESTS[] = {
 		.expected_result = EXIT_TESTSUCCESS,
 		.sec_required = 0, .mb_required = 0, .disabled = 0,
 	},
+	{	.name = "hex-kernels",
+		.testfxn = test_hex_kernels,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "hex-stream",
+		.testfxn = test_hex_stream,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "hex-bulk",
+		.testfxn = test_hex_bulk,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 64, .disabled = 0,
+	},
 	{	.name = NULL,
 		.testfxn = NULL,
 		.expected_result = EXIT_TESTSUCCESS,
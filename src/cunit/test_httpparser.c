@@ -0,0 +1,226 @@
+#include <string.h>
+#include <cunit/cunit.h>
+#include <libdank/objects/objustring.h>
+#include <libdank/objects/httpparser.h>
+
+static int
+span_is(const char *buf,const http_span *s,const char *expect){
+	return s->len == strlen(expect) && memcmp(buf + s->off,expect,s->len) == 0;
+}
+
+// Feeds the message a piece at a time (of the given size), collecting the
+// body, and returning the final result.
+static http_parse_res
+parse_pieces(http_parser *hp,const char *msg,size_t len,size_t piece,
+			ustring *body,int *headers){
+	size_t avail = 0;
+
+	*headers = 0;
+	for( ; ; ){
+		http_parse_res res = http_parse(hp,msg,avail);
+
+		switch(res){
+		case HTTP_PARSE_MORE:
+			if(avail == len){
+				return res;
+			}
+			avail = avail + piece > len ? len : avail + piece;
+			break;
+		case HTTP_PARSE_HEADERS:
+			++*headers;
+			break;
+		case HTTP_PARSE_BODY:
+			if(printUString(body,"%.*s",(int)hp->body.len,msg + hp->body.off) < 0){
+				return HTTP_PARSE_ERROR;
+			}
+			break;
+		case HTTP_PARSE_DONE: case HTTP_PARSE_ERROR:
+			return res;
+		}
+	}
+}
+
+static const char REQUEST[] =
+	"\r\n"
+	"POST /submit?x=1 HTTP/1.1\r\n"
+	"Host: example.com\r\n"
+	"X-Long: a header value long enough to be scanned in several blocks \t \r\n"
+	"Content-Length: 11\n"
+	"\r\n"
+	"hello worldGET / HTTP/1.0\r\n\r\n";
+
+// A request, fed a byte at a time, must parse as it would whole
+static int
+test_httpparser_request(void){
+	size_t piece;
+
+	for(piece = 1 ; piece <= sizeof(REQUEST) ; piece *= 7){
+		ustring body = USTRING_INITIALIZER;
+		const http_header *h;
+		http_parse_res res;
+		http_parser hp;
+		int headers;
+
+		init_http_request_parser(&hp);
+		res = parse_pieces(&hp,REQUEST,sizeof(REQUEST) - 1,piece,&body,&headers);
+		if(res != HTTP_PARSE_DONE || headers != 1){
+			fprintf(stderr," Got %d (%d headers) with %zub pieces\n",res,headers,piece);
+			reset_ustring(&body);
+			return -1;
+		}
+		if(!span_is(REQUEST,&hp.method,"POST") || !span_is(REQUEST,&hp.target,"/submit?x=1")
+				|| hp.version != 11 || hp.headercount != 3){
+			fprintf(stderr," Bad request line or headers\n");
+			reset_ustring(&body);
+			return -1;
+		}
+		h = http_find_header(&hp,REQUEST,"x-long");
+		if(h == NULL || !span_is(REQUEST,&h->value,"a header value long enough "
+					"to be scanned in several blocks")){
+			fprintf(stderr," Bad X-Long header\n");
+			reset_ustring(&body);
+			return -1;
+		}
+		if(body.current != 11 || strcmp(body.string,"hello world")){
+			fprintf(stderr," Bad body: %s\n",body.string ? body.string : "");
+			reset_ustring(&body);
+			return -1;
+		}
+		reset_ustring(&body);
+		// The pipelined request follows
+		if(strncmp(REQUEST + http_parser_consumed(&hp),"GET ",4)){
+			fprintf(stderr," Consumed %zu\n",http_parser_consumed(&hp));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static const char RESPONSE[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Transfer-Encoding: gzip, chunked\r\n"
+	"\r\n"
+	"5\r\nhello\r\n"
+	"1;name=value\r\n \r\n"
+	"0000000000000005 \r\nworld\r\n"
+	"0\r\n"
+	"Trailer: yes\r\n"
+	"\r\n";
+
+static int
+test_httpparser_chunked(void){
+	size_t piece;
+
+	for(piece = 1 ; piece <= sizeof(RESPONSE) ; piece *= 3){
+		ustring body = USTRING_INITIALIZER;
+		http_parse_res res;
+		http_parser hp;
+		int headers;
+
+		init_http_response_parser(&hp);
+		res = parse_pieces(&hp,RESPONSE,sizeof(RESPONSE) - 1,piece,&body,&headers);
+		if(res != HTTP_PARSE_DONE || hp.status != 200 || hp.bodytype != HTTP_BODY_CHUNKED){
+			fprintf(stderr," Got %d (status %u) with %zub pieces\n",res,hp.status,piece);
+			reset_ustring(&body);
+			return -1;
+		}
+		if(!span_is(RESPONSE,&hp.reason,"OK") || body.current != 11 ||
+				strcmp(body.string,"hello world")){
+			fprintf(stderr," Bad reason or body\n");
+			reset_ustring(&body);
+			return -1;
+		}
+		if(http_parser_consumed(&hp) != sizeof(RESPONSE) - 1){
+			fprintf(stderr," Consumed %zu\n",http_parser_consumed(&hp));
+			reset_ustring(&body);
+			return -1;
+		}
+		reset_ustring(&body);
+	}
+	return 0;
+}
+
+// Responses without framing run until the connection closes
+static int
+test_httpparser_close(void){
+	static const char RESP[] = "HTTP/1.0 404\r\n\r\nnot found";
+	ustring body = USTRING_INITIALIZER;
+	http_parser hp;
+	int headers,ret = -1;
+
+	init_http_response_parser(&hp);
+	if(parse_pieces(&hp,RESP,sizeof(RESP) - 1,4,&body,&headers) == HTTP_PARSE_MORE){
+		if(http_parse_eof(&hp) == HTTP_PARSE_DONE && hp.status == 404 &&
+				hp.version == 10 && hp.reason.len == 0 &&
+				strcmp(body.string,"not found") == 0){
+			ret = 0;
+		}
+	}
+	reset_ustring(&body);
+	return ret;
+}
+
+static const char * const MALFORMED[] = {
+	"GET\r\n\r\n",
+	"G(T / HTTP/1.1\r\n\r\n",
+	"GET / HTTP/2.0\r\n\r\n",
+	"GET / HTTP/1.1\r\nHost: x\r\n folded\r\n\r\n",
+	"GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+	"GET / HTTP/1.1\r\nX: a value with a control character \x01 past sixteen\r\n\r\n",
+	"GET / HTTP/1.1\r\nX: short\x7f\r\n\r\n",
+	"POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+	"POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nab\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n11111111111111111\r\n",
+	NULL
+};
+
+static int
+test_httpparser_malformed(void){
+	const char * const *m;
+
+	for(m = MALFORMED ; *m ; ++m){
+		ustring body = USTRING_INITIALIZER;
+		http_parser hp;
+		int headers;
+
+		init_http_request_parser(&hp);
+		if(parse_pieces(&hp,*m,strlen(*m),5,&body,&headers) != HTTP_PARSE_ERROR){
+			fprintf(stderr," Accepted malformed message %td\n",m - MALFORMED);
+			reset_ustring(&body);
+			return -1;
+		}
+		reset_ustring(&body);
+	}
+	return 0;
+}
+
+const declared_test HTTPPARSER_TESTS[] = {
+	{	.name = "httpparser-request",
+		.testfxn = test_httpparser_request,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "httpparser-chunked",
+		.testfxn = test_httpparser_chunked,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "httpparser-close",
+		.testfxn = test_httpparser_close,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "httpparser-malformed",
+		.testfxn = test_httpparser_malformed,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
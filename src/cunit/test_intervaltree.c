@@ -305,12 +305,217 @@ test_intervaltree_deranged(void){
 	fflush(stdout);
 	ret = 0;
 
+done:
+	free_interval_tree(&it,NULL);
+	return ret;
+}
+
+// Sorted insertion formerly degraded the tree into a list
+static int
+test_intervaltree_sorted(void){
+	struct interval_tree *it = NULL;
+	unsigned depth;
+	uint32_t val;
+	int ret = -1;
+
+	printf(" Building an interval tree in sorted order...");
+	fflush(stdout);
+	for(val = 0 ; val < NODETARGET ; ++val){
+		interval ival = { .lbound = 2 * val, .ubound = 2 * val + 1, };
+
+		if(insert_interval_tree(&it,&ival,NULL)){
+			printf("failure after %u.\n",val);
+			goto done;
+		}
+	}
+	printf("success.\n");
+	depth = depth_interval_tree(it);
+	printf(" Tree depth: %u.\n",depth);
+	if(depth > 48){ // ~4lgN for NODETARGET
+		printf(" Tree was unbalanced.\n");
+		goto done;
+	}
+	ret = 0;
+
 done:
 	free_interval_tree(&it,NULL);
 	return ret;
 }
 #undef NODETARGET
 
+#define OVERLAPCOUNT 1024
+#define PROBECOUNT 2048
+static interval overlaps[OVERLAPCOUNT];
+
+static int
+count_matches(const interval *ival,void *v,void *opaque){
+	const interval *expect = v;
+	unsigned *count = opaque;
+
+	if(expect->lbound != ival->lbound || expect->ubound != ival->ubound){
+		return -1;
+	}
+	++*count;
+	return 0;
+}
+
+// Verify lookups, stabbing and range queries against a linear scan of those
+// intervals with a lower bound below live
+static int
+check_overlapping(const struct interval_tree *it,unsigned live){
+	unsigned z,y;
+
+	for(z = 0 ; z < PROBECOUNT ; ++z){
+		interval q = { .lbound = rand() % 0x10000, .ubound = 0, };
+		const interval *best = NULL;
+		unsigned stabs = 0,ranges = 0,count;
+
+		q.ubound = q.lbound + rand() % 0x100;
+		for(y = 0 ; y < live ; ++y){
+			const interval *i = &overlaps[y];
+
+			if(i->lbound <= q.lbound && i->ubound >= q.lbound){
+				++stabs;
+				if(best == NULL || i->lbound > best->lbound ||
+						(i->lbound == best->lbound && i->ubound < best->ubound)){
+					best = i;
+				}
+			}
+			if(i->lbound <= q.ubound && i->ubound >= q.lbound){
+				++ranges;
+			}
+		}
+		if(lookup_interval_tree(it,q.lbound) != best){
+			printf(" Lookup mismatch on %u.\n",q.lbound);
+			return -1;
+		}
+		count = 0;
+		if(stab_interval_tree(it,q.lbound,count_matches,&count) || count != stabs){
+			printf(" Stabbing mismatch on %u (%u != %u).\n",q.lbound,count,stabs);
+			return -1;
+		}
+		count = 0;
+		if(range_interval_tree(it,&q,count_matches,&count) || count != ranges){
+			printf(" Range mismatch on [%u:%u] (%u != %u).\n",
+					q.lbound,q.ubound,count,ranges);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+test_intervaltree_overlapping(void){
+	struct interval_tree *it = NULL;
+	unsigned z,live;
+	int ret = -1;
+
+	srand(0);
+	for(z = 0 ; z < OVERLAPCOUNT ; ++z){
+		overlaps[z].lbound = rand() % 0x10000;
+		overlaps[z].ubound = overlaps[z].lbound + rand() % 0x400;
+		if(insert_interval_tree(&it,&overlaps[z],&overlaps[z])){
+			// duplicates are rejected; regenerate
+			--z;
+		}
+	}
+	printf(" Built overlapping interval tree of depth %u.\n",depth_interval_tree(it));
+	if(insert_interval_tree(&it,&overlaps[0],NULL) == 0){
+		printf(" Accepted duplicate interval.\n");
+		goto done;
+	}
+	if(check_overlapping(it,OVERLAPCOUNT)){
+		goto done;
+	}
+	live = OVERLAPCOUNT / 2;
+	printf(" Removing %u intervals.\n",OVERLAPCOUNT - live);
+	for(z = live ; z < OVERLAPCOUNT ; ++z){
+		if(remove_interval_tree(&it,&overlaps[z],NULL)){
+			goto done;
+		}
+	}
+	if(population_interval_tree(it) != live){
+		printf(" Population mismatch (%u != %u).\n",population_interval_tree(it),live);
+		goto done;
+	}
+	if(check_overlapping(it,live)){
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free_interval_tree(&it,NULL);
+	return ret;
+}
+static int
+test_intervaltree_frozen(void){
+	struct frozen_interval_tree *fit = NULL;
+	struct interval_tree *it = NULL;
+	uint32_t keys[PROBECOUNT];
+	void *vals[PROBECOUNT];
+	unsigned z;
+	int ret = -1;
+
+	if((fit = freeze_interval_tree(it)) == NULL){
+		goto done;
+	}
+	if(lookup_frozen_interval_tree(fit,0) || lookup_frozen_interval_tree(fit,UINT32_MAX)){
+		printf(" Found data in empty frozen tree.\n");
+		goto done;
+	}
+	free_frozen_interval_tree(fit);
+	srand(1);
+	for(z = 0 ; z < OVERLAPCOUNT ; ++z){
+		overlaps[z].lbound = rand() % 0x10000;
+		overlaps[z].ubound = overlaps[z].lbound + rand() % 0x400;
+		if(z % 3 == 0){ // and some disjoint, geo-IP style ranges
+			overlaps[z].lbound = 0x20000 + z * 0x100;
+			overlaps[z].ubound = overlaps[z].lbound + 0xff;
+		}
+		if(insert_interval_tree(&it,&overlaps[z],&overlaps[z])){
+			--z;
+		}
+	}
+	if((fit = freeze_interval_tree(it)) == NULL){
+		goto done;
+	}
+	printf(" Froze %u intervals into %u segments.\n",OVERLAPCOUNT,
+			segments_frozen_interval_tree(fit));
+	for(z = 0 ; z < OVERLAPCOUNT ; ++z){
+		const interval *i = &overlaps[z];
+		const uint32_t probes[] = { i->lbound - 1, i->lbound, i->ubound, i->ubound + 1, };
+		unsigned p;
+
+		for(p = 0 ; p < sizeof(probes) / sizeof(*probes) ; ++p){
+			if(lookup_frozen_interval_tree(fit,probes[p]) !=
+					lookup_interval_tree(it,probes[p])){
+				printf(" Frozen mismatch on %u.\n",probes[p]);
+				goto done;
+			}
+		}
+	}
+	for(z = 0 ; z < PROBECOUNT ; ++z){
+		keys[z] = rand() % 0x40000;
+	}
+	keys[0] = 0;
+	keys[1] = UINT32_MAX;
+	lookup_frozen_interval_tree_batch(fit,keys,vals,PROBECOUNT);
+	for(z = 0 ; z < PROBECOUNT ; ++z){
+		if(vals[z] != lookup_interval_tree(it,keys[z])){
+			printf(" Batch mismatch on %u.\n",keys[z]);
+			goto done;
+		}
+	}
+	ret = 0;
+
+done:
+	free_frozen_interval_tree(fit);
+	free_interval_tree(&it,NULL);
+	return ret;
+}
+#undef PROBECOUNT
+#undef OVERLAPCOUNT
+
 const declared_test INTERVAL_TREE_TESTS[] = {
 	{	.name = "intervaltree_freeempty",
 		.testfxn = test_intervaltree_freeempty,
@@ -342,6 +547,21 @@ const declared_test INTERVAL_TREE_TESTS[] = {
 		.expected_result = EXIT_TESTSUCCESS,
 		.sec_required = 0, .mb_required = 0, .disabled = 0,
 	},
+	{	.name = "intervaltree_sorted",
+		.testfxn = test_intervaltree_sorted,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "intervaltree_overlapping",
+		.testfxn = test_intervaltree_overlapping,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "intervaltree_frozen",
+		.testfxn = test_intervaltree_frozen,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
 	{	.name = NULL,
 		.testfxn = NULL,
 		.expected_result = EXIT_TESTSUCCESS,
@@ -0,0 +1,162 @@
+#include <string.h>
+#include <stdlib.h>
+#include <cunit/cunit.h>
+#include <libdank/utils/fds.h>
+#include <libdank/utils/syswrap.h>
+#include <libdank/utils/lineparser.h>
+#include <libdank/objects/objustring.h>
+
+static const char LINES_IN[] =
+	"  first\n"
+	"# comment \\\n"
+	"  continued comment\n"
+	"second \\\n"
+	"  continued\n"
+	"\n"
+	"\t third\\\n"
+	"\\\n"
+	"# not a comment\n"
+	"last";
+
+static const char LINES_OUT[] =
+	"[first][second     continued][third    # not a comment][last]";
+
+static int
+collect_line(char *line,void *vu){
+	return printUString(vu,"[%s]",line) < 0 ? -1 : 0;
+}
+
+// Mapped regular files and read pipes must parse the same
+static int
+test_lineparser(void){
+	ustring mapped = USTRING_INITIALIZER,piped = USTRING_INITIALIZER;
+	int ret = -1,fd,filedes[2];
+	FILE *fp;
+
+	if((fp = Tmpfile()) == NULL){
+		return -1;
+	}
+	if(fwrite(LINES_IN,1,strlen(LINES_IN),fp) != strlen(LINES_IN) || fflush(fp)){
+		Fclose(fp);
+		return -1;
+	}
+	fd = Fileno(fp);
+	if(lseek(fd,0,SEEK_SET) == 0){
+		ret = parser_byline_mapped(fd,collect_line,&mapped);
+	}
+	ret |= Fclose(fp);
+	if(Pipe(filedes)){
+		ret = -1;
+		goto done;
+	}
+	if(Writen(filedes[1],LINES_IN,strlen(LINES_IN)) == 0){
+		ret |= Close(filedes[1]);
+		ret |= parser_byline(filedes[0],collect_line,&piped);
+	}else{
+		Close(filedes[1]);
+		ret = -1;
+	}
+	ret |= Close(filedes[0]);
+	if(ret == 0){
+		printf(" Mapped: %s\n Read:   %s\n",mapped.string,piped.string);
+		if(strcmp(mapped.string,LINES_OUT) || strcmp(piped.string,LINES_OUT)){
+			fprintf(stderr," Expected %s\n",LINES_OUT);
+			ret = -1;
+		}
+	}
+
+done:
+	reset_ustring(&mapped);
+	reset_ustring(&piped);
+	return ret;
+}
+
+typedef struct line_tally {
+	unsigned long lines,sum;
+} line_tally;
+
+static int
+tally_line(char *line,void *vt){
+	line_tally *lt = vt;
+	unsigned long v;
+
+	if(strncmp(line,"key ",4)){
+		fprintf(stderr," Bad line: %s\n",line);
+		return -1;
+	}
+	v = strtoul(line + 4,NULL,10);
+	__atomic_add_fetch(&lt->lines,1,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&lt->sum,v,__ATOMIC_RELAXED);
+	return 0;
+}
+
+#define TALLY_LINES 400000
+
+// Splitting mustn't lose, duplicate or break up any lines, including those
+// continued across likely split points.
+static int
+test_lineparser_parallel(void){
+	line_tally serial = { 0, 0 },parallel = { 0, 0 };
+	int ret = -1,fd;
+	unsigned z;
+	FILE *fp;
+
+	if((fp = Tmpfile()) == NULL){
+		return -1;
+	}
+	for(z = 0 ; z < TALLY_LINES ; ++z){
+		int r;
+
+		if(z % 3){
+			r = fprintf(fp,"key %u value\n",z);
+		}else if(z % 2){
+			r = fprintf(fp,"# comment %u\n  \n",z);
+		}else{
+			r = fprintf(fp,"key %u\\\n   continued value \\ \n\n",z);
+		}
+		if(r < 0){
+			Fclose(fp);
+			return -1;
+		}
+	}
+	if(fflush(fp)){
+		Fclose(fp);
+		return -1;
+	}
+	fd = Fileno(fp);
+	if(lseek(fd,0,SEEK_SET) == 0 && parser_byline(fd,tally_line,&serial) == 0){
+		if(lseek(fd,0,SEEK_SET) == 0){
+			ret = parser_byline_parallel(fd,tally_line,&parallel,4);
+		}
+	}
+	ret |= Fclose(fp);
+	if(ret == 0){
+		printf(" Serial: %lu lines (%lu), parallel: %lu lines (%lu)\n",
+				serial.lines,serial.sum,parallel.lines,parallel.sum);
+		if(serial.lines != parallel.lines || serial.sum != parallel.sum){
+			ret = -1;
+		}else if(serial.lines != TALLY_LINES - (TALLY_LINES + 5) / 6){
+			fprintf(stderr," Expected %u lines\n",TALLY_LINES - (TALLY_LINES + 5) / 6);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+const declared_test LINEPARSER_TESTS[] = {
+	{	.name = "lineparser",
+		.testfxn = test_lineparser,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "lineparser-parallel",
+		.testfxn = test_lineparser_parallel,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
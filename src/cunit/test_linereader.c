@@ -0,0 +1,226 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <cunit/cunit.h>
+#include <libdank/utils/fds.h>
+#include <libdank/utils/netio.h>
+#include <libdank/utils/syswrap.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/linereader.h>
+
+// Writes the text to an unlinked scratch file, returning a descriptor open on
+// its beginning.
+static int
+scratch_text(const char *text,size_t len){
+	FILE *fp;
+	int fd;
+
+	if((fp = Tmpfile()) == NULL){
+		return -1;
+	}
+	if(fwrite(text,1,len,fp) != len || fflush(fp)){
+		fclose(fp);
+		return -1;
+	}
+	if((fd = Dup(fileno(fp))) >= 0){
+		if(lseek(fd,0,SEEK_SET)){
+			Close(fd);
+			fd = -1;
+		}
+	}
+	fclose(fp);
+	return fd;
+}
+
+static const char LINES_IN[] = "a\nbb\0ccc\n\n\0last";
+static const char * const LINES_OUT[] = { "a", "bb", "ccc", "", "", "last", NULL };
+
+static int
+test_linereader(void){
+	const char * const *expect;
+	line_reader lr;
+	int ret = -1,fd;
+	char *line;
+	size_t len;
+
+	if((fd = scratch_text(LINES_IN,sizeof(LINES_IN) - 1)) < 0){
+		return -1;
+	}
+	if(init_line_reader(&lr,0)){
+		Close(fd);
+		return -1;
+	}
+	for(expect = LINES_OUT ; *expect ; ++expect){
+		if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_SUCCESS){
+			fprintf(stderr," Expected %s, got no line\n",*expect);
+			goto done;
+		}
+		if(len != strlen(*expect) || strcmp(line,*expect)){
+			fprintf(stderr," Expected %s, got %s (%zu)\n",*expect,line,len);
+			goto done;
+		}
+	}
+	if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_EOF){
+		fprintf(stderr," Expected EOF\n");
+		goto done;
+	}
+	ret = 0;
+
+done:
+	reset_line_reader(&lr);
+	ret |= Close(fd);
+	return ret;
+}
+
+#define MANY_LINES 100000
+
+// Lines of varying length, straddling many chunk boundaries
+static int
+test_linereader_chunks(void){
+	size_t tlen = 0,len;
+	int ret = -1,fd,z;
+	line_reader lr;
+	char *text,*line;
+
+	if((text = Malloc("line text",MANY_LINES * 16)) == NULL){
+		return -1;
+	}
+	for(z = 0 ; z < MANY_LINES ; ++z){
+		tlen += (size_t)sprintf(text + tlen,"%d%.*s\n",z,z % 7,"xxxxxxx");
+	}
+	fd = scratch_text(text,tlen);
+	Free(text);
+	if(fd < 0){
+		return -1;
+	}
+	if(init_line_reader(&lr,0)){
+		Close(fd);
+		return -1;
+	}
+	for(z = 0 ; z < MANY_LINES ; ++z){
+		char expect[16];
+
+		snprintf(expect,sizeof(expect),"%d%.*s",z,z % 7,"xxxxxxx");
+		if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_SUCCESS){
+			fprintf(stderr," Couldn't read line %d\n",z);
+			goto done;
+		}
+		if(len != strlen(expect) || strcmp(line,expect)){
+			fprintf(stderr," Expected %s, got %s\n",expect,line);
+			goto done;
+		}
+	}
+	if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_EOF){
+		fprintf(stderr," Expected EOF\n");
+		goto done;
+	}
+	printf(" Read %d lines (%zub) in %zub chunks.\n",MANY_LINES,tlen,(size_t)LINE_READER_CHUNK);
+	ret = 0;
+
+done:
+	reset_line_reader(&lr);
+	ret |= Close(fd);
+	return ret;
+}
+
+// A maximum-length line is accepted, and anything longer refused
+static const char LONG_IN[] = "short\nmaxline8\nthis line is too long\n";
+
+static int
+test_linereader_longline(void){
+	line_reader lr;
+	int ret = -1,fd;
+	char *line;
+	size_t len;
+
+	if((fd = scratch_text(LONG_IN,sizeof(LONG_IN) - 1)) < 0){
+		return -1;
+	}
+	if(init_line_reader(&lr,8)){
+		Close(fd);
+		return -1;
+	}
+	if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_SUCCESS || strcmp(line,"short")){
+		fprintf(stderr," Didn't read the short line\n");
+	}else if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_SUCCESS || strcmp(line,"maxline8")){
+		fprintf(stderr," Didn't read the maximum-length line\n");
+	}else if(read_buffered_line(&lr,fd,&line,&len) != LINE_READ_LONGLINE){
+		fprintf(stderr," Accepted an overlong line\n");
+	}else{
+		ret = 0;
+	}
+	reset_line_reader(&lr);
+	ret |= Close(fd);
+	return ret;
+}
+
+static const char SOCKLINES_IN[] = "first\nsecond\0third";
+static const char * const SOCKLINES_OUT[] = { "first", "second", "third", NULL };
+
+// read_socket_dynline() mustn't consume anything past its line
+static int
+test_socket_dynline(void){
+	const char * const *expect;
+	int sv[2],ret = -1;
+	char *line;
+
+	if(Socketpair(PF_UNIX,SOCK_STREAM,0,sv)){
+		return -1;
+	}
+	if(Writen(sv[1],SOCKLINES_IN,sizeof(SOCKLINES_IN) - 1)){
+		goto done;
+	}
+	if(shutdown(sv[1],SHUT_WR)){
+		goto done;
+	}
+	for(expect = SOCKLINES_OUT ; *expect ; ++expect){
+		if(read_socket_dynline(sv[0],&line)){
+			fprintf(stderr," Expected %s, got no line\n",*expect);
+			goto done;
+		}
+		if(strcmp(line,*expect)){
+			fprintf(stderr," Expected %s, got %s\n",*expect,line);
+			Free(line);
+			goto done;
+		}
+		Free(line);
+	}
+	if(read_socket_dynline(sv[0],&line) == 0){
+		fprintf(stderr," Got a line past EOF: %s\n",line);
+		Free(line);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	ret |= Close(sv[0]);
+	ret |= Close(sv[1]);
+	return ret;
+}
+
+const declared_test LINEREADER_TESTS[] = {
+	{	.name = "linereader",
+		.testfxn = test_linereader,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "linereader-chunks",
+		.testfxn = test_linereader_chunks,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "linereader-longline",
+		.testfxn = test_linereader_longline,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "socket-dynline",
+		.testfxn = test_socket_dynline,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
@@ -1,4 +1,16 @@
+#include <time.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/wait.h>
+#include <limits.h>
 #include <cunit/cunit.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
+#include <libdank/modules/logging/logdir.h>
 #include <libdank/modules/logging/logging.h>
 
 static int
@@ -9,12 +21,462 @@ test_loggingmain(void){
 	return 0;
 }
 
+#define ASYNC_LINES 1024
+#define ASYNC_BURST 64
+#define ASYNC_FMT "%d %5.2f %-8s|%*d|%.*s %p %ju %c %% %Lg %zu %s\n"
+#define ASYNC_ARGS(i,buf) (i),(i) / 3.0,"str",6,-(i),3,"truncated",(void *)&async_anchor,\
+	(uintmax_t)(i) * (i),'a' + (i) % 26,(long double)(i) / 7,sizeof(i) * (i),(buf)
+
+static int async_anchor;
+
+// Compare a deferred rendering against that of snprintf(). Log lines carry a
+// line-number prefix, which ought be sequential.
+static int
+check_async_lines(FILE *fp,uintmax_t first){
+	char line[LISTENER_MSG_SZ],expect[LISTENER_MSG_SZ],buf[16];
+	uintmax_t lineno;
+	char *sep;
+	int i;
+
+	for(i = 0 ; i < ASYNC_LINES ; ++i){
+		if(fgets(line,sizeof(line),fp) == NULL){
+			fprintf(stderr,"  Only got %d lines\n",i);
+			return -1;
+		}
+		lineno = strtoumax(line,&sep,10);
+		if(*sep != '|' || lineno != first + (unsigned)i){
+			fprintf(stderr,"  Bad line prefix: %s",line);
+			return -1;
+		}
+		snprintf(buf,sizeof(buf),"s%d",i);
+		snprintf(expect,sizeof(expect),ASYNC_FMT,ASYNC_ARGS(i,buf));
+		if(strcmp(sep + 1,expect)){
+			fprintf(stderr,"  Expected %s  Got %s",expect,sep + 1);
+			return -1;
+		}
+	}
+	if(fgets(line,sizeof(line),fp) == NULL || !strstr(line,"deferred time")){
+		fprintf(stderr,"  Missing timed line\n");
+		return -1;
+	}
+	if(fgets(line,sizeof(line),fp)){
+		fprintf(stderr,"  Unexpected line: %s",line);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+test_asynclog(void){
+	uintmax_t first;
+	FILE *fp,*ofp;
+	char buf[16];
+	int ret = -1,i;
+	logctx *lc;
+
+	if((lc = get_thread_logctx()) == NULL){
+		return -1;
+	}
+	if((fp = tmpfile()) == NULL){
+		return -1;
+	}
+	ofp = lc->lfile;
+	lc->lfile = fp;
+	first = lc->lineswritten;
+	if(start_async_logging()){
+		goto done;
+	}
+	for(i = 0 ; i < ASYNC_LINES ; ++i){
+		// strings must be copied, not referenced
+		snprintf(buf,sizeof(buf),"s%d",i);
+		flog(ASYNC_FMT,ASYNC_ARGS(i,buf));
+		strcpy(buf,"clobbered");
+		if(i % ASYNC_BURST == ASYNC_BURST - 1){
+			usleep(20000); // don't outrun the formatter
+		}
+	}
+	timeflog("deferred time\n");
+	if(stop_async_logging()){
+		goto done;
+	}
+	if(lc->ring){
+		fprintf(stderr,"  Ring wasn't retired\n");
+		goto done;
+	}
+	rewind(fp);
+	ret = check_async_lines(fp,first);
+
+done:
+	lc->lfile = ofp;
+	fclose(fp);
+	return ret;
+}
+
+#define LOGMAP_BURST 256
+
+// Read back a logmap written by the formatter, which ought hold one record
+// per line.
+static int
+check_logmap_lines(const char *fn){
+	char text[LISTENER_MSG_SZ],expect[LISTENER_MSG_SZ];
+	int ret = 0,i = 0,len;
+	uint64_t off,nsec;
+	logmap lm;
+
+	if(open_logmap(&lm,fn)){
+		return -1;
+	}
+	off = lm.hdr->head;
+	while(ret == 0 && (len = read_logmap(&lm,&off,&nsec,text,sizeof(text))) >= 0){
+		const char *sep;
+
+		if((sep = strchr(text,'|')) == NULL || strncmp(sep + 1,"burst ",6)){
+			continue; // written by the harness, or by logging itself
+		}
+		snprintf(expect,sizeof(expect),"burst %d of %d, padded to make a long line\n",
+				i,LOGMAP_BURST);
+		if((size_t)len != strlen(text) || strcmp(sep + 1,expect)){
+			fprintf(stderr,"  Expected %s  Got %s",expect,sep + 1);
+			ret = -1;
+		}
+		++i;
+	}
+	if(ret == 0 && i != LOGMAP_BURST){
+		fprintf(stderr,"  Read %d of %d lines\n",i,LOGMAP_BURST);
+		ret = -1;
+	}
+	close_logmap(&lm);
+	return ret;
+}
+
+// The child logs a burst through the formatter into its (yet to be created)
+// logmap, and checks it. A logdir can't be torn down short of stop_logging(),
+// so it's set up in a process of its own.
+static int
+logmap_burst_child(const char *dir){
+	char fn[PATH_MAX + 8];
+	int ret = -1,i;
+	logctx *lc;
+
+	if((lc = get_thread_logctx()) == NULL){
+		return -1;
+	}
+	if(set_logdir(dir) || thread_log_name(lc,fn,sizeof(fn)) || lc->lmap){
+		fprintf(stderr,"  Couldn't log to %s\n",dir);
+		return -1;
+	}
+	if(start_async_logging() == 0){
+		for(i = 0 ; i < LOGMAP_BURST ; ++i){
+			flog("burst %d of %d, padded to make a long line\n",i,LOGMAP_BURST);
+		}
+		if(stop_async_logging() == 0 && lc->lmap){
+			ret = check_logmap_lines(fn);
+		}
+	}
+	unlink(fn);
+	snprintf(fn,sizeof(fn),"%s/crash",dir);
+	unlink(fn);
+	return ret;
+}
+
+// The formatter's first drain into a thread's logmap must nonetheless write
+// each line as its own record. The burst greatly exceeds the PIPE_BUF-sized
+// records which readers are prepared to handle.
+static int
+test_asynclog_logmap(void){
+	char dir[PATH_MAX];
+	int ret = -1,status;
+	pid_t pid;
+
+	snprintf(dir,sizeof(dir),"%s/logctxXXXXXX",P_tmpdir);
+	if(mkdtemp(dir) == NULL){
+		return -1;
+	}
+	if((pid = fork()) < 0){
+		goto done;
+	}else if(pid == 0){
+		_exit(logmap_burst_child(dir) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if(waitpid(pid,&status,0) != pid || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != EXIT_SUCCESS){
+		fprintf(stderr,"  Child failed\n");
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(rmdir(dir)){
+		fprintf(stderr,"  Couldn't remove %s\n",dir);
+		ret = -1;
+	}
+	return ret;
+}
+
+// Check a timeflog() line against ctime(3) for either of two seconds, and for
+// the requested count of sub-second digits.
+static int
+check_time_leader(const char *line,time_t t0,time_t t1,unsigned digits){
+	char c0[32],c1[32];
+	const char *l;
+	unsigned z;
+
+	if((l = strchr(line,'|')) == NULL){
+		return -1;
+	}
+	++l;
+	if(ctime_r(&t0,c0) == NULL || ctime_r(&t1,c1) == NULL){
+		return -1;
+	}
+	// "Www Mmm dd hh:mm:ss", then the fraction, then " yyyy "
+	if(strncmp(l,c0,19) && strncmp(l,c1,19)){
+		fprintf(stderr,"  Bad leader: %s",line);
+		return -1;
+	}
+	l += 19;
+	if(digits){
+		if(*l++ != '.'){
+			fprintf(stderr,"  Missing fraction: %s",line);
+			return -1;
+		}
+		for(z = 0 ; z < digits ; ++z){
+			if(!isdigit((unsigned char)*l++)){
+				fprintf(stderr,"  Bad fraction: %s",line);
+				return -1;
+			}
+		}
+	}
+	if(strncmp(l,c0 + 19,5) && strncmp(l,c1 + 19,5)){
+		fprintf(stderr,"  Bad year: %s",line);
+		return -1;
+	}
+	if(strcmp(l + 6,"leader\n")){
+		fprintf(stderr,"  Bad text: %s",line);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+test_timeleader(void){
+	const unsigned precisions[] = { 0, 3, 9, 0, };
+	char line[LISTENER_MSG_SZ];
+	FILE *fp,*ofp;
+	int ret = -1;
+	time_t t0,t1;
+	unsigned z;
+	logctx *lc;
+
+	if((lc = get_thread_logctx()) == NULL){
+		return -1;
+	}
+	if(set_log_time_precision(10) == 0){
+		fprintf(stderr,"  Accepted 10 digits of precision\n");
+		return -1;
+	}
+	if((fp = tmpfile()) == NULL){
+		return -1;
+	}
+	ofp = lc->lfile;
+	lc->lfile = fp;
+	for(z = 0 ; z < sizeof(precisions) / sizeof(*precisions) ; ++z){
+		if(set_log_time_precision(precisions[z])){
+			goto done;
+		}
+		t0 = time(NULL);
+		timeflog("leader\n");
+		t1 = time(NULL);
+		// the coarse clock might lag time(2) by a tick
+		--t0;
+		if(fseek(fp,0,SEEK_SET) || fgets(line,sizeof(line),fp) == NULL){
+			goto done;
+		}
+		if(check_time_leader(line,t0,t1,precisions[z])){
+			goto done;
+		}
+		printf("  %s",line);
+		rewind(fp);
+		if(ftruncate(fileno(fp),0)){
+			goto done;
+		}
+	}
+	ret = 0;
+
+done:
+	set_log_time_precision(0);
+	lc->lfile = ofp;
+	fclose(fp);
+	return ret;
+}
+
+static int level_evaluations;
+
+static int
+level_arg(void){
+	return ++level_evaluations;
+}
+
+// Disabled levels must produce no output, and mustn't evaluate arguments.
+static int
+test_loglevels(void){
+	char line[LISTENER_MSG_SZ];
+	int ret = -1,olvl,z;
+	FILE *fp,*ofp;
+	logctx *lc;
+
+	if((lc = get_thread_logctx()) == NULL){
+		return -1;
+	}
+	if((olvl = get_log_level(LOGCAT_GENERAL)) != LOGLVL_INFO){
+		fprintf(stderr,"  Default level was %d\n",olvl);
+		return -1;
+	}
+	if(set_log_level(LOGCAT_COUNT + 1,LOGLVL_INFO) == 0 ||
+			set_log_level(LOGCAT_GENERAL,LOGLVL_COUNT) == 0){
+		fprintf(stderr,"  Accepted invalid parameters\n");
+		return -1;
+	}
+	if((fp = tmpfile()) == NULL){
+		return -1;
+	}
+	ofp = lc->lfile;
+	lc->lfile = fp;
+	if(set_log_level(LOGCAT_GENERAL,LOGLVL_ERROR)){
+		goto done;
+	}
+	nag("nagged %d\n",level_arg());
+	dnag("dnagged %d\n",level_arg());
+	bitch("bitched %d\n",level_arg());
+	if(set_log_level(LOGCAT_COUNT,LOGLVL_DEBUG)){
+		goto done;
+	}
+	dnag("dnagged %d\n",level_arg());
+	if(set_log_level(LOGCAT_GENERAL,-1)){
+		goto done;
+	}
+	bitch("bitched %d\n",level_arg());
+	if(get_log_level(LOGCAT_GENERAL) != -1 || get_log_level(LOGCAT_EVCORE) != LOGLVL_DEBUG){
+		fprintf(stderr,"  Bad levels after update\n");
+		goto done;
+	}
+	if(level_evaluations != 2){
+		fprintf(stderr,"  Evaluated %d arguments, expected 2\n",level_evaluations);
+		goto done;
+	}
+	rewind(fp);
+	for(z = 1 ; z <= 2 ; ++z){
+		if(fgets(line,sizeof(line),fp) == NULL){
+			fprintf(stderr,"  Missing line %d\n",z);
+			goto done;
+		}
+		if(!strstr(line,z == 1 ? "bitched 1\n" : "dnagged 2\n")){
+			fprintf(stderr,"  Unexpected line %d: %s",z,line);
+			goto done;
+		}
+	}
+	if(fgets(line,sizeof(line),fp)){
+		fprintf(stderr,"  Unexpected line: %s",line);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	set_log_level(LOGCAT_COUNT,LOGLVL_INFO);
+	lc->lfile = ofp;
+	fclose(fp);
+	return ret;
+}
+
+// Within a burst, a rate-limited site writes burst lines and suppresses the
+// rest, reporting their count once tokens accrue. Sampled sites write 1 in n.
+static int
+test_lograte(void){
+	const struct timespec pause = { .tv_sec = 0, .tv_nsec = 50000000, };
+	int ret = -1,storms = 0,samples = 0,supp = 0,z;
+	char line[LISTENER_MSG_SZ];
+	FILE *fp,*ofp;
+	logctx *lc;
+
+	if((lc = get_thread_logctx()) == NULL){
+		return -1;
+	}
+	if((fp = tmpfile()) == NULL){
+		return -1;
+	}
+	ofp = lc->lfile;
+	lc->lfile = fp;
+	for(z = 0 ; z < 2 ; ++z){
+		int i;
+
+		for(i = 0 ; i < 100 ; ++i){
+			ratebitch(100,5,"storm %d\n",i);
+			samplenag(10,"sample %d\n",i);
+		}
+		nanosleep(&pause,NULL);
+	}
+	rewind(fp);
+	while(fgets(line,sizeof(line),fp)){
+		const char *s;
+
+		if(strstr(line,"] storm ")){
+			++storms;
+		}else if(strstr(line,"] [1/10] sample ")){
+			++samples;
+		}else if( (s = strstr(line,"] (")) ){
+			supp += atoi(s + 3);
+		}else{
+			fprintf(stderr,"  Unexpected line: %s",line);
+			goto done;
+		}
+	}
+	// Each pass gets at least one token, and suppresses most lines. Those
+	// suppressed after the last admission go unreported.
+	if(storms < 6 || supp < 100 - storms || storms + supp > 200){
+		fprintf(stderr,"  %d lines, %d reported suppressed\n",storms,supp);
+		goto done;
+	}
+	if(samples != 20){
+		fprintf(stderr,"  %d samples, expected 20\n",samples);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	lc->lfile = ofp;
+	fclose(fp);
+	return ret;
+}
+
 const declared_test LOGCTX_TESTS[] = {
 	{	.name = "logctx",
 		.testfxn = test_loggingmain,
 		.expected_result = EXIT_TESTSUCCESS,
 		.sec_required = 0, .mb_required = 0, .disabled = 0,
 	},
+	{	.name = "logctx-async",
+		.testfxn = test_asynclog,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "logctx-async-logmap",
+		.testfxn = test_asynclog_logmap,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "logctx-timeleader",
+		.testfxn = test_timeleader,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "logctx-levels",
+		.testfxn = test_loglevels,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "logctx-ratelimit",
+		.testfxn = test_lograte,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
 	{	.name = NULL,
 		.testfxn = NULL,
 		.expected_result = EXIT_TESTSUCCESS,
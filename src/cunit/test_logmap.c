@@ -0,0 +1,338 @@
+#include <zlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cunit/cunit.h>
+#include <libdank/utils/syswrap.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
+#include <libdank/modules/logging/logrotate.h>
+
+#define LOGMAP_LINES 1000
+
+static int
+make_logmap_name(char *fn,size_t len){
+	int fd;
+
+	snprintf(fn,len,"%s/logmapXXXXXX",P_tmpdir);
+	if((fd = mkstemp(fn)) < 0){
+		fprintf(stderr,"  Couldn't create temporary file\n");
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static void
+write_logmap_lines(logmap *lm,unsigned n){
+	char line[80];
+	unsigned z;
+	int len;
+
+	for(z = 0 ; z < n ; ++z){
+		len = snprintf(line,sizeof(line),"%u|logmap line %u\n",z,z * z);
+		write_logmap(lm,line,(size_t)len);
+	}
+}
+
+// Read back the logmap from a distinct mapping, expecting the final lines
+// written by write_logmap_lines(), in order. Returns the number found.
+static int
+check_logmap_lines(const char *fn,unsigned n){
+	char text[LISTENER_MSG_SZ],expect[80];
+	uint64_t off,nsec,lastnsec = 0;
+	unsigned first = 0,found = 0;
+	logmap lm;
+	int len;
+
+	if(open_logmap(&lm,fn)){
+		return -1;
+	}
+	off = lm.hdr->head;
+	while((len = read_logmap(&lm,&off,&nsec,text,sizeof(text))) >= 0){
+		if(found == 0){
+			first = (unsigned)strtoul(text,NULL,10);
+		}
+		snprintf(expect,sizeof(expect),"%u|logmap line %u\n",first + found,
+				(first + found) * (first + found));
+		if(strcmp(text,expect) || (size_t)len != strlen(expect)){
+			fprintf(stderr,"  Expected %s  Got %s",expect,text);
+			close_logmap(&lm);
+			return -1;
+		}
+		if(nsec < lastnsec){
+			fprintf(stderr,"  Timestamps went backwards\n");
+			close_logmap(&lm);
+			return -1;
+		}
+		lastnsec = nsec;
+		++found;
+	}
+	if(off != lm.hdr->tail || first + found != n){
+		fprintf(stderr,"  Read %u-%u of %u\n",first,first + found,n);
+		close_logmap(&lm);
+		return -1;
+	}
+	if(close_logmap(&lm)){
+		return -1;
+	}
+	return (int)found;
+}
+
+static int
+test_logmap_wrap(void){
+	char fn[PATH_MAX];
+	int ret = -1,found;
+	logmap lm;
+
+	if(make_logmap_name(fn,sizeof(fn))){
+		return -1;
+	}
+	if(create_logmap(&lm,fn,(size_t)Getpagesize())){
+		unlink(fn);
+		return -1;
+	}
+	write_logmap_lines(&lm,LOGMAP_LINES);
+	if((found = check_logmap_lines(fn,LOGMAP_LINES)) < 0){
+		goto done;
+	}
+	printf("  Retained %d/%d records in %d bytes\n",found,LOGMAP_LINES,Getpagesize());
+	if(found < 50 || found == LOGMAP_LINES){
+		goto done;
+	}
+	ret = 0;
+
+done:
+	ret |= close_logmap(&lm);
+	unlink(fn);
+	return ret;
+}
+
+// Logging must survive the process being killed outright.
+static int
+test_logmap_sigkill(void){
+	char fn[PATH_MAX];
+	int ret = -1,status;
+	pid_t pid;
+
+	if(make_logmap_name(fn,sizeof(fn))){
+		return -1;
+	}
+	if((pid = fork()) < 0){
+		goto done;
+	}else if(pid == 0){
+		logmap lm;
+
+		if(create_logmap(&lm,fn,(size_t)Getpagesize() * 16)){
+			_exit(EXIT_FAILURE);
+		}
+		write_logmap_lines(&lm,LOGMAP_LINES / 10);
+		raise(SIGKILL);
+		_exit(EXIT_FAILURE);
+	}
+	if(waitpid(pid,&status,0) != pid || !WIFSIGNALED(status)){
+		fprintf(stderr,"  Child wasn't killed\n");
+		goto done;
+	}
+	if(check_logmap_lines(fn,LOGMAP_LINES / 10) != LOGMAP_LINES / 10){
+		goto done;
+	}
+	ret = 0;
+
+done:
+	unlink(fn);
+	return ret;
+}
+
+#define ROTATE_LINES 10000
+#define ROTATE_BURST 200
+#define ROTATE_KEEP 4
+
+// Read back the retained segments, which ought be compressed, few, and hold
+// the final lines in order. Removes them.
+static int
+check_rotated_segments(const char *fn,unsigned n){
+	char sfn[PATH_MAX + 16],text[80],expect[80];
+	unsigned seq,segs = 0,next = 0;
+	int ret = 0;
+
+	for(seq = 1 ; seq <= n ; ++seq){
+		gzFile gz;
+
+		snprintf(sfn,sizeof(sfn),"%s.%u",fn,seq);
+		if(access(sfn,F_OK) == 0){
+			fprintf(stderr,"  Uncompressed segment %s\n",sfn);
+			unlink(sfn);
+			ret = -1;
+		}
+		snprintf(sfn,sizeof(sfn),"%s.%u.gz",fn,seq);
+		if((gz = gzopen(sfn,"rb")) == NULL){
+			continue;
+		}
+		while(ret == 0 && gzgets(gz,text,sizeof(text))){
+			if(segs == 0 && next == 0){
+				next = (unsigned)strtoul(text,NULL,10);
+			}
+			snprintf(expect,sizeof(expect),"%u|logmap line %u\n",next,next * next);
+			if(strcmp(text,expect)){
+				fprintf(stderr,"  Expected %s  Got %s",expect,text);
+				ret = -1;
+			}
+			++next;
+		}
+		gzclose(gz);
+		unlink(sfn);
+		printf("  Segment %u ends with line %u\n",seq,next - 1);
+		++segs;
+	}
+	if(ret == 0 && (segs == 0 || segs > ROTATE_KEEP || next != n)){
+		fprintf(stderr,"  %u segments, ending with line %u\n",segs,next - 1);
+		ret = -1;
+	}
+	return ret;
+}
+
+// Stream the completed segments into a file, and read them back as one gzip
+// stream: each segment's header, followed by consecutive lines.
+static int
+check_streamed_segments(const char *fn){
+	char text[PATH_MAX + 16],expect[80];
+	unsigned hdrs = 0,lines = 0,next = 0;
+	int fd,ret = 0,synced = 0;
+	const char *base;
+	gzFile gz;
+	FILE *fp;
+
+	base = strrchr(fn,'/') ? strrchr(fn,'/') + 1 : fn;
+	if((fp = tmpfile()) == NULL){
+		return -1;
+	}
+	if(stream_log_segments(fileno(fp)) || (fd = dup(fileno(fp))) < 0){
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	if(lseek(fd,0,SEEK_SET) || (gz = gzdopen(fd,"rb")) == NULL){
+		close(fd);
+		return -1;
+	}
+	while(ret == 0 && gzgets(gz,text,sizeof(text))){
+		if(strncmp(text,"==> ",4) == 0){
+			if(strncmp(text + 4,base,strlen(base))){
+				fprintf(stderr,"  Bad header: %s",text);
+				ret = -1;
+			}
+			++hdrs;
+			synced = 0;
+			continue;
+		}
+		if(hdrs == 0){
+			fprintf(stderr,"  Missing header: %s",text);
+			ret = -1;
+			break;
+		}
+		if(!synced){
+			next = (unsigned)strtoul(text,NULL,10);
+			synced = 1;
+		}
+		snprintf(expect,sizeof(expect),"%u|logmap line %u\n",next,next * next);
+		if(strcmp(text,expect)){
+			fprintf(stderr,"  Expected %s  Got %s",expect,text);
+			ret = -1;
+		}
+		++next;
+		++lines;
+	}
+	gzclose(gz);
+	printf("  Streamed %u lines in %u segments\n",lines,hdrs);
+	if(ret == 0 && (hdrs == 0 || lines == 0)){
+		ret = -1;
+	}
+	return ret;
+}
+
+// Archive a logmap which wraps several times over, keeping only the most
+// recent segments.
+static int
+test_logmap_rotate(void){
+	const logrotate_config cfg = {
+		.segment_bytes = 16 * 1024,
+		.keep_segments = ROTATE_KEEP,
+		.compress = 1,
+	};
+	char fn[PATH_MAX];
+	int ret = -1,mapped = 0;
+	unsigned z;
+	logmap lm;
+
+	if(make_logmap_name(fn,sizeof(fn))){
+		return -1;
+	}
+	if(start_log_rotation(&cfg)){
+		unlink(fn);
+		return -1;
+	}
+	if(create_logmap(&lm,fn,(size_t)Getpagesize() * 16)){
+		goto done;
+	}
+	mapped = 1;
+	if(rotate_logmap(fn)){
+		goto done;
+	}
+	for(z = 0 ; z < ROTATE_LINES ; ++z){
+		char line[80];
+		int len;
+
+		len = snprintf(line,sizeof(line),"%u|logmap line %u\n",z,z * z);
+		write_logmap(&lm,line,(size_t)len);
+		if(z % ROTATE_BURST == ROTATE_BURST - 1){
+			usleep(20000); // don't lap the archiver
+		}
+	}
+	mapped = 0;
+	if(close_logmap(&lm)){
+		goto done;
+	}
+	if(retire_logmap(fn) != 1 || access(fn,F_OK) == 0){
+		fprintf(stderr,"  Logmap wasn't retired\n");
+		goto done;
+	}
+	if(check_streamed_segments(fn)){
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if(mapped){
+		close_logmap(&lm);
+	}
+	ret |= stop_log_rotation();
+	ret |= check_rotated_segments(fn,ROTATE_LINES);
+	unlink(fn);
+	return ret;
+}
+
+const declared_test LOGMAP_TESTS[] = {
+	{	.name = "logmap-wrap",
+		.testfxn = test_logmap_wrap,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "logmap-sigkill",
+		.testfxn = test_logmap_sigkill,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "logmap-rotate",
+		.testfxn = test_logmap_rotate,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <cunit/cunit.h>
+#include <libdank/objects/lpm.h>
+#include <libdank/objects/ipset.h>
+#include <libdank/utils/memlimit.h>
+
+static int
+test_lpm_freeempty(void){
+	struct lpm_table *t;
+
+	if((t = create_lpm4()) == NULL){
+		return -1;
+	}
+	free_lpm(t,NULL);
+	if((t = create_lpm6()) == NULL){
+		return -1;
+	}
+	free_lpm(t,NULL);
+	return 0;
+}
+
+static struct lpmnode {
+	uint32_t ip;
+	unsigned len;
+	char data[16];
+} lpmnodes[] = {
+	{ .ip = 0x00000000, .len = 0,	.data = "default",	},
+	{ .ip = 0x0a000000, .len = 8,	.data = "10/8",		},
+	{ .ip = 0x0a010000, .len = 16,	.data = "10.1/16",	},
+	{ .ip = 0x0a010200, .len = 23,	.data = "10.1.2/23",	},
+	{ .ip = 0x0a010300, .len = 24,	.data = "10.1.3/24",	},
+	{ .ip = 0x0a010301, .len = 32,	.data = "10.1.3.1/32",	},
+	{ .ip = 0, .len = 0, .data = "", }
+};
+
+static int
+check_lpm4(const struct lpm_table *t,uint32_t ip,const char *expect){
+	const char *found = lookup_lpm4(t,ip);
+
+	if(found == NULL ? expect != NULL : (expect == NULL || strcmp(found,expect))){
+		fprintf(stderr," Expected %s for 0x%08x, got %s.\n",
+			expect ? expect : "nothing",ip,found ? found : "nothing");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+test_lpm4_nested(void){
+	struct lpm_table *t;
+	typeof(*lpmnodes) *ln;
+	int ret = -1;
+
+	if((t = create_lpm4()) == NULL){
+		return -1;
+	}
+	for(ln = lpmnodes + 1 ; *ln->data ; ++ln){
+		printf(" Adding %s.\n",ln->data);
+		if(insert_lpm4(t,ln->ip,ln->len,ln->data)){
+			goto done;
+		}
+	}
+	if(insert_lpm4(t,lpmnodes[2].ip,lpmnodes[2].len,NULL) == 0){
+		fprintf(stderr," Accepted duplicate prefix.\n");
+		goto done;
+	}
+	if(insert_lpm4(t,0,33,NULL) == 0){
+		fprintf(stderr," Accepted invalid prefix length.\n");
+		goto done;
+	}
+	if(check_lpm4(t,0x0b000000,NULL) || check_lpm4(t,0x0a020304,"10/8") ||
+			check_lpm4(t,0x0a01ff00,"10.1/16") ||
+			check_lpm4(t,0x0a010201,"10.1.2/23") ||
+			check_lpm4(t,0x0a010302,"10.1.3/24") ||
+			check_lpm4(t,0x0a010301,"10.1.3.1/32")){
+		goto done;
+	}
+	printf(" Adding default route.\n");
+	if(insert_lpm4(t,lpmnodes[0].ip,lpmnodes[0].len,lpmnodes[0].data)){
+		goto done;
+	}
+	if(check_lpm4(t,0x0b000000,"default") || check_lpm4(t,0x0a010301,"10.1.3.1/32")){
+		goto done;
+	}
+	printf(" Removing 10.1.3/24 and 10.1/16.\n");
+	if(remove_lpm4(t,0x0a010300,24,NULL) || remove_lpm4(t,0x0a010000,16,NULL)){
+		goto done;
+	}
+	if(remove_lpm4(t,0x0a010000,16,NULL) == 0){
+		fprintf(stderr," Removed nonexistent prefix.\n");
+		goto done;
+	}
+	if(check_lpm4(t,0x0a010302,"10.1.2/23") || check_lpm4(t,0x0a01ff00,"10/8") ||
+			check_lpm4(t,0x0a010201,"10.1.2/23") ||
+			check_lpm4(t,0x0a010301,"10.1.3.1/32")){
+		goto done;
+	}
+	printf(" Removing 10.1.3.1/32 and 10.1.2/23.\n");
+	if(remove_lpm4(t,0x0a010301,32,NULL) || remove_lpm4(t,0x0a010200,23,NULL)){
+		goto done;
+	}
+	if(groups_lpm(t)){
+		fprintf(stderr," %u trie groups remained.\n",groups_lpm(t));
+		goto done;
+	}
+	if(population_lpm(t) != 2){
+		fprintf(stderr," Population was %u, not 2.\n",population_lpm(t));
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free_lpm(t,NULL);
+	return ret;
+}
+
+static void
+Free_node(void *v){
+	Free(v);
+}
+
+// Check the trie against a linear scan of the rules for random prefixes
+static int
+test_lpm4_random(void){
+	#define RULECOUNT 512
+	#define PROBECOUNT 8192
+	struct { uint32_t ip; unsigned len; } rules[RULECOUNT];
+	struct lpm_table *t;
+	unsigned z,y,live;
+	int ret = -1;
+
+	if((t = create_lpm4()) == NULL){
+		return -1;
+	}
+	srandom(0);
+	for(z = 0 ; z < RULECOUNT ; ++z){
+		unsigned *v;
+
+		// clustered under a few /12s so that prefixes nest
+		rules[z].len = 8 + random() % 25;
+		rules[z].ip = (0x0a000000 | (random() & 0x0030ffff)) &
+			(rules[z].len ? ~0u << (32 - rules[z].len) : 0);
+		for(y = 0 ; y < z ; ++y){
+			if(rules[y].ip == rules[z].ip && rules[y].len == rules[z].len){
+				break;
+			}
+		}
+		if(y < z){
+			rules[z].len = 0xff;
+			continue;
+		}
+		if((v = Malloc("lpm test",sizeof(*v))) == NULL){
+			goto done;
+		}
+		*v = z;
+		if(insert_lpm4(t,rules[z].ip,rules[z].len,v)){
+			Free(v);
+			goto done;
+		}
+	}
+	printf(" Inserted %u prefixes into %u groups.\n",population_lpm(t),groups_lpm(t));
+	for(live = 2 ; live-- ; ){
+		for(z = 0 ; z < PROBECOUNT ; ++z){
+			uint32_t ip = 0x0a000000 | (random() & 0x0030ffff);
+			unsigned best = RULECOUNT,bestlen = 0;
+			const unsigned *v;
+
+			for(y = 0 ; y < RULECOUNT ; ++y){
+				uint32_t mask;
+
+				if(rules[y].len > 32){
+					continue;
+				}
+				mask = rules[y].len ? ~0u << (32 - rules[y].len) : 0;
+				if((ip & mask) == rules[y].ip && (best == RULECOUNT ||
+						rules[y].len > bestlen)){
+					best = y;
+					bestlen = rules[y].len;
+				}
+			}
+			v = lookup_lpm4(t,ip);
+			if(best == RULECOUNT ? v != NULL : (v == NULL || *v != best)){
+				fprintf(stderr," Mismatch on 0x%08x.\n",ip);
+				goto done;
+			}
+		}
+		if(live){
+			printf(" Removing half of the prefixes.\n");
+			for(z = 0 ; z < RULECOUNT ; z += 2){
+				if(rules[z].len <= 32){
+					if(remove_lpm4(t,rules[z].ip,rules[z].len,Free_node)){
+						goto done;
+					}
+					rules[z].len = 0xff;
+				}
+			}
+		}
+	}
+	printf(" Removing the remaining prefixes.\n");
+	for(z = 0 ; z < RULECOUNT ; ++z){
+		if(rules[z].len <= 32){
+			if(remove_lpm4(t,rules[z].ip,rules[z].len,Free_node)){
+				goto done;
+			}
+			rules[z].len = 0xff;
+		}
+	}
+	if(groups_lpm(t) || population_lpm(t)){
+		fprintf(stderr," %u groups, %u prefixes remained.\n",
+				groups_lpm(t),population_lpm(t));
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free_lpm(t,Free_node);
+	return ret;
+	#undef PROBECOUNT
+	#undef RULECOUNT
+}
+
+static int
+test_lpm4_batch(void){
+	#define BATCHCOUNT 37
+	uint32_t keys[BATCHCOUNT];
+	void *vals[BATCHCOUNT];
+	struct lpm_table *t;
+	typeof(*lpmnodes) *ln;
+	int ret = -1;
+	unsigned z;
+
+	if((t = create_lpm4()) == NULL){
+		return -1;
+	}
+	for(ln = lpmnodes ; *ln->data ; ++ln){
+		if(insert_lpm4(t,ln->ip,ln->len,ln->data)){
+			goto done;
+		}
+	}
+	for(z = 0 ; z < BATCHCOUNT ; ++z){
+		keys[z] = 0x0a010000 + z * 0x83;
+	}
+	lookup_lpm4_batch(t,keys,vals,BATCHCOUNT);
+	for(z = 0 ; z < BATCHCOUNT ; ++z){
+		if(vals[z] != lookup_lpm4(t,keys[z])){
+			fprintf(stderr," Batch mismatch on 0x%08x.\n",keys[z]);
+			goto done;
+		}
+	}
+	printf(" Verified batch of %u lookups.\n",BATCHCOUNT);
+	ret = 0;
+
+done:
+	free_lpm(t,NULL);
+	return ret;
+	#undef BATCHCOUNT
+}
+
+static int
+test_lpm4_ipset(void){
+	const struct {
+		const char *set;
+		const char *expect;
+	} sets[] = {
+		{ .set = "10.1.2.16-10.1.2.32",		.expect = "10.1.2/23",	},
+		{ .set = "[10.1.2.16,10.2.0.0]",	.expect = "10/8",	},
+		{ .set = "[10.1.2.16,11.0.0.0]",	.expect = NULL,		},
+		{ .set = NULL,				.expect = NULL,		},
+	},*s;
+	struct lpm_table *t;
+	typeof(*lpmnodes) *ln;
+	int ret = -1;
+
+	if((t = create_lpm4()) == NULL){
+		return -1;
+	}
+	for(ln = lpmnodes + 1 ; *ln->data ; ++ln){
+		if(insert_lpm4(t,ln->ip,ln->len,ln->data)){
+			goto done;
+		}
+	}
+	for(s = sets ; s->set ; ++s){
+		const char *found;
+		ipset is;
+
+		if(parse_ipset(s->set,&is) < 0){
+			goto done;
+		}
+		found = lookup_lpm4_ipset(t,&is);
+		free_ipset(&is);
+		printf(" %s: %s.\n",s->set,found ? found : "no enclosing prefix");
+		if(found == NULL ? s->expect != NULL :
+				(s->expect == NULL || strcmp(found,s->expect))){
+			fprintf(stderr," Expected %s.\n",s->expect ? s->expect : "nothing");
+			goto done;
+		}
+	}
+	ret = 0;
+
+done:
+	free_lpm(t,NULL);
+	return ret;
+}
+
+static int
+test_lpm6(void){
+	char net[] = "2001:db8::/32",host[] = "2001:db8::1/128";
+	struct in6_addr a,b;
+	struct lpm_table *t;
+	unsigned groups;
+	void *vals[2];
+	int ret = -1;
+
+	if((t = create_lpm6()) == NULL){
+		return -1;
+	}
+	memset(&a,0,sizeof(a));
+	a.s6_addr[0] = 0x20;
+	a.s6_addr[1] = 0x01;
+	a.s6_addr[2] = 0x0d;
+	a.s6_addr[3] = 0xb8;
+	if(insert_lpm6(t,&a,32,net)){
+		goto done;
+	}
+	groups = groups_lpm(t);
+	a.s6_addr[15] = 0x01;
+	if(insert_lpm6(t,&a,128,host)){
+		goto done;
+	}
+	b = a;
+	b.s6_addr[15] = 0x02;
+	if(lookup_lpm6(t,&a) != host){
+		fprintf(stderr," Didn't find /128.\n");
+		goto done;
+	}
+	if(lookup_lpm6(t,&b) != net){
+		fprintf(stderr," Didn't find /32.\n");
+		goto done;
+	}
+	printf(" Using %u trie groups for IPv6.\n",groups_lpm(t));
+	lookup_lpm6_batch(t,(const struct in6_addr[]){ a, b, },vals,2);
+	if(vals[0] != lookup_lpm6(t,&a) || vals[1] != lookup_lpm6(t,&b)){
+		fprintf(stderr," Batch mismatch.\n");
+		goto done;
+	}
+	if(remove_lpm6(t,&a,128,NULL)){
+		goto done;
+	}
+	if(lookup_lpm6(t,&a) != lookup_lpm6(t,&b)){
+		fprintf(stderr," /128 survived removal.\n");
+		goto done;
+	}
+	if(groups_lpm(t) != groups){
+		fprintf(stderr," %u trie groups remained (wanted %u).\n",groups_lpm(t),groups);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free_lpm(t,NULL);
+	return ret;
+}
+
+const declared_test LPM_TESTS[] = {
+	{	.name = "lpm-freeempty",
+		.testfxn = test_lpm_freeempty,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "lpm4-nested",
+		.testfxn = test_lpm4_nested,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "lpm4-random",
+		.testfxn = test_lpm4_random,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "lpm4-batch",
+		.testfxn = test_lpm4_batch,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "lpm4-ipset",
+		.testfxn = test_lpm4_ipset,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "lpm6",
+		.testfxn = test_lpm6,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
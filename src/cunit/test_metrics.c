@@ -0,0 +1,195 @@
+#include <string.h>
+#include <pthread.h>
+#include <cunit/cunit.h>
+#include <libdank/objects/objustring.h>
+#include <libdank/modules/metrics/metrics.h>
+
+// Every value must fall within its bucket, and buckets must be contiguous.
+static int
+test_metrics_buckets(void){
+	uint64_t v;
+	unsigned b;
+
+	for(b = 0 ; b + 1 < METRIC_HIST_BUCKETS ; ++b){
+		if(metric_hist_floor(b) >= metric_hist_floor(b + 1)){
+			fprintf(stderr,"  Bucket %u isn't below its successor\n",b);
+			return -1;
+		}
+		if(metric_hist_bucket(metric_hist_floor(b)) != b ||
+				metric_hist_bucket(metric_hist_floor(b + 1) - 1) != b){
+			fprintf(stderr,"  Bucket %u doesn't span its range\n",b);
+			return -1;
+		}
+	}
+	if(metric_hist_bucket(UINT64_MAX) != METRIC_HIST_BUCKETS - 1){
+		fprintf(stderr,"  UINT64_MAX went to bucket %u\n",metric_hist_bucket(UINT64_MAX));
+		return -1;
+	}
+	for(v = 1 ; v < UINT64_MAX / 3 ; v = v * 3 + 1){
+		uint64_t lo = metric_hist_floor(metric_hist_bucket(v));
+
+		if(lo > v || v - lo > v / 8){
+			fprintf(stderr,"  %ju went to the bucket at %ju\n",(uintmax_t)v,(uintmax_t)lo);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+test_metrics_registry(void){
+	metric *c,*c2,*g,*h;
+	int ret = -1;
+
+	c = c2 = g = h = NULL;
+	if((c = register_counter("test.counter")) == NULL){
+		goto done;
+	}
+	if((c2 = register_counter("test.counter")) != c){
+		fprintf(stderr,"  Didn't share the registered counter\n");
+		goto done;
+	}
+	if(register_gauge("test.counter") || register_gauge("Bad name!")){
+		fprintf(stderr,"  Accepted an invalid registration\n");
+		goto done;
+	}
+	if((g = register_gauge("test.gauge")) == NULL){
+		goto done;
+	}
+	if((h = register_histogram("test.histogram")) == NULL){
+		goto done;
+	}
+	counter_add(c,41);
+	counter_inc(c2);
+	gauge_set(g,10);
+	gauge_add(g,-15);
+	if(counter_value(c) != 42 || gauge_value(g) != -5){
+		fprintf(stderr,"  Got %ju/%jd, expected 42/-5\n",(uintmax_t)counter_value(c),
+				(intmax_t)gauge_value(g));
+		goto done;
+	}
+	ret = 0;
+
+done:
+	ret |= unregister_metric(c);
+	ret |= unregister_metric(c2);
+	ret |= unregister_metric(g);
+	ret |= unregister_metric(h);
+	return ret;
+}
+
+#define HIST_DUMP "histogram test.histogram 1000 500500 480 896 960 960 1:1 2:1 "
+
+static int
+test_metrics_histogram(void){
+	uint64_t buckets[METRIC_HIST_BUCKETS],count,sum,v;
+	ustring u = USTRING_INITIALIZER;
+	int ret = -1;
+	metric *h;
+
+	if((h = register_histogram("test.histogram")) == NULL){
+		return -1;
+	}
+	for(v = 1 ; v <= 1000 ; ++v){
+		histogram_record(h,v);
+	}
+	count = histogram_snapshot(h,buckets,&sum);
+	if(count != 1000 || sum != 500500){
+		fprintf(stderr,"  Got %ju values totaling %ju\n",(uintmax_t)count,(uintmax_t)sum);
+		goto done;
+	}
+	if(histogram_quantile(buckets,count,500) != 480 ||
+			histogram_quantile(buckets,count,990) != 960 ||
+			histogram_quantile(buckets,count,1000) != 960){
+		fprintf(stderr,"  Bad quantiles: %ju %ju %ju\n",
+				(uintmax_t)histogram_quantile(buckets,count,500),
+				(uintmax_t)histogram_quantile(buckets,count,990),
+				(uintmax_t)histogram_quantile(buckets,count,1000));
+		goto done;
+	}
+	if(stringize_metrics(&u)){
+		goto done;
+	}
+	printf("%s",u.string);
+	if(strncmp(u.string,HIST_DUMP,strlen(HIST_DUMP))){
+		fprintf(stderr,"  Bad dump: %s",u.string);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	reset_ustring(&u);
+	ret |= unregister_metric(h);
+	return ret;
+}
+
+#define METRIC_THREADS 8
+#define METRIC_INCREMENTS 100000
+
+static void *
+metric_incrementer(void *v){
+	metric *c = v;
+	int i;
+
+	for(i = 0 ; i < METRIC_INCREMENTS ; ++i){
+		counter_inc(c);
+	}
+	return NULL;
+}
+
+// Shards must sum to the total, whatever the distribution of threads
+static int
+test_metrics_threads(void){
+	pthread_t tids[METRIC_THREADS];
+	int ret = -1,z,started;
+	metric *c;
+
+	if((c = register_counter("test.threads")) == NULL){
+		return -1;
+	}
+	for(started = 0 ; started < METRIC_THREADS ; ++started){
+		if(pthread_create(&tids[started],NULL,metric_incrementer,c)){
+			break;
+		}
+	}
+	for(z = 0 ; z < started ; ++z){
+		pthread_join(tids[z],NULL);
+	}
+	if(started == METRIC_THREADS){
+		if(counter_value(c) == (uint64_t)METRIC_THREADS * METRIC_INCREMENTS){
+			ret = 0;
+		}else{
+			fprintf(stderr,"  Counted %ju\n",(uintmax_t)counter_value(c));
+		}
+	}
+	ret |= unregister_metric(c);
+	return ret;
+}
+
+const declared_test METRICS_TESTS[] = {
+	{	.name = "metrics-buckets",
+		.testfxn = test_metrics_buckets,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "metrics-registry",
+		.testfxn = test_metrics_registry,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "metrics-histogram",
+		.testfxn = test_metrics_histogram,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "metrics-threads",
+		.testfxn = test_metrics_threads,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
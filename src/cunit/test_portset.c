@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <cunit/cunit.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/portset.h>
+
+static const char *portsets[] = {
+	"none",
+	"any",
+	"0",
+	"65535",
+	"22,80,443",
+	"1-1023",
+	"!80",
+	"63-64,127-129,1000-2000,65000-65535",
+	NULL
+};
+
+static int
+parse_test_portset(const char *text,portset *ps){
+	init_portset(ps);
+	if(parse_portset(text,ps) < 0){
+		fprintf(stderr," Couldn't parse %s.\n",text);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+test_portbitmap_convert(void){
+	const char **text;
+
+	for(text = portsets ; *text ; ++text){
+		portbitmap pb;
+		portset ps,rt;
+		unsigned port;
+
+		if(parse_test_portset(*text,&ps)){
+			return -1;
+		}
+		portbitmap_from_portset(&pb,&ps);
+		for(port = 0 ; port < 65536 ; ++port){
+			if(portbitmap_contains_port(&pb,port) != contains_port(&ps,port)){
+				fprintf(stderr," Membership mismatch on %u in %s.\n",port,*text);
+				free_portset(&ps);
+				return -1;
+			}
+		}
+		if(portbitmap_portcount(&pb) != (portset_complete(&ps) ? 65536u :
+					portset_portcount(&ps))){
+			fprintf(stderr," Count mismatch for %s.\n",*text);
+			free_portset(&ps);
+			return -1;
+		}
+		init_portset(&rt);
+		if(portset_from_portbitmap(&rt,&pb)){
+			free_portset(&ps);
+			return -1;
+		}
+		if(!portsets_equal(&ps,&rt)){
+			fprintf(stderr," Roundtrip mismatch for %s.\n",*text);
+			free_portset(&rt);
+			free_portset(&ps);
+			return -1;
+		}
+		printf(" %s: %u ports in %u ranges.\n",*text,portbitmap_portcount(&pb),rt.rangecount);
+		free_portset(&rt);
+		free_portset(&ps);
+	}
+	return 0;
+}
+
+static int
+test_portbitmap_algebra(void){
+	const char **t0,**t1;
+
+	for(t0 = portsets ; *t0 ; ++t0){
+		for(t1 = portsets ; *t1 ; ++t1){
+			portbitmap b0,b1,u,i,d;
+			portset p0,p1,merged;
+			unsigned port;
+
+			if(parse_test_portset(*t0,&p0)){
+				return -1;
+			}
+			if(parse_test_portset(*t1,&p1)){
+				free_portset(&p0);
+				return -1;
+			}
+			portbitmap_from_portset(&b0,&p0);
+			portbitmap_from_portset(&b1,&p1);
+			u = b0;
+			union_portbitmaps(&u,&b1);
+			i = b0;
+			intersect_portbitmaps(&i,&b1);
+			d = b0;
+			subtract_portbitmaps(&d,&b1);
+			for(port = 0 ; port < 65536 ; ++port){
+				int in0 = contains_port(&p0,port),in1 = contains_port(&p1,port);
+
+				if(portbitmap_contains_port(&u,port) != (in0 | in1) ||
+					portbitmap_contains_port(&i,port) != (in0 & in1) ||
+					portbitmap_contains_port(&d,port) != (in0 & !in1)){
+					fprintf(stderr," Algebra mismatch on %u (%s, %s).\n",port,*t0,*t1);
+					free_portset(&p1);
+					free_portset(&p0);
+					return -1;
+				}
+			}
+			// merge_portsets() must agree with the bitmap union
+			if(merge_portsets(&p0,&p1)){
+				free_portset(&p1);
+				free_portset(&p0);
+				return -1;
+			}
+			init_portset(&merged);
+			if(portset_from_portbitmap(&merged,&u)){
+				free_portset(&p1);
+				free_portset(&p0);
+				return -1;
+			}
+			if(!portsets_equal(&merged,&p0)){
+				fprintf(stderr," Merge mismatch (%s, %s).\n",*t0,*t1);
+				free_portset(&merged);
+				free_portset(&p1);
+				free_portset(&p0);
+				return -1;
+			}
+			free_portset(&merged);
+			free_portset(&p1);
+			free_portset(&p0);
+		}
+	}
+	printf(" Verified set algebra over %zu portsets.\n",
+			sizeof(portsets) / sizeof(*portsets) - 1);
+	return 0;
+}
+
+const declared_test PORTSET_TESTS[] = {
+	{	.name = "portbitmap_convert",
+		.testfxn = test_portbitmap_convert,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = "portbitmap_algebra",
+		.testfxn = test_portbitmap_algebra,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	},
+	{	.name = NULL,
+		.testfxn = NULL,
+		.expected_result = EXIT_TESTSUCCESS,
+		.sec_required = 0, .mb_required = 0, .disabled = 0,
+	}
+};
@@ -0,0 +1,124 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdank/utils/memlimit.h>
+#include <libdank/objects/logctx.h>
+#include <libdank/objects/logmap.h>
+
+#define APPNAME "logmerge"
+
+// Reconstruct chronological output from a set of logmaps (the per-thread logs
+// of a logdir, generally), interleaving their records by timestamp.
+
+typedef struct mergesrc {
+	logmap lm;
+	const char *name;
+	uint64_t off,nsec;
+	int pending;
+	char text[LISTENER_MSG_SZ + 1];
+} mergesrc;
+
+static void
+usage(const char *name,int status){
+	FILE *out = status == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,"\n");
+	fprintf(out,"usage: %s [args] logmap...\n",name);
+	fprintf(out,"\n");
+	fprintf(out,"ARGUMENTS\n");
+	fprintf(out," -h: this message\n");
+	fprintf(out," -t: prefix each line with its timestamp\n");
+	exit(status);
+}
+
+static void
+advance_mergesrc(mergesrc *ms){
+	ms->pending = read_logmap(&ms->lm,&ms->off,&ms->nsec,ms->text,sizeof(ms->text)) >= 0;
+}
+
+static void
+print_mergesrc(const mergesrc *ms,int stamps){
+	size_t len = strlen(ms->text);
+
+	if(stamps){
+		printf("%ju.%09ju|",(uintmax_t)(ms->nsec / 1000000000ull),
+				(uintmax_t)(ms->nsec % 1000000000ull));
+	}
+	printf("%s|%s",ms->name,ms->text);
+	if(len == 0 || ms->text[len - 1] != '\n'){
+		printf("\n");
+	}
+}
+
+static int
+merge_logmaps(mergesrc *srcs,unsigned n,int stamps){
+	for( ; ; ){
+		mergesrc *next = NULL;
+		unsigned z;
+
+		// n is the thread count; a linear scan beats a heap here
+		for(z = 0 ; z < n ; ++z){
+			if(srcs[z].pending){
+				if(next == NULL || srcs[z].nsec < next->nsec){
+					next = &srcs[z];
+				}
+			}
+		}
+		if(next == NULL){
+			break;
+		}
+		print_mergesrc(next,stamps);
+		advance_mergesrc(next);
+	}
+	return fflush(stdout) ? -1 : 0;
+}
+
+int main(int argc,char **argv){
+	int ret = EXIT_FAILURE,stamps = 0,opt;
+	unsigned n,z,opened = 0;
+	mergesrc *srcs;
+
+	while((opt = getopt(argc,argv,"ht")) >= 0){
+		switch(opt){
+			case 'h':
+				usage(argv[0],EXIT_SUCCESS);
+				break;
+			case 't':
+				stamps = 1;
+				break;
+			default:
+				usage(argv[0],EXIT_FAILURE);
+				break;
+		}
+	}
+	if((n = (unsigned)(argc - optind)) == 0){
+		usage(argv[0],EXIT_FAILURE);
+	}
+	if((srcs = Malloc(APPNAME,sizeof(*srcs) * n)) == NULL){
+		return EXIT_FAILURE;
+	}
+	memset(srcs,0,sizeof(*srcs) * n);
+	for(z = 0 ; z < n ; ++z){
+		mergesrc *ms = &srcs[z];
+		const char *slash;
+
+		if(open_logmap(&ms->lm,argv[optind + z])){
+			fprintf(stderr,"Couldn't open logmap at %s\n",argv[optind + z]);
+			goto done;
+		}
+		++opened;
+		ms->name = (slash = strrchr(argv[optind + z],'/')) ? slash + 1 : argv[optind + z];
+		ms->off = ms->lm.hdr->head;
+		advance_mergesrc(ms);
+	}
+	if(merge_logmaps(srcs,n,stamps) == 0){
+		ret = EXIT_SUCCESS;
+	}
+
+done:
+	while(opened--){
+		close_logmap(&srcs[opened].lm);
+	}
+	Free(srcs);
+	return ret;
+}